@@ -23,7 +23,8 @@ else
 endif
 
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
-LOCAL_SRC_FILES := audio_hw.c
+LOCAL_SRC_FILES := audio_hw.c aec_reference.c channel_remix.c playback_position.c \
+	resampler_147_160.c iec61937.c
 
 LOCAL_C_INCLUDES += \
 	external/tinyalsa/include \
@@ -33,3 +34,128 @@ LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa libaudioutils libdl
 LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_latency_test
+LOCAL_SRC_FILES := test/audio_latency_test.c
+LOCAL_SHARED_LIBRARIES := libhardware
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := write_contention_test
+LOCAL_SRC_FILES := test/write_contention_test.c
+LOCAL_SHARED_LIBRARIES := libhardware
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := resampler_test
+LOCAL_SRC_FILES := test/resampler_test.c resampler_147_160.c
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH) \
+	$(call include-path-for, audio-utils)
+LOCAL_SHARED_LIBRARIES := liblog libcutils libaudioutils
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := remix_test
+LOCAL_SRC_FILES := test/remix_test.c channel_remix.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := position_test
+LOCAL_SRC_FILES := test/position_test.c playback_position.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := iec61937_test
+LOCAL_SRC_FILES := test/iec61937_test.c iec61937.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH)
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := aec_reference_test
+LOCAL_SRC_FILES := test/aec_reference_test.c aec_reference.c
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH) \
+	$(call include-path-for, audio-utils)
+LOCAL_SHARED_LIBRARIES := liblog libcutils
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_bench
+LOCAL_SRC_FILES := test/audio_bench.c
+LOCAL_C_INCLUDES += $(call include-path-for, audio-effects)
+LOCAL_SHARED_LIBRARIES := libhardware libdl
+LOCAL_MODULE_TAGS := tests
+
+include $(BUILD_EXECUTABLE)
+
+# Host build of the HAL against the simulated tinyalsa of tinyalsa_sim.c,
+# see test/hal_sim_test.c.  audio_utils and speex have no host modules, so
+# the resampler behind create_resampler() is compiled in from their trees.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio.primary.host
+LOCAL_SRC_FILES := audio_hw.c aec_reference.c channel_remix.c playback_position.c \
+	resampler_147_160.c iec61937.c tinyalsa_sim.c \
+	../../../../system/media/audio_utils/resampler.c \
+	../../../../external/speex/libspeex/resample.c
+LOCAL_C_INCLUDES += \
+	external/tinyalsa/include \
+	external/speex/include \
+	$(call include-path-for, audio-utils) \
+	$(call include-path-for, audio-effects)
+LOCAL_CFLAGS += -DEXPORT= -DFLOATING_POINT -DUSE_SMALLFT -DVAR_ARRAYS
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS += -lpthread -lrt -lm
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := hal_sim_test
+LOCAL_SRC_FILES := test/hal_sim_test.c
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH) \
+	external/tinyalsa/include
+LOCAL_LDLIBS += -ldl -lpthread -lm
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# audio_bench against audio.primary.host, see test/perf-regression.py;
+# named apart from the device module, module names are shared by all targets
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_bench_host
+LOCAL_SRC_FILES := test/audio_bench.c
+LOCAL_C_INCLUDES += $(call include-path-for, audio-effects)
+LOCAL_LDLIBS += -ldl -lpthread -lm -lrt
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,413 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "aec_reference"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#include "aec_reference.h"
+
+/*
+ * Played frames are converted to the reader channel count, low passed
+ * below the reader Nyquist frequency when the writer runs faster, and
+ * kept in a ring indexed by the number of frames written.  Each clock
+ * model maps its stream's frame count to CLOCK_MONOTONIC time with a
+ * line fitted to its last time stamps, which averages out their jitter
+ * and measures the rate of the clock.  A reader frame captured at time
+ * t then wants the ring at the writer frame rendered at t, between
+ * frames in general, which is interpolated with a cubic.
+ */
+#define RING_FRAMES (1 << 15)       /* power of 2, > output + input latency */
+#define FIR_TAPS 31                 /* odd, the group delay is whole frames */
+#define FIR_DELAY ((FIR_TAPS - 1) / 2)
+#define FIR_CUTOFF 0.45             /* of the reader rate */
+#define KAISER_BETA 7.0
+#define CLOCK_POINTS 512            /* time stamps a clock model is fitted to */
+#define RATE_WINDOW_NS 500000000LL  /* span needed to measure the rate */
+#define MAX_DRIFT_PPM 1000
+#define MAX_JUMP_NS 10000000LL      /* larger time stamp errors restart a model */
+
+struct clock_model {
+    uint32_t nominal_rate;
+    double rate;                /* frames per second against CLOCK_MONOTONIC */
+    int64_t pos;                /* a frame ... */
+    double ns;                  /* ... and its time on the fitted line */
+    int64_t pos_hist[CLOCK_POINTS]; /* last time stamps, oldest first from idx */
+    int64_t ns_hist[CLOCK_POINTS];
+    int idx;
+    int points;
+    bool rate_valid;
+    bool valid;
+};
+
+struct aec_reference {
+    struct echo_reference_itfe itfe;
+    pthread_mutex_t lock;
+    uint32_t rd_channels;
+    uint32_t wr_channels;
+    struct clock_model wr_clock;
+    struct clock_model rd_clock;
+    bool wr_active;
+    int64_t wr_pos;             /* frames written to the ring */
+    int64_t rd_pos;             /* frames handed to the reader */
+    float *ring;                /* RING_FRAMES * rd_channels */
+    bool filtered;
+    float fir[FIR_TAPS];
+    float *hist;                /* 2 * FIR_TAPS * rd_channels, doubled */
+    int hist_idx;
+};
+
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    int k;
+
+    for (k = 1; k < 50; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+/* Kaiser windowed sinc, cutoff a fraction of the sampling rate */
+static void init_fir(float *fir, double cutoff)
+{
+    double h[FIR_TAPS], sum = 0;
+    double i0_beta = bessel_i0(KAISER_BETA);
+    int k;
+
+    for (k = 0; k < FIR_TAPS; k++) {
+        double n = k - FIR_DELAY;
+        double r = n / FIR_DELAY;
+        double w = bessel_i0(KAISER_BETA * sqrt(fmax(0.0, 1.0 - r * r))) / i0_beta;
+        double s = (n == 0) ? 2 * cutoff : sin(2 * M_PI * cutoff * n) / (M_PI * n);
+        h[k] = s * w;
+        sum += h[k];
+    }
+    for (k = 0; k < FIR_TAPS; k++)
+        fir[k] = (float)(h[k] / sum);
+}
+
+static void clock_init(struct clock_model *clock, uint32_t rate)
+{
+    memset(clock, 0, sizeof(*clock));
+    clock->nominal_rate = rate;
+    clock->rate = rate;
+}
+
+static void clock_restart(struct clock_model *clock)
+{
+    clock->idx = 0;
+    clock->points = 0;
+    clock->valid = false;
+}
+
+/* frame pos of the clock's stream is at time ns */
+static void clock_update(struct clock_model *clock, int64_t pos, int64_t ns)
+{
+    int64_t base_pos, base_ns;
+    double mean_x = 0, mean_y = 0, sxx = 0, sxy = 0, slope;
+    int i, n;
+
+    if (clock->valid) {
+        double err = ns - (clock->ns + (pos - clock->pos) * 1e9 / clock->rate);
+
+        if (fabs(err) > MAX_JUMP_NS) {
+            /* underrun, or a stream that paused without stopping */
+            ALOGV("%s: %.3f ms off, restarting", __func__, err / 1e6);
+            clock_restart(clock);
+        }
+    }
+
+    clock->pos_hist[clock->idx] = pos;
+    clock->ns_hist[clock->idx] = ns;
+    clock->idx = (clock->idx + 1) % CLOCK_POINTS;
+    if (clock->points < CLOCK_POINTS)
+        clock->points++;
+    n = clock->points;
+
+    /* least squares line through the stored points, relative to the
+     * oldest so the sums keep their precision */
+    i = (clock->idx - n + CLOCK_POINTS) % CLOCK_POINTS;
+    base_pos = clock->pos_hist[i];
+    base_ns = clock->ns_hist[i];
+    for (; n > 0; n--, i = (i + 1) % CLOCK_POINTS) {
+        mean_x += clock->pos_hist[i] - base_pos;
+        mean_y += clock->ns_hist[i] - base_ns;
+    }
+    n = clock->points;
+    mean_x /= n;
+    mean_y /= n;
+    for (i = (clock->idx - n + CLOCK_POINTS) % CLOCK_POINTS; n > 0;
+            n--, i = (i + 1) % CLOCK_POINTS) {
+        double dx = clock->pos_hist[i] - base_pos - mean_x;
+        sxx += dx * dx;
+        sxy += dx * (clock->ns_hist[i] - base_ns - mean_y);
+    }
+
+    /* the rate needs some span to be better than the nominal one */
+    if (ns - base_ns >= RATE_WINDOW_NS && sxx > 0 && sxy > 0) {
+        double max_rate = clock->nominal_rate * (1.0 + MAX_DRIFT_PPM / 1e6);
+        double min_rate = clock->nominal_rate * (1.0 - MAX_DRIFT_PPM / 1e6);
+
+        clock->rate = fmin(fmax(1e9 * sxx / sxy, min_rate), max_rate);
+        clock->rate_valid = true;
+    }
+    slope = 1e9 / clock->rate;
+    clock->pos = pos;
+    clock->ns = base_ns + mean_y + (pos - base_pos - mean_x) * slope;
+    clock->valid = true;
+}
+
+/* position of the clock's stream at time ns, in frames */
+static double clock_pos_at(const struct clock_model *clock, double ns)
+{
+    return clock->pos + (ns - clock->ns) * clock->rate / 1e9;
+}
+
+static int64_t timespec_ns(const struct timespec *ts)
+{
+    return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static inline int16_t clamp16(float v)
+{
+    if (v >= 32767.0f)
+        return 32767;
+    if (v <= -32768.0f)
+        return -32768;
+    return (int16_t)lrintf(v);
+}
+
+/* channel c of ring frame idx, silence where nothing was kept */
+static inline float ring_at(const struct aec_reference *ref, int64_t idx, uint32_t c)
+{
+    if (idx < 0 || idx >= ref->wr_pos || idx < ref->wr_pos - RING_FRAMES)
+        return 0.0f;
+    return ref->ring[(idx & (RING_FRAMES - 1)) * ref->rd_channels + c];
+}
+
+/* must be called with reference mutex locked */
+static void store_frames(struct aec_reference *ref, const int16_t *src, size_t frames)
+{
+    uint32_t rd_ch = ref->rd_channels, wr_ch = ref->wr_channels;
+    float x[2];
+    size_t i;
+    uint32_t c;
+    int k;
+
+    for (i = 0; i < frames; i++, src += wr_ch) {
+        float *dst = ref->ring + (ref->wr_pos & (RING_FRAMES - 1)) * rd_ch;
+
+        if (rd_ch == 1 && wr_ch > 1) {
+            int32_t sum = 0;
+            for (c = 0; c < wr_ch; c++)
+                sum += src[c];
+            x[0] = (float)sum / wr_ch;
+        } else {
+            for (c = 0; c < rd_ch; c++)
+                x[c] = src[c % wr_ch];
+        }
+
+        if (ref->filtered) {
+            /* each sample is kept twice in hist, so the FIR_TAPS newest are
+             * always contiguous */
+            for (c = 0; c < rd_ch; c++) {
+                float *h = ref->hist + c * 2 * FIR_TAPS;
+                float acc = 0;
+
+                h[ref->hist_idx] = x[c];
+                h[ref->hist_idx + FIR_TAPS] = x[c];
+                for (k = 0; k < FIR_TAPS; k++)
+                    acc += ref->fir[k] * h[ref->hist_idx + 1 + k];
+                dst[c] = acc;
+            }
+            ref->hist_idx = (ref->hist_idx + 1) % FIR_TAPS;
+        } else {
+            for (c = 0; c < rd_ch; c++)
+                dst[c] = x[c];
+        }
+        ref->wr_pos++;
+    }
+}
+
+static int aec_reference_write(struct echo_reference_itfe *reference,
+                               struct echo_reference_buffer *buffer)
+{
+    struct aec_reference *ref = (struct aec_reference *)reference;
+
+    pthread_mutex_lock(&ref->lock);
+
+    if (buffer == NULL) {
+        ALOGV("%s: writer stopped", __func__);
+        ref->wr_active = false;
+        clock_restart(&ref->wr_clock);
+        pthread_mutex_unlock(&ref->lock);
+        return 0;
+    }
+
+    store_frames(ref, (const int16_t *)buffer->raw, buffer->frame_count);
+    ref->wr_active = true;
+    /* a failed time stamp leaves the model as it was */
+    if (buffer->time_stamp.tv_sec != 0 || buffer->time_stamp.tv_nsec != 0)
+        clock_update(&ref->wr_clock, ref->wr_pos,
+                     timespec_ns(&buffer->time_stamp) + buffer->delay_ns);
+
+    pthread_mutex_unlock(&ref->lock);
+    return 0;
+}
+
+static int aec_reference_read(struct echo_reference_itfe *reference,
+                              struct echo_reference_buffer *buffer)
+{
+    struct aec_reference *ref = (struct aec_reference *)reference;
+    int16_t *dst;
+    uint32_t rd_ch;
+    double q, step;
+    size_t i;
+    uint32_t c;
+
+    pthread_mutex_lock(&ref->lock);
+
+    if (buffer == NULL) {
+        ALOGV("%s: reader stopped", __func__);
+        clock_restart(&ref->rd_clock);
+        pthread_mutex_unlock(&ref->lock);
+        return 0;
+    }
+
+    dst = (int16_t *)buffer->raw;
+    rd_ch = ref->rd_channels;
+
+    if (buffer->time_stamp.tv_sec != 0 || buffer->time_stamp.tv_nsec != 0)
+        clock_update(&ref->rd_clock, ref->rd_pos,
+                     timespec_ns(&buffer->time_stamp) - buffer->delay_ns);
+
+    if (!ref->wr_active || !ref->wr_clock.valid || !ref->rd_clock.valid) {
+        memset(dst, 0, buffer->frame_count * rd_ch * sizeof(int16_t));
+    } else {
+        /* writer frame rendered when the first frame was captured, plus
+         * the low pass delay, and writer frames per reader frame */
+        double t = ref->rd_clock.ns +
+                (ref->rd_pos - ref->rd_clock.pos) * 1e9 / ref->rd_clock.rate;
+        q = clock_pos_at(&ref->wr_clock, t) + (ref->filtered ? FIR_DELAY : 0);
+        step = ref->wr_clock.rate / ref->rd_clock.rate;
+
+        for (i = 0; i < buffer->frame_count; i++, q += step, dst += rd_ch) {
+            int64_t idx = (int64_t)floor(q);
+            float f = (float)(q - idx);
+
+            for (c = 0; c < rd_ch; c++) {
+                float p0 = ring_at(ref, idx - 1, c);
+                float p1 = ring_at(ref, idx, c);
+                float p2 = ring_at(ref, idx + 1, c);
+                float p3 = ring_at(ref, idx + 2, c);
+
+                /* Catmull-Rom */
+                dst[c] = clamp16(p1 + 0.5f * f * (p2 - p0 +
+                        f * (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3 +
+                        f * (3.0f * (p1 - p2) + p3 - p0))));
+            }
+        }
+    }
+    ref->rd_pos += buffer->frame_count;
+    buffer->delay_ns = 0;
+
+    pthread_mutex_unlock(&ref->lock);
+    return 0;
+}
+
+int32_t aec_reference_get_drift_ppm(struct echo_reference_itfe *reference)
+{
+    struct aec_reference *ref = (struct aec_reference *)reference;
+    int32_t ppm = 0;
+
+    pthread_mutex_lock(&ref->lock);
+    if (ref->wr_clock.rate_valid && ref->rd_clock.rate_valid)
+        ppm = (int32_t)lrint(((ref->wr_clock.rate / ref->wr_clock.nominal_rate) /
+                              (ref->rd_clock.rate / ref->rd_clock.nominal_rate) - 1.0) * 1e6);
+    pthread_mutex_unlock(&ref->lock);
+    return ppm;
+}
+
+int create_aec_reference(uint32_t rd_channel_count, uint32_t rd_sampling_rate,
+                         uint32_t wr_channel_count, uint32_t wr_sampling_rate,
+                         struct echo_reference_itfe **reference)
+{
+    struct aec_reference *ref;
+
+    if (reference == NULL)
+        return -EINVAL;
+    *reference = NULL;
+
+    if (rd_channel_count < 1 || rd_channel_count > 2 ||
+            wr_channel_count < 1 || wr_channel_count > 2 ||
+            rd_sampling_rate == 0 || wr_sampling_rate == 0)
+        return -EINVAL;
+
+    ref = (struct aec_reference *)calloc(1, sizeof(struct aec_reference));
+    if (ref == NULL)
+        return -ENOMEM;
+
+    ref->ring = (float *)calloc(RING_FRAMES * rd_channel_count, sizeof(float));
+    ref->hist = (float *)calloc(2 * FIR_TAPS * rd_channel_count, sizeof(float));
+    if (ref->ring == NULL || ref->hist == NULL) {
+        free(ref->ring);
+        free(ref->hist);
+        free(ref);
+        return -ENOMEM;
+    }
+
+    ref->itfe.read = aec_reference_read;
+    ref->itfe.write = aec_reference_write;
+    pthread_mutex_init(&ref->lock, NULL);
+    ref->rd_channels = rd_channel_count;
+    ref->wr_channels = wr_channel_count;
+    clock_init(&ref->rd_clock, rd_sampling_rate);
+    clock_init(&ref->wr_clock, wr_sampling_rate);
+    if (wr_sampling_rate > rd_sampling_rate) {
+        ref->filtered = true;
+        init_fir(ref->fir, FIR_CUTOFF * rd_sampling_rate / wr_sampling_rate);
+    }
+
+    *reference = &ref->itfe;
+    ALOGV("%s: %p, %u ch %u Hz from %u ch %u Hz", __func__, ref, rd_channel_count,
+          rd_sampling_rate, wr_channel_count, wr_sampling_rate);
+    return 0;
+}
+
+void release_aec_reference(struct echo_reference_itfe *reference)
+{
+    struct aec_reference *ref = (struct aec_reference *)reference;
+
+    if (ref == NULL)
+        return;
+    pthread_mutex_destroy(&ref->lock);
+    free(ref->ring);
+    free(ref->hist);
+    free(ref);
+}
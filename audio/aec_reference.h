@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AEC_REFERENCE_H
+#define AEC_REFERENCE_H
+
+#include <stdint.h>
+
+#include <audio_utils/echo_reference.h>
+
+/*
+ * Echo reference for the capture pre processing, a replacement for
+ * create_echo_reference() that implements the same echo_reference_itfe,
+ * 16 bit PCM only.
+ *
+ * The writer passes what is played, with time_stamp + delay_ns the render
+ * time of the frame following the buffer.  The reader asks for
+ * frame_count frames with time_stamp - delay_ns the capture time of the
+ * first of them.  Played frames are kept in a ring; the playback and
+ * capture clocks are each tracked from their time stamps, and the reader
+ * gets, for every captured frame, the reference rendered at the time it
+ * was captured, interpolated and converted to the capture rate and
+ * channel count.  The blocks are aligned, so the delay returned in
+ * delay_ns is 0.  Where nothing was played, the reference is silence.
+ *
+ * write() and read() with a NULL buffer stop the writer and the reader.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int create_aec_reference(uint32_t rd_channel_count, uint32_t rd_sampling_rate,
+                         uint32_t wr_channel_count, uint32_t wr_sampling_rate,
+                         struct echo_reference_itfe **reference);
+void release_aec_reference(struct echo_reference_itfe *reference);
+/* playback clock rate over capture clock rate, less one, in ppm */
+int32_t aec_reference_get_drift_ppm(struct echo_reference_itfe *reference);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AEC_REFERENCE_H */
@@ -29,24 +29,40 @@
 
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <cutils/log.h>
 #include <cutils/str_parms.h>
 #include <cutils/properties.h>
+#include <cutils/atomic.h>
 
 #include <hardware/hardware.h>
 #include <system/audio.h>
+#include <system/thread_defs.h>
 #include <hardware/audio.h>
 
+#include <sound/asound.h>
 #include <tinyalsa/asoundlib.h>
 #include <audio_utils/resampler.h>
 #include <audio_utils/echo_reference.h>
 #include <hardware/audio_effect.h>
 #include <audio_effects/effect_aec.h>
 
+#include "aec_reference.h"
+#include "channel_remix.h"
+#include "iec61937.h"
+#include "playback_position.h"
+#include "resampler_147_160.h"
+
 /* Mixer control names */
 #define MIXER_DL1_EQUALIZER                 "DL1 Equalizer"
 #define MIXER_DL2_LEFT_EQUALIZER            "DL2 Left Equalizer"
@@ -117,6 +133,15 @@
 #define MIXER_FLAT_RESPONSE                 "Flat Response"
 #define MIXER_4KHZ_LPF_0DB                  "4Khz LPF   0dB"
 
+/* channel status of the HDMI and S/PDIF cards, struct snd_aes_iec958 */
+#define MIXER_IEC958_PLAYBACK_DEFAULT       "IEC958 Playback Default"
+/* IEC 60958-3 consumer channel status bits (alsa-lib asoundef.h) */
+#define IEC958_AES0_NONAUDIO                0x02
+#define IEC958_AES0_CON_NOT_COPYRIGHT       0x04
+#define IEC958_AES1_CON_PCM_CODER           0x02
+#define IEC958_AES1_CON_ORIGINAL            0x80
+#define IEC958_AES4_CON_WORDLEN_20_16       0x02
+
 
 /* ALSA cards for OMAP4 */
 #define CARD_OMAP4_HDMI 0
@@ -147,8 +172,49 @@
 #define PLAYBACK_PERIOD_COUNT 4
 /* number of periods for capture */
 #define CAPTURE_PERIOD_COUNT 2
-/* minimum sleep time in out_write() when write threshold is not reached */
-#define MIN_WRITE_SLEEP_US 5000
+/* number of short periods in a deep buffer period (AUDIO_OUTPUT_FLAG_DEEP_BUFFER) */
+#define DEEP_BUFFER_LONG_PERIOD_MULTIPLIER 8  /* 320 ms */
+/* number of frames per deep buffer period */
+#define DEEP_BUFFER_LONG_PERIOD_SIZE (SHORT_PERIOD_SIZE * DEEP_BUFFER_LONG_PERIOD_MULTIPLIER)
+/* number of periods for deep buffer playback */
+#define PLAYBACK_DEEP_BUFFER_PERIOD_COUNT 2
+/* number of base blocks in a fast output period (AUDIO_OUTPUT_FLAG_FAST) */
+#define FAST_PERIOD_MULTIPLIER 10  /* 5 ms */
+/* number of frames per fast output period */
+#define FAST_PERIOD_SIZE (ABE_BASE_FRAME_COUNT * FAST_PERIOD_MULTIPLIER)
+/* number of periods for fast playback */
+#define PLAYBACK_FAST_PERIOD_COUNT 4
+/* number of fast periods left in the kernel buffer before a write */
+#define PLAYBACK_FAST_THRESHOLD_COUNT 2
+/* SCHED_FIFO priority of the fast sink and mixer threads, same as the
+ * FastMixer's */
+#define FAST_WRITER_PRIORITY 2
+/* hardware timestamps further than this from now are not trusted for
+ * write pacing, see wait_for_write_threshold() */
+#define MAX_TSTAMP_AGE_NS 1000000000LL
+/* silence queued to an output kept warm in standby: the start threshold
+ * of all but fast outputs, see output_warm_thread() */
+#define WARM_FILL_FRAMES (SHORT_PERIOD_SIZE * 2)
+/* most channels an output has (7.1) */
+#define MAX_OUT_CHANNELS 8
+/* number of output pcms written in parallel (HDMI or USB, and S/PDIF) */
+#define MAX_OUTPUT_SINKS 2
+/* frames a sink downmixes at once */
+#define SINK_COPY_FRAMES SHORT_PERIOD_SIZE
+/* frames the writer may queue in the sink ring, in buffers of out_get_buffer_size() */
+#define SINK_RING_BUFFER_COUNT 2
+/* give up on out_write() if the main sink does not take any data for this long */
+#define SINK_WRITE_TIMEOUT_NS 500000000LL
+/* give up on out_write() of a mixed stream if the mixer does not take any data
+ * for this long */
+#define MIX_WRITE_TIMEOUT_NS 500000000LL
+/* frames mixed per cycle are capped to this, for the deep buffer output */
+#define MIX_MAX_CHUNK_FRAMES SHORT_PERIOD_SIZE
+/* largest out_write() piece scaled by the stream volume on the stack */
+#define VOLUME_CHUNK_FRAMES 256
+/* buffer size of a compressed passthrough output: an AC-3 burst, which
+ * holds the largest AC-3 frame */
+#define PASSTHROUGH_BUFFER_SIZE 6144
 
 #define RESAMPLER_BUFFER_FRAMES (SHORT_PERIOD_SIZE * 2)
 #define RESAMPLER_BUFFER_SIZE (4 * RESAMPLER_BUFFER_FRAMES)
@@ -204,6 +270,18 @@
 /* product-specific defines */
 #define PRODUCT_DEVICE_PROPERTY "ro.product.device"
 #define PRODUCT_DEVICE_STEELHEAD "steelhead"
+/* "average" mixes both channels of stereo-only capture hardware down for
+ * mono clients; anything else keeps the left channel */
+#define CAPTURE_DOWNMIX_PROPERTY "audio.capture.downmix"
+/* "1" runs capture and pre processing of inputs with effects on threads
+ * of their own, see struct capture_pipeline */
+#define CAPTURE_PIPELINE_PROPERTY "audio.capture.pipeline"
+/* "1" replaces capture frames the driver dropped with silence, so that
+ * the frames read keep pace with the capture clock */
+#define CAPTURE_ZERO_FILL_PROPERTY "audio.capture.zero_fill"
+/* milliseconds an output keeps its pcms open after standby, playing
+ * silence, so that a restart does not reopen them; 0 closes them at once */
+#define STANDBY_DELAY_PROPERTY "audio.output.standby_delay_ms"
 
 enum supported_boards {
     STEELHEAD
@@ -224,6 +302,22 @@ struct pcm_config pcm_config_mm = {
     .format = PCM_FORMAT_S16_LE,
 };
 
+struct pcm_config pcm_config_mm_deep = {
+    .channels = 2,
+    .rate = DEFAULT_OUT_SAMPLING_RATE,
+    .period_size = DEEP_BUFFER_LONG_PERIOD_SIZE,
+    .period_count = PLAYBACK_DEEP_BUFFER_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+};
+
+struct pcm_config pcm_config_mm_fast = {
+    .channels = 2,
+    .rate = DEFAULT_OUT_SAMPLING_RATE,
+    .period_size = FAST_PERIOD_SIZE,
+    .period_count = PLAYBACK_FAST_PERIOD_COUNT,
+    .format = PCM_FORMAT_S16_LE,
+};
+
 struct pcm_config pcm_config_mm_ul = {
     .channels = 2,
     .rate = MM_FULL_POWER_SAMPLING_RATE,
@@ -538,13 +632,12 @@ struct route_setting vx_ul_bt[] = {
 
 struct buffer_remix;
 
-/* buffer_remix: functor for doing in-place buffer manipulations.
- *
- * NB. When remix_func is called, the memory at `buf` must be at least
- * as large as frames * sample_size * MAX(in_chans, out_chans).
+/* buffer_remix: converts in_chans frames read from the driver to the
+ * client's out_chans.  remix_func is one of the channel_remix.h kernels,
+ * chosen when the input stream starts.
  */
 struct buffer_remix {
-    void (*remix_func)(struct buffer_remix *data, void *buf, size_t frames);
+    channel_remix_i16_t remix_func;
     size_t sample_size; /* size of one audio sample, in bytes */
     size_t in_chans;    /* number of input channels */
     size_t out_chans;   /* number of output channels */
@@ -575,6 +668,40 @@ struct mixer_ctls
     */
 };
 
+struct omap4_stream_out;
+
+/* Software mixer for concurrent output streams.  All outputs share one
+ * pcm: while only one stream plays it writes the pcm directly as the
+ * active output.  When another stream starts, the pcm is handed over to
+ * out, an internal stream with the first one's configuration, and both
+ * streams become inputs of the mixer.  Each input queues its frames, at
+ * the pcm rate, in its own mix ring; the mixer thread sums chunk frames
+ * of every input with the input's volume and writes the result to out.
+ * While a fast output is an input, out is reopened with the fast period
+ * so that the mix is queued no deeper than the fast output's own pcm;
+ * it goes back to the first output's configuration (owner_flags and
+ * owner_config) once no fast output is mixed.
+ * The mixer stops and out is closed when the last input goes to standby.
+ * inputs and num_inputs are changed with the hw device mutex and lock
+ * held, the mixer thread reads them with lock held.  chunk only changes
+ * while the mixer thread is stopped.
+ */
+struct output_mixer {
+    pthread_mutex_t lock;
+    struct omap4_stream_out *out;
+    struct omap4_stream_out *inputs[MIX_MAX_STREAMS];
+    int num_inputs;
+    pthread_t thread;
+    sem_t wake;                 /* posted when an input queues frames */
+    bool running;
+    volatile int32_t exit;
+    uint32_t chunk;
+    int32_t *acc;               /* MIX_MAX_CHUNK_FRAMES, whatever the chunk */
+    int16_t *buf;
+    audio_output_flags_t owner_flags;
+    struct pcm_config owner_config;
+};
+
 struct omap4_audio_device {
     struct audio_hw_device hw_device;
 
@@ -589,14 +716,83 @@ struct omap4_audio_device {
     float voice_volume;
     struct omap4_stream_in *active_input;
     struct omap4_stream_out *active_output;
+    struct output_mixer out_mixer;
     bool mic_mute;
     int tty_mode;
     int sidetone_capture;
     int board_type;
     struct echo_reference_itfe *echo_reference;
     int input_requires_stereo;
+    bool input_downmix_average;
+    bool capture_pipeline;
+    bool capture_zero_fill;
     bool low_power;
+    volatile int32_t out_gen;   /* bumped when a setting playing outputs follow changes */
     bool bluetooth_nrec;
+
+    /* keep-warm standby, see output_warm_thread(); the thread only runs
+     * with a non zero standby_delay_ms */
+    uint32_t standby_delay_ms;
+    pthread_t warm_thread;
+    bool warm_running;
+    volatile int32_t warm_exit;
+    sem_t warm_wake;            /* posted when an output goes warm */
+    int16_t *warm_silence;      /* WARM_FILL_FRAMES of MAX_OUT_CHANNELS */
+};
+
+/* Statistics reported by the dump hooks, kept for the life of the stream.
+ * They are updated with atomic operations and read without any lock, so
+ * dumpsys never waits for a stuck write or read.  Histograms count
+ * durations in log2 bins: bin 0 is below STATS_HIST_MIN_US, bin i below
+ * STATS_HIST_MIN_US << i, and the last bin takes everything longer.
+ */
+#define STATS_HIST_BINS 16
+#define STATS_HIST_MIN_US 64
+
+struct stats_hist {
+    volatile int32_t bins[STATS_HIST_BINS];
+};
+
+struct stream_stats {
+    volatile int32_t transfers;     /* out_write() or in_read() calls */
+    volatile int32_t xruns;         /* kernel buffer found empty (out) or full (in) */
+    volatile int32_t starts;        /* standby -> active */
+    volatile int32_t standbys;      /* active -> standby */
+    struct stats_hist call_us;      /* out_write() or in_read() duration */
+    struct stats_hist blocked_us;   /* out: time in wait_for_write_threshold() */
+    struct stats_hist fill_us;      /* kernel buffer fill at each transfer */
+    struct stats_hist resample_us;  /* resampler CPU time per call */
+};
+
+/* write pacing statistics since the last standby */
+struct write_pacing {
+    uint32_t writes;
+    uint32_t sleeps;
+    int64_t late_ns;            /* sum of wake-up lateness */
+    int64_t late_sq_us;         /* sum of squared lateness, in us^2 */
+};
+
+/* One output pcm written by its own thread from the stream's sink ring,
+ * used when more than one pcm is open so that a stalled sink does not
+ * hold back the others or the caller.  Only the main sink (sinks[0])
+ * throttles the writer; the others are overrun when they fall behind.
+ */
+struct output_sink {
+    struct omap4_stream_out *out;
+    struct pcm *pcm;
+    const char *name;
+    pthread_t thread;
+    sem_t wake;
+    volatile int32_t rd;        /* frames consumed from the ring, wraps */
+    volatile int32_t exit;
+    struct write_pacing pacing;
+    uint32_t underruns;
+    uint32_t overruns;
+    /* a secondary sink copies (or, when stereo on a multichannel output,
+     * downmixes) the ring into copy_buf, SINK_COPY_FRAMES at a time, so
+     * that the writer cannot overwrite a period while it is being written */
+    channel_remix_i16_t downmix;
+    void *copy_buf;
 };
 
 struct omap4_stream_out {
@@ -606,17 +802,129 @@ struct omap4_stream_out {
     struct pcm_config config;
     struct pcm *pcm;
     struct pcm *pcmspdif;
+    uint32_t sample_rate;       /* stream rate, out->config.rate is the pcm's */
+    audio_format_t format;
+    audio_channel_mask_t channel_mask;
+    /* multichannel: reorders a write to the HDMI layout into buffer */
+    channel_remix_i16_t remix;
     struct resampler_itfe *resampler;
+    void (*release_resampler)(struct resampler_itfe *resampler);
     char *buffer;
     int standby;
     struct echo_reference_itfe *echo_reference;
     int write_threshold;
     bool low_power;
+    audio_output_flags_t flags;
+    int32_t adev_gen;           /* adev->out_gen last followed by out_write() */
+
+    struct write_pacing pacing;
+    struct stream_stats stats;
+    struct playback_position position;
+
+    /* sink writers, see struct output_sink; the ring holds ring_frames
+     * (a power of 2) frames of which the writer fills at most ring_limit */
+    struct output_sink sinks[MAX_OUTPUT_SINKS];
+    int num_sinks;
+    char *ring;
+    uint32_t ring_frames;
+    uint32_t ring_limit;
+    volatile int32_t ring_wr;   /* frames produced, wraps */
+    sem_t ring_space;
+
+    /* compressed passthrough: the stream is packed into IEC 61937 bursts
+     * by iec, one at a time into burst, and written as it is; no
+     * resampling, volume or mixing */
+    struct iec61937 *iec;
+    int16_t *burst;
+
+    /* volume set by out_set_volume(), Q14 (MIX_UNITY_GAIN is 0 dB) */
+    volatile int32_t gain_left;
+    volatile int32_t gain_right;
+
+    /* input of the output mixer, see struct output_mixer; the ring holds
+     * mix_ring_frames (a power of 2) frames of which the writer fills at
+     * most mix_ring_limit */
+    bool mixed;
+    bool mix_primed;            /* a full chunk was queued since the last underrun */
+    int16_t *mix_ring;
+    uint32_t mix_ring_frames;
+    volatile uint32_t mix_ring_limit;   /* changes with the mixer chunk */
+    uint32_t mix_out_frames;    /* queued by the mixer output, for the latency */
+    volatile int32_t mix_wr;    /* frames produced, wraps */
+    volatile int32_t mix_rd;    /* frames mixed, wraps */
+    sem_t mix_space;
+    uint32_t mix_underruns;
+
+    /* keep-warm standby: the pcms stay open, playing silence, until
+     * warm_deadline_ns (CLOCK_MONOTONIC) or the next start */
+    bool warm;
+    int64_t warm_deadline_ns;
+    volatile int32_t warm_closes;       /* pcms closed by the delay running out */
+    struct stats_hist cold_start_us;    /* start_output_stream() finding no warm pcms */
+    struct stats_hist warm_start_us;    /* start_output_stream() resuming warm pcms */
 
     struct omap4_audio_device *dev;
 };
 
 #define MAX_PREPROCESSORS 3 /* maximum one AGC + one NS + one AEC per input stream */
+/* capacity of the pre processing queues, in client buffers */
+#define PROC_RING_BUFFER_COUNT 2
+/* capacity of the capture pipeline queues and largest block processed at
+ * once, in client buffers */
+#define PIPELINE_RING_BUFFER_COUNT 4
+#define PIPELINE_PROCESS_BUFFER_COUNT 2
+#define PIPELINE_READ_TIMEOUT_NS 100000000LL
+/* longest capture gap replaced with silence, longer ones are cut */
+#define MAX_ZERO_FILL_MS 1000
+
+/* frame_ring: fixed size FIFO of interleaved 16 bit frames.  Frames are
+ * read and written in place through contiguous spans; a span ends at the
+ * end of the storage and the next one starts at its beginning, so queued
+ * frames are never moved.  When the ring empties it restarts at the
+ * beginning, which keeps the usual case down to a single span.
+ */
+struct frame_ring {
+    int16_t *buf;
+    size_t size;                /* capacity, in frames */
+    size_t alloc_samples;       /* allocated size of buf, in samples */
+    size_t chans;
+    size_t rd;                  /* first queued frame */
+    size_t frames;              /* queued frames */
+};
+
+/* Capture pipeline of an input stream with pre processing.  A capture
+ * thread reads the driver one client buffer at a time and fetches the
+ * echo reference for it; a process thread runs the effects on whatever
+ * has been captured, up to PIPELINE_PROCESS_BUFFER_COUNT buffers at
+ * once; in_read() only takes processed frames.  The queues between the
+ * stages are bounded: a stage that falls behind loses the oldest frames
+ * rather than stalling the driver.  The threads own the read path of the
+ * stream (pcm, resampler, remix) and its effects while they run and take
+ * no stream lock; effects are not added or removed while they run.
+ */
+struct capture_pipeline {
+    pthread_t capture_thread;
+    pthread_t process_thread;
+    pthread_mutex_t lock;       /* protects the rings, status and exit */
+    sem_t captured;             /* posted when frames reach cap_ring */
+    sem_t processed;            /* posted when frames reach out_ring or on error */
+    struct frame_ring cap_ring; /* captured, waiting for the process thread */
+    struct frame_ring ref_ring; /* their echo reference, same frames */
+    struct frame_ring out_ring; /* processed, waiting for in_read() */
+    int16_t *cap_buf;           /* block read by the capture thread */
+    int16_t *ref_buf;           /* its echo reference */
+    int16_t *proc_in;           /* block taken by the process thread */
+    int16_t *proc_ref;
+    int16_t *proc_out;
+    size_t block;               /* frames per capture */
+    size_t alloc_frames;        /* allocated size of the blocks above */
+    int32_t echo_delay_us;
+    int status;                 /* last capture error, for in_read() */
+    bool exit;
+    bool running;
+    uint32_t cap_dropped;       /* frames lost between the stages */
+    uint32_t out_dropped;
+};
 
 struct omap4_stream_in {
     struct audio_stream_in stream;
@@ -636,14 +944,24 @@ struct omap4_stream_in {
     bool need_echo_reference;
     effect_handle_t preprocessors[MAX_PREPROCESSORS];
     int num_preprocessors;
-    int16_t *proc_buf;
-    size_t proc_buf_size;
-    size_t proc_frames_in;
-    int16_t *ref_buf;
-    size_t ref_buf_size;
-    size_t ref_frames_in;
+    struct frame_ring proc_ring;    /* captured frames waiting for process() */
+    struct frame_ring ref_ring;     /* echo reference waiting for process_reverse() */
     int read_status;
+    /* frames the driver dropped, found from the capture position implied
+     * by the hardware time stamps; see check_capture_gap() */
+    uint64_t frames_read;       /* pcm frames read since the pcm was opened */
+    uint64_t gap_ref_pos;       /* capture position at gap_ref_ns, in pcm frames */
+    int64_t gap_ref_ns;
+    bool gap_ref_valid;
+    size_t fill_frames;         /* silence to hand out before frames_in */
+    bool filling;               /* the last buffer provided was silence */
+    int16_t *zero_buf;          /* a period of silence, with zero fill only */
+    volatile int32_t frames_lost;   /* stream frames, since the stream was opened */
+    int32_t frames_lost_reported;   /* frames_lost at the last in_get_input_frames_lost() */
+    volatile int32_t gaps;
+    struct capture_pipeline pipe;
     struct buffer_remix *remix_at_driver; /* adapt hw chan count to client */
+    struct stream_stats stats;
 
     struct omap4_audio_device *dev;
 };
@@ -651,6 +969,10 @@ struct omap4_stream_in {
 /**
  * NOTE: when multiple mutexes have to be acquired, always respect the following order:
  *        hw device > in stream > out stream
+ * Two output stream mutexes are only held together with the hw device
+ * mutex held, when the output mixer starts, its inputs are forced to
+ * standby or the pcms another output kept warm are closed.  The output
+ * mixer lock is always taken last.
  */
 
 
@@ -658,69 +980,154 @@ static void select_output_device(struct omap4_audio_device *adev);
 static void select_input_device(struct omap4_audio_device *adev);
 static int adev_set_voice_volume(struct audio_hw_device *dev, float volume);
 static int do_input_standby(struct omap4_stream_in *in);
+static void stop_capture_pipeline(struct omap4_stream_in *in);
 static int do_output_standby(struct omap4_stream_out *out);
+static void close_warm_output(struct omap4_audio_device *adev);
+static int start_output_sinks(struct omap4_stream_out *out);
+static void stop_output_sinks(struct omap4_stream_out *out);
+static int start_output_mixer(struct omap4_audio_device *adev, struct omap4_stream_out *owner);
+static int attach_mixer_input(struct omap4_audio_device *adev, struct omap4_stream_out *out);
+static void detach_mixer_input(struct omap4_audio_device *adev, struct omap4_stream_out *out);
+static int set_output_mixer_period(struct omap4_audio_device *adev);
+
+/* Empties the ring and sets it to size frames of chans channels, growing
+ * the storage if needed.  Not for the read path: it may allocate. */
+static int frame_ring_init(struct frame_ring *ring, size_t size, size_t chans)
+{
+    if (ring->alloc_samples < size * chans) {
+        int16_t *buf = (int16_t *)realloc(ring->buf, size * chans * sizeof(int16_t));
+        if (buf == NULL)
+            return -ENOMEM;
+        ring->buf = buf;
+        ring->alloc_samples = size * chans;
+    }
+    ring->size = size;
+    ring->chans = chans;
+    ring->rd = 0;
+    ring->frames = 0;
+    return 0;
+}
 
-/* Implementation of buffer_remix::remix_func that removes
- * channels in place without doing any other processing.  The
- * extra channels are truncated.
- */
-static void remove_channels_from_buf(struct buffer_remix *data, void *buf, size_t frames)
+/* first contiguous span of queued frames, at most *frames long */
+static int16_t *frame_ring_read_span(struct frame_ring *ring, size_t *frames)
 {
-    size_t samp_size, in_frame, out_frame;
-    size_t N, c;
-    char *s, *d;
+    size_t span = ring->size - ring->rd;
 
-    LOGFUNC("%s(%p, %p, %d)", __FUNCTION__, data, buf, frames);
-    if (frames == 0)
-        return;
+    if (span > ring->frames)
+        span = ring->frames;
+    if (*frames > span)
+        *frames = span;
+    return ring->buf + ring->rd * ring->chans;
+}
 
+static void frame_ring_consume(struct frame_ring *ring, size_t frames)
+{
+    ring->frames -= frames;
+    ring->rd += frames;
+    if (ring->rd >= ring->size)
+        ring->rd -= ring->size;
+    if (ring->frames == 0)
+        ring->rd = 0;
+}
 
-    samp_size = data->sample_size;
-    in_frame = data->in_chans * samp_size;
-    out_frame = data->out_chans * samp_size;
+/* first contiguous span of free frames, at most *frames long */
+static int16_t *frame_ring_write_span(struct frame_ring *ring, size_t *frames)
+{
+    size_t wr = ring->rd + ring->frames;
+    size_t span;
+
+    if (wr >= ring->size)
+        wr -= ring->size;
+    span = (wr >= ring->rd ? ring->size : ring->rd) - wr;
+    if (span > ring->size - ring->frames)
+        span = ring->size - ring->frames;
+    if (*frames > span)
+        *frames = span;
+    return ring->buf + wr * ring->chans;
+}
 
-    if (out_frame >= in_frame) {
-        ALOGE("BUG: remove_channels_from_buf() can not add channels to a buffer.\n");
-        return;
-    }
+static void frame_ring_commit(struct frame_ring *ring, size_t frames)
+{
+    ring->frames += frames;
+}
 
-    N = frames - 1;
-    d = (char*)buf + out_frame;
-    s = (char*)buf + in_frame;
+/* Copies frames in, dropping the oldest queued frames to make room;
+ * returns the number of frames dropped. */
+static size_t frame_ring_put(struct frame_ring *ring, const int16_t *src, size_t frames)
+{
+    size_t dropped = 0;
 
-    /* take the first several channels and
-     * truncate the rest
-     */
-    while (N--) {
-        for (c=0 ; c < out_frame ; ++c)
-            d[c] = s[c];
-        d += out_frame;
-        s += in_frame;
+    if (frames > ring->size) {
+        dropped = frames - ring->size;
+        src += dropped * ring->chans;
+        frames = ring->size;
+    }
+    if (frames > ring->size - ring->frames) {
+        size_t n = frames - (ring->size - ring->frames);
+        frame_ring_consume(ring, n);
+        dropped += n;
     }
+    while (frames != 0) {
+        size_t span = frames;
+        int16_t *dst = frame_ring_write_span(ring, &span);
+
+        memcpy(dst, src, span * ring->chans * sizeof(int16_t));
+        frame_ring_commit(ring, span);
+        src += span * ring->chans;
+        frames -= span;
+    }
+    return dropped;
 }
 
-static void setup_stereo_to_mono_input_remix(struct omap4_stream_in *in)
+/* Copies out up to frames queued frames, returns how many. */
+static size_t frame_ring_get(struct frame_ring *ring, int16_t *dst, size_t frames)
 {
-    struct buffer_remix *br = (struct buffer_remix *)malloc(sizeof(struct buffer_remix));
+    size_t done = 0;
 
-    LOGFUNC("%s(%p)", __FUNCTION__, in);
+    while (done < frames && ring->frames != 0) {
+        size_t span = frames - done;
+        const int16_t *src = frame_ring_read_span(ring, &span);
 
+        memcpy(dst + done * ring->chans, src, span * ring->chans * sizeof(int16_t));
+        frame_ring_consume(ring, span);
+        done += span;
+    }
+    return done;
+}
 
-    if (br) {
-        br->remix_func = remove_channels_from_buf;
-        br->sample_size = audio_stream_frame_size(&in->stream.common) / in->config.channels;
-        br->in_chans = 2;
-        br->out_chans = 1;
-    } else
-        ALOGE("Could not allocate memory for struct buffer_remix\n");
+/* Sets up the conversion from hw_chans at the driver to the stream's
+ * channel count.  in->buffer holds two periods of client frames: a period
+ * of up to twice as many hardware channels is read to its start and mixed
+ * down in place, fewer hardware channels are read to its upper half and
+ * expanded to the start.
+ */
+static void setup_input_remix(struct omap4_stream_in *in, size_t hw_chans)
+{
+    struct omap4_audio_device *adev = in->dev;
+    struct buffer_remix *br;
+    channel_remix_i16_t func = NULL;
+
+    LOGFUNC("%s(%p, %zu)", __FUNCTION__, in, hw_chans);
+
+    if (hw_chans == 2 && in->config.channels == 1)
+        func = adev->input_downmix_average ? remix_stereo_to_mono_avg_i16 :
+                                             remix_stereo_to_mono_pick_i16;
+    else if (hw_chans == 1 && in->config.channels == 2)
+        func = remix_mono_to_stereo_i16;
+    if (func == NULL) {
+        ALOGE("No remix from %zu to %d channels\n", hw_chans, in->config.channels);
+        return;
+    }
 
-    if (in->buffer) {
-        size_t chans = (br->in_chans > br->out_chans) ? br->in_chans : br->out_chans;
-        free(in->buffer);
-        in->buffer = malloc(in->config.period_size * br->sample_size * chans);
-        if (!in->buffer)
-            ALOGE("Could not reallocate memory for input buffer\n");
+    br = (struct buffer_remix *)malloc(sizeof(struct buffer_remix));
+    if (!br) {
+        ALOGE("Could not allocate memory for struct buffer_remix\n");
+        return;
     }
+    br->remix_func = func;
+    br->sample_size = sizeof(int16_t);
+    br->in_chans = hw_chans;
+    br->out_chans = in->config.channels;
 
     if (in->remix_at_driver)
         free(in->remix_at_driver);
@@ -916,19 +1323,38 @@ static void set_output_volumes(struct omap4_audio_device *adev)
     */
 }
 
-static void force_all_standby(struct omap4_audio_device *adev)
+/* Puts every playing output stream in standby: the active output or,
+ * while mixing, all the mixer inputs, the last of which stops the mixer.
+ * locked is an output stream whose mutex the caller already holds, or NULL.
+ * must be called with hw device mutex locked
+ */
+static void force_output_standby(struct omap4_audio_device *adev,
+                                 struct omap4_stream_out *locked)
 {
-    struct omap4_stream_in *in;
+    struct output_mixer *mixer = &adev->out_mixer;
     struct omap4_stream_out *out;
 
-    LOGFUNC("%s(%p)", __FUNCTION__, adev);
+    while (mixer->num_inputs > 0 || adev->active_output != NULL) {
+        if (mixer->num_inputs > 0)
+            out = mixer->inputs[mixer->num_inputs - 1];
+        else
+            out = adev->active_output;
 
-    if (adev->active_output) {
-        out = adev->active_output;
-        pthread_mutex_lock(&out->lock);
+        if (out != locked)
+            pthread_mutex_lock(&out->lock);
         do_output_standby(out);
-        pthread_mutex_unlock(&out->lock);
+        if (out != locked)
+            pthread_mutex_unlock(&out->lock);
     }
+}
+
+static void force_all_standby(struct omap4_audio_device *adev)
+{
+    struct omap4_stream_in *in;
+
+    LOGFUNC("%s(%p)", __FUNCTION__, adev);
+
+    force_output_standby(adev, NULL);
     if (adev->active_input) {
         in = adev->active_input;
         pthread_mutex_lock(&in->lock);
@@ -1022,17 +1448,156 @@ static void select_input_device(struct omap4_audio_device *adev)
     }
 }
 
+/* Deep buffer output: with the screen off let the whole buffer fill and
+ * only wake up once per long period, with the screen on keep the fill
+ * level at the primary output's so that pause and volume act quickly.
+ * The new avail_min must be pushed with pcm_set_avail_min() if the pcm
+ * is already open.
+ * must be called with hw device and output stream mutexes locked
+ */
+static void select_deep_buffer_power(struct omap4_stream_out *out, bool low_power)
+{
+    if (low_power) {
+        out->write_threshold = DEEP_BUFFER_LONG_PERIOD_SIZE * PLAYBACK_DEEP_BUFFER_PERIOD_COUNT;
+        out->config.avail_min = DEEP_BUFFER_LONG_PERIOD_SIZE;
+    } else {
+        out->write_threshold = SHORT_PERIOD_SIZE * PLAYBACK_PERIOD_COUNT;
+        out->config.avail_min = SHORT_PERIOD_SIZE;
+    }
+    out->low_power = low_power;
+}
+
+/* IEC 60958 channel status byte 3: sampling frequency */
+static unsigned char iec958_rate_code(uint32_t rate)
+{
+    switch (rate) {
+    case 32000:
+        return 0x03;
+    case 44100:
+        return 0x00;
+    case 48000:
+        return 0x02;
+    case 88200:
+        return 0x08;
+    case 96000:
+        return 0x0a;
+    case 176400:
+        return 0x0c;
+    case 192000:
+        return 0x0e;
+    default:
+        return 0x01;            /* not indicated */
+    }
+}
+
+/* Sets the channel status card sends with its pcm: consumer format, and
+ * the non-audio bit while compressed bursts are passed through so that
+ * receivers do not play them as pcm.  A card without the control keeps
+ * its own.
+ * must be called with hw device mutex locked
+ */
+static void set_iec958_status(unsigned int card, uint32_t rate, bool nonaudio)
+{
+    struct snd_aes_iec958 iec958;
+    struct mixer *mixer;
+    struct mixer_ctl *ctl;
+
+    mixer = mixer_open(card);
+    if (mixer == NULL)
+        return;
+    ctl = mixer_get_ctl_by_name(mixer, MIXER_IEC958_PLAYBACK_DEFAULT);
+    if (ctl != NULL) {
+        memset(&iec958, 0, sizeof(iec958));
+        iec958.status[0] = IEC958_AES0_CON_NOT_COPYRIGHT | (nonaudio ? IEC958_AES0_NONAUDIO : 0);
+        iec958.status[1] = IEC958_AES1_CON_ORIGINAL | IEC958_AES1_CON_PCM_CODER;
+        iec958.status[3] = iec958_rate_code(rate);
+        iec958.status[4] = IEC958_AES4_CON_WORDLEN_20_16;
+        if (mixer_ctl_set_array(ctl, &iec958, 1) != 0)
+            ALOGW("card %u: cannot set the channel status", card);
+    } else if (nonaudio) {
+        ALOGW("card %u: no %s, the receiver may take passthrough for pcm", card,
+              MIXER_IEC958_PLAYBACK_DEFAULT);
+    }
+    mixer_close(mixer);
+}
+
+/* back to pcm on both cards, after passthrough
+ * must be called with hw device mutex locked
+ */
+static void end_passthrough_status(void)
+{
+    set_iec958_status(CARD_OMAP4_HDMI, DEFAULT_OUT_SAMPLING_RATE, false);
+    set_iec958_status(CARD_OMAP4_SPDIF, DEFAULT_OUT_SAMPLING_RATE, false);
+}
+
+/* an output the mixer cannot take: compressed bursts, or more channels
+ * than its stereo inputs */
+static bool out_is_exclusive(const struct omap4_stream_out *out)
+{
+    return out->iec != NULL || out->config.channels > 2;
+}
+
 /* must be called with hw device and output stream mutexes locked */
 static int start_output_stream(struct omap4_stream_out *out)
 {
     struct omap4_audio_device *adev = out->dev;
     unsigned int card = CARD_STEELHEAD_DEFAULT;
     unsigned int port = PORT_MM_LP;
+    unsigned int flags = PCM_OUT | PCM_MMAP;
 
     LOGFUNC("%s(%p)", __FUNCTION__, adev);
 
+    if (out->warm) {
+        /* the pcms were kept open at standby and are playing silence:
+         * writing to them again is all it takes */
+        out->warm = false;
+        if (adev->echo_reference != NULL && !out_is_exclusive(out))
+            out->echo_reference = adev->echo_reference;
+        if (out->resampler)
+            out->resampler->reset(out->resampler);
+        return 0;
+    }
+    /* pcms another output kept warm are closed, not mixed into */
+    close_warm_output(adev);
+
+    /* compressed bursts and multichannel cannot be mixed: such an output
+     * takes the pcm from the others, which cannot start again until it
+     * goes to standby */
+    if (adev->active_output != NULL && adev->active_output != out) {
+        if (out_is_exclusive(adev->active_output))
+            return -EBUSY;
+        if (out_is_exclusive(out))
+            force_output_standby(adev, out);
+    }
+
+    /* all outputs share the same pcm device: the first one started has it
+     * to itself until another one starts, then both go through the mixer */
+    if (adev->active_output != NULL && adev->active_output != out) {
+        int ret = 0;
+
+        if (adev->out_mixer.out == NULL)
+            ret = start_output_mixer(adev, adev->active_output);
+        if (ret == 0)
+            ret = attach_mixer_input(adev, out);
+        if (ret == 0 && (out->flags & AUDIO_OUTPUT_FLAG_FAST)) {
+            ret = set_output_mixer_period(adev);
+            if (ret != 0)
+                detach_mixer_input(adev, out);
+        }
+        if (ret != 0) {
+            ALOGW("%s: output %p busy, cannot mix %p: %d", __func__,
+                  adev->active_output, out, ret);
+            return ret;
+        }
+        if (out->resampler)
+            out->resampler->reset(out->resampler);
+        return 0;
+    }
+
     adev->active_output = out;
-    if (adev->devices & AUDIO_DEVICE_OUT_ALL_SCO)
+    if (out->iec != NULL)
+        ; /* the pcm runs at the burst rate, set at open */
+    else if (adev->devices & AUDIO_DEVICE_OUT_ALL_SCO)
         out->config.rate = MM_FULL_POWER_SAMPLING_RATE;
     else
         out->config.rate = DEFAULT_OUT_SAMPLING_RATE;
@@ -1059,14 +1624,50 @@ static int start_output_stream(struct omap4_stream_out *out)
     /* default to low power:
      *  NOTE: PCM_NOIRQ mode is required to dynamically scale avail_min
      */
-    out->write_threshold = PLAYBACK_PERIOD_COUNT * LONG_PERIOD_SIZE;
-    out->config.start_threshold = SHORT_PERIOD_SIZE * 2;
-    out->config.avail_min = LONG_PERIOD_SIZE,
-    out->low_power = 1;
-
-    out->pcm = pcm_open(card, port, PCM_OUT | PCM_MMAP, &out->config);
-    if (card != CARD_OMAP4_SPDIF) {
-        out->pcmspdif = pcm_open(CARD_OMAP4_SPDIF, port, PCM_OUT | PCM_MMAP, &out->config);
+    if (out->config.channels > 2 && card != CARD_OMAP4_HDMI) {
+        ALOGE("%s: multichannel is only sent to hdmi", __func__);
+        adev->active_output = NULL;
+        return -EINVAL;
+    }
+    if (out->iec != NULL) {
+        if (card == CARD_OMAP4_USB) {
+            ALOGE("%s: no passthrough to usb", __func__);
+            adev->active_output = NULL;
+            return -EINVAL;
+        }
+        out->write_threshold = PLAYBACK_PERIOD_COUNT * out->config.period_size;
+        out->config.start_threshold = out->config.period_size;
+        out->config.avail_min = out->config.period_size;
+        out->low_power = 0;
+        iec61937_reset(out->iec);
+        set_iec958_status(card, out->config.rate, true);
+    } else if (out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
+        select_deep_buffer_power(out, adev->low_power);
+        out->config.start_threshold = SHORT_PERIOD_SIZE * 2;
+        flags |= PCM_NOIRQ;
+    } else if (out->flags & AUDIO_OUTPUT_FLAG_FAST) {
+        /* start on the first period and keep the buffer nearly empty */
+        out->write_threshold = FAST_PERIOD_SIZE * PLAYBACK_FAST_THRESHOLD_COUNT;
+        out->config.start_threshold = FAST_PERIOD_SIZE;
+        out->config.avail_min = FAST_PERIOD_SIZE;
+        out->low_power = 0;
+    } else {
+        out->write_threshold = PLAYBACK_PERIOD_COUNT * LONG_PERIOD_SIZE;
+        out->config.start_threshold = SHORT_PERIOD_SIZE * 2;
+        out->config.avail_min = LONG_PERIOD_SIZE,
+        out->low_power = 1;
+    }
+
+    out->pcm = pcm_open(card, port, flags, &out->config);
+    /* E-AC-3 needs the HDMI bandwidth: it is not sent to S/PDIF */
+    if (card != CARD_OMAP4_SPDIF && out->format != AUDIO_FORMAT_E_AC3) {
+        /* S/PDIF is stereo: its sink downmixes multichannel */
+        struct pcm_config spdif_config = out->config;
+
+        spdif_config.channels = 2;
+        if (out->iec != NULL)
+            set_iec958_status(CARD_OMAP4_SPDIF, out->config.rate, true);
+        out->pcmspdif = pcm_open(CARD_OMAP4_SPDIF, port, flags, &spdif_config);
     } else {
         out->pcmspdif = NULL;
     }
@@ -1079,11 +1680,23 @@ static int start_output_stream(struct omap4_stream_out *out)
     if (!pcm_is_ready(out->pcm)) {
         ALOGE("cannot open pcm_out driver: %s", pcm_get_error(out->pcm));
         pcm_close(out->pcm);
+        if (out->pcmspdif != NULL) {
+            pcm_close(out->pcmspdif);
+            out->pcmspdif = NULL;
+        }
+        if (out->iec != NULL)
+            end_passthrough_status();
         adev->active_output = NULL;
         return -ENOMEM;
     }
 
-    if (adev->echo_reference != NULL)
+    if (out->pcmspdif != NULL && start_output_sinks(out) != 0) {
+        ALOGE("cannot start sink writers, dropping spdif");
+        pcm_close(out->pcmspdif);
+        out->pcmspdif = NULL;
+    }
+
+    if (adev->echo_reference != NULL && !out_is_exclusive(out))
         out->echo_reference = adev->echo_reference;
     if (out->resampler)
         out->resampler->reset(out->resampler);
@@ -1172,7 +1785,7 @@ static void put_echo_reference(struct omap4_audio_device *adev,
             reference == adev->echo_reference) {
         if (adev->active_output != NULL)
             remove_echo_reference(adev->active_output, reference);
-        release_echo_reference(reference);
+        release_aec_reference(reference);
         adev->echo_reference = NULL;
     }
 }
@@ -1186,19 +1799,17 @@ static struct echo_reference_itfe *get_echo_reference(struct omap4_audio_device
                                                 channel_count, sampling_rate);
 
     put_echo_reference(adev, adev->echo_reference);
-    if (adev->active_output != NULL) {
-        struct audio_stream *stream = &adev->active_output->stream.common;
-        uint32_t wr_channel_count = popcount(stream->get_channels(stream));
-        uint32_t wr_sampling_rate = stream->get_sample_rate(stream);
-
-        int status = create_echo_reference(AUDIO_FORMAT_PCM_16_BIT,
-                                           channel_count,
-                                           sampling_rate,
-                                           AUDIO_FORMAT_PCM_16_BIT,
-                                           wr_channel_count,
-                                           wr_sampling_rate,
-                                           &adev->echo_reference);
-        if (status == 0)
+    /* there is no reference to compressed passthrough or multichannel */
+    if (adev->active_output != NULL && !out_is_exclusive(adev->active_output)) {
+        /* the output writes what it hands to the pcm, after resampling */
+        struct omap4_stream_out *out = adev->active_output;
+        int status = create_aec_reference(channel_count,
+                                          sampling_rate,
+                                          out->config.channels,
+                                          out->config.rate,
+                                          &adev->echo_reference);
+        /* a warm output attaches it when it restarts */
+        if (status == 0 && !out->warm)
             add_echo_reference(adev->active_output, adev->echo_reference);
     }
     return adev->echo_reference;
@@ -1224,21 +1835,61 @@ static int get_playback_delay(struct omap4_stream_out *out,
     }
 
     kernel_frames = pcm_get_buffer_size(out->pcm) - kernel_frames;
+    if (out->num_sinks > 0)
+        kernel_frames += (uint32_t)(out->ring_wr - android_atomic_acquire_load(&out->sinks[0].rd));
 
     /* adjust render time stamp with delay added by current driver buffer.
      * Add the duration of current frame as we want the render time of the last
      * sample being written. */
     buffer->delay_ns = (long)(((int64_t)(kernel_frames + frames)* 1000000000)/
-                            MM_FULL_POWER_SAMPLING_RATE);
+                            out->config.rate);
 
     return 0;
 }
 
+/* Frames written to the pcm but not yet played: the kernel buffer and,
+ * with sink writers, the part of the ring the main sink has not taken.
+ * For a mixer input, what waits in its mix ring plus what the mixer
+ * output has queued.  tstamp is when the kernel fill level was sampled.
+ * must be called with output stream mutex locked
+ */
+static int get_output_queued_frames(struct omap4_stream_out *out, uint32_t *frames,
+                                    struct timespec *tstamp)
+{
+    unsigned int avail;
+    int kernel_frames;
+
+    if (out->mixed) {
+        uint32_t mix_fill = (uint32_t)(out->mix_wr - android_atomic_acquire_load(&out->mix_rd));
+
+        if (get_output_queued_frames(out->dev->out_mixer.out, frames, tstamp) != 0)
+            return -ENODEV;
+        *frames += mix_fill;
+        return 0;
+    }
+
+    if (out->pcm == NULL || pcm_get_htimestamp(out->pcm, &avail, tstamp) < 0)
+        return -ENODEV;
+
+    kernel_frames = (int)pcm_get_buffer_size(out->pcm) - (int)avail;
+    *frames = kernel_frames > 0 ? kernel_frames : 0;
+    if (out->num_sinks > 0)
+        *frames += (uint32_t)(out->ring_wr - android_atomic_acquire_load(&out->sinks[0].rd));
+    return 0;
+}
+
+static int64_t get_output_resampler_delay_ns(struct omap4_stream_out *out)
+{
+    return out->resampler != NULL ? out->resampler->delay_ns(out->resampler) : 0;
+}
+
 static uint32_t out_get_sample_rate(const struct audio_stream *stream)
 {
+    struct omap4_stream_out *out = (struct omap4_stream_out *)stream;
+
     LOGFUNC("%s(%p)", __FUNCTION__, stream);
 
-    return DEFAULT_OUT_SAMPLING_RATE;
+    return out->sample_rate;
 }
 
 static int out_set_sample_rate(struct audio_stream *stream, uint32_t rate)
@@ -1254,26 +1905,41 @@ static size_t out_get_buffer_size(const struct audio_stream *stream)
 
     LOGFUNC("%s(%p)", __FUNCTION__, stream);
 
+    if (out->iec != NULL)
+        return PASSTHROUGH_BUFFER_SIZE;
+
     /* take resampling into account and return the closest majoring
     multiple of 16 frames, as audioflinger expects audio buffers to
     be a multiple of 16 frames */
-    size_t size = (SHORT_PERIOD_SIZE * DEFAULT_OUT_SAMPLING_RATE) / out->config.rate;
+    size_t period = SHORT_PERIOD_SIZE;
+    size_t size;
+
+    if (out->flags & AUDIO_OUTPUT_FLAG_FAST)
+        period = FAST_PERIOD_SIZE;
+    else if (out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER)
+        /* AudioFlinger writes as rarely as the pcm wakes up */
+        period = DEEP_BUFFER_LONG_PERIOD_SIZE;
+    size = (period * out->sample_rate) / out->config.rate;
     size = ((size + 15) / 16) * 16;
     return size * audio_stream_frame_size((struct audio_stream *)stream);
 }
 
 static uint32_t out_get_channels(const struct audio_stream *stream)
 {
+    struct omap4_stream_out *out = (struct omap4_stream_out *)stream;
+
     LOGFUNC("%s(%p)", __FUNCTION__, stream);
 
-    return AUDIO_CHANNEL_OUT_STEREO;
+    return out->channel_mask;
 }
 
 static int out_get_format(const struct audio_stream *stream)
 {
+    struct omap4_stream_out *out = (struct omap4_stream_out *)stream;
+
     LOGFUNC("%s(%p)", __FUNCTION__, stream);
 
-    return AUDIO_FORMAT_PCM_16_BIT;
+    return out->format;
 }
 
 static int out_set_format(struct audio_stream *stream, int format)
@@ -1283,96 +1949,359 @@ static int out_set_format(struct audio_stream *stream, int format)
     return 0;
 }
 
-/* must be called with hw device and output stream mutexes locked */
-static int do_output_standby(struct omap4_stream_out *out)
+/* bytes per pcm frame, which for passthrough is not a stream frame */
+static size_t out_pcm_frame_size(const struct omap4_stream_out *out)
 {
-    struct omap4_audio_device *adev = out->dev;
+    return out->config.channels * sizeof(int16_t);
+}
 
-    LOGFUNC("%s(%p)", __FUNCTION__, out);
+static int64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
 
-    if (!out->standby) {
-        pcm_close(out->pcm);
-        out->pcm = NULL;
-        if (out->pcmspdif != NULL) {
-            pcm_close(out->pcmspdif);
-            out->pcmspdif = NULL;
-        }
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-        adev->active_output = 0;
+static void stats_hist_add(struct stats_hist *hist, int64_t us)
+{
+    int bin = 0;
 
-        /* if in call, don't turn off the output stage. This will
-        be done when the call is ended */
-        if (adev->mode != AUDIO_MODE_IN_CALL) {
-            /* FIXME: only works if only one output can be active at a time */
-            //set_route_by_array(adev->mixer, hs_output, 0);
-            //set_route_by_array(adev->mixer, hf_output, 0);
-        }
+    while (bin < STATS_HIST_BINS - 1 && us >= (int64_t)STATS_HIST_MIN_US << bin)
+        bin++;
+    android_atomic_inc(&hist->bins[bin]);
+}
 
-        /* stop writing to echo reference */
-        if (out->echo_reference != NULL) {
-            out->echo_reference->write(out->echo_reference, NULL);
-            out->echo_reference = NULL;
-        }
-        out->standby = 1;
+/* Records the fill level of a capture pcm before a read.  tinyalsa keeps
+ * its xrun count to itself, so a full kernel buffer counts as an overrun.
+ */
+static void stats_capture_fill(struct stream_stats *stats, struct pcm *pcm, unsigned int rate)
+{
+    unsigned int avail;
+    struct timespec tstamp;
+
+    if (pcm_get_htimestamp(pcm, &avail, &tstamp) < 0)
+        return;
+    stats_hist_add(&stats->fill_us, (int64_t)avail * 1000000 / rate);
+    if (avail >= pcm_get_buffer_size(pcm))
+        android_atomic_inc(&stats->xruns);
+}
+
+/* AudioFlinger dumps from its binder thread: wait a little for a stream
+ * lock held across a pcm write, but never hang dumpsys on a stuck stream */
+#define DUMP_LOCK_RETRIES 50
+#define DUMP_LOCK_SLEEP_US 10000
+
+static bool dump_trylock(pthread_mutex_t *lock)
+{
+    int i;
+
+    for (i = 0; i < DUMP_LOCK_RETRIES; i++) {
+        if (pthread_mutex_trylock(lock) == 0)
+            return true;
+        usleep(DUMP_LOCK_SLEEP_US);
     }
+    return false;
+}
 
-    return 0;
+static void dump_printf(int fd, const char *fmt, ...)
+{
+    char buf[256];
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len > (int)sizeof(buf) - 1)
+        len = sizeof(buf) - 1;
+    if (len > 0)
+        write(fd, buf, len);
 }
 
-static int out_standby(struct audio_stream *stream)
+/* one line of percentiles (upper bin limits) and one of non empty bins */
+static void dump_stats_hist(int fd, const char *name, const struct stats_hist *hist)
 {
-    struct omap4_stream_out *out = (struct omap4_stream_out *)stream;
-    int status;
+    static const int percents[] = { 50, 90, 99, 100 };
+    int32_t bins[STATS_HIST_BINS];
+    int64_t total = 0, sum;
+    char line[256] = "";
+    int len = 0;
+    int i, p;
+
+    for (i = 0; i < STATS_HIST_BINS; i++) {
+        bins[i] = android_atomic_acquire_load(&hist->bins[i]);
+        total += bins[i];
+    }
+    dump_printf(fd, "    %s: %lld", name, (long long)total);
+    if (total == 0) {
+        dump_printf(fd, "\n");
+        return;
+    }
 
-    LOGFUNC("%s(%p)", __FUNCTION__, stream);
+    for (p = 0, i = 0, sum = bins[0]; p < (int)(sizeof(percents) / sizeof(percents[0])); p++) {
+        while (sum * 100 < total * percents[p])
+            sum += bins[++i];
+        if (percents[p] == 100)
+            dump_printf(fd, ", max");
+        else
+            dump_printf(fd, ", p%d", percents[p]);
+        if (i == STATS_HIST_BINS - 1)
+            dump_printf(fd, " >= %d us", STATS_HIST_MIN_US << (STATS_HIST_BINS - 2));
+        else
+            dump_printf(fd, " < %d us", STATS_HIST_MIN_US << i);
+    }
+    dump_printf(fd, "\n");
 
-    pthread_mutex_lock(&out->dev->lock);
-    pthread_mutex_lock(&out->lock);
-    status = do_output_standby(out);
-    pthread_mutex_unlock(&out->lock);
-    pthread_mutex_unlock(&out->dev->lock);
-    return status;
+    for (i = 0; i < STATS_HIST_BINS && len < (int)sizeof(line) - 1; i++) {
+        if (bins[i] == 0)
+            continue;
+        if (i == STATS_HIST_BINS - 1)
+            len += snprintf(line + len, sizeof(line) - len, " >=%d:%d",
+                            STATS_HIST_MIN_US << (i - 1), bins[i]);
+        else
+            len += snprintf(line + len, sizeof(line) - len, " <%d:%d",
+                            STATS_HIST_MIN_US << i, bins[i]);
+    }
+    dump_printf(fd, "     %s\n", line);
 }
 
-static int out_dump(const struct audio_stream *stream, int fd)
+static void dump_stream_stats(int fd, const struct stream_stats *stats, const char *xruns)
 {
-    LOGFUNC("%s(%p, %d)", __FUNCTION__, stream, fd);
+    dump_printf(fd, "  %d transfers, %d %s, %d starts, %d standbys\n",
+                stats->transfers, stats->xruns, xruns, stats->starts, stats->standbys);
+    dump_stats_hist(fd, "call", &stats->call_us);
+    dump_stats_hist(fd, "blocked", &stats->blocked_us);
+    dump_stats_hist(fd, "kernel fill", &stats->fill_us);
+    dump_stats_hist(fd, "resampler cpu", &stats->resample_us);
+}
 
-    return 0;
+/* mean and variance of the wake-up lateness, 0 if the writer never slept */
+static void write_pacing_lateness(const struct write_pacing *pacing,
+                                  int64_t *mean_us, int64_t *var_us2)
+{
+    *mean_us = 0;
+    *var_us2 = 0;
+    if (pacing->sleeps == 0)
+        return;
+
+    *mean_us = pacing->late_ns / 1000 / pacing->sleeps;
+    *var_us2 = pacing->late_sq_us / pacing->sleeps - *mean_us * *mean_us;
 }
 
-static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
+static void log_write_pacing(const char *name, const struct write_pacing *pacing)
 {
-    struct omap4_stream_out *out = (struct omap4_stream_out *)stream;
-    struct omap4_audio_device *adev = out->dev;
-    struct omap4_stream_in *in;
-    struct str_parms *parms;
-    char *str;
-    char value[32];
-    int ret, val = 0;
-    bool force_input_standby = false;
+    int64_t mean_us, var_us2;
 
-    LOGFUNC("%s(%p, %s)", __FUNCTION__, stream, kvpairs);
+    if (pacing->sleeps == 0)
+        return;
 
-    parms = str_parms_create_str(kvpairs);
+    write_pacing_lateness(pacing, &mean_us, &var_us2);
+    ALOGV("%s write pacing: %u writes, %u sleeps, lateness mean %lld us var %lld us^2",
+          name, pacing->writes, pacing->sleeps, (long long)mean_us, (long long)var_us2);
+}
 
-    ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_ROUTING, value, sizeof(value));
-    if (ret >= 0) {
-        val = atoi(value);
-        pthread_mutex_lock(&adev->lock);
-        pthread_mutex_lock(&out->lock);
-        if (((adev->devices & AUDIO_DEVICE_OUT_ALL) != val) && (val != 0)) {
-            if (out == adev->active_output) {
-                do_output_standby(out);
-                /* a change in output device may change the microphone selection */
+static void dump_write_pacing(int fd, const char *name, const struct write_pacing *pacing)
+{
+    int64_t mean_us, var_us2;
+
+    if (pacing->writes == 0)
+        return;
+
+    write_pacing_lateness(pacing, &mean_us, &var_us2);
+    dump_printf(fd, "  %s write pacing: %u writes, %u sleeps, "
+                "lateness mean %lld us var %lld us^2\n", name, pacing->writes, pacing->sleeps,
+                (long long)mean_us, (long long)var_us2);
+}
+
+/* Closes the pcms of the output that has them to itself.
+ * must be called with hw device and output stream mutexes locked
+ */
+static void close_output_pcms(struct omap4_stream_out *out)
+{
+    stop_output_sinks(out);
+    pcm_close(out->pcm);
+    out->pcm = NULL;
+    if (out->pcmspdif != NULL) {
+        pcm_close(out->pcmspdif);
+        out->pcmspdif = NULL;
+    }
+    if (out->iec != NULL)
+        end_passthrough_status();
+
+    out->dev->active_output = 0;
+    out->warm = false;
+}
+
+/* Closes the pcms the active output kept open in standby, if it did.
+ * must be called with hw device mutex locked, and not the active output's
+ */
+static void close_warm_output(struct omap4_audio_device *adev)
+{
+    struct omap4_stream_out *out = adev->active_output;
+
+    if (out == NULL || !out->warm)
+        return;
+    pthread_mutex_lock(&out->lock);
+    close_output_pcms(out);
+    pthread_mutex_unlock(&out->lock);
+}
+
+/* Puts the output in standby.  With keep_warm, an output that has the
+ * pcms to itself leaves them open for adev->standby_delay_ms, see
+ * output_warm_thread().  Otherwise they are closed, also those of an
+ * output already in standby that kept them warm.
+ * must be called with hw device and output stream mutexes locked
+ */
+static int output_standby(struct omap4_stream_out *out, bool keep_warm)
+{
+    struct omap4_audio_device *adev = out->dev;
+
+    LOGFUNC("%s(%p, %d)", __FUNCTION__, out, keep_warm);
+
+    if (!out->standby) {
+        uint32_t queued = 0;
+        struct timespec tstamp;
+
+        /* what is still queued is dropped, as is the resampler's content
+         * when the output restarts */
+        get_output_queued_frames(out, &queued, &tstamp);
+        playback_position_standby(&out->position, queued, get_output_resampler_delay_ns(out));
+
+        if (out->mixed) {
+            detach_mixer_input(adev, out);
+        } else if (keep_warm) {
+            out->warm = true;
+            out->warm_deadline_ns = clock_ns(CLOCK_MONOTONIC) +
+                                    (int64_t)adev->standby_delay_ms * 1000000LL;
+            sem_post(&adev->warm_wake);
+        } else {
+            close_output_pcms(out);
+        }
+
+        /* if in call, don't turn off the output stage. This will
+        be done when the call is ended */
+        if (adev->mode != AUDIO_MODE_IN_CALL) {
+            /* FIXME: only works if only one output can be active at a time */
+            //set_route_by_array(adev->mixer, hs_output, 0);
+            //set_route_by_array(adev->mixer, hf_output, 0);
+        }
+
+        /* stop writing to echo reference */
+        if (out->echo_reference != NULL) {
+            out->echo_reference->write(out->echo_reference, NULL);
+            out->echo_reference = NULL;
+        }
+
+        log_write_pacing("out", &out->pacing);
+        memset(&out->pacing, 0, sizeof(out->pacing));
+        android_atomic_inc(&out->stats.standbys);
+
+        out->standby = 1;
+    } else if (out->warm && !keep_warm) {
+        close_output_pcms(out);
+    }
+
+    return 0;
+}
+
+/* must be called with hw device and output stream mutexes locked */
+static int do_output_standby(struct omap4_stream_out *out)
+{
+    return output_standby(out, false);
+}
+
+/* AudioFlinger's standby: the pcms of an output that has them to itself
+ * are kept warm, unless they carry compressed bursts or a call is up */
+static int out_standby(struct audio_stream *stream)
+{
+    struct omap4_stream_out *out = (struct omap4_stream_out *)stream;
+    struct omap4_audio_device *adev = out->dev;
+    int status;
+
+    LOGFUNC("%s(%p)", __FUNCTION__, stream);
+
+    pthread_mutex_lock(&adev->lock);
+    pthread_mutex_lock(&out->lock);
+    status = output_standby(out, adev->warm_running && out->iec == NULL &&
+                                 adev->mode != AUDIO_MODE_IN_CALL);
+    pthread_mutex_unlock(&out->lock);
+    pthread_mutex_unlock(&adev->lock);
+    return status;
+}
+
+static int out_dump(const struct audio_stream *stream, int fd)
+{
+    struct omap4_stream_out *out = (struct omap4_stream_out *)stream;
+    int i;
+
+    LOGFUNC("%s(%p, %d)", __FUNCTION__, stream, fd);
+
+    if (!dump_trylock(&out->lock)) {
+        dump_printf(fd, "  output %p: busy, not dumped\n", out);
+        return 0;
+    }
+
+    dump_printf(fd, "  output %p: flags 0x%x, %u Hz (pcm %u Hz), %u channels, %s\n", out,
+                out->flags, out->sample_rate, out->config.rate, out->config.channels,
+                out->standby ? "standby" : "active");
+    dump_stream_stats(fd, &out->stats, "underruns");
+    dump_stats_hist(fd, "cold start", &out->cold_start_us);
+    dump_stats_hist(fd, "warm start", &out->warm_start_us);
+    if (out->dev->standby_delay_ms > 0)
+        dump_printf(fd, "  keep warm: %u ms, pcms %s, %d closed after the delay\n",
+                    out->dev->standby_delay_ms, out->warm ? "warm" : "not warm",
+                    out->warm_closes);
+    if (out->iec != NULL)
+        dump_printf(fd, "  passthrough: format 0x%x, %u bursts, %u bytes skipped\n",
+                    out->format, out->iec->bursts, out->iec->skipped);
+    if (out->mixed)
+        dump_printf(fd, "  mixed: %u underruns since start, volume %d/%d\n",
+                    out->mix_underruns, out->gain_left, out->gain_right);
+    dump_write_pacing(fd, "out", &out->pacing);
+    for (i = 0; i < out->num_sinks; i++) {
+        dump_printf(fd, "  %s sink: %u underruns, %u overruns since start\n",
+                    out->sinks[i].name, out->sinks[i].underruns, out->sinks[i].overruns);
+        dump_write_pacing(fd, out->sinks[i].name, &out->sinks[i].pacing);
+    }
+
+    pthread_mutex_unlock(&out->lock);
+    return 0;
+}
+
+static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
+{
+    struct omap4_stream_out *out = (struct omap4_stream_out *)stream;
+    struct omap4_audio_device *adev = out->dev;
+    struct omap4_stream_in *in;
+    struct str_parms *parms;
+    char *str;
+    char value[32];
+    int ret, val = 0;
+    bool force_input_standby = false;
+
+    LOGFUNC("%s(%p, %s)", __FUNCTION__, stream, kvpairs);
+
+    parms = str_parms_create_str(kvpairs);
+
+    ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_ROUTING, value, sizeof(value));
+    if (ret >= 0) {
+        val = atoi(value);
+        pthread_mutex_lock(&adev->lock);
+        pthread_mutex_lock(&out->lock);
+        if (((adev->devices & AUDIO_DEVICE_OUT_ALL) != val) && (val != 0)) {
+            if (out == adev->active_output || out->mixed) {
+                /* the pcm is reopened on the new device, by all the
+                 * streams mixed into it */
+                force_output_standby(adev, out);
+                /* a change in output device may change the microphone selection */
                 if (adev->active_input &&
                         adev->active_input->source == AUDIO_SOURCE_VOICE_COMMUNICATION) {
                     force_input_standby = true;
                 }
-                /* force standby if moving to/from HDMI */
-                if ((val & AUDIO_DEVICE_OUT_AUX_DIGITAL) ^
-                    (adev->devices & AUDIO_DEVICE_OUT_AUX_DIGITAL))
-                        do_output_standby(out);
+            } else {
+                /* warm pcms would restart on the old device */
+                close_warm_output(adev);
             }
             adev->devices &= ~AUDIO_DEVICE_OUT_ALL;
             adev->devices |= val;
@@ -1395,25 +2324,1053 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
 
 static char * out_get_parameters(const struct audio_stream *stream, const char *keys)
 {
+    struct omap4_stream_out *out = (struct omap4_stream_out *)stream;
+    struct str_parms *query, *reply;
+    char value[8];
+    char *str;
+
     LOGFUNC("%s(%p, %s)", __FUNCTION__, stream, keys);
 
-    return strdup("");
+    /* a direct output takes multichannel, see adev_open_output_stream() */
+    query = str_parms_create_str(keys);
+    if (str_parms_get_str(query, AUDIO_PARAMETER_STREAM_SUP_CHANNELS, value,
+                          sizeof(value)) < 0 ||
+            !(out->flags & AUDIO_OUTPUT_FLAG_DIRECT) || out->iec != NULL) {
+        str_parms_destroy(query);
+        return strdup("");
+    }
+    reply = str_parms_create();
+    str_parms_add_str(reply, AUDIO_PARAMETER_STREAM_SUP_CHANNELS,
+                      "AUDIO_CHANNEL_OUT_STEREO|AUDIO_CHANNEL_OUT_5POINT1|"
+                      "AUDIO_CHANNEL_OUT_7POINT1");
+    str = str_parms_to_str(reply);
+    str_parms_destroy(reply);
+    str_parms_destroy(query);
+    return str;
 }
 
 static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
-    struct omap4_stream_out *out = (struct omap4_stream_out *)stream;
+    struct omap4_stream_out *out = (struct omap4_stream_out *)stream;
+    uint32_t frames;
+
+    LOGFUNC("%s(%p)", __FUNCTION__, stream);
+    /* a mixed output is queued in its mix ring, then by the mixer output
+     * whose pcm it plays on */
+    if (out->mixed)
+        frames = out->mix_ring_limit + out->mix_out_frames;
+    else if (out->iec != NULL)
+        frames = out->write_threshold + out->config.period_size;
+    else if (out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER)
+        frames = out->config.period_size * out->config.period_count;
+    /* writes are paced to the threshold, so at most the threshold plus
+     * one write is queued */
+    else if (out->flags & AUDIO_OUTPUT_FLAG_FAST)
+        frames = FAST_PERIOD_SIZE * (PLAYBACK_FAST_THRESHOLD_COUNT + 1);
+    else
+        frames = SHORT_PERIOD_SIZE * PLAYBACK_PERIOD_COUNT;
+
+    /* plus what waits in the ring for the sink writers */
+    if (out->num_sinks > 0)
+        frames += out->ring_limit;
+
+    /* round up so the latency is never under-reported */
+    return (frames * 1000 + out->config.rate - 1) / out->config.rate;
+}
+
+static int16_t volume_to_gain(float volume)
+{
+    if (volume <= 0.0f)
+        return 0;
+    if (volume >= 1.0f)
+        return MIX_UNITY_GAIN;
+    return (int16_t)(volume * MIX_UNITY_GAIN + 0.5f);
+}
+
+/* The volume is applied by the mixer, or by out_write() while the stream
+ * has the pcm to itself. */
+static int out_set_volume(struct audio_stream_out *stream, float left,
+                          float right)
+{
+    struct omap4_stream_out *out = (struct omap4_stream_out *)stream;
+
+    LOGFUNC("%s(%p, %f, %f)", __FUNCTION__, stream, left, right);
+
+    android_atomic_release_store(volume_to_gain(left), &out->gain_left);
+    android_atomic_release_store(volume_to_gain(right), &out->gain_right);
+    return 0;
+}
+
+static int64_t timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+    return (int64_t)(a->tv_sec - b->tv_sec) * 1000000000LL + (a->tv_nsec - b->tv_nsec);
+}
+
+/* Sleeps until no more than threshold frames are left in the kernel
+ * buffer of pcm.  The deadline is computed once from the hardware
+ * timestamp taken with the fill level, so the writer wakes exactly once
+ * instead of polling the fill level.
+ * If stats is not NULL the fill level and the time blocked are recorded;
+ * an empty buffer after the first write counts as an underrun, tinyalsa
+ * does not report its own xrun count.
+ * must be called by the only thread writing to pcm
+ */
+static void wait_for_write_threshold(struct pcm *pcm, int threshold, unsigned int rate,
+                                     struct write_pacing *pacing, struct stream_stats *stats)
+{
+    unsigned int avail;
+    int kernel_frames;
+    struct timespec tstamp, now, deadline;
+    int64_t delay_ns, late_ns, start_ns = 0;
+
+    if (stats != NULL)
+        start_ns = clock_ns(CLOCK_MONOTONIC);
+
+    if (pcm_get_htimestamp(pcm, &avail, &tstamp) < 0)
+        return;
+
+    kernel_frames = pcm_get_buffer_size(pcm) - avail;
+    if (stats != NULL) {
+        stats_hist_add(&stats->fill_us,
+                       kernel_frames > 0 ? (int64_t)kernel_frames * 1000000 / rate : 0);
+        if (kernel_frames <= 0 && pacing->writes > 0)
+            android_atomic_inc(&stats->xruns);
+    }
+    if (kernel_frames <= threshold) {
+        if (stats != NULL)
+            stats_hist_add(&stats->blocked_us, 0);
+        return;
+    }
+
+    delay_ns = ((int64_t)(kernel_frames - threshold) * 1000000000LL) / rate;
+
+    /* the fill level was sampled at tstamp; if the driver does not
+     * timestamp on CLOCK_MONOTONIC, count from now */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    late_ns = timespec_diff_ns(&now, &tstamp);
+    if (late_ns < 0 || late_ns > MAX_TSTAMP_AGE_NS)
+        tstamp = now;
+
+    delay_ns += tstamp.tv_nsec;
+    deadline.tv_sec = tstamp.tv_sec + delay_ns / 1000000000LL;
+    deadline.tv_nsec = delay_ns % 1000000000LL;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+        ;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    late_ns = timespec_diff_ns(&now, &deadline);
+    if (stats != NULL)
+        stats_hist_add(&stats->blocked_us,
+                       ((int64_t)now.tv_sec * 1000000000LL + now.tv_nsec - start_ns) / 1000);
+    pacing->sleeps++;
+    pacing->late_ns += late_ns;
+    pacing->late_sq_us += (late_ns / 1000) * (late_ns / 1000);
+}
+
+/* Drains the sink ring into one pcm with the stream's pacing.  A write
+ * error is counted as an underrun and the data dropped; tinyalsa
+ * restarts the pcm on the next write.  A secondary sink that is lapped
+ * by the writer skips to the newest data.  Whatever is left in the ring
+ * at standby is dropped, as the kernel buffer is.
+ */
+static void *output_sink_thread(void *context)
+{
+    struct output_sink *sink = (struct output_sink *)context;
+    struct omap4_stream_out *out = sink->out;
+    size_t frame_size = out_pcm_frame_size(out);
+    bool main_sink = (sink == &out->sinks[0]);
+
+    if (out->flags & AUDIO_OUTPUT_FLAG_FAST) {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = FAST_WRITER_PRIORITY;
+        if (sched_setscheduler(0, SCHED_FIFO, &param) != 0)
+            ALOGW("%s sink: cannot set SCHED_FIFO: %s", sink->name, strerror(errno));
+    } else {
+        setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_URGENT_AUDIO);
+    }
+
+    while (!android_atomic_acquire_load(&sink->exit)) {
+        int32_t wr;
+        uint32_t avail, offset, frames;
+        int ret;
+
+        wr = android_atomic_acquire_load(&out->ring_wr);
+        avail = (uint32_t)(wr - sink->rd);
+        if (avail == 0) {
+            sem_wait(&sink->wake);
+            continue;
+        }
+        if (avail > out->ring_frames) {
+            sink->overruns++;
+            android_atomic_release_store(wr, &sink->rd);
+            continue;
+        }
+
+        offset = (uint32_t)sink->rd & (out->ring_frames - 1);
+        frames = out->ring_frames - offset;
+        if (frames > avail)
+            frames = avail;
+        /* a period at a time, so that the ring frees up as the pcm plays
+         * rather than once a whole client buffer has gone in */
+        if (frames > out->config.period_size)
+            frames = out->config.period_size;
+
+        wait_for_write_threshold(sink->pcm, out->write_threshold, out->config.rate,
+                                 &sink->pacing, main_sink ? &out->stats : NULL);
+        if (main_sink) {
+            ret = pcm_mmap_write(sink->pcm, out->ring + offset * frame_size,
+                                 frames * frame_size);
+        } else {
+            const void *src = out->ring + offset * frame_size;
+            size_t bytes;
+            int32_t wr_limit;
+
+            if (frames > SINK_COPY_FRAMES)
+                frames = SINK_COPY_FRAMES;
+            if (sink->downmix != NULL) {
+                sink->downmix(sink->copy_buf, src, frames);
+                bytes = frames * 2 * sizeof(int16_t);
+            } else {
+                memcpy(sink->copy_buf, src, frames * frame_size);
+                bytes = frames * frame_size;
+            }
+            /* the writer may have been partway through lapping these frames
+             * while they were copied: it never fills past ring_limit frames
+             * ahead of the main sink, so that bounds what it can have reached */
+            wr_limit = android_atomic_acquire_load(&out->sinks[0].rd) + out->ring_limit;
+            if ((uint32_t)(wr_limit - sink->rd) > out->ring_frames) {
+                sink->overruns++;
+                android_atomic_release_store(android_atomic_acquire_load(&out->ring_wr),
+                                             &sink->rd);
+                continue;
+            }
+            ret = pcm_mmap_write(sink->pcm, sink->copy_buf, bytes);
+        }
+        if (ret != 0) {
+            if (sink->underruns++ == 0)
+                ALOGW("%s sink: write error: %s", sink->name, pcm_get_error(sink->pcm));
+        }
+        sink->pacing.writes++;
+
+        android_atomic_release_store(sink->rd + frames, &sink->rd);
+        if (main_sink)
+            sem_post(&out->ring_space);
+    }
+
+    return NULL;
+}
+
+/* must be called with output stream mutex locked, out->pcm and
+ * out->pcmspdif open */
+static int start_output_sinks(struct omap4_stream_out *out)
+{
+    size_t frame_size = out_pcm_frame_size(out);
+    uint32_t buffer_frames = out_get_buffer_size(&out->stream.common) / frame_size;
+    struct pcm *pcms[MAX_OUTPUT_SINKS] = { out->pcm, out->pcmspdif };
+    const char *names[MAX_OUTPUT_SINKS] = { "main", "spdif" };
+    int i;
+
+    out->ring_limit = buffer_frames * SINK_RING_BUFFER_COUNT;
+    /* twice the limit so that a slow secondary sink is not lapped at once */
+    out->ring_frames = 1;
+    while (out->ring_frames < out->ring_limit * 2)
+        out->ring_frames <<= 1;
+    out->ring = malloc(out->ring_frames * frame_size);
+    if (out->ring == NULL)
+        return -ENOMEM;
+    out->ring_wr = 0;
+    sem_init(&out->ring_space, 0, 0);
+
+    for (i = 0; i < MAX_OUTPUT_SINKS; i++) {
+        struct output_sink *sink = &out->sinks[i];
+
+        memset(sink, 0, sizeof(*sink));
+        sink->out = out;
+        sink->pcm = pcms[i];
+        sink->name = names[i];
+        if (i > 0) {
+            if (sink->pcm == out->pcmspdif && out->config.channels > 2)
+                sink->downmix = out->config.channels == 8 ? remix_cea_7point1_to_stereo_i16 :
+                                                            remix_cea_5point1_to_stereo_i16;
+            sink->copy_buf = malloc(SINK_COPY_FRAMES * frame_size);
+            if (sink->copy_buf == NULL) {
+                stop_output_sinks(out);
+                return -ENOMEM;
+            }
+        }
+        sem_init(&sink->wake, 0, 0);
+        if (pthread_create(&sink->thread, NULL, output_sink_thread, sink) != 0) {
+            ALOGE("cannot create %s sink thread", sink->name);
+            sem_destroy(&sink->wake);
+            free(sink->copy_buf);
+            stop_output_sinks(out);
+            return -ENOMEM;
+        }
+        out->num_sinks++;
+    }
+
+    return 0;
+}
+
+/* must be called with output stream mutex locked */
+static void stop_output_sinks(struct omap4_stream_out *out)
+{
+    int i;
+
+    for (i = 0; i < out->num_sinks; i++) {
+        struct output_sink *sink = &out->sinks[i];
+
+        android_atomic_release_store(1, &sink->exit);
+        sem_post(&sink->wake);
+        pthread_join(sink->thread, NULL);
+        sem_destroy(&sink->wake);
+        free(sink->copy_buf);
+        sink->copy_buf = NULL;
+
+        log_write_pacing(sink->name, &sink->pacing);
+        if (sink->underruns || sink->overruns)
+            ALOGV("%s sink: %u underruns, %u overruns",
+                  sink->name, sink->underruns, sink->overruns);
+    }
+    if (out->ring != NULL) {
+        sem_destroy(&out->ring_space);
+        free(out->ring);
+        out->ring = NULL;
+    }
+    out->num_sinks = 0;
+}
+
+/* returns -ETIMEDOUT if sem is not posted within timeout_ns */
+static int sem_wait_timeout(sem_t *sem, int64_t timeout_ns)
+{
+    struct timespec ts;
+    int64_t ns;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ns = ts.tv_nsec + timeout_ns;
+    ts.tv_sec += ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    if (sem_timedwait(sem, &ts) != 0 && errno == ETIMEDOUT)
+        return -ETIMEDOUT;
+    return 0;
+}
+
+/* Queues frames for the sink writers and returns as soon as the ring has
+ * taken them.  Waits only while the main sink is ring_limit frames
+ * behind.
+ * must be called with output stream mutex locked
+ */
+static int write_to_sinks(struct omap4_stream_out *out, const void *buffer, size_t frames)
+{
+    size_t frame_size = out_pcm_frame_size(out);
+    const char *src = (const char *)buffer;
+    int i;
+
+    while (frames > 0) {
+        int32_t wr = out->ring_wr;
+        uint32_t fill = (uint32_t)(wr - android_atomic_acquire_load(&out->sinks[0].rd));
+        uint32_t offset = (uint32_t)wr & (out->ring_frames - 1);
+        uint32_t n;
+
+        if (fill >= out->ring_limit) {
+            if (sem_wait_timeout(&out->ring_space, SINK_WRITE_TIMEOUT_NS) != 0) {
+                ALOGE("%s: main sink stalled", __func__);
+                return -ETIMEDOUT;
+            }
+            continue;
+        }
+
+        n = out->ring_limit - fill;
+        if (n > out->ring_frames - offset)
+            n = out->ring_frames - offset;
+        if (n > frames)
+            n = frames;
+
+        memcpy(out->ring + offset * frame_size, src, n * frame_size);
+        android_atomic_release_store(wr + n, &out->ring_wr);
+        for (i = 0; i < out->num_sinks; i++)
+            sem_post(&out->sinks[i].wake);
+
+        src += n * frame_size;
+        frames -= n;
+    }
+
+    return 0;
+}
+
+/* Scales frames of interleaved stereo by the stream volume; dst may be src. */
+static void apply_volume(int16_t *dst, const int16_t *src, size_t frames,
+                         int16_t gain_left, int16_t gain_right)
+{
+    int32_t acc[VOLUME_CHUNK_FRAMES * 2];
+
+    while (frames > 0) {
+        size_t n = frames < VOLUME_CHUNK_FRAMES ? frames : VOLUME_CHUNK_FRAMES;
+
+        memset(acc, 0, n * 2 * sizeof(int32_t));
+        mix_accumulate_i16(acc, src, n, gain_left, gain_right);
+        mix_clamp_i16(dst, acc, n * 2);
+        src += n * 2;
+        dst += n * 2;
+        frames -= n;
+    }
+}
+
+/* Queues frames for the mixer and returns as soon as the mix ring has
+ * taken them.  Waits only while mix_ring_limit frames are queued.
+ * must be called with output stream mutex locked
+ */
+static int write_to_mixer(struct omap4_stream_out *out, const int16_t *buffer, size_t frames)
+{
+    struct output_mixer *mixer = &out->dev->out_mixer;
+
+    while (frames > 0) {
+        int32_t wr = out->mix_wr;
+        uint32_t fill = (uint32_t)(wr - android_atomic_acquire_load(&out->mix_rd));
+        uint32_t offset = (uint32_t)wr & (out->mix_ring_frames - 1);
+        uint32_t limit = out->mix_ring_limit;
+        uint32_t n;
+
+        if (fill >= limit) {
+            if (sem_wait_timeout(&out->mix_space, MIX_WRITE_TIMEOUT_NS) != 0) {
+                ALOGE("%s: mixer stalled", __func__);
+                return -ETIMEDOUT;
+            }
+            continue;
+        }
+
+        n = limit - fill;
+        if (n > out->mix_ring_frames - offset)
+            n = out->mix_ring_frames - offset;
+        if (n > frames)
+            n = frames;
+
+        memcpy(out->mix_ring + offset * 2, buffer, n * 2 * sizeof(int16_t));
+        android_atomic_release_store(wr + n, &out->mix_wr);
+        sem_post(&mixer->wake);
+
+        buffer += n * 2;
+        frames -= n;
+    }
+
+    return 0;
+}
+
+/* Sleeps until the mixer output takes a chunk without blocking: the pcm
+ * fill level is down to the write threshold or the sink ring has room.
+ * must be called by the mixer thread
+ */
+static void wait_for_mixer_output(struct output_mixer *mixer)
+{
+    struct omap4_stream_out *out = mixer->out;
+
+    if (out->num_sinks == 0) {
+        wait_for_write_threshold(out->pcm, out->write_threshold, out->config.rate,
+                                 &out->pacing, &out->stats);
+        return;
+    }
+
+    while ((uint32_t)(out->ring_wr - android_atomic_acquire_load(&out->sinks[0].rd)) +
+                mixer->chunk > out->ring_limit &&
+            !android_atomic_acquire_load(&mixer->exit)) {
+        if (sem_wait_timeout(&out->ring_space, SINK_WRITE_TIMEOUT_NS) != 0) {
+            ALOGE("%s: main sink stalled", __func__);
+            return;
+        }
+    }
+}
+
+/* true when every input that is playing has a chunk queued, and at least
+ * one input has
+ * must be called with the mixer lock held
+ */
+static bool mixer_inputs_ready(struct output_mixer *mixer)
+{
+    bool ready = false;
+    int i;
+
+    for (i = 0; i < mixer->num_inputs; i++) {
+        struct omap4_stream_out *in = mixer->inputs[i];
+        uint32_t avail = (uint32_t)(android_atomic_acquire_load(&in->mix_wr) - in->mix_rd);
+
+        if (avail >= mixer->chunk)
+            ready = true;
+        else if (in->mix_primed)
+            return false;
+    }
+    return ready;
+}
+
+/* Sums a chunk of every input into mixer->acc.  An input that runs dry
+ * counts an underrun, gives what it has and is then left out until it
+ * has a full chunk queued again, so that a stream is not chopped while
+ * it starts or catches up.
+ * must be called with the mixer lock held
+ */
+static void mix_inputs(struct output_mixer *mixer)
+{
+    uint32_t chunk = mixer->chunk;
+    int i;
+
+    memset(mixer->acc, 0, chunk * 2 * sizeof(int32_t));
+    for (i = 0; i < mixer->num_inputs; i++) {
+        struct omap4_stream_out *in = mixer->inputs[i];
+        uint32_t avail = (uint32_t)(android_atomic_acquire_load(&in->mix_wr) - in->mix_rd);
+        uint32_t frames = avail < chunk ? avail : chunk;
+        int16_t gain_left = android_atomic_acquire_load(&in->gain_left);
+        int16_t gain_right = android_atomic_acquire_load(&in->gain_right);
+        uint32_t done = 0;
+
+        if (!in->mix_primed) {
+            if (avail < chunk)
+                continue;
+            in->mix_primed = true;
+        } else if (avail < chunk) {
+            in->mix_underruns++;
+            in->mix_primed = false;
+        }
+
+        while (done < frames) {
+            uint32_t offset = ((uint32_t)in->mix_rd + done) & (in->mix_ring_frames - 1);
+            uint32_t n = in->mix_ring_frames - offset;
+
+            if (n > frames - done)
+                n = frames - done;
+            mix_accumulate_i16(mixer->acc + done * 2, in->mix_ring + offset * 2, n,
+                               gain_left, gain_right);
+            done += n;
+        }
+
+        android_atomic_release_store(in->mix_rd + frames, &in->mix_rd);
+        sem_post(&in->mix_space);
+    }
+}
+
+/* Writes a chunk of mix every time the output can take one.  Inputs that
+ * are late get up to half a chunk to catch up before they are mixed with
+ * what they have; with no input playing the output is fed silence. */
+static void *output_mixer_thread(void *context)
+{
+    struct output_mixer *mixer = (struct output_mixer *)context;
+    struct omap4_stream_out *out = mixer->out;
+    size_t frame_size = out_pcm_frame_size(out);
+    int64_t grace_ns = (int64_t)mixer->chunk * 1000000000LL / out->config.rate / 2;
+
+    if (out->flags & AUDIO_OUTPUT_FLAG_FAST) {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = FAST_WRITER_PRIORITY;
+        if (sched_setscheduler(0, SCHED_FIFO, &param) != 0)
+            ALOGW("output mixer: cannot set SCHED_FIFO: %s", strerror(errno));
+    } else {
+        setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_URGENT_AUDIO);
+    }
+
+    while (!android_atomic_acquire_load(&mixer->exit)) {
+        struct timespec deadline;
+        int64_t ns;
+
+        wait_for_mixer_output(mixer);
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        ns = deadline.tv_nsec + grace_ns;
+        deadline.tv_sec += ns / 1000000000LL;
+        deadline.tv_nsec = ns % 1000000000LL;
+
+        pthread_mutex_lock(&mixer->lock);
+        while (!mixer_inputs_ready(mixer) && !android_atomic_acquire_load(&mixer->exit)) {
+            bool timed_out;
+
+            pthread_mutex_unlock(&mixer->lock);
+            timed_out = sem_timedwait(&mixer->wake, &deadline) != 0 && errno == ETIMEDOUT;
+            pthread_mutex_lock(&mixer->lock);
+            if (timed_out)
+                break;
+        }
+        mix_inputs(mixer);
+        pthread_mutex_unlock(&mixer->lock);
+
+        mix_clamp_i16(mixer->buf, mixer->acc, mixer->chunk * 2);
+
+        pthread_mutex_lock(&out->lock);
+        if (out->echo_reference != NULL) {
+            struct echo_reference_buffer b;
+            b.raw = mixer->buf;
+            b.frame_count = mixer->chunk;
+
+            get_playback_delay(out, mixer->chunk, &b);
+            out->echo_reference->write(out->echo_reference, &b);
+        }
+        if (out->num_sinks > 0) {
+            write_to_sinks(out, mixer->buf, mixer->chunk);
+        } else {
+            out->pacing.writes++;
+            if (pcm_mmap_write(out->pcm, mixer->buf, mixer->chunk * frame_size) != 0) {
+                /* do not spin on a broken pcm */
+                pthread_mutex_unlock(&out->lock);
+                usleep(grace_ns * 2 / 1000);
+                continue;
+            }
+        }
+        android_atomic_inc(&out->stats.transfers);
+        pthread_mutex_unlock(&out->lock);
+    }
+
+    return NULL;
+}
+
+static int start_mixer_thread(struct output_mixer *mixer)
+{
+    mixer->exit = 0;
+    if (pthread_create(&mixer->thread, NULL, output_mixer_thread, mixer) != 0) {
+        ALOGE("cannot create output mixer thread");
+        return -ENOMEM;
+    }
+    mixer->running = true;
+    return 0;
+}
+
+static void stop_mixer_thread(struct output_mixer *mixer)
+{
+    if (!mixer->running)
+        return;
+    android_atomic_release_store(1, &mixer->exit);
+    sem_post(&mixer->wake);
+    pthread_join(mixer->thread, NULL);
+    mixer->running = false;
+}
+
+/* the period out writes at while it is a mixer input */
+static uint32_t mixer_input_period(const struct omap4_stream_out *out)
+{
+    return (out->flags & AUDIO_OUTPUT_FLAG_FAST) ? FAST_PERIOD_SIZE : SHORT_PERIOD_SIZE;
+}
+
+/* Sizes the mix ring fill of every input to a chunk being mixed plus the
+ * input's next write, and tells it how much the mixer output queues.
+ * must be called with hw device mutex locked
+ */
+static void update_mixer_queues(struct output_mixer *mixer)
+{
+    struct omap4_stream_out *out = mixer->out;
+    uint32_t out_frames = out->write_threshold + mixer->chunk;
+    int i;
+
+    if (out->num_sinks > 0)
+        out_frames += out->ring_limit;
+    for (i = 0; i < mixer->num_inputs; i++) {
+        struct omap4_stream_out *in = mixer->inputs[i];
+
+        in->mix_ring_limit = mixer->chunk + mixer_input_period(in);
+        in->mix_out_frames = out_frames;
+    }
+}
+
+/* The other streams must not wait for a deep buffer to drain: a mixer
+ * output with the deep buffer configuration keeps the normal threshold.
+ * must be called with the mixer output's mutex locked, its pcms open
+ */
+static void set_mixer_output_threshold(struct omap4_stream_out *out)
+{
+    if (!(out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER))
+        return;
+    select_deep_buffer_power(out, false);
+    pcm_set_avail_min(out->pcm, out->config.avail_min);
+    if (out->pcmspdif != NULL)
+        pcm_set_avail_min(out->pcmspdif, out->config.avail_min);
+}
+
+/* Runs the mixer at the period of its fastest input: while a fast output
+ * is mixed the mixer output's pcms are reopened with the fast period and
+ * threshold, and with the first output's again once none is.  The pcms
+ * are closed once what they have queued has played, so the switch is a
+ * gap of a pcm start rather than lost frames.
+ * must be called with hw device mutex locked, not the mixer output's
+ */
+static int set_output_mixer_period(struct omap4_audio_device *adev)
+{
+    struct output_mixer *mixer = &adev->out_mixer;
+    struct omap4_stream_out *out = mixer->out;
+    struct timespec tstamp;
+    uint32_t queued = 0;
+    bool fast = false;
+    int i, ret;
+
+    for (i = 0; i < mixer->num_inputs; i++) {
+        if (mixer->inputs[i]->flags & AUDIO_OUTPUT_FLAG_FAST)
+            fast = true;
+    }
+    if (out->config.period_size ==
+            (fast ? FAST_PERIOD_SIZE : mixer->owner_config.period_size))
+        return 0;
+
+    stop_mixer_thread(mixer);
+
+    pthread_mutex_lock(&out->lock);
+    /* the inputs keep what they write meanwhile: play what the mixer
+     * output has queued rather than drop it */
+    if (get_output_queued_frames(out, &queued, &tstamp) == 0 && queued > 0)
+        usleep((int64_t)queued * 1000000 / out->config.rate);
+    do_output_standby(out);
+    if (fast) {
+        out->flags = (mixer->owner_flags & ~AUDIO_OUTPUT_FLAG_DEEP_BUFFER) |
+                     AUDIO_OUTPUT_FLAG_FAST;
+        out->config = pcm_config_mm_fast;
+    } else {
+        out->flags = mixer->owner_flags;
+        out->config = mixer->owner_config;
+    }
+    ret = start_output_stream(out);
+    if (ret == 0) {
+        out->standby = 0;
+        set_mixer_output_threshold(out);
+    }
+    pthread_mutex_unlock(&out->lock);
+    if (ret != 0) {
+        ALOGE("%s: cannot reopen the mixer output: %d", __func__, ret);
+        return ret;
+    }
+
+    mixer->chunk = MIN(out->config.period_size, MIX_MAX_CHUNK_FRAMES);
+    update_mixer_queues(mixer);
+
+    ALOGV("%s: mixing %u frame chunks", __func__, mixer->chunk);
+    return start_mixer_thread(mixer);
+}
+
+/* Stops the mixer thread and closes the mixer output.
+ * must be called with hw device mutex locked, once the last input is detached
+ */
+static void stop_output_mixer(struct omap4_audio_device *adev)
+{
+    struct output_mixer *mixer = &adev->out_mixer;
+    struct omap4_stream_out *out = mixer->out;
+
+    LOGFUNC("%s(%p)", __FUNCTION__, adev);
+
+    stop_mixer_thread(mixer);
+
+    pthread_mutex_lock(&out->lock);
+    do_output_standby(out);
+    pthread_mutex_unlock(&out->lock);
+
+    mixer->out = NULL;
+    free(mixer->acc);
+    mixer->acc = NULL;
+    free(mixer->buf);
+    mixer->buf = NULL;
+    free(out);
+}
+
+/* Hands the pcm of owner, the active output, over to a new mixer output
+ * with the same configuration, and starts the mixer with owner as its
+ * first input.  What owner has queued keeps playing.
+ * must be called with hw device mutex locked; owner's mutex is taken here
+ */
+static int start_output_mixer(struct omap4_audio_device *adev, struct omap4_stream_out *owner)
+{
+    struct output_mixer *mixer = &adev->out_mixer;
+    struct omap4_stream_out *out;
+    int ret;
+
+    LOGFUNC("%s(%p, %p)", __FUNCTION__, adev, owner);
+
+    out = (struct omap4_stream_out *)calloc(1, sizeof(struct omap4_stream_out));
+    if (out == NULL)
+        return -ENOMEM;
+
+    /* the inputs resample to the pcm rate themselves */
+    out->stream = owner->stream;
+    out->flags = owner->flags;
+    out->format = owner->format;
+    out->channel_mask = owner->channel_mask;
+    out->config = owner->config;
+    out->sample_rate = owner->config.rate;
+    out->write_threshold = owner->write_threshold;
+    out->low_power = owner->low_power;
+    out->gain_left = MIX_UNITY_GAIN;
+    out->gain_right = MIX_UNITY_GAIN;
+    out->dev = adev;
+    playback_position_init(&out->position, out->sample_rate);
+    playback_position_start(&out->position, out->config.rate);
+
+    mixer->owner_flags = owner->flags;
+    mixer->owner_config = owner->config;
+    mixer->chunk = MIN(out->config.period_size, MIX_MAX_CHUNK_FRAMES);
+    mixer->acc = (int32_t *)malloc(MIX_MAX_CHUNK_FRAMES * 2 * sizeof(int32_t));
+    mixer->buf = (int16_t *)malloc(MIX_MAX_CHUNK_FRAMES * 2 * sizeof(int16_t));
+    if (mixer->acc == NULL || mixer->buf == NULL) {
+        ret = -ENOMEM;
+        goto err;
+    }
+    mixer->out = out;
+
+    /* the owner's writer holds its mutex for as long as a write blocks
+     * and takes it again at once: a new out_gen sends it through the hw
+     * device mutex, held here, so that it lets go of it */
+    android_atomic_inc(&adev->out_gen);
+    pthread_mutex_lock(&owner->lock);
+    ret = attach_mixer_input(adev, owner);
+    if (ret != 0) {
+        pthread_mutex_unlock(&owner->lock);
+        mixer->out = NULL;
+        goto err;
+    }
+
+    out->pcm = owner->pcm;
+    out->pcmspdif = owner->pcmspdif;
+    owner->pcm = NULL;
+    owner->pcmspdif = NULL;
+    if (owner->num_sinks > 0) {
+        /* the sink rings are per stream: what owner has in its ring is lost */
+        stop_output_sinks(owner);
+        if (start_output_sinks(out) != 0) {
+            ALOGE("cannot start sink writers, dropping spdif");
+            pcm_close(out->pcmspdif);
+            out->pcmspdif = NULL;
+        }
+    }
+    out->echo_reference = owner->echo_reference;
+    owner->echo_reference = NULL;
+    set_mixer_output_threshold(out);
+    out->standby = 0;
+    adev->active_output = out;
+    update_mixer_queues(mixer);
+
+    if (start_mixer_thread(mixer) != 0) {
+        /* closes the mixer output again */
+        do_output_standby(owner);
+        pthread_mutex_unlock(&owner->lock);
+        return -ENOMEM;
+    }
+    pthread_mutex_unlock(&owner->lock);
+
+    ALOGV("%s: mixing into %p, %u frame chunks", __func__, out, mixer->chunk);
+    return 0;
+
+err:
+    free(mixer->acc);
+    mixer->acc = NULL;
+    free(mixer->buf);
+    mixer->buf = NULL;
+    free(out);
+    return ret;
+}
+
+/* Makes out a mixer input, with a mix ring that can hold the largest
+ * chunk being mixed plus out's next write.
+ * must be called with hw device and output stream mutexes locked, the
+ * mixer output open
+ */
+static int attach_mixer_input(struct omap4_audio_device *adev, struct omap4_stream_out *out)
+{
+    struct output_mixer *mixer = &adev->out_mixer;
+    uint32_t frames = 1;
+
+    if (mixer->num_inputs == MIX_MAX_STREAMS)
+        return -EBUSY;
+
+    while (frames < MIX_MAX_CHUNK_FRAMES + mixer_input_period(out))
+        frames <<= 1;
+    if (frames > out->mix_ring_frames) {
+        free(out->mix_ring);
+        out->mix_ring = (int16_t *)malloc(frames * 2 * sizeof(int16_t));
+        out->mix_ring_frames = out->mix_ring != NULL ? frames : 0;
+        if (out->mix_ring == NULL)
+            return -ENOMEM;
+    }
+    out->mix_wr = 0;
+    out->mix_rd = 0;
+    out->mix_primed = false;
+    out->mix_underruns = 0;
+    sem_init(&out->mix_space, 0, 0);
+    out->config.rate = mixer->out->config.rate;
+    out->mixed = true;
+
+    pthread_mutex_lock(&mixer->lock);
+    mixer->inputs[mixer->num_inputs++] = out;
+    pthread_mutex_unlock(&mixer->lock);
+    update_mixer_queues(mixer);
+
+    ALOGV("%s: %p, %d inputs", __func__, out, mixer->num_inputs);
+    return 0;
+}
+
+/* Removes out from the mixer inputs, dropping what it has queued; the
+ * last input stops the mixer.
+ * must be called with hw device and output stream mutexes locked
+ */
+static void detach_mixer_input(struct omap4_audio_device *adev, struct omap4_stream_out *out)
+{
+    struct output_mixer *mixer = &adev->out_mixer;
+    int i;
+
+    pthread_mutex_lock(&mixer->lock);
+    for (i = 0; i < mixer->num_inputs; i++) {
+        if (mixer->inputs[i] == out) {
+            mixer->inputs[i] = mixer->inputs[--mixer->num_inputs];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mixer->lock);
+
+    sem_destroy(&out->mix_space);
+    out->mixed = false;
+    if (out->mix_underruns)
+        ALOGV("%s: %p, %u underruns", __func__, out, out->mix_underruns);
+
+    if (mixer->num_inputs == 0)
+        stop_output_mixer(adev);
+    else if (out->flags & AUDIO_OUTPUT_FLAG_FAST)
+        set_output_mixer_period(adev);
+}
+
+/* Writes frames to the sink writers or straight to the pcm.
+ * must be called with output stream mutex locked
+ */
+static int write_to_pcm(struct omap4_stream_out *out, const void *buffer, size_t frames)
+{
+    if (out->num_sinks > 0)
+        return write_to_sinks(out, buffer, frames);
+
+    /* do not allow more than out->write_threshold frames in kernel pcm driver buffer */
+    wait_for_write_threshold(out->pcm, out->write_threshold, out->config.rate,
+                             &out->pacing, &out->stats);
+    out->pacing.writes++;
+    return pcm_mmap_write(out->pcm, buffer, frames * out_pcm_frame_size(out));
+}
+
+/* Tops what a warm output has queued up to WARM_FILL_FRAMES of silence,
+ * or to its write threshold if that is lower, and returns in how long it
+ * should be topped up again.  The silence is not counted as transfers,
+ * though the sink writers pace it like any other frames.
+ * must be called with output stream mutex locked
+ */
+static int64_t feed_warm_output(struct omap4_stream_out *out)
+{
+    uint32_t target = WARM_FILL_FRAMES, queued = 0;
+    struct timespec tstamp;
+
+    if ((uint32_t)out->write_threshold < target)
+        target = out->write_threshold;
+    if (get_output_queued_frames(out, &queued, &tstamp) == 0 && queued < target) {
+        if (out->num_sinks > 0)
+            write_to_sinks(out, out->dev->warm_silence, target - queued);
+        else
+            pcm_mmap_write(out->pcm, out->dev->warm_silence,
+                           (target - queued) * out_pcm_frame_size(out));
+        queued = target;
+    }
+    /* wake up when half of it has played */
+    return (int64_t)queued * 1000000000LL / out->config.rate / 2;
+}
+
+/* Keep-warm standby: the output that had the pcms to itself keeps them
+ * open after out_standby() and this thread plays silence on them, until
+ * the output restarts or adev->standby_delay_ms has passed and they are
+ * closed.  tinyalsa cannot pause a pcm; a running one also keeps HDMI and
+ * S/PDIF receivers locked, so the next sound is not cut or popped.  The
+ * silence is kept short so that it does not hold back the next write.
+ */
+static void *output_warm_thread(void *context)
+{
+    struct omap4_audio_device *adev = (struct omap4_audio_device *)context;
+
+    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_AUDIO);
+
+    while (!android_atomic_acquire_load(&adev->warm_exit)) {
+        struct omap4_stream_out *out;
+        int64_t wait_ns = -1;
+
+        pthread_mutex_lock(&adev->lock);
+        out = adev->active_output;
+        /* warm only changes with both the hw device and output locked */
+        if (out != NULL && out->warm) {
+            int64_t left_ns = out->warm_deadline_ns - clock_ns(CLOCK_MONOTONIC);
+
+            pthread_mutex_lock(&out->lock);
+            if (left_ns <= 0) {
+                ALOGV("%s: closing output %p after %u ms", __func__, out,
+                      adev->standby_delay_ms);
+                close_output_pcms(out);
+                android_atomic_inc(&out->warm_closes);
+            } else {
+                wait_ns = feed_warm_output(out);
+                if (wait_ns > left_ns)
+                    wait_ns = left_ns;
+            }
+            pthread_mutex_unlock(&out->lock);
+        }
+        pthread_mutex_unlock(&adev->lock);
+
+        if (wait_ns < 0)
+            sem_wait(&adev->warm_wake);
+        else
+            sem_wait_timeout(&adev->warm_wake, wait_ns);
+    }
+
+    return NULL;
+}
+
+/* Packs the compressed stream into IEC 61937 bursts and writes each as it
+ * is complete; a frame cut by the end of buffer is completed by the next
+ * write.  The position counts the samples of the bursts written.
+ * must be called with output stream mutex locked
+ */
+static int write_passthrough(struct omap4_stream_out *out, const void *buffer, size_t bytes)
+{
+    const uint8_t *data = (const uint8_t *)buffer;
 
-    LOGFUNC("%s(%p)", __FUNCTION__, stream);
-    return (SHORT_PERIOD_SIZE * PLAYBACK_PERIOD_COUNT * 1000) / out->config.rate;
+    while (bytes > 0) {
+        size_t used, frames;
+        uint32_t samples;
+        int ret;
+
+        used = iec61937_pack(out->iec, data, bytes, out->burst, &frames, &samples);
+        data += used;
+        bytes -= used;
+        if (frames == 0)
+            continue;
+        ret = write_to_pcm(out, out->burst, frames);
+        if (ret != 0)
+            return ret;
+        playback_position_add(&out->position, samples);
+    }
+    return 0;
 }
 
-static int out_set_volume(struct audio_stream_out *stream, float left,
-                          float right)
+/* Reorders multichannel frames to the HDMI layout and scales them by the
+ * stream volume, a buffer at a time, then writes them.  The left volume
+ * goes to the even channels, the right one to the odd channels.
+ * must be called with output stream mutex locked
+ */
+static int write_multichannel(struct omap4_stream_out *out, const int16_t *buffer, size_t frames)
 {
-    LOGFUNC("%s(%p, %f, %f)", __FUNCTION__, stream, left, right);
-
-    return -ENOSYS;
+    size_t channels = out->config.channels;
+    size_t buffer_frames = out_get_buffer_size(&out->stream.common) / out_pcm_frame_size(out);
+    int16_t gain_left = android_atomic_acquire_load(&out->gain_left);
+    int16_t gain_right = android_atomic_acquire_load(&out->gain_right);
+    int16_t *buf = (int16_t *)out->buffer;
+
+    while (frames > 0) {
+        size_t n = frames < buffer_frames ? frames : buffer_frames;
+        int ret;
+
+        out->remix(buf, buffer, n);
+        if (gain_left != MIX_UNITY_GAIN || gain_right != MIX_UNITY_GAIN)
+            apply_volume(buf, buf, n * channels / 2, gain_left, gain_right);
+        ret = write_to_pcm(out, buf, n);
+        if (ret != 0)
+            return ret;
+        playback_position_add(&out->position, n);
+        buffer += n * channels;
+        frames -= n;
+    }
+    return 0;
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
@@ -1424,94 +3381,151 @@ static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
     struct omap4_audio_device *adev = out->dev;
     size_t frame_size = audio_stream_frame_size(&out->stream.common);
     size_t in_frames = bytes / frame_size;
-    size_t out_frames = RESAMPLER_BUFFER_SIZE / frame_size;
     bool force_input_standby = false;
     struct omap4_stream_in *in;
-    int kernel_frames;
+    const int16_t *src;
     void *buf;
+    int16_t gain_left, gain_right;
+    int64_t start_ns = clock_ns(CLOCK_MONOTONIC);
 
     LOGFUNC("%s(%p, %p, %d)", __FUNCTION__, stream, buffer, bytes);
 
-    /* acquiring hw device mutex systematically is useful if a low priority thread is waiting
-     * on the output stream mutex - e.g. executing select_mode() while holding the hw device
-     * mutex
+    /* The hw device mutex is only needed to leave standby or to follow a
+     * device setting that changed (see adev->out_gen): a playing stream
+     * writes under its own mutex, so that control calls holding the hw
+     * device mutex (routing, mode, input start) do not stall it.  Anything
+     * that stops the stream takes the output stream mutex and sets standby.
      */
-    pthread_mutex_lock(&adev->lock);
     pthread_mutex_lock(&out->lock);
-    if (out->standby) {
-        ret = start_output_stream(out);
-        if (ret != 0) {
-            pthread_mutex_unlock(&adev->lock);
-            goto exit;
+    if (out->standby || out->adev_gen != android_atomic_acquire_load(&adev->out_gen)) {
+        pthread_mutex_unlock(&out->lock);
+        pthread_mutex_lock(&adev->lock);
+        pthread_mutex_lock(&out->lock);
+        if (out->standby) {
+            bool warm = out->warm;
+            int64_t restart_ns = clock_ns(CLOCK_MONOTONIC);
+
+            ret = start_output_stream(out);
+            if (ret != 0) {
+                pthread_mutex_unlock(&adev->lock);
+                goto exit;
+            }
+            stats_hist_add(warm ? &out->warm_start_us : &out->cold_start_us,
+                           (clock_ns(CLOCK_MONOTONIC) - restart_ns) / 1000);
+            out->standby = 0;
+            android_atomic_inc(&out->stats.starts);
+            playback_position_start(&out->position, out->config.rate);
+            /* a change in output device may change the microphone selection */
+            if (adev->active_input &&
+                    adev->active_input->source == AUDIO_SOURCE_VOICE_COMMUNICATION)
+                force_input_standby = true;
         }
-        out->standby = 0;
-        /* a change in output device may change the microphone selection */
-        if (adev->active_input &&
-                adev->active_input->source == AUDIO_SOURCE_VOICE_COMMUNICATION)
-            force_input_standby = true;
+        out->adev_gen = adev->out_gen;
+        /* follow screen state changes while playing */
+        if ((out->flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) && !out->mixed &&
+                out->low_power != adev->low_power) {
+            select_deep_buffer_power(out, adev->low_power);
+            pcm_set_avail_min(out->pcm, out->config.avail_min);
+            if (out->pcmspdif != NULL)
+                pcm_set_avail_min(out->pcmspdif, out->config.avail_min);
+        }
+        pthread_mutex_unlock(&adev->lock);
+    }
+
+    if (out->iec != NULL) {
+        ret = write_passthrough(out, buffer, bytes);
+        goto exit;
+    }
+    if (out->remix != NULL) {
+        ret = write_multichannel(out, (const int16_t *)buffer, in_frames);
+        goto exit;
     }
-    pthread_mutex_unlock(&adev->lock);
 
-    /* only use resampler if required */
-    if (out->config.rate != DEFAULT_OUT_SAMPLING_RATE) {
-        if (out->resampler) {
+    /* the resampler and the volume work a buffer at a time: a larger
+     * write goes through them in several */
+    src = (const int16_t *)buffer;
+    ret = 0;
+    while (in_frames > 0 && ret == 0) {
+        size_t chunk_frames = in_frames;
+        size_t out_frames = RESAMPLER_BUFFER_FRAMES;
+
+        /* only use resampler if required */
+        if (out->sample_rate != out->config.rate) {
+            int64_t cpu_ns;
+
+            if (out->resampler == NULL) {
+                ret = create_resampler(out->sample_rate,
+                        out->config.rate,
+                        2,
+                        RESAMPLER_QUALITY_DEFAULT,
+                        NULL,
+                        &out->resampler);
+                if (ret != 0)
+                    goto exit;
+                out->release_resampler = release_resampler;
+                if (out->buffer == NULL)
+                    out->buffer = malloc(RESAMPLER_BUFFER_SIZE); /* todo: allow for reallocing */
+            }
+            cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
             out->resampler->resample_from_input(out->resampler,
-                    (int16_t *)buffer,
-                    &in_frames,
+                    (int16_t *)src,
+                    &chunk_frames,
                     (int16_t *)out->buffer,
                     &out_frames);
+            stats_hist_add(&out->stats.resample_us,
+                           (clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_ns) / 1000);
+            if (chunk_frames == 0)
+                break;
             buf = out->buffer;
+        } else {
+            out_frames = chunk_frames;
+            buf = (void *)src;
         }
-        else {
-            ret = create_resampler(DEFAULT_OUT_SAMPLING_RATE,
-                    MM_FULL_POWER_SAMPLING_RATE,
-                    2,
-                    RESAMPLER_QUALITY_DEFAULT,
-                    NULL,
-                    &out->resampler);
-            if (ret != 0)
-                goto exit;
-            out->buffer = malloc(RESAMPLER_BUFFER_SIZE); /* todo: allow for reallocing */
+        /* the mixer applies the volume of its inputs */
+        gain_left = android_atomic_acquire_load(&out->gain_left);
+        gain_right = android_atomic_acquire_load(&out->gain_right);
+        if (!out->mixed && (gain_left != MIX_UNITY_GAIN || gain_right != MIX_UNITY_GAIN)) {
+            const int16_t *unscaled = (const int16_t *)buf;
+
+            if (buf == src) {
+                /* scale a copy, as much of it as the resampler would take */
+                if (out->buffer == NULL)
+                    out->buffer = malloc(RESAMPLER_BUFFER_SIZE);
+                if (out->buffer == NULL) {
+                    ret = -ENOMEM;
+                    goto exit;
+                }
+                if (out_frames > RESAMPLER_BUFFER_FRAMES)
+                    chunk_frames = out_frames = RESAMPLER_BUFFER_FRAMES;
+                buf = out->buffer;
+            }
+            apply_volume((int16_t *)buf, unscaled, out_frames, gain_left, gain_right);
         }
+        if (out->echo_reference != NULL) {
+            struct echo_reference_buffer b;
+            b.raw = buf;
+            b.frame_count = out_frames;
 
-    } else {
-        out_frames = in_frames;
-        buf = (void *)buffer;
-    }
-    if (out->echo_reference != NULL) {
-        struct echo_reference_buffer b;
-        b.raw = (void *)buffer;
-        b.frame_count = in_frames;
-
-        get_playback_delay(out, out_frames, &b);
-        out->echo_reference->write(out->echo_reference, &b);
-    }
-
-    /* do not allow more than out->write_threshold frames in kernel pcm driver buffer */
-    do {
-        struct timespec time_stamp;
-
-        if (pcm_get_htimestamp(out->pcm, (unsigned int *)&kernel_frames, &time_stamp) < 0)
-            break;
-        kernel_frames = pcm_get_buffer_size(out->pcm) - kernel_frames;
-        if (kernel_frames > out->write_threshold) {
-            unsigned long time = (unsigned long)
-                    (((int64_t)(kernel_frames - out->write_threshold) * 1000000) /
-                            MM_FULL_POWER_SAMPLING_RATE);
-            if (time < MIN_WRITE_SLEEP_US)
-                time = MIN_WRITE_SLEEP_US;
-            usleep(time);
+            get_playback_delay(out, out_frames, &b);
+            out->echo_reference->write(out->echo_reference, &b);
         }
-    } while (kernel_frames > out->write_threshold);
 
-    if (out->pcmspdif != NULL) {
-        pcm_mmap_write(out->pcmspdif, (void *)buf, out_frames * frame_size);
+        if (out->mixed)
+            ret = write_to_mixer(out, (const int16_t *)buf, out_frames);
+        else
+            ret = write_to_pcm(out, buf, out_frames);
+        if (ret == 0)
+            playback_position_add(&out->position, chunk_frames);
+        src += chunk_frames * 2;
+        in_frames -= chunk_frames;
     }
-    ret = pcm_mmap_write(out->pcm, (void *)buf, out_frames * frame_size);
 
 exit:
     pthread_mutex_unlock(&out->lock);
 
+    android_atomic_inc(&out->stats.transfers);
+    stats_hist_add(&out->stats.call_us, (clock_ns(CLOCK_MONOTONIC) - start_ns) / 1000);
+
     if (ret != 0) {
         usleep(bytes * 1000000 / audio_stream_frame_size(&stream->common) /
                out_get_sample_rate(&stream->common));
@@ -1531,13 +3545,62 @@ exit:
     return bytes;
 }
 
+/* Frames played since the output last left standby; in standby, those
+ * played before it went there. */
 static int out_get_render_position(const struct audio_stream_out *stream,
                                    uint32_t *dsp_frames)
 {
+    struct omap4_stream_out *out = (struct omap4_stream_out *)stream;
+    uint32_t queued = 0;
+    struct timespec tstamp;
+    int64_t delay_ns = 0;
+
     LOGFUNC("%s(%p, %p)", __FUNCTION__, stream, dsp_frames);
 
-    return -EINVAL;
+    if (dsp_frames == NULL)
+        return -EINVAL;
+
+    pthread_mutex_lock(&out->lock);
+    if (!out->standby) {
+        if (get_output_queued_frames(out, &queued, &tstamp) != 0) {
+            pthread_mutex_unlock(&out->lock);
+            return -ENODEV;
+        }
+        delay_ns = get_output_resampler_delay_ns(out);
+    }
+    *dsp_frames = playback_position_render(&out->position, queued, delay_ns);
+    pthread_mutex_unlock(&out->lock);
+
+    return 0;
+}
+
+#ifdef AUDIO_OFFLOAD_CODEC_PARAMS
+/* Frames played since the stream was opened and the CLOCK_MONOTONIC time
+ * the last of them was presented.  Not reset by standby; fails while in
+ * standby as there is no timestamp to give. */
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                         uint64_t *frames, struct timespec *timestamp)
+{
+    struct omap4_stream_out *out = (struct omap4_stream_out *)stream;
+    uint32_t queued;
+    int ret = -ENODEV;
+
+    LOGFUNC("%s(%p, %p, %p)", __FUNCTION__, stream, frames, timestamp);
+
+    if (frames == NULL || timestamp == NULL)
+        return -EINVAL;
+
+    pthread_mutex_lock(&out->lock);
+    if (!out->standby && get_output_queued_frames(out, &queued, timestamp) == 0) {
+        *frames = playback_position_get(&out->position, queued,
+                                        get_output_resampler_delay_ns(out));
+        ret = 0;
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
 }
+#endif
 
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
 {
@@ -1562,6 +3625,7 @@ static int start_input_stream(struct omap4_stream_in *in)
     unsigned int card = CARD_STEELHEAD_DEFAULT;
     unsigned int device = PORT_MM2_UL;
     struct omap4_audio_device *adev = in->dev;
+    size_t buffer_frames;
 
     LOGFUNC("%s(%p)", __FUNCTION__, in);
 
@@ -1574,7 +3638,21 @@ static int start_input_stream(struct omap4_stream_in *in)
     }
 
     if (adev->input_requires_stereo && (in->config.channels == 1))
-        setup_stereo_to_mono_input_remix(in);
+        setup_input_remix(in, 2);
+
+    /* effects can be added while the stream runs, so the queues are sized
+     * here whether or not any are attached yet */
+    buffer_frames = get_input_buffer_size(in->requested_rate, AUDIO_FORMAT_PCM_16_BIT,
+                                          in->config.channels) /
+                        (in->config.channels * sizeof(int16_t));
+    if (frame_ring_init(&in->proc_ring, buffer_frames * PROC_RING_BUFFER_COUNT,
+                        in->config.channels) != 0 ||
+            frame_ring_init(&in->ref_ring, buffer_frames * PROC_RING_BUFFER_COUNT,
+                            in->config.channels) != 0) {
+        ALOGE("cannot allocate pre processing buffers");
+        adev->active_input = NULL;
+        return -ENOMEM;
+    }
 
     if (in->need_echo_reference && in->echo_reference == NULL)
         in->echo_reference = get_echo_reference(adev,
@@ -1597,10 +3675,12 @@ static int start_input_stream(struct omap4_stream_in *in)
     }
 
     /* if no supported sample rate is available, use the resampler */
-    if (in->resampler) {
+    if (in->resampler)
         in->resampler->reset(in->resampler);
-        in->frames_in = 0;
-    }
+    in->frames_in = 0;
+    in->frames_read = 0;
+    in->gap_ref_valid = false;
+    in->fill_frames = 0;
     return 0;
 }
 
@@ -1666,6 +3746,7 @@ static int do_input_standby(struct omap4_stream_in *in)
     LOGFUNC("%s(%p)", __FUNCTION__, in);
 
     if (!in->standby) {
+        stop_capture_pipeline(in);
         pcm_close(in->pcm);
         in->pcm = NULL;
 
@@ -1676,12 +3757,15 @@ static int do_input_standby(struct omap4_stream_in *in)
         }
 
         if (in->echo_reference != NULL) {
+            ALOGV("echo reference drift %d ppm",
+                  aec_reference_get_drift_ppm(in->echo_reference));
             /* stop reading from echo reference */
             in->echo_reference->read(in->echo_reference, NULL);
             put_echo_reference(adev, in->echo_reference);
             in->echo_reference = NULL;
         }
         in->standby = 1;
+        android_atomic_inc(&in->stats.standbys);
     }
     return 0;
 }
@@ -1701,10 +3785,30 @@ static int in_standby(struct audio_stream *stream)
     return status;
 }
 
+/* no lock taken, see out_dump() */
 static int in_dump(const struct audio_stream *stream, int fd)
 {
+    struct omap4_stream_in *in = (struct omap4_stream_in *)stream;
+
     LOGFUNC("%s(%p, %d)", __FUNCTION__, stream, fd);
 
+    if (!dump_trylock(&in->lock)) {
+        dump_printf(fd, "  input %p: busy, not dumped\n", in);
+        return 0;
+    }
+
+    dump_printf(fd, "  input %p: source %d, %u Hz (pcm %u Hz), %d preprocessors, %s\n",
+                in, in->source, in->requested_rate, in->config.rate, in->num_preprocessors,
+                in->standby ? "standby" : "active");
+    dump_stream_stats(fd, &in->stats, "overruns");
+    dump_printf(fd, "    %d frames lost in %d capture gaps%s\n", in->frames_lost, in->gaps,
+                in->zero_buf != NULL ? ", zero filled" : "");
+    if (in->pipe.running)
+        dump_printf(fd, "    capture pipeline: %u frame blocks, %u frames dropped before"
+                    " processing, %u after\n", (unsigned)in->pipe.block,
+                    in->pipe.cap_dropped, in->pipe.out_dropped);
+
+    pthread_mutex_unlock(&in->lock);
     return 0;
 }
 static int in_fm_routing(struct audio_stream *stream)
@@ -1716,8 +3820,10 @@ static int in_fm_routing(struct audio_stream *stream)
 
     if (in->standby) {
         ret = start_input_stream(in);
-        if (ret == 0)
+        if (ret == 0) {
             in->standby = 0;
+            android_atomic_inc(&in->stats.starts);
+        }
     }
     return 0;
 }
@@ -1783,8 +3889,10 @@ static int in_set_gain(struct audio_stream_in *stream, float gain)
     return 0;
 }
 
+/* Capture time of a reference block, queued_frames being the stream
+ * frames already read from the driver path from its first frame on. */
 static void get_capture_delay(struct omap4_stream_in *in,
-                       size_t frames,
+                       size_t queued_frames,
                        struct echo_reference_buffer *buffer)
 {
 
@@ -1796,7 +3904,7 @@ static void get_capture_delay(struct omap4_stream_in *in,
     long kernel_delay;
     long delay_ns;
 
-    LOGFUNC("%s(%p, %ul, %p)", __FUNCTION__, in, frames, buffer);
+    LOGFUNC("%s(%p, %ul, %p)", __FUNCTION__, in, queued_frames, buffer);
 
     if (pcm_get_htimestamp(in->pcm, &kernel_frames, &tstamp) < 0) {
         buffer->time_stamp.tv_sec  = 0;
@@ -1806,11 +3914,11 @@ static void get_capture_delay(struct omap4_stream_in *in,
         return;
     }
 
-    /* read frames available in audio HAL input buffer
-     * add number of frames being read as we want the capture time of first sample
-     * in current buffer */
-    buf_delay = (long)(((int64_t)(in->frames_in + in->proc_frames_in) * 1000000000)
-                                    / in->config.rate);
+    /* frames captured after the first one the reference is read for:
+     * those waiting in the pcm buffer (pcm rate), those already read
+     * (stream rate), and the resampler contents */
+    buf_delay = (long)(((int64_t)in->frames_in * 1000000000) / in->config.rate +
+                       ((int64_t)queued_frames * 1000000000) / in->requested_rate);
     /* add delay introduced by resampler */
     rsmp_delay = 0;
     if (in->resampler) {
@@ -1825,10 +3933,10 @@ static void get_capture_delay(struct omap4_stream_in *in,
     buffer->delay_ns   = delay_ns;
     ALOGV("get_capture_delay time_stamp = [%ld].[%ld], delay_ns: [%d],"
          " kernel_delay:[%ld], buf_delay:[%ld], rsmp_delay:[%ld], kernel_frames:[%d], "
-         "in->frames_in:[%d], in->proc_frames_in:[%d], frames:[%d]",
+         "in->frames_in:[%d], queued_frames:[%d]",
          buffer->time_stamp.tv_sec , buffer->time_stamp.tv_nsec, buffer->delay_ns,
          kernel_delay, buf_delay, rsmp_delay, kernel_frames,
-         in->frames_in, in->proc_frames_in, frames);
+         in->frames_in, queued_frames);
 
 }
 
@@ -1839,28 +3947,27 @@ static int32_t update_echo_reference(struct omap4_stream_in *in, size_t frames)
 
     LOGFUNC("%s(%p, %ul)", __FUNCTION__, in, frames);
 
-    ALOGV("update_echo_reference, frames = [%d], in->ref_frames_in = [%d],  "
+    ALOGV("update_echo_reference, frames = [%d], in->ref_ring.frames = [%d],  "
           "b.frame_count = [%d]",
-         frames, in->ref_frames_in, frames - in->ref_frames_in);
-    if (in->ref_frames_in < frames) {
-        if (in->ref_buf_size < frames) {
-            in->ref_buf_size = frames;
-            in->ref_buf = (int16_t *)realloc(in->ref_buf,
-                                             in->ref_buf_size *
-                                                 in->config.channels * sizeof(int16_t));
+         frames, in->ref_ring.frames, frames - in->ref_ring.frames);
+    if (in->ref_ring.frames < frames) {
+        /* one contiguous read, the rest comes with the next call if the
+         * free space wraps */
+        b.frame_count = frames - in->ref_ring.frames;
+        b.raw = (void *)frame_ring_write_span(&in->ref_ring, &b.frame_count);
+        if (b.frame_count == 0) {
+            ALOGW("update_echo_reference: ref buffer full");
+            return b.delay_ns;
         }
 
-        b.frame_count = frames - in->ref_frames_in;
-        b.raw = (void *)(in->ref_buf + in->ref_frames_in * in->config.channels);
-
-        get_capture_delay(in, frames, &b);
+        get_capture_delay(in, frames - in->ref_ring.frames, &b);
 
         if (in->echo_reference->read(in->echo_reference, &b) == 0)
         {
-            in->ref_frames_in += b.frame_count;
-            ALOGV("update_echo_reference: in->ref_frames_in:[%d], "
-                    "in->ref_buf_size:[%d], frames:[%d], b.frame_count:[%d]",
-                 in->ref_frames_in, in->ref_buf_size, frames, b.frame_count);
+            frame_ring_commit(&in->ref_ring, b.frame_count);
+            ALOGV("update_echo_reference: in->ref_ring.frames:[%d], "
+                    "in->ref_ring.size:[%d], frames:[%d], b.frame_count:[%d]",
+                 in->ref_ring.frames, in->ref_ring.size, frames, b.frame_count);
         }
     } else
         ALOGW("update_echo_reference: NOT enough frames to read ref buffer");
@@ -1907,35 +4014,83 @@ static int set_preprocessor_echo_delay(effect_handle_t handle,
 static void push_echo_reference(struct omap4_stream_in *in, size_t frames)
 {
     /* read frames from echo reference buffer and update echo delay
-     * in->ref_frames_in is updated with frames available in in->ref_buf */
+     * in->ref_ring is updated with frames available from the reference */
     int32_t delay_us = update_echo_reference(in, frames)/1000;
-    int i;
+    int i, span;
     audio_buffer_t buf;
 
     LOGFUNC("%s(%p, %ul)", __FUNCTION__, in, frames);
 
-    if (in->ref_frames_in < frames)
-        frames = in->ref_frames_in;
+    if (in->ref_ring.frames < frames)
+        frames = in->ref_ring.frames;
 
-    buf.frameCount = frames;
-    buf.raw = in->ref_buf;
+    /* up to two spans if the queued frames wrap */
+    for (span = 0; span < 2 && frames != 0; span++) {
+        buf.frameCount = frames;
+        buf.s16 = frame_ring_read_span(&in->ref_ring, &buf.frameCount);
 
-    for (i = 0; i < in->num_preprocessors; i++) {
-        if ((*in->preprocessors[i])->process_reverse == NULL)
-            continue;
+        for (i = 0; i < in->num_preprocessors; i++) {
+            if ((*in->preprocessors[i])->process_reverse == NULL)
+                continue;
 
-        (*in->preprocessors[i])->process_reverse(in->preprocessors[i],
-                                               &buf,
-                                               NULL);
-        set_preprocessor_echo_delay(in->preprocessors[i], delay_us);
+            (*in->preprocessors[i])->process_reverse(in->preprocessors[i],
+                                                   &buf,
+                                                   NULL);
+        }
+
+        frame_ring_consume(&in->ref_ring, buf.frameCount);
+        frames -= buf.frameCount;
+    }
+
+    for (i = 0; i < in->num_preprocessors; i++) {
+        if ((*in->preprocessors[i])->process_reverse != NULL)
+            set_preprocessor_echo_delay(in->preprocessors[i], delay_us);
     }
+}
+
+/* Accounts for frames_read pcm frames just read and returns the number
+ * of pcm frames the driver dropped before them.  The capture position,
+ * frames read plus those available, must move with the time stamp of the
+ * hardware pointer: after an overrun tinyalsa restarts the pcm within
+ * pcm_read() and what was in the buffer or not captured meanwhile shows
+ * as a shortfall.  Each check is relative to the previous one, so clock
+ * drift does not build up.
+ * must be called with input stream mutex locked or from the capture thread
+ */
+static size_t check_capture_gap(struct omap4_stream_in *in, size_t frames_read)
+{
+    unsigned int avail;
+    struct timespec tstamp;
+    uint64_t pos;
+    int64_t ns, expected;
+    size_t gap = 0;
 
-    in->ref_frames_in -= buf.frameCount;
-    if (in->ref_frames_in) {
-        memcpy(in->ref_buf,
-               in->ref_buf + buf.frameCount * in->config.channels,
-               in->ref_frames_in * in->config.channels * sizeof(int16_t));
+    in->frames_read += frames_read;
+    if (pcm_get_htimestamp(in->pcm, &avail, &tstamp) < 0) {
+        in->gap_ref_valid = false;
+        return 0;
+    }
+    pos = in->frames_read + avail;
+    ns = (int64_t)tstamp.tv_sec * 1000000000LL + tstamp.tv_nsec;
+
+    if (in->gap_ref_valid) {
+        expected = (ns - in->gap_ref_ns) * in->config.rate / 1000000000LL;
+        /* the pointer moves by DMA bursts: half a period is noise */
+        if (expected > (int64_t)(pos - in->gap_ref_pos + in->config.period_size / 2)) {
+            int32_t lost;
+
+            gap = expected - (pos - in->gap_ref_pos);
+            lost = (int32_t)(((uint64_t)gap * in->requested_rate) / in->config.rate);
+            android_atomic_add(lost, &in->frames_lost);
+            android_atomic_inc(&in->gaps);
+            ALOGW("capture gap: %u pcm frames lost", (unsigned)gap);
+        }
     }
+    in->gap_ref_pos = pos;
+    in->gap_ref_ns = ns;
+    in->gap_ref_valid = true;
+
+    return gap;
 }
 
 static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
@@ -1966,9 +4121,14 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
     else
         hw_frame_size = audio_stream_frame_size(&in->stream.common);
 
-    if (in->frames_in == 0) {
+    if (in->frames_in == 0 && in->fill_frames == 0) {
+        int16_t *hw_buf = in->buffer;
+        size_t gap;
+
+        if (remix && remix->in_chans < remix->out_chans)
+            hw_buf += in->config.period_size * remix->out_chans;
         in->read_status = pcm_read(in->pcm,
-                                   (void*)in->buffer,
+                                   (void*)hw_buf,
                                    in->config.period_size * hw_frame_size);
         if (in->read_status != 0) {
             ALOGE("get_next_buffer() pcm_read error %d", in->read_status);
@@ -1979,7 +4139,23 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
         in->frames_in = in->config.period_size;
 
         if (remix)
-            remix->remix_func(remix, in->buffer, in->frames_in);
+            remix->remix_func(in->buffer, hw_buf, in->frames_in);
+
+        /* the silence goes before the frames read after the gap */
+        gap = check_capture_gap(in, in->frames_in);
+        if (gap != 0 && in->zero_buf != NULL)
+            in->fill_frames = gap < in->config.rate * MAX_ZERO_FILL_MS / 1000 ?
+                                    gap : in->config.rate * MAX_ZERO_FILL_MS / 1000;
+    }
+
+    in->filling = in->fill_frames != 0;
+    if (in->filling) {
+        if (buffer->frame_count > in->fill_frames)
+            buffer->frame_count = in->fill_frames;
+        if (buffer->frame_count > in->config.period_size)
+            buffer->frame_count = in->config.period_size;
+        buffer->i16 = in->zero_buf;
+        return 0;
     }
 
     buffer->frame_count = (buffer->frame_count > in->frames_in) ?
@@ -2004,7 +4180,10 @@ static void release_buffer(struct resampler_buffer_provider *buffer_provider,
     in = (struct omap4_stream_in *)((char *)buffer_provider -
                                    offsetof(struct omap4_stream_in, buf_provider));
 
-    in->frames_in -= buffer->frame_count;
+    if (in->filling)
+        in->fill_frames -= buffer->frame_count;
+    else
+        in->frames_in -= buffer->frame_count;
 }
 
 /* read_frames() reads frames from kernel driver, down samples to capture rate
@@ -2024,9 +4203,14 @@ static ssize_t read_frames(struct omap4_stream_in *in, void *buffer, ssize_t fra
     while (frames_wr < frames) {
         size_t frames_rd = frames - frames_wr;
         if (in->resampler != NULL) {
+            /* includes the driver reads done through the provider */
+            int64_t cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
             in->resampler->resample_from_provider(in->resampler,
                     (int16_t *)((char *)buffer + frames_wr * frame_size),
                     &frames_rd);
+            stats_hist_add(&in->stats.resample_us,
+                           (clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_ns) / 1000);
         } else {
             struct resampler_buffer buf = {
                     { raw : NULL, },
@@ -2064,37 +4248,33 @@ static ssize_t process_frames(struct omap4_stream_in *in, void* buffer, ssize_t
 
     LOGFUNC("%s(%p, %p, %ld)", __FUNCTION__, in, buffer, frames);
 
+    if (in->proc_ring.buf == NULL)
+        return -ENOMEM;
+
     while (frames_wr < frames) {
         /* first reload enough frames at the end of process input buffer */
-        if (in->proc_frames_in < (size_t)frames) {
+        if (in->proc_ring.frames < (size_t)frames) {
+            size_t space = (size_t)frames - in->proc_ring.frames;
+            int16_t *dst = frame_ring_write_span(&in->proc_ring, &space);
             ssize_t frames_rd;
 
-            if (in->proc_buf_size < (size_t)frames) {
-                in->proc_buf_size = (size_t)frames;
-                in->proc_buf = (int16_t *)realloc(in->proc_buf,
-                                         in->proc_buf_size *
-                                             in->config.channels * sizeof(int16_t));
-                ALOGV("process_frames(): in->proc_buf %p size extended to %d frames",
-                     in->proc_buf, in->proc_buf_size);
-            }
-            frames_rd = read_frames(in,
-                                    in->proc_buf +
-                                        in->proc_frames_in * in->config.channels,
-                                    frames - in->proc_frames_in);
-            if (frames_rd < 0) {
-                frames_wr = frames_rd;
-                break;
+            if (space != 0) {
+                frames_rd = read_frames(in, dst, space);
+                if (frames_rd < 0) {
+                    frames_wr = frames_rd;
+                    break;
+                }
+                frame_ring_commit(&in->proc_ring, frames_rd);
             }
-            in->proc_frames_in += frames_rd;
         }
 
         if (in->echo_reference != NULL)
-            push_echo_reference(in, in->proc_frames_in);
+            push_echo_reference(in, in->proc_ring.frames);
 
          /* in_buf.frameCount and out_buf.frameCount indicate respectively
           * the maximum number of frames to be consumed and produced by process() */
-        in_buf.frameCount = in->proc_frames_in;
-        in_buf.s16 = in->proc_buf;
+        in_buf.frameCount = in->proc_ring.frames;
+        in_buf.s16 = frame_ring_read_span(&in->proc_ring, &in_buf.frameCount);
         out_buf.frameCount = frames - frames_wr;
         out_buf.s16 = (int16_t *)buffer + frames_wr * in->config.channels;
 
@@ -2104,14 +4284,8 @@ static ssize_t process_frames(struct omap4_stream_in *in, void* buffer, ssize_t
                                                &out_buf);
 
         /* process() has updated the number of frames consumed and produced in
-         * in_buf.frameCount and out_buf.frameCount respectively
-         * move remaining frames to the beginning of in->proc_buf */
-        in->proc_frames_in -= in_buf.frameCount;
-        if (in->proc_frames_in) {
-            memcpy(in->proc_buf,
-                   in->proc_buf + in_buf.frameCount * in->config.channels,
-                   in->proc_frames_in * in->config.channels * sizeof(int16_t));
-        }
+         * in_buf.frameCount and out_buf.frameCount respectively */
+        frame_ring_consume(&in->proc_ring, in_buf.frameCount);
 
         /* if not enough frames were passed to process(), read more and retry. */
         if (out_buf.frameCount == 0)
@@ -2122,6 +4296,268 @@ static ssize_t process_frames(struct omap4_stream_in *in, void* buffer, ssize_t
     return frames_wr;
 }
 
+/* Reads the driver one client buffer at a time and queues the frames,
+ * with their echo reference, for the process thread. */
+static void *capture_thread(void *context)
+{
+    struct omap4_stream_in *in = (struct omap4_stream_in *)context;
+    struct capture_pipeline *pipe = &in->pipe;
+    size_t frame_size = audio_stream_frame_size(&in->stream.common);
+
+    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_URGENT_AUDIO);
+
+    for (;;) {
+        struct echo_reference_buffer b;
+        ssize_t frames;
+        size_t dropped;
+
+        pthread_mutex_lock(&pipe->lock);
+        if (pipe->exit) {
+            pthread_mutex_unlock(&pipe->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pipe->lock);
+
+        frames = read_frames(in, pipe->cap_buf, pipe->block);
+        if (frames <= 0) {
+            pthread_mutex_lock(&pipe->lock);
+            pipe->status = frames < 0 ? (int)frames : -EIO;
+            pthread_mutex_unlock(&pipe->lock);
+            sem_post(&pipe->processed);
+            /* do not spin on a broken pcm */
+            usleep(pipe->block * 1000000 / in->requested_rate);
+            continue;
+        }
+
+        b.delay_ns = 0;
+        if (in->echo_reference != NULL) {
+            /* the reference of the block just read, timed from its first
+             * frame */
+            b.raw = pipe->ref_buf;
+            b.frame_count = frames;
+            get_capture_delay(in, frames, &b);
+            if (in->echo_reference->read(in->echo_reference, &b) != 0)
+                memset(pipe->ref_buf, 0, frames * frame_size);
+        }
+
+        pthread_mutex_lock(&pipe->lock);
+        dropped = frame_ring_put(&pipe->cap_ring, pipe->cap_buf, frames);
+        if (in->echo_reference != NULL)
+            frame_ring_put(&pipe->ref_ring, pipe->ref_buf, frames);
+        pipe->cap_dropped += dropped;
+        if (dropped != 0)
+            android_atomic_add(dropped, &in->frames_lost);
+        pipe->echo_delay_us = b.delay_ns / 1000;
+        pthread_mutex_unlock(&pipe->lock);
+        sem_post(&pipe->captured);
+    }
+
+    return NULL;
+}
+
+/* Runs the effects on what the capture thread queued, in blocks of up to
+ * PIPELINE_PROCESS_BUFFER_COUNT client buffers, and queues the result for
+ * in_read(). */
+static void *process_thread(void *context)
+{
+    struct omap4_stream_in *in = (struct omap4_stream_in *)context;
+    struct capture_pipeline *pipe = &in->pipe;
+    size_t chans = in->config.channels;
+    int i;
+
+    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_AUDIO);
+
+    pthread_mutex_lock(&pipe->lock);
+    while (!pipe->exit) {
+        size_t frames, consumed = 0, produced = 0, dropped;
+        int32_t delay_us;
+
+        if (pipe->cap_ring.frames == 0) {
+            pthread_mutex_unlock(&pipe->lock);
+            sem_wait(&pipe->captured);
+            pthread_mutex_lock(&pipe->lock);
+            continue;
+        }
+        frames = frame_ring_get(&pipe->cap_ring, pipe->proc_in,
+                                pipe->block * PIPELINE_PROCESS_BUFFER_COUNT);
+        if (in->echo_reference != NULL)
+            frame_ring_get(&pipe->ref_ring, pipe->proc_ref, frames);
+        delay_us = pipe->echo_delay_us;
+        pthread_mutex_unlock(&pipe->lock);
+
+        if (in->echo_reference != NULL) {
+            for (i = 0; i < in->num_preprocessors; i++) {
+                audio_buffer_t ref;
+
+                if ((*in->preprocessors[i])->process_reverse == NULL)
+                    continue;
+                ref.frameCount = frames;
+                ref.s16 = pipe->proc_ref;
+                (*in->preprocessors[i])->process_reverse(in->preprocessors[i], &ref, NULL);
+                set_preprocessor_echo_delay(in->preprocessors[i], delay_us);
+            }
+        }
+
+        /* as in process_frames(), every effect of the session sees the same
+         * buffers and the last one to run writes the output */
+        while (consumed < frames) {
+            audio_buffer_t in_buf;
+            audio_buffer_t out_buf;
+
+            in_buf.frameCount = frames - consumed;
+            in_buf.s16 = pipe->proc_in + consumed * chans;
+            out_buf.frameCount = pipe->alloc_frames - produced;
+            out_buf.s16 = pipe->proc_out + produced * chans;
+            for (i = 0; i < in->num_preprocessors; i++)
+                (*in->preprocessors[i])->process(in->preprocessors[i], &in_buf, &out_buf);
+            if (in_buf.frameCount == 0)
+                break;
+            consumed += in_buf.frameCount;
+            produced += out_buf.frameCount;
+        }
+
+        pthread_mutex_lock(&pipe->lock);
+        dropped = frame_ring_put(&pipe->out_ring, pipe->proc_out, produced);
+        pipe->out_dropped += dropped;
+        if (dropped != 0)
+            android_atomic_add(dropped, &in->frames_lost);
+        if (produced != 0)
+            sem_post(&pipe->processed);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    return NULL;
+}
+
+/* must be called with input stream mutex locked, the stream started */
+static int start_capture_pipeline(struct omap4_stream_in *in)
+{
+    struct capture_pipeline *pipe = &in->pipe;
+    size_t chans = in->config.channels;
+    size_t block = get_input_buffer_size(in->requested_rate, AUDIO_FORMAT_PCM_16_BIT, chans) /
+                        (chans * sizeof(int16_t));
+    /* the effects may hand back more than they were given while they
+     * drain what they buffer */
+    size_t alloc_frames = block * (PIPELINE_PROCESS_BUFFER_COUNT + 1);
+
+    LOGFUNC("%s(%p)", __FUNCTION__, in);
+
+    if (frame_ring_init(&pipe->cap_ring, block * PIPELINE_RING_BUFFER_COUNT, chans) != 0 ||
+            frame_ring_init(&pipe->ref_ring, block * PIPELINE_RING_BUFFER_COUNT, chans) != 0 ||
+            frame_ring_init(&pipe->out_ring, block * PIPELINE_RING_BUFFER_COUNT, chans) != 0)
+        return -ENOMEM;
+    if (pipe->alloc_frames < alloc_frames) {
+        int16_t **bufs[] = { &pipe->cap_buf, &pipe->ref_buf, &pipe->proc_in,
+                             &pipe->proc_ref, &pipe->proc_out };
+        unsigned int i;
+
+        for (i = 0; i < sizeof(bufs) / sizeof(bufs[0]); i++) {
+            int16_t *buf = (int16_t *)realloc(*bufs[i], alloc_frames * chans * sizeof(int16_t));
+            if (buf == NULL)
+                return -ENOMEM;
+            *bufs[i] = buf;
+        }
+        pipe->alloc_frames = alloc_frames;
+    }
+    pipe->block = block;
+    pipe->status = 0;
+    pipe->exit = false;
+    pipe->echo_delay_us = 0;
+    sem_init(&pipe->captured, 0, 0);
+    sem_init(&pipe->processed, 0, 0);
+
+    if (pthread_create(&pipe->process_thread, NULL, process_thread, in) != 0) {
+        ALOGE("cannot create capture process thread");
+        goto err_sems;
+    }
+    if (pthread_create(&pipe->capture_thread, NULL, capture_thread, in) != 0) {
+        ALOGE("cannot create capture thread");
+        pthread_mutex_lock(&pipe->lock);
+        pipe->exit = true;
+        pthread_mutex_unlock(&pipe->lock);
+        sem_post(&pipe->captured);
+        pthread_join(pipe->process_thread, NULL);
+        goto err_sems;
+    }
+    pipe->running = true;
+    return 0;
+
+err_sems:
+    sem_destroy(&pipe->captured);
+    sem_destroy(&pipe->processed);
+    return -ENOMEM;
+}
+
+/* Stops the threads; whatever is still queued is dropped with the pcm.
+ * must be called with input stream mutex locked
+ */
+static void stop_capture_pipeline(struct omap4_stream_in *in)
+{
+    struct capture_pipeline *pipe = &in->pipe;
+
+    LOGFUNC("%s(%p)", __FUNCTION__, in);
+
+    if (!pipe->running)
+        return;
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->exit = true;
+    pthread_mutex_unlock(&pipe->lock);
+    sem_post(&pipe->captured);
+    /* the capture thread returns once its current read completes */
+    pthread_join(pipe->capture_thread, NULL);
+    pthread_join(pipe->process_thread, NULL);
+    sem_destroy(&pipe->captured);
+    sem_destroy(&pipe->processed);
+    pipe->running = false;
+
+    if (pipe->cap_dropped || pipe->out_dropped)
+        ALOGV("capture pipeline: %u frames dropped before processing, %u after",
+              pipe->cap_dropped, pipe->out_dropped);
+}
+
+/* Takes frames processed frames for in_read(), waiting for them at most
+ * PIPELINE_READ_TIMEOUT_NS.  On error the buffer is silenced.
+ * must be called with input stream mutex locked
+ */
+static ssize_t pipeline_read(struct omap4_stream_in *in, void *buffer, size_t frames)
+{
+    struct capture_pipeline *pipe = &in->pipe;
+    int64_t deadline_ns = clock_ns(CLOCK_MONOTONIC) + PIPELINE_READ_TIMEOUT_NS;
+    size_t chans = in->config.channels;
+    size_t done = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&pipe->lock);
+    for (;;) {
+        int64_t left_ns;
+
+        done += frame_ring_get(&pipe->out_ring, (int16_t *)buffer + done * chans,
+                               frames - done);
+        if (done == frames)
+            break;
+        if (pipe->status != 0) {
+            ret = pipe->status;
+            pipe->status = 0;
+            break;
+        }
+        left_ns = deadline_ns - clock_ns(CLOCK_MONOTONIC);
+        pthread_mutex_unlock(&pipe->lock);
+        if (left_ns <= 0 || sem_wait_timeout(&pipe->processed, left_ns) != 0)
+            ret = -ETIMEDOUT;
+        pthread_mutex_lock(&pipe->lock);
+        if (ret != 0)
+            break;
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    if (ret != 0) {
+        memset(buffer, 0, frames * chans * sizeof(int16_t));
+        return ret;
+    }
+    return done;
+}
+
 static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
                        size_t bytes)
 {
@@ -2129,6 +4565,7 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
     struct omap4_stream_in *in = (struct omap4_stream_in *)stream;
     struct omap4_audio_device *adev = in->dev;
     size_t frames_rq = bytes / audio_stream_frame_size(&stream->common);
+    int64_t start_ns = clock_ns(CLOCK_MONOTONIC);
 
     LOGFUNC("%s(%p, %p, %d)", __FUNCTION__, stream, buffer, bytes);
 
@@ -2140,20 +4577,29 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
     pthread_mutex_lock(&in->lock);
     if (in->standby) {
         ret = start_input_stream(in);
-        if (ret == 0)
+        if (ret == 0) {
             in->standby = 0;
+            android_atomic_inc(&in->stats.starts);
+        }
     }
+    if (ret == 0 && adev->capture_pipeline && in->num_preprocessors != 0 &&
+            !in->pipe.running && start_capture_pipeline(in) != 0)
+        ALOGW("cannot start capture pipeline, processing in in_read()");
     pthread_mutex_unlock(&adev->lock);
 
     if (ret < 0)
         goto exit;
 
-    if (in->num_preprocessors != 0)
+    stats_capture_fill(&in->stats, in->pcm, in->config.rate);
+
+    if (in->pipe.running)
+        ret = pipeline_read(in, buffer, frames_rq);
+    else if (in->num_preprocessors != 0)
         ret = process_frames(in, buffer, frames_rq);
-    else if (in->resampler != NULL || in->remix_at_driver)
+    else if (in->resampler != NULL || in->remix_at_driver || in->zero_buf != NULL)
         ret = read_frames(in, buffer, frames_rq);
-    else
-        ret = pcm_read(in->pcm, buffer, bytes);
+    else if ((ret = pcm_read(in->pcm, buffer, bytes)) == 0)
+        check_capture_gap(in, frames_rq);
 
     if (ret > 0)
         ret = 0;
@@ -2162,19 +4608,32 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
         memset(buffer, 0, bytes);
 
 exit:
-    if (ret < 0)
+    if (ret < 0) {
+        /* what the client gets instead of the frames is silence */
+        memset(buffer, 0, bytes);
+        android_atomic_add(frames_rq, &in->frames_lost);
         usleep(bytes * 1000000 / audio_stream_frame_size(&stream->common) /
                in_get_sample_rate(&stream->common));
+    }
 
     pthread_mutex_unlock(&in->lock);
+
+    android_atomic_inc(&in->stats.transfers);
+    stats_hist_add(&in->stats.call_us, (clock_ns(CLOCK_MONOTONIC) - start_ns) / 1000);
     return bytes;
 }
 
+/* called from the client read thread only */
 static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
 {
+    struct omap4_stream_in *in = (struct omap4_stream_in *)stream;
+    int32_t lost = android_atomic_acquire_load(&in->frames_lost);
+    uint32_t frames = (uint32_t)(lost - in->frames_lost_reported);
+
     LOGFUNC("%s(%p)", __FUNCTION__, stream);
 
-    return 0;
+    in->frames_lost_reported = lost;
+    return frames;
 }
 
 static int in_add_audio_effect(const struct audio_stream *stream,
@@ -2197,6 +4656,9 @@ static int in_add_audio_effect(const struct audio_stream *stream,
     if (status != 0)
         goto exit;
 
+    /* the pipeline threads use the effects without the stream lock */
+    if (in->pipe.running)
+        do_input_standby(in);
     in->preprocessors[in->num_preprocessors++] = effect;
 
     if (memcmp(&desc.type, FX_IID_AEC, sizeof(effect_uuid_t)) == 0) {
@@ -2229,6 +4691,8 @@ static int in_remove_audio_effect(const struct audio_stream *stream,
         goto exit;
     }
 
+    if (in->pipe.running)
+        do_input_standby(in);
     for (i = 0; i < in->num_preprocessors; i++) {
         if (found) {
             in->preprocessors[i - 1] = in->preprocessors[i];
@@ -2276,12 +4740,71 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     LOGFUNC("%s(%p, 0x%04x, %p)", __FUNCTION__, dev, devices,
                         stream_out);
 
+    /* compressed formats are only taken by a direct output, for
+     * passthrough; otherwise suggest the pcm format */
+    if (!audio_is_linear_pcm(config->format) &&
+            (!(flags & AUDIO_OUTPUT_FLAG_DIRECT) ||
+             iec61937_pcm_rate(config->format, config->sample_rate) == 0)) {
+        ALOGW("%s: cannot pass format 0x%x at %u Hz through", __func__,
+              config->format, config->sample_rate);
+        config->format = AUDIO_FORMAT_PCM_16_BIT;
+        config->channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+        config->sample_rate = DEFAULT_OUT_SAMPLING_RATE;
+        *stream_out = NULL;
+        return -EINVAL;
+    }
+    /* so is 5.1 and 7.1 pcm, for HDMI at the pcm rate; anything else is
+     * mixed in stereo */
+    if (audio_is_linear_pcm(config->format) && config->channel_mask != 0 &&
+            config->channel_mask != AUDIO_CHANNEL_OUT_STEREO &&
+            (!(flags & AUDIO_OUTPUT_FLAG_DIRECT) ||
+             (config->channel_mask != AUDIO_CHANNEL_OUT_5POINT1 &&
+              config->channel_mask != AUDIO_CHANNEL_OUT_7POINT1) ||
+             config->format != AUDIO_FORMAT_PCM_16_BIT ||
+             config->sample_rate != DEFAULT_OUT_SAMPLING_RATE)) {
+        ALOGW("%s: cannot open channels 0x%x at %u Hz", __func__,
+              config->channel_mask, config->sample_rate);
+        config->format = AUDIO_FORMAT_PCM_16_BIT;
+        config->channel_mask = (flags & AUDIO_OUTPUT_FLAG_DIRECT) &&
+                popcount(config->channel_mask) > 2 ? AUDIO_CHANNEL_OUT_5POINT1 :
+                                                     AUDIO_CHANNEL_OUT_STEREO;
+        config->sample_rate = DEFAULT_OUT_SAMPLING_RATE;
+        *stream_out = NULL;
+        return -EINVAL;
+    }
+
     out = (struct omap4_stream_out *)calloc(1, sizeof(struct omap4_stream_out));
     ALOGV("%s %d\n", __func__, __LINE__);
     if (!out)
         return -ENOMEM;
     ALOGV("%s %d\n", __func__, __LINE__);
-    if (devices & AUDIO_DEVICE_OUT_ALL_SCO) {
+    out->sample_rate = DEFAULT_OUT_SAMPLING_RATE;
+    out->format = AUDIO_FORMAT_PCM_16_BIT;
+    out->channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    if (!audio_is_linear_pcm(config->format)) {
+        out->iec = (struct iec61937 *)calloc(1, sizeof(struct iec61937));
+        out->burst = (int16_t *)malloc(IEC61937_MAX_BURST_FRAMES * 2 * sizeof(int16_t));
+        if (out->iec == NULL || out->burst == NULL) {
+            ret = -ENOMEM;
+            goto err_open;
+        }
+        ret = iec61937_init(out->iec, config->format, config->sample_rate);
+        if (ret != 0)
+            goto err_open;
+        out->format = config->format;
+        out->sample_rate = config->sample_rate;
+        out->resampler = NULL;
+    } else if ((flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) &&
+            config->sample_rate == RESAMPLER_147_160_IN_RATE) {
+        /* most music is 44.1 kHz: take it as is and convert it here with
+         * the dedicated resampler rather than in the mixer */
+        ret = create_resampler_147_160(&out->resampler);
+        if (ret != 0)
+            goto err_open;
+        out->release_resampler = release_resampler_147_160;
+        out->sample_rate = RESAMPLER_147_160_IN_RATE;
+        out->buffer = malloc(RESAMPLER_BUFFER_SIZE);
+    } else if (devices & AUDIO_DEVICE_OUT_ALL_SCO) {
     ALOGV("%s %d\n", __func__, __LINE__);
         ret = create_resampler(DEFAULT_OUT_SAMPLING_RATE,
                 MM_FULL_POWER_SAMPLING_RATE,
@@ -2292,6 +4815,7 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     ALOGV("%s %d\n", __func__, __LINE__);
         if (ret != 0)
             goto err_open;
+        out->release_resampler = release_resampler;
     ALOGV("%s %d\n", __func__, __LINE__);
         out->buffer = malloc(RESAMPLER_BUFFER_SIZE); /* todo: allow for reallocing */
     ALOGV("%s %d\n", __func__, __LINE__);
@@ -2315,11 +4839,47 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.set_volume = out_set_volume;
     out->stream.write = out_write;
     out->stream.get_render_position = out_get_render_position;
+#ifdef AUDIO_OFFLOAD_CODEC_PARAMS
+    /* the hook came with offload support in hardware/audio.h */
+    out->stream.get_presentation_position = out_get_presentation_position;
+#endif
 
-    out->config = pcm_config_mm;
+    out->flags = flags;
+    if (out->iec != NULL) {
+        /* the bursts go at the pcm rate, in periods of the same duration
+         * as a normal output's */
+        uint32_t rate = iec61937_pcm_rate(out->format, out->sample_rate);
+
+        out->config = pcm_config_mm;
+        out->config.rate = rate;
+        out->config.period_size = LONG_PERIOD_SIZE * (rate / DEFAULT_OUT_SAMPLING_RATE);
+        if (out->config.period_size < LONG_PERIOD_SIZE)
+            out->config.period_size = LONG_PERIOD_SIZE;
+        out->write_threshold = PLAYBACK_PERIOD_COUNT * out->config.period_size;
+    } else if (config->channel_mask == AUDIO_CHANNEL_OUT_5POINT1 ||
+               config->channel_mask == AUDIO_CHANNEL_OUT_7POINT1) {
+        out->config = pcm_config_mm;
+        out->config.channels = popcount(config->channel_mask);
+        out->channel_mask = config->channel_mask;
+        out->remix = out->config.channels == 8 ? remix_7point1_to_cea_i16 :
+                                                 remix_5point1_to_cea_i16;
+        out->buffer = malloc(out_get_buffer_size(&out->stream.common));
+        if (out->buffer == NULL) {
+            ret = -ENOMEM;
+            goto err_open;
+        }
+    } else if (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER)
+        out->config = pcm_config_mm_deep;
+    else if (flags & AUDIO_OUTPUT_FLAG_FAST)
+        out->config = pcm_config_mm_fast;
+    else
+        out->config = pcm_config_mm;
 
     out->dev = ladev;
     out->standby = 1;
+    out->gain_left = MIX_UNITY_GAIN;
+    out->gain_right = MIX_UNITY_GAIN;
+    playback_position_init(&out->position, out->sample_rate);
 
     /* FIXME: when we support multiple output devices, we will want to
      * do the following:
@@ -2343,6 +4903,13 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 
 err_open:
     ALOGV("%s %d\n", __func__, __LINE__);
+    if (out->resampler)
+        out->release_resampler(out->resampler);
+    if (out->iec != NULL)
+        iec61937_release(out->iec);
+    free(out->iec);
+    free(out->burst);
+    free(out->buffer);
     free(out);
     ALOGV("%s %d\n", __func__, __LINE__);
     *stream_out = NULL;
@@ -2357,11 +4924,21 @@ static void adev_close_output_stream(struct audio_hw_device *dev,
 
     LOGFUNC("%s(%p, %p)", __FUNCTION__, dev, stream);
 
-    out_standby(&stream->common);
+    /* not out_standby(): the pcms must not be kept warm */
+    pthread_mutex_lock(&out->dev->lock);
+    pthread_mutex_lock(&out->lock);
+    do_output_standby(out);
+    pthread_mutex_unlock(&out->lock);
+    pthread_mutex_unlock(&out->dev->lock);
     if (out->buffer)
         free(out->buffer);
+    free(out->mix_ring);
     if (out->resampler)
-        release_resampler(out->resampler);
+        out->release_resampler(out->resampler);
+    if (out->iec != NULL)
+        iec61937_release(out->iec);
+    free(out->iec);
+    free(out->burst);
     free(stream);
 }
 
@@ -2411,10 +4988,15 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 
     ret = str_parms_get_str(parms, "screen_state", value, sizeof(value));
     if (ret >= 0) {
-        if (strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0)
-            adev->low_power = false;
-        else
-            adev->low_power = true;
+        bool low_power = strcmp(value, AUDIO_PARAMETER_VALUE_ON) != 0;
+
+        pthread_mutex_lock(&adev->lock);
+        if (low_power != adev->low_power) {
+            adev->low_power = low_power;
+            /* playing deep buffer outputs pick it up on their next write */
+            android_atomic_inc(&adev->out_gen);
+        }
+        pthread_mutex_unlock(&adev->lock);
     }
 
     str_parms_destroy(parms);
@@ -2572,6 +5154,16 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->dev = ladev;
     in->standby = 1;
     in->device = devices;
+    pthread_mutex_init(&in->pipe.lock, NULL);
+
+    if (ladev->capture_zero_fill) {
+        /* stereo, whatever the channel count becomes with the remix */
+        in->zero_buf = (int16_t *)calloc(in->config.period_size * 2, sizeof(int16_t));
+        if (in->zero_buf == NULL) {
+            ret = -ENOMEM;
+            goto err;
+        }
+    }
 
     *stream_in = &in->stream;
     return 0;
@@ -2579,6 +5171,7 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
 err:
     if (in->resampler)
         release_resampler(in->resampler);
+    free(in->zero_buf);
 
     free(in);
     *stream_in = NULL;
@@ -2602,14 +5195,41 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
     if (in->remix_at_driver)
         free(in->remix_at_driver);
 
+    free(in->proc_ring.buf);
+    free(in->ref_ring.buf);
+    free(in->pipe.cap_ring.buf);
+    free(in->pipe.ref_ring.buf);
+    free(in->pipe.out_ring.buf);
+    free(in->pipe.cap_buf);
+    free(in->pipe.ref_buf);
+    free(in->pipe.proc_in);
+    free(in->pipe.proc_ref);
+    free(in->pipe.proc_out);
+    free(in->zero_buf);
+    pthread_mutex_destroy(&in->pipe.lock);
     free(stream);
     return;
 }
 
+/* no lock taken, see out_dump(); the streams dump their own statistics */
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
+    const struct omap4_audio_device *adev = (const struct omap4_audio_device *)device;
+
     LOGFUNC("%s(%p, %d)", __FUNCTION__, device, fd);
 
+    dump_printf(fd, "  mode %d, devices 0x%x, active output %p, active input %p\n",
+                adev->mode, adev->devices, adev->active_output, adev->active_input);
+    if (adev->out_mixer.out != NULL)
+        dump_printf(fd, "  output mixer: %d inputs, %u frame chunks\n",
+                    adev->out_mixer.num_inputs, adev->out_mixer.chunk);
+    dump_printf(fd, "  mic %s, low power %d, input requires stereo %d%s, capture pipeline %d,"
+                " zero fill %d\n",
+                adev->mic_mute ? "muted" : "on", adev->low_power,
+                adev->input_requires_stereo,
+                adev->input_downmix_average ? " (average)" : "",
+                adev->capture_pipeline, adev->capture_zero_fill);
+
     return 0;
 }
 
@@ -2619,7 +5239,16 @@ static int adev_close(hw_device_t *device)
 
     LOGFUNC("%s(%p)", __FUNCTION__, device);
 
+    if (adev->warm_running) {
+        android_atomic_release_store(1, &adev->warm_exit);
+        sem_post(&adev->warm_wake);
+        pthread_join(adev->warm_thread, NULL);
+    }
+    sem_destroy(&adev->warm_wake);
+    free(adev->warm_silence);
     mixer_close(adev->mixer);
+    sem_destroy(&adev->out_mixer.wake);
+    pthread_mutex_destroy(&adev->out_mixer.lock);
     free(device);
     return 0;
 }
@@ -2645,6 +5274,7 @@ static int adev_open(const hw_module_t* module, const char* name,
                      hw_device_t** device)
 {
     struct omap4_audio_device *adev;
+    char value[PROPERTY_VALUE_MAX];
     int ret;
     pthread_mutexattr_t mta;
 
@@ -2745,6 +5375,9 @@ static int adev_open(const hw_module_t* module, const char* name,
     pthread_mutexattr_settype(&mta, PTHREAD_MUTEX_NORMAL);
     pthread_mutex_init(&adev->lock, &mta);
     pthread_mutexattr_destroy(&mta);
+    pthread_mutex_init(&adev->out_mixer.lock, NULL);
+    sem_init(&adev->out_mixer.wake, 0, 0);
+    sem_init(&adev->warm_wake, 0, 0);
 
     /* Set the default route before the PCM stream is opened */
     pthread_mutex_lock(&adev->lock);
@@ -2766,6 +5399,23 @@ static int adev_open(const hw_module_t* module, const char* name,
     }
 
     adev->input_requires_stereo = 0;
+    property_get(CAPTURE_DOWNMIX_PROPERTY, value, "");
+    adev->input_downmix_average = !strcmp(value, "average");
+    property_get(CAPTURE_PIPELINE_PROPERTY, value, "0");
+    adev->capture_pipeline = !strcmp(value, "1");
+    property_get(CAPTURE_ZERO_FILL_PROPERTY, value, "0");
+    adev->capture_zero_fill = !strcmp(value, "1");
+    property_get(STANDBY_DELAY_PROPERTY, value, "0");
+    adev->standby_delay_ms = strtoul(value, NULL, 10);
+    if (adev->standby_delay_ms > 0) {
+        adev->warm_silence = (int16_t *)calloc(WARM_FILL_FRAMES * MAX_OUT_CHANNELS,
+                                               sizeof(int16_t));
+        if (adev->warm_silence != NULL &&
+                pthread_create(&adev->warm_thread, NULL, output_warm_thread, adev) == 0)
+            adev->warm_running = true;
+        else
+            ALOGE("cannot start output warm thread, outputs close at standby");
+    }
     adev->bluetooth_nrec = true;
     pthread_mutex_unlock(&adev->lock);
     *device = &adev->hw_device.common;
@@ -0,0 +1,394 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "channel_remix.h"
+
+/*
+ * The vector loops do 8 frames (4 for the multichannel kernels) at a
+ * time with unaligned loads and stores; the remaining frames go through
+ * the scalar loop.  In the in-place
+ * stereo to mono case a block is read completely before its 8 output
+ * samples are stored below it, so no unread input is overwritten.
+ */
+
+#if !defined(__ARM_NEON__) && defined(__SSE2__)
+/* sign extended left and right samples of 4 stereo frames */
+static inline __m128i left_i32(__m128i v)
+{
+    return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+static inline __m128i right_i32(__m128i v)
+{
+    return _mm_srai_epi32(v, 16);
+}
+#endif
+
+void remix_stereo_to_mono_pick_i16(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t v = vld2q_s16(src + i * 2);
+        vst1q_s16(dst + i, v.val[0]);
+    }
+#elif defined(__SSE2__)
+    for (; i + 8 <= frames; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i * 2 + 8));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(left_i32(a), left_i32(b)));
+    }
+#endif
+    for (; i < frames; i++)
+        dst[i] = src[i * 2];
+}
+
+void remix_stereo_to_mono_avg_i16(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t v = vld2q_s16(src + i * 2);
+        vst1q_s16(dst + i, vhaddq_s16(v.val[0], v.val[1]));
+    }
+#elif defined(__SSE2__)
+    for (; i + 8 <= frames; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i * 2 + 8));
+        __m128i sa = _mm_srai_epi32(_mm_add_epi32(left_i32(a), right_i32(a)), 1);
+        __m128i sb = _mm_srai_epi32(_mm_add_epi32(left_i32(b), right_i32(b)), 1);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(sa, sb));
+    }
+#endif
+    for (; i < frames; i++)
+        dst[i] = (int16_t)(((int32_t)src[i * 2] + src[i * 2 + 1]) >> 1);
+}
+
+void remix_mono_to_stereo_i16(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t v;
+        v.val[0] = v.val[1] = vld1q_s16(src + i);
+        vst2q_s16(dst + i * 2, v);
+    }
+#elif defined(__SSE2__)
+    for (; i + 8 <= frames; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_unpacklo_epi16(v, v));
+        _mm_storeu_si128((__m128i *)(dst + i * 2 + 8), _mm_unpackhi_epi16(v, v));
+    }
+#endif
+    for (; i < frames; i++)
+        dst[i * 2] = dst[i * 2 + 1] = src[i];
+}
+
+void mix_accumulate_i16(int32_t *acc, const int16_t *src, size_t frames,
+                        int16_t gain_left, int16_t gain_right)
+{
+    size_t i = 0, samples = frames * 2;
+
+#if defined(__ARM_NEON__)
+    const int16_t gains[4] = { gain_left, gain_right, gain_left, gain_right };
+    int16x4_t g = vld1_s16(gains);
+
+    for (; i + 8 <= samples; i += 8) {
+        int16x8_t v = vld1q_s16(src + i);
+        vst1q_s32(acc + i, vmlal_s16(vld1q_s32(acc + i), vget_low_s16(v), g));
+        vst1q_s32(acc + i + 4, vmlal_s16(vld1q_s32(acc + i + 4), vget_high_s16(v), g));
+    }
+#elif defined(__SSE2__)
+    __m128i g = _mm_set_epi16(gain_right, gain_left, gain_right, gain_left,
+                              gain_right, gain_left, gain_right, gain_left);
+
+    for (; i + 8 <= samples; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = _mm_mullo_epi16(v, g);
+        __m128i hi = _mm_mulhi_epi16(v, g);
+        __m128i *a = (__m128i *)(acc + i);
+
+        _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_unpacklo_epi16(lo, hi)));
+        _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(lo, hi)));
+    }
+#endif
+    for (; i < samples; i += 2) {
+        acc[i] += (int32_t)src[i] * gain_left;
+        acc[i + 1] += (int32_t)src[i + 1] * gain_right;
+    }
+}
+
+void mix_clamp_i16(int16_t *dst, const int32_t *acc, size_t samples)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 8 <= samples; i += 8) {
+        int16x4_t lo = vqshrn_n_s32(vld1q_s32(acc + i), MIX_GAIN_SHIFT);
+        int16x4_t hi = vqshrn_n_s32(vld1q_s32(acc + i + 4), MIX_GAIN_SHIFT);
+        vst1q_s16(dst + i, vcombine_s16(lo, hi));
+    }
+#elif defined(__SSE2__)
+    for (; i + 8 <= samples; i += 8) {
+        __m128i lo = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(acc + i)), MIX_GAIN_SHIFT);
+        __m128i hi = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(acc + i + 4)), MIX_GAIN_SHIFT);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+    }
+#endif
+    for (; i < samples; i++) {
+        int32_t v = acc[i] >> MIX_GAIN_SHIFT;
+        dst[i] = v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+    }
+}
+
+/* a surround channel in the stereo downmix, -3 dB in Q14 */
+#define DOWNMIX_GAIN 11585
+
+static inline int16_t downmix_sample(int32_t front, int32_t center, int32_t surround)
+{
+    int32_t v = (front * MIX_UNITY_GAIN + (center + surround) * DOWNMIX_GAIN) >> MIX_GAIN_SHIFT;
+
+    return v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+}
+
+/*
+ * The multichannel kernels take a frame as pairs of channels in 32 bit
+ * lanes, FL FR, FC LFE (LFE FC in the CEA order), then the surround
+ * pairs: NEON deinterleaves 4 frames into one vector per pair with
+ * vld3/vld4, SSE2 with 32 bit shuffles.  The reorder swaps the halves of
+ * the center lane and, for 7.1, the two surround lanes.  The downmix
+ * works on the pair vectors as on 4 stereo frames, with the center copied
+ * to both halves of its lane.
+ */
+
+#if defined(__ARM_NEON__)
+static inline uint32x4_t swap_halves_u32(uint32x4_t v)
+{
+    return vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(v)));
+}
+
+/* 4 stereo frames front + center + surrounds, the center lanes LFE FC */
+static inline void downmix_store(int16_t *dst, uint32x4_t front, uint32x4_t center,
+                                 uint32x4_t surround1, uint32x4_t surround2)
+{
+    int16x8_t c = vreinterpretq_s16_u32(center);
+    int16x8_t f = vreinterpretq_s16_u32(front);
+    int16x8_t s1 = vreinterpretq_s16_u32(surround1);
+    int16x8_t s2 = vreinterpretq_s16_u32(surround2);
+    int32x4_t lo, hi;
+
+    c = vtrnq_s16(c, c).val[1];
+    lo = vmull_n_s16(vget_low_s16(f), MIX_UNITY_GAIN);
+    hi = vmull_n_s16(vget_high_s16(f), MIX_UNITY_GAIN);
+    lo = vmlal_n_s16(lo, vget_low_s16(c), DOWNMIX_GAIN);
+    hi = vmlal_n_s16(hi, vget_high_s16(c), DOWNMIX_GAIN);
+    lo = vmlal_n_s16(lo, vget_low_s16(s1), DOWNMIX_GAIN);
+    hi = vmlal_n_s16(hi, vget_high_s16(s1), DOWNMIX_GAIN);
+    lo = vmlal_n_s16(lo, vget_low_s16(s2), DOWNMIX_GAIN);
+    hi = vmlal_n_s16(hi, vget_high_s16(s2), DOWNMIX_GAIN);
+    vst1q_s16(dst, vcombine_s16(vqshrn_n_s32(lo, MIX_GAIN_SHIFT),
+                                vqshrn_n_s32(hi, MIX_GAIN_SHIFT)));
+}
+#elif defined(__SSE2__)
+static inline __m128i swap_halves_i32(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi32(v, 16), _mm_srli_epi32(v, 16));
+}
+
+/* lanes of v where mask is set taken from w */
+static inline __m128i select_i32(__m128i mask, __m128i w, __m128i v)
+{
+    return _mm_or_si128(_mm_and_si128(mask, w), _mm_andnot_si128(mask, v));
+}
+
+/* lanes x[i], x[j], y[k], y[l] of the concatenation of x and y */
+#define SHUFFLE_I32(x, y, i, j, k, l) _mm_castps_si128(_mm_shuffle_ps( \
+        _mm_castsi128_ps(x), _mm_castsi128_ps(y), _MM_SHUFFLE(l, k, j, i)))
+
+/* 4 stereo frames front + center + surrounds, the center lanes LFE FC */
+static inline void downmix_store(int16_t *dst, __m128i front, __m128i center,
+                                 __m128i surround1, __m128i surround2)
+{
+    const __m128i gains_fc = _mm_set1_epi32((DOWNMIX_GAIN << 16) | MIX_UNITY_GAIN);
+    const __m128i gains_s = _mm_set1_epi32((DOWNMIX_GAIN << 16) | DOWNMIX_GAIN);
+    __m128i c = _mm_shufflehi_epi16(_mm_shufflelo_epi16(center, _MM_SHUFFLE(3, 3, 1, 1)),
+                                    _MM_SHUFFLE(3, 3, 1, 1));
+    __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(front, c), gains_fc),
+                               _mm_madd_epi16(_mm_unpacklo_epi16(surround1, surround2), gains_s));
+    __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(front, c), gains_fc),
+                               _mm_madd_epi16(_mm_unpackhi_epi16(surround1, surround2), gains_s));
+
+    _mm_storeu_si128((__m128i *)dst, _mm_packs_epi32(_mm_srai_epi32(lo, MIX_GAIN_SHIFT),
+                                                     _mm_srai_epi32(hi, MIX_GAIN_SHIFT)));
+}
+#endif
+
+void remix_5point1_to_cea_i16(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 4 <= frames; i += 4) {
+        uint32x4x3_t v = vld3q_u32((const uint32_t *)(src + i * 6));
+        v.val[1] = swap_halves_u32(v.val[1]);
+        vst3q_u32((uint32_t *)(dst + i * 6), v);
+    }
+#elif defined(__SSE2__)
+    /* the center lanes of 4 frames: 1 of the first vector, 0 and 3 of the
+     * second, 2 of the third */
+    const __m128i mask_a = _mm_set_epi32(0, 0, -1, 0);
+    const __m128i mask_b = _mm_set_epi32(-1, 0, 0, -1);
+    const __m128i mask_c = _mm_set_epi32(0, -1, 0, 0);
+
+    for (; i + 4 <= frames; i += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i * 6));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i * 6 + 8));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + i * 6 + 16));
+        _mm_storeu_si128((__m128i *)(dst + i * 6), select_i32(mask_a, swap_halves_i32(a), a));
+        _mm_storeu_si128((__m128i *)(dst + i * 6 + 8), select_i32(mask_b, swap_halves_i32(b), b));
+        _mm_storeu_si128((__m128i *)(dst + i * 6 + 16), select_i32(mask_c, swap_halves_i32(c), c));
+    }
+#endif
+    for (; i < frames; i++) {
+        const int16_t *s = src + i * 6;
+        int16_t *d = dst + i * 6;
+        int16_t fc = s[2], lfe = s[3];
+
+        d[0] = s[0];
+        d[1] = s[1];
+        d[2] = lfe;
+        d[3] = fc;
+        d[4] = s[4];
+        d[5] = s[5];
+    }
+}
+
+void remix_7point1_to_cea_i16(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 4 <= frames; i += 4) {
+        uint32x4x4_t v = vld4q_u32((const uint32_t *)(src + i * 8));
+        uint32x4_t back = v.val[2];
+
+        v.val[1] = swap_halves_u32(v.val[1]);
+        v.val[2] = v.val[3];
+        v.val[3] = back;
+        vst4q_u32((uint32_t *)(dst + i * 8), v);
+    }
+#elif defined(__SSE2__)
+    /* a frame per vector */
+    for (; i < frames; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 1, 0));
+        _mm_storeu_si128((__m128i *)(dst + i * 8), _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 1, 0)));
+    }
+#endif
+    for (; i < frames; i++) {
+        const int16_t *s = src + i * 8;
+        int16_t *d = dst + i * 8;
+        int16_t fc = s[2], lfe = s[3], bl = s[4], br = s[5];
+
+        d[0] = s[0];
+        d[1] = s[1];
+        d[2] = lfe;
+        d[3] = fc;
+        d[4] = s[6];
+        d[5] = s[7];
+        d[6] = bl;
+        d[7] = br;
+    }
+}
+
+void remix_cea_5point1_to_stereo_i16(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 4 <= frames; i += 4) {
+        uint32x4x3_t v = vld3q_u32((const uint32_t *)(src + i * 6));
+        downmix_store(dst + i * 2, v.val[0], v.val[1], v.val[2], vdupq_n_u32(0));
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= frames; i += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i * 6));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i * 6 + 8));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + i * 6 + 16));
+        /* lanes F0 C0 S0 F1, C1 S1 F2 C2, S2 F3 C3 S3 */
+        __m128i front = SHUFFLE_I32(SHUFFLE_I32(a, a, 0, 0, 3, 3),
+                                    SHUFFLE_I32(b, c, 2, 2, 1, 1), 0, 2, 0, 2);
+        __m128i center = SHUFFLE_I32(SHUFFLE_I32(a, b, 1, 1, 0, 0),
+                                     SHUFFLE_I32(b, c, 3, 3, 2, 2), 0, 2, 0, 2);
+        __m128i surround = SHUFFLE_I32(SHUFFLE_I32(a, b, 2, 2, 1, 1),
+                                       SHUFFLE_I32(c, c, 0, 0, 3, 3), 0, 2, 0, 2);
+        downmix_store(dst + i * 2, front, center, surround, _mm_setzero_si128());
+    }
+#endif
+    for (; i < frames; i++) {
+        const int16_t *s = src + i * 6;
+        int16_t l = downmix_sample(s[0], s[3], s[4]);
+        int16_t r = downmix_sample(s[1], s[3], s[5]);
+
+        dst[i * 2] = l;
+        dst[i * 2 + 1] = r;
+    }
+}
+
+void remix_cea_7point1_to_stereo_i16(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 4 <= frames; i += 4) {
+        uint32x4x4_t v = vld4q_u32((const uint32_t *)(src + i * 8));
+        downmix_store(dst + i * 2, v.val[0], v.val[1], v.val[2], v.val[3]);
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= frames; i += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i * 8));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i * 8 + 8));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + i * 8 + 16));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + i * 8 + 24));
+        /* transpose the 4 frames of 4 lanes into a vector per lane */
+        __m128i ab_lo = _mm_unpacklo_epi32(a, b), cd_lo = _mm_unpacklo_epi32(c, d);
+        __m128i ab_hi = _mm_unpackhi_epi32(a, b), cd_hi = _mm_unpackhi_epi32(c, d);
+        downmix_store(dst + i * 2, _mm_unpacklo_epi64(ab_lo, cd_lo),
+                      _mm_unpackhi_epi64(ab_lo, cd_lo), _mm_unpacklo_epi64(ab_hi, cd_hi),
+                      _mm_unpackhi_epi64(ab_hi, cd_hi));
+    }
+#endif
+    for (; i < frames; i++) {
+        const int16_t *s = src + i * 8;
+        int16_t l = downmix_sample(s[0], s[3], (int32_t)s[4] + s[6]);
+        int16_t r = downmix_sample(s[1], s[3], (int32_t)s[5] + s[7]);
+
+        dst[i * 2] = l;
+        dst[i * 2 + 1] = r;
+    }
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CHANNEL_REMIX_H
+#define CHANNEL_REMIX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Channel count conversions for interleaved 16 bit buffers, for streams
+ * whose client channel count differs from what the hardware delivers,
+ * and the mixing of several streams into one.
+ *
+ * The stereo to mono kernels may run in place (dst == src): each frame is
+ * written at or below where it was read.  The mono to stereo kernel needs
+ * separate, non-overlapping buffers.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*channel_remix_i16_t)(int16_t *dst, const int16_t *src, size_t frames);
+
+/* keeps the left channel */
+void remix_stereo_to_mono_pick_i16(int16_t *dst, const int16_t *src, size_t frames);
+/* (left + right) / 2, rounded down */
+void remix_stereo_to_mono_avg_i16(int16_t *dst, const int16_t *src, size_t frames);
+/* copies each sample to both channels */
+void remix_mono_to_stereo_i16(int16_t *dst, const int16_t *src, size_t frames);
+
+/*
+ * Multichannel output over HDMI.  Android orders 5.1 as FL FR FC LFE BL BR
+ * and 7.1 as FL FR FC LFE BL BR SL SR; HDMI sinks take the order of the
+ * CEA-861 speaker allocations 0x0b and 0x13, FL FR LFE FC RL RR and
+ * FL FR LFE FC RL RR RLC RRC, where RL RR are the side (surround)
+ * speakers and RLC RRC the back ones.  The reorder kernels may run in
+ * place.
+ *
+ * The stereo downmix of the CEA order is, as in ITU-R BS.775 without the
+ * LFE: L = FL + 0.707 FC + 0.707 (RL + RLC), and R likewise, saturated to
+ * 16 bit.  It may run in place.
+ */
+void remix_5point1_to_cea_i16(int16_t *dst, const int16_t *src, size_t frames);
+void remix_7point1_to_cea_i16(int16_t *dst, const int16_t *src, size_t frames);
+void remix_cea_5point1_to_stereo_i16(int16_t *dst, const int16_t *src, size_t frames);
+void remix_cea_7point1_to_stereo_i16(int16_t *dst, const int16_t *src, size_t frames);
+
+/*
+ * Mixing of stereo 16 bit streams: each stream is scaled by its left and
+ * right gains and summed into a 32 bit accumulator, which is then
+ * narrowed back to 16 bit with saturation.  Gains are Q14, at most
+ * MIX_UNITY_GAIN, so up to MIX_MAX_STREAMS full scale streams can be
+ * summed without overflowing the accumulator.
+ */
+#define MIX_GAIN_SHIFT 14
+#define MIX_UNITY_GAIN (1 << MIX_GAIN_SHIFT)
+#define MIX_MAX_STREAMS 4
+
+/* acc[i] += src[i] * gain of the sample's channel */
+void mix_accumulate_i16(int32_t *acc, const int16_t *src, size_t frames,
+                        int16_t gain_left, int16_t gain_right);
+/* dst[i] = acc[i] / MIX_UNITY_GAIN, saturated to 16 bit */
+void mix_clamp_i16(int16_t *dst, const int32_t *acc, size_t samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CHANNEL_REMIX_H */
@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iec61937.h"
+
+/* burst preamble sync words */
+#define IEC61937_PA 0xF872
+#define IEC61937_PB 0x4E1F
+#define IEC61937_PREAMBLE_WORDS 4
+
+/* data types of the burst info word Pc */
+#define IEC61937_TYPE_AC3 0x01
+#define IEC61937_TYPE_DTS1 0x0B
+#define IEC61937_TYPE_DTS2 0x0C
+#define IEC61937_TYPE_DTS3 0x0D
+#define IEC61937_TYPE_EAC3 0x15
+
+#define AC3_SAMPLES 1536
+#define AC3_BLOCK_SAMPLES 256
+#define AC3_BLOCKS 6
+#define AC3_HEADER_BYTES 6
+#define AC3_MAX_FRAME_BYTES 3840
+#define EAC3_MAX_FRAME_BYTES 4096
+#define EAC3_RATE_MULTIPLIER 4
+#define DTS_HEADER_BYTES 8
+#define DTS_MIN_FRAME_BYTES 96
+#define DTS_MAX_FRAME_BYTES 16384
+#define DTS_BLOCK_SAMPLES 32
+
+/* bytes a burst of period stereo frames carries after the preamble */
+#define PAYLOAD_BYTES(period) ((period) * 4 - IEC61937_PREAMBLE_WORDS * 2)
+
+static const uint8_t ac3_sync[] = { 0x0b, 0x77 };
+static const uint8_t dts_sync[] = { 0x7f, 0xfe, 0x80, 0x01 };
+
+/* AC-3 frame size in 16 bit words by frmsizecod, at 48, 44.1 and 32 kHz
+ * (fscod 0, 1, 2) */
+static const uint16_t ac3_frame_words[3][38] = {
+    {   64,   64,   80,   80,   96,   96,  112,  112,  128,  128,  160,  160,  192,
+       192,  224,  224,  256,  256,  320,  320,  384,  384,  448,  448,  512,  512,
+       640,  640,  768,  768,  896,  896, 1024, 1024, 1152, 1152, 1280, 1280 },
+    {   69,   70,   87,   88,  104,  105,  121,  122,  139,  140,  174,  175,  208,
+       209,  243,  244,  278,  279,  348,  349,  417,  418,  487,  488,  557,  558,
+       696,  697,  835,  836,  975,  976, 1114, 1115, 1253, 1254, 1393, 1394 },
+    {   96,   96,  120,  120,  144,  144,  168,  168,  192,  192,  240,  240,  288,
+       288,  336,  336,  384,  384,  480,  480,  576,  576,  672,  672,  768,  768,
+       960,  960, 1152, 1152, 1344, 1344, 1536, 1536, 1728, 1728, 1920, 1920 },
+};
+
+static const unsigned int eac3_blocks[4] = { 1, 2, 3, 6 };
+
+uint32_t iec61937_pcm_rate(audio_format_t format, uint32_t rate)
+{
+    if (rate != 32000 && rate != 44100 && rate != 48000)
+        return 0;
+
+    switch (format) {
+    case AUDIO_FORMAT_AC3:
+    case AUDIO_FORMAT_DTS:
+        return rate;
+    case AUDIO_FORMAT_E_AC3:
+        return rate * EAC3_RATE_MULTIPLIER;
+    default:
+        return 0;
+    }
+}
+
+int iec61937_init(struct iec61937 *iec, audio_format_t format, uint32_t rate)
+{
+    size_t max_frame;
+
+    memset(iec, 0, sizeof(*iec));
+    if (iec61937_pcm_rate(format, rate) == 0)
+        return -EINVAL;
+    iec->format = format;
+    iec->rate = rate;
+
+    if (format == AUDIO_FORMAT_AC3)
+        max_frame = AC3_MAX_FRAME_BYTES;
+    else if (format == AUDIO_FORMAT_E_AC3)
+        max_frame = EAC3_MAX_FRAME_BYTES;
+    else
+        max_frame = DTS_MAX_FRAME_BYTES;
+    iec->frame = (uint8_t *)malloc(max_frame);
+    if (format == AUDIO_FORMAT_E_AC3)
+        iec->payload = (uint8_t *)malloc(PAYLOAD_BYTES(IEC61937_MAX_BURST_FRAMES));
+    if (iec->frame == NULL || (format == AUDIO_FORMAT_E_AC3 && iec->payload == NULL)) {
+        iec61937_release(iec);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void iec61937_release(struct iec61937 *iec)
+{
+    free(iec->frame);
+    iec->frame = NULL;
+    free(iec->payload);
+    iec->payload = NULL;
+}
+
+void iec61937_reset(struct iec61937 *iec)
+{
+    iec->frame_fill = 0;
+    iec->frame_size = 0;
+    iec->payload_fill = 0;
+    iec->payload_blocks = 0;
+    iec->payload_samples = 0;
+}
+
+/* frame size from a complete header, 0 if it is not a valid one */
+static size_t parse_frame_size(const struct iec61937 *iec)
+{
+    const uint8_t *h = iec->frame;
+    size_t size;
+
+    if (iec->format == AUDIO_FORMAT_DTS) {
+        unsigned int blocks = (((h[4] & 0x01) << 6) | (h[5] >> 2)) + 1;
+
+        size = (((h[5] & 0x03) << 12) | (h[6] << 4) | (h[7] >> 4)) + 1;
+        if ((blocks != 16 && blocks != 32 && blocks != 64) || size < DTS_MIN_FRAME_BYTES)
+            return 0;
+        return size;
+    }
+
+    if ((h[5] >> 3) <= 10) {
+        /* AC-3, also allowed in an E-AC-3 stream */
+        unsigned int fscod = h[4] >> 6, frmsizecod = h[4] & 0x3f;
+
+        if (fscod == 3 || frmsizecod >= 38)
+            return 0;
+        return ac3_frame_words[fscod][frmsizecod] * 2;
+    }
+
+    if (iec->format != AUDIO_FORMAT_E_AC3 || (h[5] >> 3) > 16 || (h[2] >> 6) == 3)
+        return 0;
+    size = ((((h[2] & 0x07) << 8) | h[3]) + 1) * 2;
+    return size >= AC3_HEADER_BYTES && size <= EAC3_MAX_FRAME_BYTES ? size : 0;
+}
+
+/* Drops bytes from the start of the frame buffer until it holds the
+ * start of a frame; sets frame_size once its header is complete. */
+static void find_frame(struct iec61937 *iec)
+{
+    bool dts = iec->format == AUDIO_FORMAT_DTS;
+    const uint8_t *sync = dts ? dts_sync : ac3_sync;
+    size_t sync_len = dts ? sizeof(dts_sync) : sizeof(ac3_sync);
+    size_t header = dts ? DTS_HEADER_BYTES : AC3_HEADER_BYTES;
+
+    while (iec->frame_fill > 0) {
+        size_t i, n = iec->frame_fill < sync_len ? iec->frame_fill : sync_len;
+
+        for (i = 0; i < n && iec->frame[i] == sync[i]; i++)
+            ;
+        if (i == n) {
+            if (iec->frame_fill < header)
+                return;
+            iec->frame_size = parse_frame_size(iec);
+            if (iec->frame_size != 0)
+                return;
+        }
+        memmove(iec->frame, iec->frame + 1, --iec->frame_fill);
+        iec->skipped++;
+    }
+}
+
+/* Writes a burst of period stereo frames; without a preamble if
+ * preamble is false. */
+static size_t write_burst(int16_t *burst, size_t period, bool preamble, uint16_t pc,
+                          uint16_t pd, const uint8_t *payload, size_t len)
+{
+    int16_t *p = burst;
+    size_t i, words = (len + 1) / 2;
+
+    if (preamble) {
+        *p++ = (int16_t)IEC61937_PA;
+        *p++ = (int16_t)IEC61937_PB;
+        *p++ = (int16_t)pc;
+        *p++ = (int16_t)pd;
+    }
+    /* the payload is sent as big endian 16 bit words */
+    for (i = 0; i < len / 2; i++)
+        p[i] = (int16_t)((payload[2 * i] << 8) | payload[2 * i + 1]);
+    if (len & 1)
+        p[i] = (int16_t)(payload[len - 1] << 8);
+    p += words;
+    memset(p, 0, (burst + period * 2 - p) * sizeof(int16_t));
+
+    return period;
+}
+
+/* Handles the complete frame in iec->frame; returns the stereo frames of
+ * the burst written to burst, 0 if there is none yet. */
+static size_t pack_frame(struct iec61937 *iec, int16_t *burst, uint32_t *samples)
+{
+    const uint8_t *h = iec->frame;
+    size_t size = iec->frame_size;
+    size_t frames = 0;
+
+    if (iec->format == AUDIO_FORMAT_AC3) {
+        *samples = AC3_SAMPLES;
+        return write_burst(burst, AC3_SAMPLES, true, IEC61937_TYPE_AC3 | ((h[5] & 0x07) << 8),
+                           size * 8, h, size);
+    }
+
+    if (iec->format == AUDIO_FORMAT_DTS) {
+        size_t period = ((((h[4] & 0x01) << 6) | (h[5] >> 2)) + 1) * DTS_BLOCK_SAMPLES;
+        uint16_t type = period == 512 ? IEC61937_TYPE_DTS1 :
+                        period == 1024 ? IEC61937_TYPE_DTS2 : IEC61937_TYPE_DTS3;
+
+        if (size > period * 4) {
+            /* more than the link carries at this rate */
+            iec->skipped += size;
+            return 0;
+        }
+        *samples = period;
+        /* a frame that fills the period goes without a preamble */
+        return write_burst(burst, period, size <= PAYLOAD_BYTES(period), type, size * 8,
+                           h, size);
+    }
+
+    /* E-AC-3: a burst is closed by the next independent frame of
+     * substream 0 once it holds 6 blocks */
+    {
+        bool ac3 = (h[5] >> 3) <= 10;
+        bool first = ac3 || ((h[2] >> 6) != 1 && ((h[2] >> 3) & 0x07) == 0);
+        unsigned int blocks = AC3_BLOCKS;
+
+        if (!ac3 && (h[4] >> 6) != 3)
+            blocks = eac3_blocks[(h[4] >> 4) & 0x03];
+
+        if (first && iec->payload_blocks >= AC3_BLOCKS) {
+            frames = write_burst(burst, IEC61937_MAX_BURST_FRAMES, true, IEC61937_TYPE_EAC3,
+                                 iec->payload_fill, iec->payload, iec->payload_fill);
+            *samples = iec->payload_samples;
+            iec->payload_fill = 0;
+            iec->payload_blocks = 0;
+            iec->payload_samples = 0;
+        }
+        if (iec->payload_fill + size > PAYLOAD_BYTES(IEC61937_MAX_BURST_FRAMES)) {
+            iec->skipped += size;
+            return frames;
+        }
+        memcpy(iec->payload + iec->payload_fill, h, size);
+        iec->payload_fill += size;
+        if (first) {
+            iec->payload_blocks += blocks;
+            iec->payload_samples += blocks * AC3_BLOCK_SAMPLES;
+        }
+    }
+    return frames;
+}
+
+size_t iec61937_pack(struct iec61937 *iec, const void *data, size_t bytes,
+                     int16_t *burst, size_t *burst_frames, uint32_t *samples)
+{
+    const uint8_t *src = (const uint8_t *)data;
+    size_t used = 0;
+
+    *burst_frames = 0;
+    *samples = 0;
+    while (used < bytes) {
+        size_t n;
+
+        if (iec->frame_size == 0) {
+            /* the header is taken a byte at a time, to resync on any */
+            iec->frame[iec->frame_fill++] = src[used++];
+            find_frame(iec);
+            continue;
+        }
+
+        n = iec->frame_size - iec->frame_fill;
+        if (n > bytes - used)
+            n = bytes - used;
+        memcpy(iec->frame + iec->frame_fill, src + used, n);
+        iec->frame_fill += n;
+        used += n;
+        if (iec->frame_fill < iec->frame_size)
+            break;
+
+        *burst_frames = pack_frame(iec, burst, samples);
+        iec->frame_fill = 0;
+        iec->frame_size = 0;
+        if (*burst_frames > 0) {
+            iec->bursts++;
+            break;
+        }
+    }
+    return used;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef IEC61937_H
+#define IEC61937_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <system/audio.h>
+
+/*
+ * IEC 61937 packing of compressed audio (AC-3, E-AC-3, DTS) for
+ * passthrough over S/PDIF and HDMI.
+ *
+ * The compressed stream comes in as bytes, cut anywhere; codec frames are
+ * found by their sync word and put, each in its own data burst, in a
+ * stream of 16 bit stereo frames that the receiver takes for PCM until it
+ * sees the burst preamble.  A burst starts with the preamble words Pa, Pb
+ * (sync), Pc (data type) and Pd (payload length), carries the codec frame
+ * as big endian 16 bit words and is padded with zeros to the repetition
+ * period of the data type:
+ *
+ *   AC-3     one frame, 1536 stereo frames at the stream rate
+ *   E-AC-3   frames up to 6 audio blocks (1536 samples), 6144 stereo
+ *            frames at 4 times the stream rate
+ *   DTS      one frame of 512, 1024 or 2048 samples (types I, II, III),
+ *            as many stereo frames at the stream rate
+ *
+ * Only big endian streams are taken (16 bit words for DTS).  Bytes that
+ * do not make a valid frame are skipped until the next sync word.
+ */
+
+/* largest burst, in stereo frames (E-AC-3) */
+#define IEC61937_MAX_BURST_FRAMES 6144
+
+struct iec61937 {
+    audio_format_t format;
+    uint32_t rate;
+    uint8_t *frame;             /* codec frame being assembled */
+    size_t frame_fill;
+    size_t frame_size;          /* 0 until the header is complete */
+    uint8_t *payload;           /* E-AC-3 frames of the next burst */
+    size_t payload_fill;
+    unsigned int payload_blocks;
+    uint32_t payload_samples;
+    uint32_t bursts;            /* bursts packed */
+    uint32_t skipped;           /* bytes dropped looking for a frame */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Rate of the pcm carrying format at rate, 0 if format or rate cannot be
+ * passed through. */
+uint32_t iec61937_pcm_rate(audio_format_t format, uint32_t rate);
+
+/* returns -EINVAL if the format or rate is not supported, -ENOMEM */
+int iec61937_init(struct iec61937 *iec, audio_format_t format, uint32_t rate);
+void iec61937_release(struct iec61937 *iec);
+/* drops the frame being assembled and, for E-AC-3, the pending burst */
+void iec61937_reset(struct iec61937 *iec);
+
+/*
+ * Takes up to bytes of the compressed stream.  Stops as soon as a burst
+ * is complete: the burst is written to burst, which must hold
+ * IEC61937_MAX_BURST_FRAMES stereo frames, *burst_frames is its length in
+ * stereo frames and *samples the audio samples it carries.  Otherwise
+ * every byte is taken and *burst_frames is 0.  Returns the bytes taken.
+ *
+ * An E-AC-3 burst is only complete once the first frame of the next one
+ * has been seen, so that dependent substreams stay with their
+ * independent frame.
+ */
+size_t iec61937_pack(struct iec61937 *iec, const void *data, size_t bytes,
+                     int16_t *burst, size_t *burst_frames, uint32_t *samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IEC61937_H */
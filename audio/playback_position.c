@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "playback_position.h"
+
+void playback_position_init(struct playback_position *pos, uint32_t stream_rate)
+{
+    memset(pos, 0, sizeof(*pos));
+    pos->stream_rate = stream_rate;
+    pos->pcm_rate = stream_rate;
+}
+
+void playback_position_start(struct playback_position *pos, uint32_t pcm_rate)
+{
+    pos->start = pos->written;
+    pos->pcm_rate = pcm_rate;
+}
+
+void playback_position_add(struct playback_position *pos, size_t frames)
+{
+    pos->written += frames;
+}
+
+uint64_t playback_position_get(struct playback_position *pos, uint32_t queued_frames,
+                               int64_t delay_ns)
+{
+    /* rounded to the nearest frame, so the error does not build up over
+     * standby cycles */
+    uint64_t pending = ((uint64_t)queued_frames * pos->stream_rate + pos->pcm_rate / 2) /
+                            pos->pcm_rate;
+
+    if (delay_ns > 0)
+        pending += ((uint64_t)delay_ns * pos->stream_rate + 500000000) / 1000000000;
+
+    /* the queue and the delay are sampled a little apart from each other
+     * and from the write count; never step back */
+    if (pending < pos->written && pos->written - pending > pos->presented)
+        pos->presented = pos->written - pending;
+    return pos->presented;
+}
+
+uint32_t playback_position_render(struct playback_position *pos, uint32_t queued_frames,
+                                  int64_t delay_ns)
+{
+    uint64_t presented = playback_position_get(pos, queued_frames, delay_ns);
+
+    return presented > pos->start ? (uint32_t)(presented - pos->start) : 0;
+}
+
+void playback_position_standby(struct playback_position *pos, uint32_t queued_frames,
+                               int64_t delay_ns)
+{
+    pos->written = playback_position_get(pos, queued_frames, delay_ns);
+}
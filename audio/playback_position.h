@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PLAYBACK_POSITION_H
+#define PLAYBACK_POSITION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Frames of an output stream that have reached the DAC, in stream frames.
+ *
+ * The stream counts the frames out_write() accepts; what is presented is
+ * that count less what is still queued after the HAL (kernel buffer and
+ * sink ring, in pcm frames) and less the resampler delay.  Frames queued
+ * when the output goes to standby are dropped from the count, so the
+ * position never includes audio that was never played, and a reported
+ * position never goes backwards.
+ */
+
+struct playback_position {
+    uint64_t written;           /* stream frames written, less those dropped */
+    uint64_t start;             /* written when the output last left standby */
+    uint64_t presented;         /* last position reported */
+    uint32_t stream_rate;
+    uint32_t pcm_rate;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void playback_position_init(struct playback_position *pos, uint32_t stream_rate);
+/* the output left standby, its pcm runs at pcm_rate */
+void playback_position_start(struct playback_position *pos, uint32_t pcm_rate);
+/* frames stream frames were accepted by out_write() */
+void playback_position_add(struct playback_position *pos, size_t frames);
+/* Presented frames since the stream was opened, given the pcm frames
+ * queued after the HAL and the resampler delay. */
+uint64_t playback_position_get(struct playback_position *pos, uint32_t queued_frames,
+                               int64_t delay_ns);
+/* Presented frames since the output last left standby. */
+uint32_t playback_position_render(struct playback_position *pos, uint32_t queued_frames,
+                                  int64_t delay_ns);
+/* the output goes to standby and drops queued_frames and the resampler
+ * contents */
+void playback_position_standby(struct playback_position *pos, uint32_t queued_frames,
+                               int64_t delay_ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PLAYBACK_POSITION_H */
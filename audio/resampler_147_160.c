@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "resampler_147_160"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "resampler_147_160.h"
+
+/*
+ * 48000 / 44100 = 160 / 147: upsample by L = 160, low pass, keep every
+ * M = 147th sample.  Only the taps that meet a non-zero input sample are
+ * evaluated, i.e. each output sample is a TAPS long dot product of the
+ * last input frames with one of the L phases of the prototype filter.
+ *
+ * The prototype is a Kaiser windowed sinc with its -6 dB point at 23 kHz:
+ * flat to 20 kHz, and at least 90 dB down above 26 kHz.  Images between
+ * 22.05 and 26 kHz are only partly removed but end up above 20 kHz after
+ * the rate change, so they are not audible.
+ */
+#define L 160
+#define M 147
+#define TAPS 48                 /* per phase, multiple of 8 */
+#define CUTOFF_HZ 23000.0
+#define KAISER_BETA 9.0
+
+/*
+ * The arithmetic is single precision float: with 16 bit coefficients the
+ * per phase quantization error alone limits THD+N to about -76 dB.  Input
+ * frames are converted once, when they are queued.
+ */
+struct resampler_147_160 {
+    struct resampler_itfe itfe;
+    uint32_t phase;             /* filter phase of the next output, 0..L-1 */
+    size_t frames;              /* frames in buf, the first TAPS - 1 are history */
+    float buf[(TAPS - 1 + RESAMPLER_147_160_MAX_INPUT) * 2] __attribute__((aligned(16)));
+};
+
+#if !defined(__ARM_NEON__) && defined(__SSE2__)
+/* coefs[p][k] multiplies the input frame TAPS - 1 - k frames before the
+ * newest one, so the dot product walks input and coefficients forward.
+ * For SSE each tap is doubled to match interleaved stereo: c0 c0 c1 c1 ... */
+#define COEF_STRIDE 2
+#else
+#define COEF_STRIDE 1
+#endif
+static float coefs[L][TAPS * COEF_STRIDE] __attribute__((aligned(16)));
+static pthread_once_t coefs_once = PTHREAD_ONCE_INIT;
+
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    int k;
+
+    for (k = 1; k < 50; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+static void init_coefs(void)
+{
+    const int len = L * TAPS;
+    const double center = (len - 1) / 2.0;
+    const double fc = CUTOFF_HZ / ((double)RESAMPLER_147_160_IN_RATE * L);
+    const double i0_beta = bessel_i0(KAISER_BETA);
+    int p, k;
+
+    for (p = 0; p < L; p++) {
+        double h[TAPS];
+        double sum = 0;
+
+        for (k = 0; k < TAPS; k++) {
+            double n = p + (double)L * k - center;
+            double r = n / center;
+            double w = bessel_i0(KAISER_BETA * sqrt(fmax(0.0, 1.0 - r * r))) / i0_beta;
+            double s = (n == 0) ? 2 * fc : sin(2 * M_PI * fc * n) / (M_PI * n);
+            h[k] = s * w;
+            sum += h[k];
+        }
+        /* unity DC gain in every phase */
+        for (k = 0; k < TAPS; k++) {
+            int i;
+            for (i = 0; i < COEF_STRIDE; i++)
+                coefs[p][(TAPS - 1 - k) * COEF_STRIDE + i] = (float)(h[k] / sum);
+        }
+    }
+}
+
+static inline int16_t clamp16(float v)
+{
+    if (v >= 32767.0f)
+        return 32767;
+    if (v <= -32768.0f)
+        return -32768;
+    return (int16_t)lrintf(v);
+}
+
+/* one stereo output frame from TAPS input frames at x */
+static inline void fir_frame(const float *x, int phase, int16_t *out)
+{
+    const float *c = coefs[phase];
+#if defined(__ARM_NEON__)
+    float32x4_t acc_l = vdupq_n_f32(0), acc_r = vdupq_n_f32(0);
+    float32x2_t sum;
+    int k;
+
+    for (k = 0; k < TAPS; k += 4) {
+        float32x4x2_t in = vld2q_f32(x + k * 2);
+        float32x4_t coef = vld1q_f32(c + k);
+        acc_l = vmlaq_f32(acc_l, in.val[0], coef);
+        acc_r = vmlaq_f32(acc_r, in.val[1], coef);
+    }
+    sum = vpadd_f32(vpadd_f32(vget_low_f32(acc_l), vget_high_f32(acc_l)),
+                    vpadd_f32(vget_low_f32(acc_r), vget_high_f32(acc_r)));
+    out[0] = clamp16(vget_lane_f32(sum, 0));
+    out[1] = clamp16(vget_lane_f32(sum, 1));
+#elif defined(__SSE2__)
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    float lanes[4] __attribute__((aligned(16)));
+    int k;
+
+    /* L0 R0 L1 R1 * c0 c0 c1 c1, two independent sums to hide latency */
+    for (k = 0; k < TAPS * 2; k += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + k), _mm_load_ps(c + k)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + k + 4), _mm_load_ps(c + k + 4)));
+    }
+    _mm_store_ps(lanes, _mm_add_ps(acc0, acc1));
+    out[0] = clamp16(lanes[0] + lanes[2]);
+    out[1] = clamp16(lanes[1] + lanes[3]);
+#else
+    float acc_l = 0, acc_r = 0;
+    int k;
+
+    for (k = 0; k < TAPS; k++) {
+        acc_l += x[k * 2] * c[k];
+        acc_r += x[k * 2 + 1] * c[k];
+    }
+    out[0] = clamp16(acc_l);
+    out[1] = clamp16(acc_r);
+#endif
+}
+
+static void resampler_147_160_reset(struct resampler_itfe *resampler)
+{
+    struct resampler_147_160 *rsmp = (struct resampler_147_160 *)resampler;
+
+    memset(rsmp->buf, 0, (TAPS - 1) * 2 * sizeof(float));
+    rsmp->frames = TAPS - 1;
+    rsmp->phase = 0;
+}
+
+static int resampler_147_160_from_provider(struct resampler_itfe *resampler,
+                                           int16_t *out, size_t *outFrameCount)
+{
+    return -ENOSYS;
+}
+
+static int resampler_147_160_from_input(struct resampler_itfe *resampler,
+                                        int16_t *in, size_t *inFrameCount,
+                                        int16_t *out, size_t *outFrameCount)
+{
+    struct resampler_147_160 *rsmp = (struct resampler_147_160 *)resampler;
+    size_t in_frames = *inFrameCount;
+    size_t out_frames = 0;
+    size_t next = TAPS - 1;     /* newest input frame of the next output */
+    uint32_t phase = rsmp->phase;
+    size_t i;
+
+    if (in == NULL || out == NULL)
+        return -EINVAL;
+
+    if (in_frames > TAPS - 1 + RESAMPLER_147_160_MAX_INPUT - rsmp->frames)
+        in_frames = TAPS - 1 + RESAMPLER_147_160_MAX_INPUT - rsmp->frames;
+    for (i = 0; i < in_frames * 2; i++)
+        rsmp->buf[rsmp->frames * 2 + i] = in[i];
+    rsmp->frames += in_frames;
+
+    while (next < rsmp->frames && out_frames < *outFrameCount) {
+        fir_frame(rsmp->buf + (next - (TAPS - 1)) * 2, phase, out + out_frames * 2);
+        out_frames++;
+        phase += M;
+        next += phase / L;
+        phase %= L;
+    }
+
+    /* keep the history of the next output and anything not consumed */
+    next -= TAPS - 1;
+    memmove(rsmp->buf, rsmp->buf + next * 2, (rsmp->frames - next) * 2 * sizeof(float));
+    rsmp->frames -= next;
+    rsmp->phase = phase;
+
+    *inFrameCount = in_frames;
+    *outFrameCount = out_frames;
+    return 0;
+}
+
+static int32_t resampler_147_160_delay_ns(struct resampler_itfe *resampler)
+{
+    struct resampler_147_160 *rsmp = (struct resampler_147_160 *)resampler;
+
+    /* half the filter plus the frames waiting in buf */
+    return (int32_t)(((int64_t)(TAPS / 2 + rsmp->frames - (TAPS - 1)) * 1000000000LL) /
+                        RESAMPLER_147_160_IN_RATE);
+}
+
+int create_resampler_147_160(struct resampler_itfe **resampler)
+{
+    struct resampler_147_160 *rsmp;
+
+    if (resampler == NULL)
+        return -EINVAL;
+    *resampler = NULL;
+
+    pthread_once(&coefs_once, init_coefs);
+
+    rsmp = (struct resampler_147_160 *)calloc(1, sizeof(struct resampler_147_160));
+    if (rsmp == NULL)
+        return -ENOMEM;
+
+    rsmp->itfe.reset = resampler_147_160_reset;
+    rsmp->itfe.resample_from_provider = resampler_147_160_from_provider;
+    rsmp->itfe.resample_from_input = resampler_147_160_from_input;
+    rsmp->itfe.delay_ns = resampler_147_160_delay_ns;
+    resampler_147_160_reset(&rsmp->itfe);
+
+    *resampler = &rsmp->itfe;
+    ALOGV("%s: %p", __func__, rsmp);
+    return 0;
+}
+
+void release_resampler_147_160(struct resampler_itfe *resampler)
+{
+    free(resampler);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RESAMPLER_147_160_H
+#define RESAMPLER_147_160_H
+
+#include <audio_utils/resampler.h>
+
+/*
+ * Fixed ratio 44.1 kHz -> 48 kHz polyphase resampler for 16 bit stereo,
+ * a cheaper alternative to create_resampler() for the one conversion the
+ * music output does all the time.  It implements resampler_itfe so a
+ * stream can use either; only resample_from_input() is supported.
+ *
+ * Input frames that do not produce output within *outFrameCount are kept
+ * and used by the next call, up to RESAMPLER_147_160_MAX_INPUT frames.
+ */
+
+#define RESAMPLER_147_160_IN_RATE 44100
+#define RESAMPLER_147_160_OUT_RATE 48000
+#define RESAMPLER_147_160_MAX_INPUT 4096
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int create_resampler_147_160(struct resampler_itfe **resampler);
+void release_resampler_147_160(struct resampler_itfe *resampler);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RESAMPLER_147_160_H */
@@ -28,6 +28,7 @@ import time
 import subprocess
 import sys
 import time
+import json
 
 g_default_timeout = 300
 
@@ -215,6 +216,141 @@ class TestCase:
         if self._logfile is not None:
             self._logfile.flush()
 
+class BenchmarkCase(TestCase):
+    """Test running wrapper for a benchmark.
+
+    The program prints one line per measured workload,
+
+        RESULT {"workload": "playback", "cpu_ms_per_s": 2.61, ...}
+
+    with a JSON object of the workload name and its metrics.  The case
+    passes if the program does, and no metric is worse than its baseline
+    by more than the tolerance.  All metrics are lower-is-better.
+    """
+
+    def __init__(self, TestDict = {}, Logfile = None):
+        """Set up the benchmark runner object.
+
+        TestDict: as for TestCase, and:
+
+                  filename - may be a name found in the PATH (e.g. adb)
+
+                  baseline - results to compare with, workload name to
+                      a dict of metric values.  Workloads or metrics that
+                      are not in it are recorded but not checked
+                      Type: dict, or None
+                      Required: no
+                      Default: None
+
+                  tolerances - allowed regression of each metric, as
+                      metric name to a tuple (relative, absolute): a value
+                      passes if it is at most
+                      baseline * (1 + relative) + absolute.  Metrics that
+                      are not in it are not checked
+                      Type: dict
+                      Required: no
+                      Default: {}
+        """
+        TestCase.__init__(self, TestDict, Logfile)
+        self._baseline = TestDict.get('baseline')
+        self._tolerances = TestDict.get('tolerances', {})
+        self._output = ""
+        self._results = None
+        self._regressions = None
+
+    def start(self):
+        """Starts the benchmark with its arguments, see TestCase.start()"""
+
+        command = self._program
+        if os.path.sep in command or not self._in_path(command):
+            command = os.path.abspath(command)
+            if not os.path.exists(command):
+                print "ERROR: The program to execute does not exist (%s)" % (command,)
+                return False
+
+        timestamp = time.strftime("%Y.%m.%d %H:%M:%S")
+        self._time_expire = self._timeout + time.time()
+        self._kill_timeout = False
+
+        self._log_write("====================================================================\n")
+        self._log_write("BEGINNG BENCHMARK '%s' at %s\n" % (self._program, timestamp))
+        self._log_write("--------------------------------------------------------------------\n")
+        self._log_flush()
+
+        self._proc = subprocess.Popen(args=[command] + (self._args or []),
+                                      stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+
+        return (self._proc is not None)
+
+    def results(self):
+        """Returns the results of the finished benchmark, as workload name to
+        a dict of its metrics.
+        """
+        if self._results is None:
+            self._results = {}
+            for line in self._output.splitlines():
+                if not line.startswith("RESULT "):
+                    continue
+                try:
+                    r = json.loads(line[len("RESULT "):])
+                except ValueError:
+                    print "WARNING: cannot parse '%s'" % (line.strip(),)
+                    continue
+                self._results[r['workload']] = r
+        return self._results
+
+    def regressions(self):
+        """Returns a list of strings, one per metric worse than its baseline
+        beyond its tolerance.
+        """
+        if self._regressions is not None:
+            return self._regressions
+        self._regressions = []
+        if self._baseline is None:
+            return self._regressions
+        results = self.results()
+        for workload in sorted(self._baseline.keys()):
+            if workload not in results:
+                self._regressions.append("%s: no result" % (workload,))
+                continue
+            for metric in sorted(self._tolerances.keys()):
+                if metric not in self._baseline[workload] or metric not in results[workload]:
+                    continue
+                base = self._baseline[workload][metric]
+                value = results[workload][metric]
+                rel, abs_ = self._tolerances[metric]
+                limit = base * (1 + rel) + abs_
+                if value > limit:
+                    self._regressions.append("%s: %s %g, baseline %g, limit %g" %
+                                             (workload, metric, value, base, limit))
+        return self._regressions
+
+    def verdict(self):
+        """As TestCase.verdict(), and 'FAIL/REGRESSION' if the benchmark ran
+        but a metric regressed.
+        """
+        v = TestCase.verdict(self)
+        if v != "PASS":
+            return v
+        if len(self.results()) == 0:
+            return "FAIL/NO RESULTS"
+        if len(self.regressions()) > 0:
+            return "FAIL/REGRESSION"
+        return "PASS"
+
+    def _process_logs(self):
+        data = self._proc.stdout.read()
+        self._output += data
+        if self._logfile is not None:
+            self._logfile.write(data)
+            self._logfile.flush()
+
+    def _in_path(self, name):
+        for d in os.environ.get('PATH', '').split(os.pathsep):
+            if os.path.exists(os.path.join(d, name)):
+                return True
+        return False
+
 def setup_logfile(override_logfile_name = None):
     """Open a logfile and prepare it for use with TestFlinger logging.
     The filename will be generated based on the current date/time.
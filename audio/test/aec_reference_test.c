@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Alignment of the echo reference (aec_reference.c) against a simulated
+ * output and input on a simulated clock.  The output renders a multi tone
+ * signal with its own clock error, the writer queueing it ahead of the
+ * DAC; the input captures with another clock error and the reader asks
+ * for the reference of each captured block, both passing time stamps
+ * with random jitter.  The reference handed to the reader must match the
+ * signal rendered at the capture time of each frame, measured as a
+ * signal to error ratio once the clock models have settled, and the
+ * estimated drift must match the simulated one.  One case moves the
+ * output timeline by an underrun and checks the reference catches up.
+ *
+ *   aec_reference_test [-s seed]
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aec_reference.h"
+
+#define WRITE_FRAMES_MS 20
+#define READ_FRAMES_MS 10
+#define OUT_LATENCY_NS 60000000LL   /* written this far ahead of the DAC */
+#define IN_LATENCY_NS 20000000LL    /* read this long after capture */
+#define JITTER_NS 50000             /* time stamps off by up to this much */
+#define RUN_SECONDS 10
+#define SETTLE_SECONDS 3            /* not measured after start or a step */
+#define STEP_NS 30000000LL          /* output gap of the underrun case */
+#define MIN_SER_DB 15.0             /* about a quarter of a 16 kHz frame off */
+#define MAX_DRIFT_ERROR_PPM 10
+
+struct test_case {
+    const char *name;
+    uint32_t wr_rate;
+    uint32_t wr_channels;
+    uint32_t rd_rate;
+    uint32_t rd_channels;
+    double wr_ppm;              /* clock error of the output */
+    double rd_ppm;              /* clock error of the input */
+    bool step;                  /* the output underruns half way */
+};
+
+static const struct test_case cases[] = {
+    { "48k stereo to 16k mono",       48000, 2, 16000, 1,    0,    0, false },
+    { "48k to 16k, drifting",         48000, 2, 16000, 1,  150, -100, false },
+    { "44.1k to 16k, drifting",       44100, 2, 16000, 1,  300,    0, false },
+    { "48k stereo to 48k stereo",     48000, 2, 48000, 2, -200,   50, false },
+    { "48k to 16k, output underrun",  48000, 2, 16000, 1,  100,  -50, true },
+};
+
+static const double tones[] = { 200, 700, 1900, 3100 };
+
+/* the played signal at content time tau, in seconds of output frames */
+static double signal_at(double tau)
+{
+    double v = 0;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(tones) / sizeof(tones[0]); i++)
+        v += 6000.0 * sin(2 * M_PI * tones[i] * tau + i);
+    return v;
+}
+
+static double jitter(void)
+{
+    return ((double)rand() / RAND_MAX * 2.0 - 1.0) * JITTER_NS;
+}
+
+static struct timespec to_timespec(double ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(ns / 1e9);
+    ts.tv_nsec = (long)(ns - ts.tv_sec * 1e9);
+    return ts;
+}
+
+/* Output frame n is rendered at render_ns(n): the DAC starts at 1 s and
+ * runs wr_ppm fast; with step, frames from the middle on come STEP_NS
+ * late.  Capture frame k is captured at 1 s plus k frames of an input
+ * running rd_ppm fast. */
+static double render_ns(const struct test_case *tc, int64_t n)
+{
+    double ns = 1e9 + n * 1e9 / (tc->wr_rate * (1 + tc->wr_ppm / 1e6));
+
+    if (tc->step && n >= (int64_t)tc->wr_rate * RUN_SECONDS / 2)
+        ns += STEP_NS;
+    return ns;
+}
+
+static double capture_ns(const struct test_case *tc, int64_t k)
+{
+    return 1e9 + k * 1e9 / (tc->rd_rate * (1 + tc->rd_ppm / 1e6));
+}
+
+/* what was rendered at time ns, 0 before the start and in the gap */
+static double rendered_at(const struct test_case *tc, double ns)
+{
+    double rate = tc->wr_rate * (1 + tc->wr_ppm / 1e6);
+    int64_t step_frame = (int64_t)tc->wr_rate * RUN_SECONDS / 2;
+    double n = (ns - 1e9) * rate / 1e9;
+
+    if (n < 0)
+        return 0;
+    if (tc->step && n >= step_frame) {
+        n = (ns - 1e9 - STEP_NS) * rate / 1e9;
+        if (n < step_frame)
+            return 0;
+    }
+    return signal_at(n / tc->wr_rate);
+}
+
+static int run_case(const struct test_case *tc)
+{
+    struct echo_reference_itfe *ref;
+    size_t wr_frames = tc->wr_rate * WRITE_FRAMES_MS / 1000;
+    size_t rd_frames = tc->rd_rate * READ_FRAMES_MS / 1000;
+    int16_t *wr_buf = malloc(wr_frames * tc->wr_channels * sizeof(int16_t));
+    int16_t *rd_buf = malloc(rd_frames * tc->rd_channels * sizeof(int16_t));
+    int64_t wr_pos = 0, rd_pos = 0;
+    double end_ns = 1e9 + RUN_SECONDS * 1e9;
+    double settle_ns = 1e9 + SETTLE_SECONDS * 1e9;
+    double step_ns = 1e9 + RUN_SECONDS * 1e9 / 2;
+    double sig = 0, err = 0, ser_db;
+    int32_t drift_ppm, want_ppm;
+    int ret = 1;
+
+    if (wr_buf == NULL || rd_buf == NULL ||
+            create_aec_reference(tc->rd_channels, tc->rd_rate, tc->wr_channels,
+                                 tc->wr_rate, &ref) != 0) {
+        printf("%-30s cannot create the reference\n", tc->name);
+        goto exit;
+    }
+
+    while (capture_ns(tc, rd_pos + rd_frames) < end_ns) {
+        /* the write of the next output block is due OUT_LATENCY_NS before
+         * its DAC time, the read of the next input block IN_LATENCY_NS
+         * after its capture time; whichever comes first */
+        double wr_due = render_ns(tc, wr_pos) - OUT_LATENCY_NS;
+        double rd_due = capture_ns(tc, rd_pos + rd_frames) + IN_LATENCY_NS;
+
+        if (wr_due <= rd_due) {
+            struct echo_reference_buffer b;
+            size_t i;
+            uint32_t c;
+
+            for (i = 0; i < wr_frames; i++) {
+                int16_t v = (int16_t)lrint(signal_at((double)(wr_pos + i) / tc->wr_rate));
+                for (c = 0; c < tc->wr_channels; c++)
+                    wr_buf[i * tc->wr_channels + c] = v;
+            }
+            b.raw = wr_buf;
+            b.frame_count = wr_frames;
+            b.time_stamp = to_timespec(wr_due + jitter());
+            b.delay_ns = (int32_t)(render_ns(tc, wr_pos + wr_frames) - wr_due);
+            ref->write(ref, &b);
+            wr_pos += wr_frames;
+        } else {
+            struct echo_reference_buffer b;
+            size_t i;
+            uint32_t c;
+
+            b.raw = rd_buf;
+            b.frame_count = rd_frames;
+            b.time_stamp = to_timespec(rd_due + jitter());
+            b.delay_ns = (int32_t)(rd_due - capture_ns(tc, rd_pos));
+            ref->read(ref, &b);
+
+            for (i = 0; i < rd_frames; i++) {
+                double t = capture_ns(tc, rd_pos + i);
+                double want = rendered_at(tc, t);
+
+                if (t < settle_ns || (tc->step && t >= step_ns && t < step_ns + 1e9))
+                    continue;
+                for (c = 0; c < tc->rd_channels; c++) {
+                    double e = rd_buf[i * tc->rd_channels + c] - want;
+                    sig += want * want;
+                    err += e * e;
+                }
+            }
+            rd_pos += rd_frames;
+        }
+    }
+
+    ser_db = 10 * log10(sig / fmax(err, 1e-9));
+    drift_ppm = aec_reference_get_drift_ppm(ref);
+    want_ppm = (int32_t)lrint(((1 + tc->wr_ppm / 1e6) / (1 + tc->rd_ppm / 1e6) - 1) * 1e6);
+    release_aec_reference(ref);
+
+    printf("%-30s signal to error %.1f dB, drift %d ppm (simulated %d)\n",
+           tc->name, ser_db, drift_ppm, want_ppm);
+    if (ser_db < MIN_SER_DB || abs(drift_ppm - want_ppm) > MAX_DRIFT_ERROR_PPM) {
+        printf("FAIL: %s below %.0f dB or drift off by more than %d ppm\n",
+               tc->name, MIN_SER_DB, MAX_DRIFT_ERROR_PPM);
+        goto exit;
+    }
+    ret = 0;
+
+exit:
+    free(wr_buf);
+    free(rd_buf);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int seed = 1;
+    unsigned int i;
+    int opt, ret = 0;
+
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch (opt) {
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s seed]\n", argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    srand(seed);
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        ret |= run_case(&cases[i]);
+
+    if (ret == 0)
+        printf("PASS\n");
+    return ret;
+}
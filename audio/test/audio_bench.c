@@ -0,0 +1,636 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Scripted workloads against the primary audio HAL, for the performance
+ * regression suite (perf-regression.py).  On the device the HAL is the
+ * installed one and mediaserver must be stopped; -l loads a library
+ * instead, such as the host build audio.primary.host.so.
+ *
+ *   playback         one output writing a tone
+ *   start_stop       outputs opened, written briefly, put in standby and
+ *                    closed every START_STOP_GAP_MS, alternating the fast
+ *                    and primary profiles
+ *   route_flap       a playing output routed between HDMI and S/PDIF
+ *                    every ROUTE_PERIOD_MS
+ *   mix              a fast output joining a primary output that plays,
+ *                    both at half volume through the output mixer; the
+ *                    primary one opens the pcm, so the fast writes show
+ *                    whether the mixer keeps to the fast period
+ *   capture_effects  a 16 kHz voice capture through an echo canceller
+ *                    and a second pre processing, with an output playing
+ *                    for the echo reference; the effects only copy, so
+ *                    what is measured is the HAL
+ *
+ * Each workload runs for -s seconds and prints one line
+ *
+ *   RESULT {"workload": "playback", "cpu_ms_per_s": 2.61, ...}
+ *
+ * with the process CPU time and voluntary context switches (wakeups) per
+ * second, the p50/p90/p99/max of the timed call, the xruns the HAL counted
+ * for its streams (from their dump) and the number of failed calls.
+ *
+ *   audio_bench [-l library] [-w workload] [-s seconds]
+ *
+ * The host build, against audio.primary.host, is audio_bench_host.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/hardware.h>
+#include <hardware/audio.h>
+#include <hardware/audio_effect.h>
+#include <audio_effects/effect_aec.h>
+#include <system/audio.h>
+
+#define DEFAULT_SECONDS 10
+#define MAX_SAMPLES 100000
+#define TONE_HZ 440
+#define RENDER_US 1000              /* a mixer renders between writes */
+#define START_STOP_WRITES 3
+#define START_STOP_GAP_MS 10
+#define ROUTE_PERIOD_MS 250
+#define MIX_LEAD_MS 100             /* the primary output starts first */
+#define CAPTURE_RATE 16000
+
+struct bench {
+    audio_hw_device_t *dev;
+    int seconds;
+};
+
+/* the timed call of a workload and the counters around it */
+struct result {
+    const char *workload;
+    const char *call;
+    int64_t *ns;
+    int count;
+    int xruns;
+    int errors;
+    uint32_t frames_lost;
+};
+
+struct writer {
+    struct audio_stream_out *out;
+    volatile int stop;
+    int errors;
+};
+
+/* an effect that copies its input, typed as an echo canceller or not */
+struct bench_effect {
+    const struct effect_interface_s *itfe;
+    effect_descriptor_t desc;
+};
+
+static const effect_uuid_t bench_type_other = {
+    0x2f9c1d40, 0x1a7e, 0x11e2, 0x8c6f, { 0x00, 0x02, 0xa5, 0xd5, 0xc5, 0x1b }
+};
+
+static int64_t clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t timeval_ns(const struct timeval *tv)
+{
+    return (int64_t)tv->tv_sec * 1000000000LL + tv->tv_usec * 1000LL;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void add_sample(struct result *r, int64_t ns)
+{
+    if (r->count < MAX_SAMPLES)
+        r->ns[r->count++] = ns;
+}
+
+/* Adds the xruns of a stream dump ("  N transfers, M underruns, ...") */
+static void add_xruns(struct result *r, const struct audio_stream *stream)
+{
+    FILE *f = tmpfile();
+    char line[256];
+
+    if (f == NULL)
+        return;
+    stream->dump(stream, fileno(f));
+    rewind(f);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        int transfers, xruns;
+
+        if (sscanf(line, " %d transfers, %d", &transfers, &xruns) == 2)
+            r->xruns += xruns;
+    }
+    fclose(f);
+}
+
+static void fill_tone(int16_t *buf, size_t frames, uint32_t rate, size_t pos)
+{
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        buf[2 * i] = buf[2 * i + 1] =
+                (int16_t)(8000 * sin(2 * M_PI * TONE_HZ * (double)((pos + i) % rate) / rate));
+}
+
+static struct audio_stream_out *open_output(struct bench *b, audio_output_flags_t flags)
+{
+    struct audio_stream_out *out = NULL;
+    struct audio_config config;
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = 48000;
+    config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    if (b->dev->open_output_stream(b->dev, 0, AUDIO_DEVICE_OUT_AUX_DIGITAL, flags,
+                                   &config, &out) != 0)
+        return NULL;
+    return out;
+}
+
+static void close_output(struct bench *b, struct audio_stream_out *out, struct result *r)
+{
+    out->common.standby(&out->common);
+    add_xruns(r, &out->common);
+    b->dev->close_output_stream(b->dev, out);
+}
+
+static void *writer_thread(void *data)
+{
+    struct writer *w = (struct writer *)data;
+    struct audio_stream_out *out = w->out;
+    size_t bytes = out->common.get_buffer_size(&out->common);
+    size_t frames = bytes / (2 * sizeof(int16_t)), pos = 0;
+    int16_t *buf = malloc(bytes);
+
+    while (buf != NULL && !w->stop) {
+        fill_tone(buf, frames, out->common.get_sample_rate(&out->common), pos);
+        if (out->write(out, buf, bytes) != (ssize_t)bytes)
+            w->errors++;
+        pos += frames;
+        usleep(RENDER_US);
+    }
+    free(buf);
+    return NULL;
+}
+
+static int run_playback(struct bench *b, struct result *r)
+{
+    struct audio_stream_out *out = open_output(b, AUDIO_OUTPUT_FLAG_PRIMARY);
+    size_t bytes, frames, pos = 0;
+    int16_t *buf;
+    int64_t end;
+
+    r->call = "write";
+    if (out == NULL)
+        return -ENODEV;
+    bytes = out->common.get_buffer_size(&out->common);
+    frames = bytes / (2 * sizeof(int16_t));
+    buf = malloc(bytes);
+    if (buf == NULL) {
+        close_output(b, out, r);
+        return -ENOMEM;
+    }
+
+    end = clock_ns() + b->seconds * 1000000000LL;
+    while (clock_ns() < end) {
+        int64_t t0;
+
+        fill_tone(buf, frames, 48000, pos);
+        t0 = clock_ns();
+        if (out->write(out, buf, bytes) != (ssize_t)bytes)
+            r->errors++;
+        add_sample(r, clock_ns() - t0);
+        pos += frames;
+    }
+
+    free(buf);
+    close_output(b, out, r);
+    return 0;
+}
+
+static int run_start_stop(struct bench *b, struct result *r)
+{
+    int64_t end = clock_ns() + b->seconds * 1000000000LL;
+    int cycle = 0;
+
+    r->call = "start";
+    while (clock_ns() < end) {
+        audio_output_flags_t flags = (cycle++ & 1) ? AUDIO_OUTPUT_FLAG_PRIMARY :
+                                                      AUDIO_OUTPUT_FLAG_FAST;
+        int64_t t0 = clock_ns();
+        struct audio_stream_out *out = open_output(b, flags);
+        size_t bytes;
+        void *buf;
+        int i;
+
+        if (out == NULL) {
+            r->errors++;
+            continue;
+        }
+        bytes = out->common.get_buffer_size(&out->common);
+        buf = calloc(1, bytes);
+        for (i = 0; buf != NULL && i < START_STOP_WRITES; i++) {
+            if (out->write(out, buf, bytes) != (ssize_t)bytes)
+                r->errors++;
+            /* from open to the first buffer accepted */
+            if (i == 0)
+                add_sample(r, clock_ns() - t0);
+        }
+        free(buf);
+        close_output(b, out, r);
+        usleep(START_STOP_GAP_MS * 1000);
+    }
+    return 0;
+}
+
+static int run_route_flap(struct bench *b, struct result *r)
+{
+    static const audio_devices_t devices[] = {
+        AUDIO_DEVICE_OUT_SPEAKER, AUDIO_DEVICE_OUT_AUX_DIGITAL,
+    };
+    struct audio_stream_out *out = open_output(b, AUDIO_OUTPUT_FLAG_PRIMARY);
+    struct writer w;
+    pthread_t writer;
+    int64_t end;
+    int i;
+
+    r->call = "route";
+    if (out == NULL)
+        return -ENODEV;
+    memset(&w, 0, sizeof(w));
+    w.out = out;
+    if (pthread_create(&writer, NULL, writer_thread, &w) != 0) {
+        close_output(b, out, r);
+        return -ENOMEM;
+    }
+
+    end = clock_ns() + b->seconds * 1000000000LL;
+    for (i = 0; clock_ns() < end; i++) {
+        char kvpairs[32];
+        int64_t t0;
+
+        usleep(ROUTE_PERIOD_MS * 1000);
+        snprintf(kvpairs, sizeof(kvpairs), "%s=%d", AUDIO_PARAMETER_STREAM_ROUTING,
+                 devices[i % 2]);
+        t0 = clock_ns();
+        if (out->common.set_parameters(&out->common, kvpairs) < 0)
+            r->errors++;
+        add_sample(r, clock_ns() - t0);
+    }
+
+    w.stop = 1;
+    pthread_join(writer, NULL);
+    r->errors += w.errors;
+    close_output(b, out, r);
+    return 0;
+}
+
+static int run_mix(struct bench *b, struct result *r)
+{
+    struct audio_stream_out *out = open_output(b, AUDIO_OUTPUT_FLAG_PRIMARY);
+    struct audio_stream_out *fast = NULL;
+    struct writer w;
+    pthread_t writer;
+    size_t bytes, frames, pos = 0;
+    int16_t *buf = NULL;
+    int64_t end;
+    int ret = -ENODEV;
+
+    r->call = "write";
+    if (out == NULL)
+        return -ENODEV;
+    fast = open_output(b, AUDIO_OUTPUT_FLAG_FAST);
+    if (fast == NULL)
+        goto close_primary;
+    out->set_volume(out, 0.5f, 0.5f);
+    fast->set_volume(fast, 0.5f, 0.5f);
+
+    memset(&w, 0, sizeof(w));
+    w.out = out;
+    if (pthread_create(&writer, NULL, writer_thread, &w) != 0) {
+        ret = -ENOMEM;
+        goto close_fast;
+    }
+
+    usleep(MIX_LEAD_MS * 1000);
+    bytes = fast->common.get_buffer_size(&fast->common);
+    frames = bytes / (2 * sizeof(int16_t));
+    buf = malloc(bytes);
+    end = clock_ns() + b->seconds * 1000000000LL;
+    while (buf != NULL && clock_ns() < end) {
+        int64_t t0;
+
+        fill_tone(buf, frames, 48000, pos);
+        t0 = clock_ns();
+        if (fast->write(fast, buf, bytes) != (ssize_t)bytes)
+            r->errors++;
+        add_sample(r, clock_ns() - t0);
+        pos += frames;
+    }
+    ret = buf != NULL ? 0 : -ENOMEM;
+    free(buf);
+
+    w.stop = 1;
+    pthread_join(writer, NULL);
+    r->errors += w.errors;
+close_fast:
+    close_output(b, fast, r);
+close_primary:
+    close_output(b, out, r);
+    return ret;
+}
+
+static int32_t effect_process(effect_handle_t self, audio_buffer_t *in, audio_buffer_t *out)
+{
+    if (out != NULL && out->raw != in->raw)
+        memcpy(out->raw, in->raw, in->frameCount * sizeof(int16_t));
+    if (out != NULL)
+        out->frameCount = in->frameCount;
+    return 0;
+}
+
+static int32_t effect_process_reverse(effect_handle_t self, audio_buffer_t *in,
+                                      audio_buffer_t *out)
+{
+    return 0;
+}
+
+static int32_t effect_command(effect_handle_t self, uint32_t cmd, uint32_t size, void *data,
+                              uint32_t *reply_size, void *reply)
+{
+    if (reply != NULL && reply_size != NULL && *reply_size >= sizeof(int32_t))
+        *(int32_t *)reply = 0;
+    return 0;
+}
+
+static int32_t effect_get_descriptor(effect_handle_t self, effect_descriptor_t *desc)
+{
+    *desc = ((struct bench_effect *)self)->desc;
+    return 0;
+}
+
+static const struct effect_interface_s bench_effect_itfe = {
+    effect_process,
+    effect_command,
+    effect_get_descriptor,
+    effect_process_reverse,
+};
+
+static int run_capture_effects(struct bench *b, struct result *r)
+{
+    struct audio_stream_out *out = open_output(b, AUDIO_OUTPUT_FLAG_PRIMARY);
+    struct audio_stream_in *in = NULL;
+    struct audio_config config;
+    struct bench_effect effects[2];
+    struct writer w;
+    pthread_t writer;
+    char kvpairs[32];
+    size_t bytes;
+    void *buf = NULL;
+    int64_t end;
+    int i, ret = -ENODEV;
+
+    r->call = "read";
+    if (out == NULL)
+        return -ENODEV;
+    memset(&w, 0, sizeof(w));
+    w.out = out;
+    if (pthread_create(&writer, NULL, writer_thread, &w) != 0) {
+        close_output(b, out, r);
+        return -ENOMEM;
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = CAPTURE_RATE;
+    config.channel_mask = AUDIO_CHANNEL_IN_MONO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    if (b->dev->open_input_stream(b->dev, 0, AUDIO_DEVICE_IN_BUILTIN_MIC, &config, &in) != 0)
+        goto stop_writer;
+    snprintf(kvpairs, sizeof(kvpairs), "%s=%d", AUDIO_PARAMETER_STREAM_INPUT_SOURCE,
+             AUDIO_SOURCE_VOICE_COMMUNICATION);
+    in->common.set_parameters(&in->common, kvpairs);
+
+    memset(effects, 0, sizeof(effects));
+    for (i = 0; i < 2; i++) {
+        effects[i].itfe = &bench_effect_itfe;
+        effects[i].desc.type = i == 0 ? *FX_IID_AEC : bench_type_other;
+        snprintf(effects[i].desc.name, sizeof(effects[i].desc.name), "bench effect %d", i);
+        if (in->common.add_audio_effect(&in->common, (effect_handle_t)&effects[i]) != 0)
+            r->errors++;
+    }
+
+    bytes = in->common.get_buffer_size(&in->common);
+    buf = malloc(bytes);
+    if (buf == NULL) {
+        ret = -ENOMEM;
+        goto close_input;
+    }
+
+    end = clock_ns() + b->seconds * 1000000000LL;
+    while (clock_ns() < end) {
+        int64_t t0 = clock_ns();
+
+        if (in->read(in, buf, bytes) != (ssize_t)bytes)
+            r->errors++;
+        add_sample(r, clock_ns() - t0);
+        r->frames_lost += in->get_input_frames_lost(in);
+    }
+    ret = 0;
+
+close_input:
+    free(buf);
+    for (i = 0; i < 2; i++)
+        in->common.remove_audio_effect(&in->common, (effect_handle_t)&effects[i]);
+    in->common.standby(&in->common);
+    add_xruns(r, &in->common);
+    b->dev->close_input_stream(b->dev, in);
+stop_writer:
+    w.stop = 1;
+    pthread_join(writer, NULL);
+    r->errors += w.errors;
+    close_output(b, out, r);
+    return ret;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(struct bench *b, struct result *r);
+} workloads[] = {
+    { "playback",           run_playback },
+    { "start_stop",         run_start_stop },
+    { "route_flap",         run_route_flap },
+    { "mix",                run_mix },
+    { "capture_effects",    run_capture_effects },
+};
+
+static double percentile_ms(const struct result *r, int percent)
+{
+    int i = r->count * percent / 100;
+
+    if (r->count == 0)
+        return 0;
+    return r->ns[i < r->count ? i : r->count - 1] / 1e6;
+}
+
+static int run_workload(struct bench *b, int index, int64_t *samples)
+{
+    struct result r;
+    struct rusage ru0, ru1;
+    int64_t t0, wall_ns, cpu_ns;
+    long wakeups;
+    int ret;
+
+    memset(&r, 0, sizeof(r));
+    r.workload = workloads[index].name;
+    r.ns = samples;
+
+    getrusage(RUSAGE_SELF, &ru0);
+    t0 = clock_ns();
+    ret = workloads[index].run(b, &r);
+    wall_ns = clock_ns() - t0;
+    getrusage(RUSAGE_SELF, &ru1);
+
+    if (ret != 0) {
+        printf("FAIL: %s: cannot run (%d)\n", r.workload, ret);
+        return 1;
+    }
+    cpu_ns = timeval_ns(&ru1.ru_utime) - timeval_ns(&ru0.ru_utime) +
+             timeval_ns(&ru1.ru_stime) - timeval_ns(&ru0.ru_stime);
+    wakeups = ru1.ru_nvcsw - ru0.ru_nvcsw;
+    qsort(r.ns, r.count, sizeof(int64_t), cmp_int64);
+
+    printf("RESULT {\"workload\": \"%s\", \"seconds\": %.2f, \"cpu_ms_per_s\": %.2f, "
+           "\"wakeups_per_s\": %.1f, \"call\": \"%s\", \"calls\": %d, "
+           "\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, "
+           "\"xruns\": %d, \"frames_lost\": %u, \"errors\": %d}\n",
+           r.workload, wall_ns / 1e9, cpu_ns / 1e6 / (wall_ns / 1e9),
+           wakeups / (wall_ns / 1e9), r.call, r.count,
+           percentile_ms(&r, 50), percentile_ms(&r, 90), percentile_ms(&r, 99),
+           r.count ? r.ns[r.count - 1] / 1e6 : 0.0,
+           r.xruns, r.frames_lost, r.errors);
+    fflush(stdout);
+    return r.errors != 0;
+}
+
+static int open_device(const char *library, audio_hw_device_t **dev)
+{
+    struct hw_module_t *module;
+    void *handle;
+
+#ifdef HAVE_ANDROID_OS
+    if (library == NULL) {
+        const hw_module_t *installed;
+
+        if (hw_get_module_by_class(AUDIO_HARDWARE_MODULE_ID, "primary", &installed) != 0)
+            return -ENOENT;
+        return audio_hw_device_open(installed, dev);
+    }
+#endif
+    if (library == NULL)
+        library = "audio.primary.host.so";
+    handle = dlopen(library, RTLD_NOW);
+    if (handle == NULL) {
+        fprintf(stderr, "cannot load %s: %s\n", library, dlerror());
+        return -ENOENT;
+    }
+    module = (struct hw_module_t *)dlsym(handle, HAL_MODULE_INFO_SYM_AS_STR);
+    if (module == NULL)
+        return -ENOENT;
+    module->dso = handle;
+    return module->methods->open(module, AUDIO_HARDWARE_INTERFACE,
+                                 (struct hw_device_t **)dev);
+}
+
+static void usage(const char *prog)
+{
+    unsigned int i;
+
+    fprintf(stderr, "usage: %s [-l library] [-w workload] [-s seconds]\nworkloads:", prog);
+    for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+        fprintf(stderr, " %s", workloads[i].name);
+    fprintf(stderr, " (default: all)\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *library = NULL, *workload = NULL;
+    struct bench b;
+    int64_t *samples;
+    unsigned int i;
+    int opt, found = 0, ret = 0;
+
+    memset(&b, 0, sizeof(b));
+    b.seconds = DEFAULT_SECONDS;
+    while ((opt = getopt(argc, argv, "l:w:s:h")) != -1) {
+        switch (opt) {
+        case 'l':
+            library = optarg;
+            break;
+        case 'w':
+            workload = optarg;
+            break;
+        case 's':
+            b.seconds = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (b.seconds < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (open_device(library, &b.dev) != 0) {
+        fprintf(stderr, "cannot open the primary audio HAL\n");
+        return 1;
+    }
+    samples = malloc(MAX_SAMPLES * sizeof(int64_t));
+    if (samples == NULL)
+        return 1;
+
+    for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (workload != NULL && strcmp(workload, workloads[i].name))
+            continue;
+        found = 1;
+        ret |= run_workload(&b, i, samples);
+    }
+    if (!found) {
+        usage(argv[0]);
+        ret = 1;
+    }
+
+    b.dev->common.close(&b.dev->common);
+    free(samples);
+    return ret;
+}
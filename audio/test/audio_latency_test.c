@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Round trip latency of an output stream of the primary audio HAL,
+ * measured through an external loopback (output jack to input jack).
+ *
+ * The HAL is driven directly, so mediaserver must be stopped first.  One
+ * thread writes a click every second into an output stream opened with
+ * the given flags while another reads an input stream; the time from the
+ * out_write() carrying the click to the capture of its onset is the
+ * round trip.  The median over all clicks is reported next to the
+ * latency the streams claim, and the test fails if it exceeds -m.
+ *
+ *   audio_latency_test [-f out_flags] [-n clicks] [-m max_ms]
+ *
+ * out_flags defaults to AUDIO_OUTPUT_FLAG_FAST.
+ */
+
+#define LOG_TAG "audio_latency_test"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/hardware.h>
+#include <hardware/audio.h>
+#include <system/audio.h>
+
+#define SAMPLE_RATE 48000
+#define CHANNELS 2
+#define CLICK_FRAMES 48             /* 1 ms */
+#define CLICK_PERIOD_FRAMES SAMPLE_RATE
+#define CLICK_LEVEL 16000
+#define DETECT_LEVEL 4000
+#define DEFAULT_CLICKS 10
+#define DEFAULT_MAX_MS 50
+#define MAX_CLICKS 100
+#define CAPTURE_FRAMES 240
+
+struct click_times {
+    int64_t written_ns[MAX_CLICKS];
+    int64_t captured_ns[MAX_CLICKS];
+    volatile int written;
+    int captured;
+};
+
+struct writer {
+    struct audio_stream_out *out;
+    struct click_times *times;
+    int clicks;
+    volatile int stop;
+    int error;
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* fills frames [pos, pos + frames) of the click train */
+static void fill_clicks(int16_t *buf, size_t frames, uint64_t pos, int *has_click)
+{
+    size_t i;
+
+    *has_click = 0;
+    for (i = 0; i < frames; i++) {
+        int16_t v = 0;
+        if (((pos + i) % CLICK_PERIOD_FRAMES) < CLICK_FRAMES) {
+            v = ((pos + i) & 1) ? CLICK_LEVEL : -CLICK_LEVEL;
+            if (((pos + i) % CLICK_PERIOD_FRAMES) == 0)
+                *has_click = 1;
+        }
+        buf[i * CHANNELS] = v;
+        buf[i * CHANNELS + 1] = v;
+    }
+}
+
+/* returns the index of the first loud frame, -1 if none */
+static int find_onset(const int16_t *buf, size_t frames, int channels)
+{
+    size_t i;
+
+    for (i = 0; i < frames * channels; i++) {
+        if (buf[i] > DETECT_LEVEL || buf[i] < -DETECT_LEVEL)
+            return i / channels;
+    }
+    return -1;
+}
+
+/* Plays the click train and stamps the return of each write that
+ * starts a click. */
+static void *writer_thread(void *data)
+{
+    struct writer *w = (struct writer *)data;
+    struct audio_stream_out *out = w->out;
+    size_t frames = out->common.get_buffer_size(&out->common) / (CHANNELS * sizeof(int16_t));
+    int16_t *buf = malloc(frames * CHANNELS * sizeof(int16_t));
+    uint64_t pos = 0;
+
+    if (buf == NULL) {
+        w->error = -ENOMEM;
+        return NULL;
+    }
+
+    while (!w->stop) {
+        int has_click;
+
+        fill_clicks(buf, frames, pos, &has_click);
+        if (out->write(out, buf, frames * CHANNELS * sizeof(int16_t)) < 0) {
+            w->error = -EIO;
+            break;
+        }
+        if (has_click && w->times->written < w->clicks) {
+            w->times->written_ns[w->times->written] = now_ns();
+            __sync_synchronize();
+            w->times->written++;
+        }
+        pos += frames;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-f out_flags] [-n clicks] [-m max_ms]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const hw_module_t *module;
+    audio_hw_device_t *dev;
+    struct audio_stream_out *out = NULL;
+    struct audio_stream_in *in = NULL;
+    struct audio_config config;
+    audio_output_flags_t flags = AUDIO_OUTPUT_FLAG_FAST;
+    struct click_times times;
+    struct writer w;
+    pthread_t thread;
+    int thread_started = 0;
+    int clicks = DEFAULT_CLICKS;
+    int max_ms = DEFAULT_MAX_MS;
+    int16_t *in_buf = NULL;
+    int64_t start_ns, capture_ns, rt_ns[MAX_CLICKS], median_ms;
+    int in_channels, opt, i, ret = 1;
+
+    while ((opt = getopt(argc, argv, "f:n:m:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            flags = (audio_output_flags_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            clicks = atoi(optarg);
+            break;
+        case 'm':
+            max_ms = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (clicks < 1 || clicks > MAX_CLICKS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (hw_get_module_by_class(AUDIO_HARDWARE_MODULE_ID, "primary", &module) != 0 ||
+            audio_hw_device_open(module, &dev) != 0) {
+        fprintf(stderr, "cannot open the primary audio HAL\n");
+        return 1;
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = SAMPLE_RATE;
+    config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    if (dev->open_output_stream(dev, 0, AUDIO_DEVICE_OUT_AUX_DIGITAL, flags,
+                                &config, &out) != 0) {
+        fprintf(stderr, "cannot open output stream (flags 0x%x)\n", flags);
+        goto exit;
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = SAMPLE_RATE;
+    config.channel_mask = AUDIO_CHANNEL_IN_MONO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    if (dev->open_input_stream(dev, 1, AUDIO_DEVICE_IN_BUILTIN_MIC, &config, &in) != 0) {
+        fprintf(stderr, "cannot open input stream\n");
+        goto exit;
+    }
+    in_channels = popcount(in->common.get_channels(&in->common));
+
+    in_buf = malloc(CAPTURE_FRAMES * in_channels * sizeof(int16_t));
+    if (in_buf == NULL)
+        goto exit;
+
+    memset(&times, 0, sizeof(times));
+    memset(&w, 0, sizeof(w));
+    w.out = out;
+    w.times = &times;
+    w.clicks = clicks;
+    if (pthread_create(&thread, NULL, writer_thread, &w) != 0)
+        goto exit;
+    thread_started = 1;
+
+    /* Reads are short compared to the click spacing; the return of the
+     * read holding the onset, less the frames captured after it, is the
+     * capture time. */
+    start_ns = now_ns();
+    while (times.captured < clicks && !w.error) {
+        int onset;
+
+        if (in->read(in, in_buf, CAPTURE_FRAMES * in_channels * sizeof(int16_t)) < 0) {
+            fprintf(stderr, "read failed\n");
+            goto exit;
+        }
+        capture_ns = now_ns();
+        onset = find_onset(in_buf, CAPTURE_FRAMES, in_channels);
+        /* skip the tail of a click and anything heard before it was written */
+        if (onset >= 0 && times.captured < times.written &&
+                (times.captured == 0 ||
+                 capture_ns - times.captured_ns[times.captured - 1] > 500000000LL)) {
+            times.captured_ns[times.captured++] = capture_ns -
+                    (int64_t)(CAPTURE_FRAMES - onset) * 1000000000LL / SAMPLE_RATE;
+        }
+
+        if (capture_ns - start_ns > (int64_t)(clicks + 5) * 1000000000LL) {
+            fprintf(stderr, "only %d of %d clicks captured, is the loopback connected?\n",
+                    times.captured, clicks);
+            goto exit;
+        }
+    }
+    if (w.error) {
+        fprintf(stderr, "write failed (%d)\n", w.error);
+        goto exit;
+    }
+
+    for (i = 0; i < clicks; i++)
+        rt_ns[i] = times.captured_ns[i] - times.written_ns[i];
+    qsort(rt_ns, clicks, sizeof(rt_ns[0]), cmp_int64);
+    median_ms = rt_ns[clicks / 2] / 1000000;
+
+    printf("output flags 0x%x, buffer %u bytes, reported latency %u ms\n",
+           flags, (unsigned)out->common.get_buffer_size(&out->common),
+           out->get_latency(out));
+    printf("round trip: median %lld ms, min %lld ms, max %lld ms over %d clicks\n",
+           (long long)median_ms, (long long)(rt_ns[0] / 1000000),
+           (long long)(rt_ns[clicks - 1] / 1000000), clicks);
+
+    if (median_ms > max_ms) {
+        printf("FAIL: round trip above %d ms\n", max_ms);
+    } else {
+        printf("PASS\n");
+        ret = 0;
+    }
+
+exit:
+    if (thread_started) {
+        w.stop = 1;
+        pthread_join(thread, NULL);
+    }
+    if (in != NULL)
+        dev->close_input_stream(dev, in);
+    if (out != NULL)
+        dev->close_output_stream(dev, out);
+    audio_hw_device_close(dev);
+    free(in_buf);
+    return ret;
+}
@@ -0,0 +1,52 @@
+#!/usr/bin/python
+###
+### Copyright (C) 2012 The Android Open Source Project
+###
+### Licensed under the Apache License, Version 2.0 (the "License");
+### you may not use this file except in compliance with the License.
+### You may obtain a copy of the License at
+###
+###      http://www.apache.org/licenses/LICENSE-2.0
+###
+### Unless required by applicable law or agreed to in writing, software
+### distributed under the License is distributed on an "AS IS" BASIS,
+### WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+### See the License for the specific language governing permissions and
+### limitations under the License.
+###
+
+#
+# Round trip latency of the fast output (AUDIO_OUTPUT_FLAG_FAST).
+# Needs audio_latency_test on the device and a loopback cable from the
+# output to the input.  mediaserver is stopped while the HAL is in use.
+#
+
+import sys, os, re, subprocess
+
+AUDIO_OUTPUT_FLAG_FAST = 0x4
+MAX_ROUND_TRIP_MS = 50
+CLICKS = 10
+
+def adb_shell(cmd):
+    p = subprocess.Popen(["adb", "shell", cmd], stdout=subprocess.PIPE,
+                         stderr=subprocess.STDOUT)
+    out = p.communicate()[0]
+    sys.stdout.write(out)
+    return out
+
+def main(argv = []):
+    adb_shell("stop media")
+    try:
+        out = adb_shell("audio_latency_test -f %d -n %d -m %d" %
+                        (AUDIO_OUTPUT_FLAG_FAST, CLICKS, MAX_ROUND_TRIP_MS))
+    finally:
+        adb_shell("start media")
+
+    # adb shell does not return the exit status of the command
+    if re.search(r"^PASS", out, re.MULTILINE) is None:
+        return 1
+    return 0
+
+if __name__ == "__main__":
+    rv = main(sys.argv)
+    sys.exit(rv)
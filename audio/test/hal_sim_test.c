@@ -0,0 +1,774 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Runs the host build of the primary HAL (audio.primary.host, linked
+ * against tinyalsa_sim.c) with no hardware.  The library is loaded the
+ * way libhardware does and driven through its audio_hw_device: outputs of
+ * each profile, 5.1 and 7.1 HDMI included, write a tone for -s seconds,
+ * then a fast output joins a playing primary one through the output
+ * mixer, inputs read for as long, once with the simulated capture stalled
+ * into overruns, an output is routed back and forth while it plays, and
+ * AC-3 is passed through a direct output.  Every case reports the time
+ * spent in out_write() or in_read() and the thread CPU time per second
+ * of audio; run it under perf to profile the HAL.
+ *
+ * A case fails if a call returns an error, if the streams are not paced
+ * by the simulated clock, if an output's writers wake up more than once a
+ * write or too irregularly (see MAX_LATENESS_VAR_US2), if the mixed
+ * outputs do not keep the pcm fed, if the fast one mixed behind the
+ * primary one is held up longer than MIX_FAST_MAX_P99_NS, if the capture
+ * tone does not come through, or if frames lost to overruns are not reported by
+ * get_input_frames_lost(), or if the HDMI channel status is not marked
+ * non-audio during passthrough only.
+ * The simulated devices take their configuration from TINYALSA_SIM (see
+ * tinyalsa_sim.h), e.g. TINYALSA_SIM="jitter_us=2000" hal_sim_test.
+ *
+ *   hal_sim_test [-l library] [-s seconds]
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/hardware.h>
+#include <hardware/audio.h>
+#include <system/audio.h>
+#include <tinyalsa/asoundlib.h>
+
+#include "tinyalsa_sim.h"
+
+#define DEFAULT_LIBRARY "audio.primary.host.so"
+#define DEFAULT_SECONDS 3
+#define TONE_HZ 440
+#define MAX_CALLS 20000
+#define PACING_TOLERANCE 0.05       /* of the audio duration */
+#define PACING_SLACK_NS 50000000LL
+#define MAX_LATENESS_VAR_US2 25000000LL /* (5 ms)^2 of wake-up lateness */
+#define MIN_TONE_RMS 1000.0         /* the simulated capture tone is ~2300 */
+#define ROUTE_CHANGES 20
+#define MIX_LEAD_MS 100             /* the primary output opens the pcm */
+#define MIX_FAST_MAX_P99_NS 20000000LL  /* 4 fast periods */
+#define RENDER_US 1000
+#define XRUN_CONFIG "xrun_ms=700"
+#define AC3_FRAME_BYTES 2560        /* 640 kbit/s at 48 kHz */
+#define AC3_FRAME_SAMPLES 1536
+#define IEC958_AES0_NONAUDIO 0x02
+
+struct out_case {
+    const char *name;
+    audio_output_flags_t flags;
+    uint32_t rate;
+    audio_channel_mask_t channel_mask;
+};
+
+struct in_case {
+    const char *name;
+    uint32_t rate;
+    audio_channel_mask_t channel_mask;
+    const char *sim_config;         /* replaces TINYALSA_SIM for the case */
+};
+
+static const struct out_case out_cases[] = {
+    { "primary 48k",        AUDIO_OUTPUT_FLAG_PRIMARY,     48000, AUDIO_CHANNEL_OUT_STEREO },
+    { "fast 48k",           AUDIO_OUTPUT_FLAG_FAST,        48000, AUDIO_CHANNEL_OUT_STEREO },
+    { "deep buffer 44.1k",  AUDIO_OUTPUT_FLAG_DEEP_BUFFER, 44100, AUDIO_CHANNEL_OUT_STEREO },
+    { "hdmi 5.1",           AUDIO_OUTPUT_FLAG_DIRECT,      48000, AUDIO_CHANNEL_OUT_5POINT1 },
+    { "hdmi 7.1",           AUDIO_OUTPUT_FLAG_DIRECT,      48000, AUDIO_CHANNEL_OUT_7POINT1 },
+};
+
+static const struct in_case in_cases[] = {
+    { "capture 16k mono",       16000, AUDIO_CHANNEL_IN_MONO,   NULL },
+    { "capture 48k stereo",     48000, AUDIO_CHANNEL_IN_STEREO, NULL },
+    { "capture 16k overruns",   16000, AUDIO_CHANNEL_IN_MONO,   XRUN_CONFIG },
+};
+
+struct sim_hooks {
+    int (*configure)(const char *config);
+    int (*get_stats)(unsigned int card, unsigned int device, unsigned int flags,
+                     struct tinyalsa_sim_stats *stats);
+    struct mixer *(*mixer_open)(unsigned int card);
+    void (*mixer_close)(struct mixer *mixer);
+    struct mixer_ctl *(*mixer_get_ctl_by_name)(struct mixer *mixer, const char *name);
+    int (*mixer_ctl_get_value)(struct mixer_ctl *ctl, unsigned int id);
+};
+
+/* timing of the calls of one case */
+struct call_stats {
+    int64_t *ns;
+    int count;
+    int64_t wall_ns;
+    int64_t cpu_ns;
+};
+
+static int64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_stats(const char *name, struct call_stats *s, double audio_s)
+{
+    int n = s->count;
+
+    qsort(s->ns, n, sizeof(int64_t), cmp_int64);
+    printf("%-24s %5d calls: p50 %.2f ms, p99 %.2f ms, max %.2f ms; "
+           "%.2f s for %.2f s of audio, cpu %.1f ms/s\n",
+           name, n, s->ns[n / 2] / 1e6, s->ns[n * 99 / 100] / 1e6, s->ns[n - 1] / 1e6,
+           s->wall_ns / 1e9, audio_s, s->cpu_ns / 1e6 / audio_s);
+}
+
+/* wall time must follow the audio, less what the buffers absorb */
+static int check_pacing(const char *name, int64_t wall_ns, double audio_s, int64_t buffered_ns)
+{
+    int64_t audio_ns = (int64_t)(audio_s * 1e9);
+
+    if (wall_ns < audio_ns - buffered_ns - PACING_SLACK_NS ||
+            wall_ns > audio_ns + audio_ns * PACING_TOLERANCE + PACING_SLACK_NS) {
+        printf("FAIL: %s took %.3f s for %.3f s of audio\n", name, wall_ns / 1e9, audio_s);
+        return 1;
+    }
+    return 0;
+}
+
+/* Reads the write pacing of each pcm writer of out from its dump: a
+ * writer must wake up at most once per write, and on time give or take
+ * the scheduler; returns 1 if not. */
+static int check_write_pacing(struct audio_stream_out *out, const char *name)
+{
+    FILE *f = tmpfile();
+    char line[256];
+    int writers = 0, ret = 0;
+
+    if (f == NULL || out->common.dump(&out->common, fileno(f)) != 0) {
+        printf("FAIL: %s: cannot dump the output\n", name);
+        if (f != NULL)
+            fclose(f);
+        return 1;
+    }
+    rewind(f);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char writer[16];
+        unsigned int writes, sleeps;
+        long long mean_us, var_us2;
+
+        if (sscanf(line, " %15s write pacing: %u writes, %u sleeps, lateness mean %lld us "
+                   "var %lld us^2", writer, &writes, &sleeps, &mean_us, &var_us2) != 5)
+            continue;
+        writers++;
+        printf("%-24s %s: %u writes, %u wake-ups, lateness %lld us, var %lld us^2\n", "",
+               writer, writes, sleeps, mean_us, var_us2);
+        if (sleeps > writes) {
+            printf("FAIL: %s: %s writer woke up %u times for %u writes\n",
+                   name, writer, sleeps, writes);
+            ret = 1;
+        }
+        if (var_us2 > MAX_LATENESS_VAR_US2) {
+            printf("FAIL: %s: %s writer wake-up lateness variance %lld us^2, mean %lld us\n",
+                   name, writer, var_us2, mean_us);
+            ret = 1;
+        }
+    }
+    fclose(f);
+    if (writers == 0) {
+        printf("FAIL: %s: no write pacing in the dump\n", name);
+        ret = 1;
+    }
+    return ret;
+}
+
+/* Opens an output to HDMI, with the S/PDIF copy; NULL if it fails or
+ * does not take the rate and channels. */
+static struct audio_stream_out *open_out(audio_hw_device_t *dev, const struct out_case *c)
+{
+    struct audio_stream_out *out = NULL;
+    struct audio_config config;
+    char kvpairs[32];
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = c->rate;
+    config.channel_mask = c->channel_mask;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    if (dev->open_output_stream(dev, 0, AUDIO_DEVICE_OUT_AUX_DIGITAL, c->flags,
+                                &config, &out) != 0) {
+        printf("FAIL: %s: cannot open the output\n", c->name);
+        return NULL;
+    }
+    if (out->common.get_sample_rate(&out->common) != c->rate ||
+            out->common.get_channels(&out->common) != c->channel_mask) {
+        printf("FAIL: %s: output opened at %u Hz, channels 0x%x\n", c->name,
+               out->common.get_sample_rate(&out->common),
+               out->common.get_channels(&out->common));
+        dev->close_output_stream(dev, out);
+        return NULL;
+    }
+    snprintf(kvpairs, sizeof(kvpairs), "%s=%d", AUDIO_PARAMETER_STREAM_ROUTING,
+             AUDIO_DEVICE_OUT_AUX_DIGITAL);
+    out->common.set_parameters(&out->common, kvpairs);
+    return out;
+}
+
+/* Writes a tone for seconds to all the channels of out, timing the calls
+ * in s; returns 1 on a write error or if it is not paced.  queued_ns is
+ * what may be buffered past the latency of out. */
+static int play_tone(struct audio_stream_out *out, const struct out_case *c, int seconds,
+                     int64_t queued_ns, struct call_stats *s)
+{
+    int16_t *buf = NULL;
+    size_t channels = __builtin_popcount(c->channel_mask);
+    size_t bytes, frames, pos = 0;
+    int64_t t0, cpu0;
+    double audio_s;
+    int ret = 1;
+
+    bytes = out->common.get_buffer_size(&out->common);
+    frames = bytes / (channels * sizeof(int16_t));
+    buf = malloc(bytes);
+    if (buf == NULL)
+        return 1;
+
+    s->count = 0;
+    t0 = clock_ns(CLOCK_MONOTONIC);
+    cpu0 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    while (pos < (size_t)seconds * c->rate && s->count < MAX_CALLS) {
+        int64_t w0;
+        size_t i;
+
+        for (i = 0; i < frames; i++) {
+            int16_t v = (int16_t)(8000 * sin(2 * M_PI * TONE_HZ * (double)(pos + i) / c->rate));
+            size_t ch;
+
+            for (ch = 0; ch < channels; ch++)
+                buf[channels * i + ch] = v;
+        }
+        w0 = clock_ns(CLOCK_MONOTONIC);
+        if (out->write(out, buf, bytes) != (ssize_t)bytes) {
+            printf("FAIL: %s: write error\n", c->name);
+            goto exit;
+        }
+        s->ns[s->count++] = clock_ns(CLOCK_MONOTONIC) - w0;
+        pos += frames;
+    }
+    s->wall_ns = clock_ns(CLOCK_MONOTONIC) - t0;
+    s->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu0;
+
+    audio_s = (double)pos / c->rate;
+    print_stats(c->name, s, audio_s);
+    ret = check_pacing(c->name, s->wall_ns, audio_s, queued_ns +
+                       out->get_latency(out) * 1000000LL + frames * 1000000000LL / c->rate);
+
+exit:
+    free(buf);
+    return ret;
+}
+
+static int run_out_case(audio_hw_device_t *dev, const struct out_case *c, int seconds,
+                        struct call_stats *s)
+{
+    struct audio_stream_out *out = open_out(dev, c);
+    int ret;
+
+    if (out == NULL)
+        return 1;
+    ret = play_tone(out, c, seconds, 0, s);
+    if (ret == 0)
+        ret = check_write_pacing(out, c->name);
+    out->common.standby(&out->common);
+    dev->close_output_stream(dev, out);
+    return ret;
+}
+
+struct mix_writer {
+    struct audio_stream_out *out;
+    const struct out_case *c;
+    int seconds;
+    int64_t queued_ns;
+    struct call_stats s;
+    int ret;
+};
+
+static void *mix_writer_thread(void *context)
+{
+    struct mix_writer *w = (struct mix_writer *)context;
+
+    w->ret = play_tone(w->out, w->c, w->seconds, w->queued_ns, &w->s);
+    return NULL;
+}
+
+/* one period of silence to out, which makes it start */
+static int join_mixer(struct audio_stream_out *out, const struct out_case *c)
+{
+    size_t bytes = out->common.get_buffer_size(&out->common);
+    void *buf = calloc(1, bytes);
+    int ret = 0;
+
+    if (buf == NULL || out->write(out, buf, bytes) != (ssize_t)bytes) {
+        printf("FAIL: %s: write error\n", c->name);
+        ret = 1;
+    }
+    free(buf);
+    return ret;
+}
+
+/* The primary output plays on a thread of its own and a fast output
+ * joins it: both go through the output mixer, which must pace them, hand
+ * all the frames mixed to the pcm and, though the primary output opened
+ * the pcm, keep the fast writes at the fast period. */
+static int run_mix_case(audio_hw_device_t *dev, struct sim_hooks *sim, int seconds,
+                        struct call_stats *s)
+{
+    static const struct out_case primary =
+        { "mixed primary 48k", AUDIO_OUTPUT_FLAG_PRIMARY, 48000, AUDIO_CHANNEL_OUT_STEREO };
+    static const struct out_case fast =
+        { "mixed fast 48k", AUDIO_OUTPUT_FLAG_FAST, 48000, AUDIO_CHANNEL_OUT_STEREO };
+    struct audio_stream_out *out, *fast_out;
+    struct tinyalsa_sim_stats before, after;
+    struct mix_writer w;
+    pthread_t writer;
+    uint64_t frames;
+    int ret = 1;
+
+    out = open_out(dev, &primary);
+    if (out == NULL)
+        return 1;
+    fast_out = open_out(dev, &fast);
+    if (fast_out == NULL)
+        goto close_primary;
+
+    memset(&w, 0, sizeof(w));
+    w.out = out;
+    w.c = &primary;
+    w.seconds = seconds;
+    w.queued_ns = fast_out->get_latency(fast_out) * 1000000LL;
+    w.s.ns = malloc(MAX_CALLS * sizeof(int64_t));
+    if (w.s.ns == NULL)
+        goto close_fast;
+
+    sim->get_stats(0, 0, PCM_OUT, &before);
+    if (pthread_create(&writer, NULL, mix_writer_thread, &w) != 0)
+        goto free_calls;
+    usleep(MIX_LEAD_MS * 1000);
+    /* joining waits for what the primary output queued at its own period
+     * to play: the pacing is measured from then */
+    if (join_mixer(fast_out, &fast) != 0)
+        ret = 1;
+    else
+        ret = play_tone(fast_out, &fast, seconds, out->get_latency(out) * 1000000LL, s);
+    printf("%-24s latency %u ms\n", "", fast_out->get_latency(fast_out));
+    if (s->count > 0 && s->ns[s->count * 99 / 100] > MIX_FAST_MAX_P99_NS) {
+        printf("FAIL: mixing: fast writes take up to %.2f ms (p99)\n",
+               s->ns[s->count * 99 / 100] / 1e6);
+        ret = 1;
+    }
+    pthread_join(writer, NULL);
+    ret |= w.ret;
+
+    /* the pcm plays at 48 kHz for as long as either output plays */
+    sim->get_stats(0, 0, PCM_OUT, &after);
+    frames = after.frames - before.frames;
+    printf("%-24s %llu frames to hdmi\n", "", (unsigned long long)frames);
+    if (frames < (uint64_t)seconds * 48000 * (1 - PACING_TOLERANCE)) {
+        printf("FAIL: mixing: %llu frames reached the pcm for %d s\n",
+               (unsigned long long)frames, seconds);
+        ret = 1;
+    }
+
+free_calls:
+    free(w.s.ns);
+close_fast:
+    fast_out->common.standby(&fast_out->common);
+    dev->close_output_stream(dev, fast_out);
+close_primary:
+    out->common.standby(&out->common);
+    dev->close_output_stream(dev, out);
+    return ret;
+}
+
+static int run_in_case(audio_hw_device_t *dev, struct sim_hooks *sim, const struct in_case *c,
+                       int seconds, struct call_stats *s)
+{
+    struct audio_stream_in *in = NULL;
+    struct audio_config config;
+    int16_t *buf = NULL;
+    size_t bytes, samples, frames, pos = 0;
+    int channels = popcount(c->channel_mask);
+    double audio_s, sum = 0, rms;
+    uint32_t lost = 0;
+    int64_t t0, cpu0;
+    int ret = 1;
+
+    if (c->sim_config != NULL)
+        sim->configure(c->sim_config);
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = c->rate;
+    config.channel_mask = c->channel_mask;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    if (dev->open_input_stream(dev, 0, AUDIO_DEVICE_IN_BUILTIN_MIC, &config, &in) != 0) {
+        printf("FAIL: %s: cannot open the input\n", c->name);
+        goto restore;
+    }
+
+    bytes = in->common.get_buffer_size(&in->common);
+    samples = bytes / sizeof(int16_t);
+    frames = samples / channels;
+    buf = malloc(bytes);
+    if (buf == NULL)
+        goto exit;
+
+    s->count = 0;
+    t0 = clock_ns(CLOCK_MONOTONIC);
+    cpu0 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    while (pos < (size_t)seconds * c->rate && s->count < MAX_CALLS) {
+        int64_t r0 = clock_ns(CLOCK_MONOTONIC);
+        size_t i;
+
+        if (in->read(in, buf, bytes) != (ssize_t)bytes) {
+            printf("FAIL: %s: read error\n", c->name);
+            goto exit;
+        }
+        s->ns[s->count++] = clock_ns(CLOCK_MONOTONIC) - r0;
+        lost += in->get_input_frames_lost(in);
+        /* the first reads hold the resampler and filter start up */
+        if (pos >= c->rate / 10) {
+            for (i = 0; i < samples; i++)
+                sum += (double)buf[i] * buf[i];
+        }
+        pos += frames;
+    }
+    s->wall_ns = clock_ns(CLOCK_MONOTONIC) - t0;
+    s->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu0;
+
+    audio_s = (double)pos / c->rate;
+    rms = sqrt(sum / ((pos - c->rate / 10) * channels));
+    print_stats(c->name, s, audio_s);
+    printf("%-24s tone rms %.0f, %u frames lost\n", "", rms, lost);
+
+    if (rms < MIN_TONE_RMS) {
+        printf("FAIL: %s: no capture tone\n", c->name);
+    } else if (c->sim_config == NULL && lost != 0) {
+        printf("FAIL: %s: frames lost without overruns\n", c->name);
+    } else if (c->sim_config != NULL && lost == 0) {
+        printf("FAIL: %s: overruns not reported\n", c->name);
+    } else if (c->sim_config == NULL) {
+        /* in_read() returns once a buffer is captured: up to one early */
+        ret = check_pacing(c->name, s->wall_ns, audio_s,
+                           (int64_t)frames * 1000000000LL / c->rate);
+    } else {
+        ret = 0;
+    }
+
+exit:
+    free(buf);
+    in->common.standby(&in->common);
+    dev->close_input_stream(dev, in);
+restore:
+    if (c->sim_config != NULL)
+        sim->configure(getenv("TINYALSA_SIM"));
+    return ret;
+}
+
+struct route_writer {
+    struct audio_stream_out *out;
+    volatile int stop;
+    int errors;
+};
+
+static void *route_writer_thread(void *data)
+{
+    struct route_writer *w = (struct route_writer *)data;
+    size_t bytes = w->out->common.get_buffer_size(&w->out->common);
+    void *buf = calloc(1, bytes);
+
+    while (buf != NULL && !w->stop) {
+        if (w->out->write(w->out, buf, bytes) != (ssize_t)bytes)
+            w->errors++;
+        /* a mixer thread renders between writes; without the gap the
+         * unfair stream mutex could starve the routing thread */
+        usleep(RENDER_US);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* routes a playing output between HDMI and S/PDIF (cards 0 and 1); this
+ * moves the pcms, steelhead has no codec routes to set on the mixer */
+static int run_route_case(audio_hw_device_t *dev, int seconds, struct call_stats *s)
+{
+    static const audio_devices_t devices[] = {
+        AUDIO_DEVICE_OUT_AUX_DIGITAL, AUDIO_DEVICE_OUT_SPEAKER,
+    };
+    struct audio_stream_out *out = NULL;
+    struct audio_config config;
+    struct route_writer w;
+    pthread_t writer;
+    int i, ret = 1;
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = 48000;
+    config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    if (dev->open_output_stream(dev, 0, AUDIO_DEVICE_OUT_AUX_DIGITAL,
+                                AUDIO_OUTPUT_FLAG_PRIMARY, &config, &out) != 0) {
+        printf("FAIL: routing: cannot open the output\n");
+        return 1;
+    }
+
+    memset(&w, 0, sizeof(w));
+    w.out = out;
+    if (pthread_create(&writer, NULL, route_writer_thread, &w) != 0)
+        goto exit;
+
+    s->count = 0;
+    for (i = 0; i < ROUTE_CHANGES; i++) {
+        char kvpairs[32];
+        int64_t t0;
+
+        usleep(seconds * 1000000 / ROUTE_CHANGES);
+        snprintf(kvpairs, sizeof(kvpairs), "%s=%d", AUDIO_PARAMETER_STREAM_ROUTING,
+                 devices[i % 2]);
+        t0 = clock_ns(CLOCK_MONOTONIC);
+        out->common.set_parameters(&out->common, kvpairs);
+        s->ns[s->count++] = clock_ns(CLOCK_MONOTONIC) - t0;
+    }
+
+    w.stop = 1;
+    pthread_join(writer, NULL);
+
+    s->wall_ns = seconds * 1000000000LL;
+    s->cpu_ns = 0;
+    print_stats("routing", s, seconds);
+    if (w.errors != 0)
+        printf("FAIL: routing: %d write errors\n", w.errors);
+    else
+        ret = 0;
+
+exit:
+    out->common.standby(&out->common);
+    dev->close_output_stream(dev, out);
+    return ret;
+}
+
+/* byte 0 of the channel status of card, -1 if it cannot be read */
+static int iec958_status0(struct sim_hooks *sim, unsigned int card)
+{
+    struct mixer *mixer = sim->mixer_open(card);
+    struct mixer_ctl *ctl;
+    int value = -1;
+
+    if (mixer == NULL)
+        return -1;
+    ctl = sim->mixer_get_ctl_by_name(mixer, "IEC958 Playback Default");
+    if (ctl != NULL)
+        value = sim->mixer_ctl_get_value(ctl, 0);
+    sim->mixer_close(mixer);
+    return value;
+}
+
+static int run_passthrough_case(audio_hw_device_t *dev, struct sim_hooks *sim, int seconds,
+                                struct call_stats *s)
+{
+    const char *name = "ac3 passthrough";
+    struct audio_stream_out *out = NULL;
+    struct audio_config config;
+    uint8_t *stream = NULL;
+    char kvpairs[32];
+    size_t bytes, len, pos = 0, i;
+    double audio_s;
+    int64_t t0, cpu0;
+    int status, ret = 1;
+
+    /* compressed audio is only taken by a direct output */
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = 48000;
+    config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    config.format = AUDIO_FORMAT_AC3;
+    if (dev->open_output_stream(dev, 0, AUDIO_DEVICE_OUT_AUX_DIGITAL, AUDIO_OUTPUT_FLAG_PRIMARY,
+                                &config, &out) == 0 || config.format != AUDIO_FORMAT_PCM_16_BIT) {
+        printf("FAIL: %s: AC-3 taken by a mixed output\n", name);
+        if (out != NULL)
+            dev->close_output_stream(dev, out);
+        return 1;
+    }
+
+    config.format = AUDIO_FORMAT_AC3;
+    if (dev->open_output_stream(dev, 0, AUDIO_DEVICE_OUT_AUX_DIGITAL, AUDIO_OUTPUT_FLAG_DIRECT,
+                                &config, &out) != 0) {
+        printf("FAIL: %s: cannot open the output\n", name);
+        return 1;
+    }
+    if (out->common.get_format(&out->common) != AUDIO_FORMAT_AC3) {
+        printf("FAIL: %s: output opened as format 0x%x\n", name,
+               out->common.get_format(&out->common));
+        goto exit;
+    }
+    snprintf(kvpairs, sizeof(kvpairs), "%s=%d", AUDIO_PARAMETER_STREAM_ROUTING,
+             AUDIO_DEVICE_OUT_AUX_DIGITAL);
+    out->common.set_parameters(&out->common, kvpairs);
+
+    /* a second of frames, written over and over in buffer size pieces */
+    bytes = out->common.get_buffer_size(&out->common);
+    len = 48000 / AC3_FRAME_SAMPLES * AC3_FRAME_BYTES;
+    stream = malloc(len);
+    if (stream == NULL)
+        goto exit;
+    for (i = 0; i < len; i++)
+        stream[i] = rand();
+    for (i = 0; i < len; i += AC3_FRAME_BYTES) {
+        stream[i] = 0x0b;
+        stream[i + 1] = 0x77;
+        stream[i + 4] = 36;         /* 48 kHz, 640 kbit/s */
+        stream[i + 5] = 8 << 3;
+    }
+
+    s->count = 0;
+    t0 = clock_ns(CLOCK_MONOTONIC);
+    cpu0 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    while (pos < (size_t)seconds * len && s->count < MAX_CALLS) {
+        size_t off = pos % len, n = bytes < len - off ? bytes : len - off;
+        int64_t w0 = clock_ns(CLOCK_MONOTONIC);
+
+        if (out->write(out, stream + off, n) != (ssize_t)n) {
+            printf("FAIL: %s: write error\n", name);
+            goto exit;
+        }
+        s->ns[s->count++] = clock_ns(CLOCK_MONOTONIC) - w0;
+        pos += n;
+    }
+    s->wall_ns = clock_ns(CLOCK_MONOTONIC) - t0;
+    s->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu0;
+
+    status = iec958_status0(sim, 0);
+    if (status < 0 || !(status & IEC958_AES0_NONAUDIO)) {
+        printf("FAIL: %s: channel status not marked non-audio\n", name);
+        goto exit;
+    }
+    audio_s = (double)(pos / AC3_FRAME_BYTES) * AC3_FRAME_SAMPLES / 48000;
+    print_stats(name, s, audio_s);
+    ret = check_pacing(name, s->wall_ns, audio_s,
+                       out->get_latency(out) * 1000000LL +
+                       AC3_FRAME_SAMPLES * 1000000000LL / 48000);
+
+    out->common.standby(&out->common);
+    if (iec958_status0(sim, 0) & IEC958_AES0_NONAUDIO) {
+        printf("FAIL: %s: channel status still non-audio in standby\n", name);
+        ret = 1;
+    }
+
+exit:
+    free(stream);
+    out->common.standby(&out->common);
+    dev->close_output_stream(dev, out);
+    return ret;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-l library] [-s seconds]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *library = DEFAULT_LIBRARY;
+    int seconds = DEFAULT_SECONDS;
+    struct hw_module_t *module;
+    audio_hw_device_t *dev;
+    struct sim_hooks sim;
+    struct call_stats s;
+    void *handle;
+    unsigned int i;
+    int opt, ret = 0;
+
+    while ((opt = getopt(argc, argv, "l:s:h")) != -1) {
+        switch (opt) {
+        case 'l':
+            library = optarg;
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (seconds < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    handle = dlopen(library, RTLD_NOW);
+    if (handle == NULL) {
+        fprintf(stderr, "cannot load %s: %s\n", library, dlerror());
+        return 1;
+    }
+    module = (struct hw_module_t *)dlsym(handle, HAL_MODULE_INFO_SYM_AS_STR);
+    sim.configure = (int (*)(const char *))dlsym(handle, "tinyalsa_sim_configure");
+    sim.get_stats = (int (*)(unsigned int, unsigned int, unsigned int,
+                             struct tinyalsa_sim_stats *))dlsym(handle, "tinyalsa_sim_get_stats");
+    sim.mixer_open = (struct mixer *(*)(unsigned int))dlsym(handle, "mixer_open");
+    sim.mixer_close = (void (*)(struct mixer *))dlsym(handle, "mixer_close");
+    sim.mixer_get_ctl_by_name = (struct mixer_ctl *(*)(struct mixer *, const char *))
+            dlsym(handle, "mixer_get_ctl_by_name");
+    sim.mixer_ctl_get_value = (int (*)(struct mixer_ctl *, unsigned int))
+            dlsym(handle, "mixer_ctl_get_value");
+    if (module == NULL || sim.configure == NULL || sim.get_stats == NULL ||
+            sim.mixer_open == NULL || sim.mixer_close == NULL ||
+            sim.mixer_get_ctl_by_name == NULL || sim.mixer_ctl_get_value == NULL) {
+        fprintf(stderr, "%s is not a HAL built with tinyalsa_sim\n", library);
+        return 1;
+    }
+    module->dso = handle;
+    if (module->methods->open(module, AUDIO_HARDWARE_INTERFACE,
+                              (struct hw_device_t **)&dev) != 0) {
+        fprintf(stderr, "cannot open the audio device of %s\n", library);
+        return 1;
+    }
+
+    s.ns = malloc(MAX_CALLS * sizeof(int64_t));
+    if (s.ns == NULL)
+        return 1;
+
+    for (i = 0; i < sizeof(out_cases) / sizeof(out_cases[0]); i++)
+        ret |= run_out_case(dev, &out_cases[i], seconds, &s);
+    ret |= run_mix_case(dev, &sim, seconds, &s);
+    for (i = 0; i < sizeof(in_cases) / sizeof(in_cases[0]); i++)
+        ret |= run_in_case(dev, &sim, &in_cases[i], seconds, &s);
+    ret |= run_route_case(dev, seconds, &s);
+    ret |= run_passthrough_case(dev, &sim, seconds, &s);
+
+    dev->common.close(&dev->common);
+    free(s.ns);
+
+    if (ret == 0)
+        printf("PASS\n");
+    return ret;
+}
@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Packs synthetic AC-3, E-AC-3 and DTS streams, fed in randomly cut
+ * writes with garbage between some frames, and checks every burst
+ * against the frames that went in: preamble, data type, length, payload
+ * and padding, and the samples reported.  The E-AC-3 stream has 2 block
+ * frames each followed by a dependent substream frame; the DTS stream
+ * ends with a frame that fills its period and goes without a preamble.
+ * Then reports the CPU time per second of 640 kbit/s AC-3.  Exits non
+ * zero on any mismatch.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iec61937.h"
+
+#define FRAMES 200
+#define MAX_WRITE 3000
+#define BENCH_SECONDS 600
+#define MAX_STREAM (FRAMES * 8192 * 2)
+
+/* a frame that went in, as it should come out of its burst */
+struct expect {
+    size_t offset;              /* in the stream */
+    size_t size;
+    uint16_t type;              /* Pc */
+    unsigned int period;
+    uint32_t samples;
+    int preamble;
+};
+
+struct stream {
+    uint8_t data[MAX_STREAM];
+    size_t len;
+    struct expect bursts[FRAMES];
+    int num_bursts;
+    uint32_t garbage;
+};
+
+static struct stream stream;
+static int16_t burst[IEC61937_MAX_BURST_FRAMES * 2];
+
+static int64_t cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint8_t *add_frame(struct stream *s, size_t size)
+{
+    uint8_t *f = s->data + s->len;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        f[i] = rand();
+    s->len += size;
+    return f;
+}
+
+/* bytes that cannot start a frame, with a false AC-3 sync */
+static void add_garbage(struct stream *s)
+{
+    static const uint8_t junk[] = { 0x00, 0x0b, 0x77, 0x00, 0x00, 0xc0, 0xff, 0x12 };
+
+    memcpy(s->data + s->len, junk, sizeof(junk));
+    s->len += sizeof(junk);
+    s->garbage += sizeof(junk);
+}
+
+static void make_ac3(struct stream *s)
+{
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    for (i = 0; i < FRAMES; i++) {
+        /* 48 kHz frame sizes in words, by frmsizecod / 2 */
+        static const uint16_t words[19] = { 64, 80, 96, 112, 128, 160, 192, 224, 256, 320,
+                                            384, 448, 512, 640, 768, 896, 1024, 1152, 1280 };
+        unsigned int frmsizecod = rand() % 38, bsmod = rand() % 8;
+        size_t size = words[frmsizecod / 2] * 2;
+        uint8_t *f;
+
+        if (i % 7 == 3)
+            add_garbage(s);
+        s->bursts[s->num_bursts].offset = s->len;
+        f = add_frame(s, size);
+        f[0] = 0x0b;
+        f[1] = 0x77;
+        f[4] = frmsizecod;
+        f[5] = (8 << 3) | bsmod;
+        s->bursts[s->num_bursts].size = size;
+        s->bursts[s->num_bursts].type = 0x01 | (bsmod << 8);
+        s->bursts[s->num_bursts].period = 1536;
+        s->bursts[s->num_bursts].samples = 1536;
+        s->bursts[s->num_bursts].preamble = 1;
+        s->num_bursts++;
+    }
+}
+
+static void eac3_header(uint8_t *f, size_t size, int dependent)
+{
+    unsigned int frmsiz = size / 2 - 1;
+
+    f[0] = 0x0b;
+    f[1] = 0x77;
+    f[2] = ((dependent ? 1 : 0) << 6) | ((frmsiz >> 8) & 0x07);
+    f[3] = frmsiz & 0xff;
+    f[4] = (0 << 6) | (1 << 4) | (7 << 1);      /* 48 kHz, 2 blocks, 3/2 */
+    f[5] = 16 << 3;
+}
+
+/* bursts of 3 frames of 2 blocks, each with a dependent frame; the last
+ * burst is held until the next independent frame and is not expected */
+static void make_eac3(struct stream *s)
+{
+    int i, j;
+
+    memset(s, 0, sizeof(*s));
+    for (i = 0; i < FRAMES / 4; i++) {
+        struct expect *e = &s->bursts[s->num_bursts];
+
+        e->offset = s->len;
+        for (j = 0; j < 6; j++) {
+            size_t size = 2 * (100 + rand() % 500);
+
+            eac3_header(add_frame(s, size), size, j & 1);
+            e->size += size;
+        }
+        e->type = 0x15;
+        e->period = 6144;
+        e->samples = 1536;
+        e->preamble = 1;
+        s->num_bursts++;
+    }
+    s->num_bursts--;
+}
+
+static void make_dts(struct stream *s)
+{
+    static const unsigned int periods[] = { 512, 1024, 2048 };
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    for (i = 0; i < FRAMES; i++) {
+        struct expect *e = &s->bursts[s->num_bursts];
+        unsigned int period = periods[rand() % 3], nblks = period / 32 - 1;
+        size_t size = 96 + rand() % (period * 4 - 8 - 96);
+        uint8_t *f;
+
+        if (i == FRAMES - 1) {
+            period = 2048;
+            nblks = 63;
+            size = period * 4;
+        }
+        if (i % 5 == 2)
+            add_garbage(s);
+        e->offset = s->len;
+        f = add_frame(s, size);
+        f[0] = 0x7f;
+        f[1] = 0xfe;
+        f[2] = 0x80;
+        f[3] = 0x01;
+        f[4] = 0xfc | (nblks >> 6);
+        f[5] = ((nblks & 0x3f) << 2) | (((size - 1) >> 12) & 0x03);
+        f[6] = ((size - 1) >> 4) & 0xff;
+        f[7] = (((size - 1) & 0x0f) << 4) | (f[7] & 0x0f);
+        e->size = size;
+        e->type = period == 512 ? 0x0b : period == 1024 ? 0x0c : 0x0d;
+        e->period = period;
+        e->samples = period;
+        e->preamble = size + 8 <= period * 4;
+        s->num_bursts++;
+    }
+}
+
+static int check_burst(const struct stream *s, const struct expect *e, size_t frames,
+                       uint32_t samples, int index)
+{
+    const int16_t *p = burst;
+    const uint8_t *src = s->data + e->offset;
+    size_t i, words = (e->size + 1) / 2;
+
+    if (frames != e->period || samples != e->samples) {
+        printf("burst %d: %zu frames, %u samples, expected %u, %u\n", index, frames, samples,
+               e->period, e->samples);
+        return 1;
+    }
+    if (e->preamble) {
+        uint16_t pd = e->type == 0x15 ? e->size : e->size * 8;
+
+        if ((uint16_t)p[0] != 0xf872 || (uint16_t)p[1] != 0x4e1f ||
+                (uint16_t)p[2] != e->type || (uint16_t)p[3] != pd) {
+            printf("burst %d: preamble %04x %04x %04x %04x, expected type %04x length %u\n",
+                   index, (uint16_t)p[0], (uint16_t)p[1], (uint16_t)p[2], (uint16_t)p[3],
+                   e->type, pd);
+            return 1;
+        }
+        p += 4;
+    }
+    for (i = 0; i < e->size / 2; i++) {
+        if ((uint16_t)p[i] != ((src[2 * i] << 8) | src[2 * i + 1])) {
+            printf("burst %d: payload word %zu differs\n", index, i);
+            return 1;
+        }
+    }
+    for (i = words; p + i < burst + frames * 2; i++) {
+        if (p[i] != 0) {
+            printf("burst %d: padding word %zu not zero\n", index, i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int run(const char *name, audio_format_t format, const struct stream *s)
+{
+    struct iec61937 iec;
+    size_t pos = 0;
+    int n = 0, errors = 0;
+
+    if (iec61937_init(&iec, format, 48000) != 0) {
+        printf("%s: init failed\n", name);
+        return 1;
+    }
+    while (pos < s->len) {
+        size_t len = 1 + rand() % MAX_WRITE;
+
+        if (len > s->len - pos)
+            len = s->len - pos;
+        while (len > 0) {
+            size_t frames;
+            uint32_t samples;
+            size_t used = iec61937_pack(&iec, s->data + pos, len, burst, &frames, &samples);
+
+            pos += used;
+            len -= used;
+            if (frames == 0)
+                continue;
+            if (n >= s->num_bursts) {
+                printf("%s: unexpected burst %d\n", name, n);
+                errors++;
+            } else {
+                errors += check_burst(s, &s->bursts[n], frames, samples, n);
+            }
+            n++;
+        }
+    }
+    if (n != s->num_bursts) {
+        printf("%s: %d bursts, expected %d\n", name, n, s->num_bursts);
+        errors++;
+    }
+    if (iec.skipped != s->garbage) {
+        printf("%s: %u bytes skipped, expected %u\n", name, iec.skipped, s->garbage);
+        errors++;
+    }
+    printf("%s: %d bursts, %u bytes skipped, %d errors\n", name, n, iec.skipped, errors);
+    iec61937_release(&iec);
+    return errors;
+}
+
+/* 640 kbit/s AC-3 at 48 kHz, written 6144 bytes at a time */
+static void bench(void)
+{
+    struct iec61937 iec;
+    uint8_t *data;
+    size_t frame = 2560, len = frame * 32, done = 0;
+    size_t i, total = (size_t)BENCH_SECONDS * 48000 / 1536 * frame;
+    int64_t t0;
+
+    data = malloc(len);
+    if (data == NULL || iec61937_init(&iec, AUDIO_FORMAT_AC3, 48000) != 0)
+        return;
+    for (i = 0; i < len; i++)
+        data[i] = rand();
+    for (i = 0; i < len; i += frame) {
+        data[i] = 0x0b;
+        data[i + 1] = 0x77;
+        data[i + 4] = 36;
+        data[i + 5] = 8 << 3;
+    }
+
+    t0 = cpu_ns();
+    while (done < total) {
+        size_t off = 0;
+
+        while (off < len) {
+            size_t frames;
+            uint32_t samples;
+
+            off += iec61937_pack(&iec, data + off, len - off < 6144 ? len - off : 6144, burst,
+                                 &frames, &samples);
+        }
+        done += len;
+    }
+    printf("ac3 640 kbit/s: %.3f ms cpu per second\n",
+           (cpu_ns() - t0) / 1e6 / BENCH_SECONDS);
+    iec61937_release(&iec);
+    free(data);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int seed = 1;
+    int opt, errors = 0;
+
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch (opt) {
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s seed]\n", argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    srand(seed);
+
+    make_ac3(&stream);
+    errors += run("ac3", AUDIO_FORMAT_AC3, &stream);
+    make_eac3(&stream);
+    errors += run("eac3", AUDIO_FORMAT_E_AC3, &stream);
+    make_dts(&stream);
+    errors += run("dts", AUDIO_FORMAT_DTS, &stream);
+
+    if (errors != 0) {
+        printf("FAIL\n");
+        return 1;
+    }
+    bench();
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,178 @@
+#!/usr/bin/python
+###
+### Copyright (C) 2012 The Android Open Source Project
+###
+### Licensed under the Apache License, Version 2.0 (the "License");
+### you may not use this file except in compliance with the License.
+### You may obtain a copy of the License at
+###
+###      http://www.apache.org/licenses/LICENSE-2.0
+###
+### Unless required by applicable law or agreed to in writing, software
+### distributed under the License is distributed on an "AS IS" BASIS,
+### WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+### See the License for the specific language governing permissions and
+### limitations under the License.
+###
+
+#
+# Performance regression suite of the primary audio HAL.  Runs the
+# audio_bench workloads (playback, start_stop, route_flap, mix,
+# capture_effects)
+# and compares their CPU time, wakeups, call latency percentiles and xruns
+# with a stored baseline.
+#
+# On the device (the default) audio_bench must be installed and
+# mediaserver is stopped while the HAL is in use.  With --host OUT, the
+# host build of the HAL (audio.primary.host, on the simulated tinyalsa) is
+# measured instead with audio_bench_host, OUT being the host output
+# directory, e.g. out/host/linux-x86.
+#
+#   perf-regression.py [--host OUT] [--seconds N] [--results FILE]
+#                      [--baseline FILE] [--update]
+#
+# --update writes the results as the new baseline instead of comparing.
+#
+
+import sys, os, os.path, json, getopt
+import TestFlinger
+
+WORKLOADS = [ 'playback', 'start_stop', 'route_flap', 'mix', 'capture_effects' ]
+DEFAULT_SECONDS = 10
+
+# metric: (relative, absolute) regression allowed over the baseline
+TOLERANCES = {
+    'cpu_ms_per_s':  (0.25, 1.0),
+    'wakeups_per_s': (0.25, 5.0),
+    'p50_ms':        (0.10, 1.0),
+    'p90_ms':        (0.20, 2.0),
+    'p99_ms':        (0.50, 5.0),
+    'xruns':         (0.0, 0),
+    'frames_lost':   (0.0, 0),
+    'errors':        (0.0, 0),
+    }
+
+# metrics kept in a baseline
+BASELINE_METRICS = TOLERANCES.keys() + [ 'max_ms', 'calls' ]
+
+def default_baseline(host):
+    here = os.path.dirname(os.path.abspath(__file__))
+    return os.path.join(here, "perf-baseline-%s.json" % ("host" if host else "device",))
+
+def bench_command(host, workload, seconds):
+    """Returns the TestCase filename and args running one workload."""
+    if host is not None:
+        return (os.path.join(host, "bin", "audio_bench_host"),
+                [ "-l", os.path.join(host, "lib", "audio.primary.host.so"),
+                  "-w", workload, "-s", str(seconds) ])
+    return ("adb", [ "shell", "audio_bench -w %s -s %d" % (workload, seconds) ])
+
+def load_baseline(filename):
+    if not os.path.exists(filename):
+        return None
+    f = open(filename)
+    try:
+        return json.load(f)
+    finally:
+        f.close()
+
+def save_json(filename, data):
+    f = open(filename, 'w')
+    try:
+        json.dump(data, f, indent=4, sort_keys=True, separators=(",", ": "))
+        f.write("\n")
+    finally:
+        f.close()
+
+def usage():
+    print "usage: perf-regression.py [--host OUT] [--seconds N] [--results FILE]"
+    print "                          [--baseline FILE] [--update]"
+
+def main(argv = []):
+    try:
+        opts, args = getopt.getopt(argv[1:], "h",
+                                   [ "host=", "seconds=", "results=", "baseline=",
+                                     "update", "help" ])
+    except getopt.GetoptError, e:
+        print e
+        usage()
+        return 1
+
+    host = None
+    seconds = DEFAULT_SECONDS
+    results_file = None
+    baseline_file = None
+    update = False
+    for o, a in opts:
+        if o == "--host":
+            host = a
+        elif o == "--seconds":
+            seconds = int(a)
+        elif o == "--results":
+            results_file = a
+        elif o == "--baseline":
+            baseline_file = a
+        elif o == "--update":
+            update = True
+        else:
+            usage()
+            return 0
+    if baseline_file is None:
+        baseline_file = default_baseline(host is not None)
+
+    baseline = None
+    if not update:
+        baseline = load_baseline(baseline_file)
+        if baseline is None:
+            print "WARNING: no baseline %s, results are not compared" % (baseline_file,)
+
+    if host is None:
+        os.system("adb shell stop media")
+
+    results = {}
+    failed = False
+    try:
+        for workload in WORKLOADS:
+            filename, args = bench_command(host, workload, seconds)
+            test = { 'filename': filename,
+                     'args':     args,
+                     'timeout':  seconds * 3 + 30,
+                     'tolerances': TOLERANCES, }
+            if baseline is not None and workload in baseline:
+                test['baseline'] = { workload: baseline[workload] }
+            tcase = TestFlinger.BenchmarkCase(test)
+            if not tcase.start():
+                failed = True
+                continue
+            tcase.wait()
+            verdict = tcase.verdict()
+            for r in tcase.regressions():
+                print "  " + r
+            print "%s: %s" % (workload, verdict)
+            if verdict != "PASS":
+                failed = True
+            results.update(tcase.results())
+    finally:
+        if host is None:
+            os.system("adb shell start media")
+
+    if results_file is not None:
+        save_json(results_file, results)
+    if update:
+        if failed:
+            print "ERROR: not updating %s, a workload failed" % (baseline_file,)
+            return 1
+        save_json(baseline_file,
+                  dict((w, dict((m, r[m]) for m in BASELINE_METRICS if m in r))
+                       for w, r in results.items()))
+        print "Baseline written to", baseline_file
+
+    if failed:
+        print "FAIL"
+        return 1
+    print "PASS"
+    return 0
+
+if __name__ == "__main__":
+    rv = main(sys.argv)
+    sys.exit(rv)
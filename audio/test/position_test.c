@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Render and presentation position bookkeeping (playback_position.c)
+ * against a simulated output: a writer paced like out_write(), a
+ * resampler that holds back a varying number of frames plus a fixed group
+ * delay, and a DAC draining the kernel buffer at the pcm rate, all on a
+ * simulated clock.  Positions are queried at random times, across
+ * standby and a pcm rate change, and must never go backwards nor be more
+ * than MAX_ERROR_FRAMES away from what the DAC really played.  Positions
+ * are whole frames while a resampled run ends on a fraction of one, so
+ * each standby may leave up to MAX_STANDBY_DRIFT_FRAMES of offset; that
+ * offset is the reference for the next run and is checked on its own.
+ *
+ *   position_test [-s seed]
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "playback_position.h"
+
+#define STREAM_RATE 44100
+#define CHUNK_FRAMES 1764               /* out_write() size, stream frames */
+#define THRESHOLD_FRAMES 3840           /* kernel fill the writer waits for */
+#define GROUP_DELAY_FRAMES 24           /* resampler, stream frames */
+#define MAX_HELD_FRAMES 48
+#define RUNS 20
+#define WRITES_PER_RUN 500
+#define QUERIES_PER_WRITE 3
+#define MAX_ERROR_FRAMES 2
+#define MAX_STANDBY_DRIFT_FRAMES 1
+
+struct sim {
+    struct playback_position pos;
+    uint32_t pcm_rate;
+    double queued;                      /* pcm frames in the kernel buffer */
+    double produced;                    /* pcm frames the resampler produced this run */
+    double time_carry;                  /* DAC time not yet worth a whole frame */
+    double played;                      /* stream frames the DAC played, all runs */
+    double run_output;                  /* stream frames the resampler produced this run */
+    unsigned int held;                  /* frames held back by the resampler */
+    double offset;                      /* position less played at the last standby */
+    uint64_t last;
+    uint32_t last_render;
+    int errors;
+};
+
+static double rnd(void)
+{
+    return rand() / (RAND_MAX + 1.0);
+}
+
+/* the group delay, the frames held and the part of a frame not yet output */
+static int64_t delay_ns(const struct sim *sim)
+{
+    double frames = GROUP_DELAY_FRAMES + sim->held +
+            (sim->run_output - sim->produced * STREAM_RATE / sim->pcm_rate);
+
+    return (int64_t)(frames * 1000000000.0 / STREAM_RATE);
+}
+
+/* the DAC runs for dt seconds, a whole frame at a time; the first
+ * GROUP_DELAY_FRAMES produced in a run are the resampler's start up, not
+ * stream audio */
+static void advance(struct sim *sim, double dt)
+{
+    double frames = floor((dt + sim->time_carry) * sim->pcm_rate);
+    double before, after;
+
+    sim->time_carry += dt - frames / sim->pcm_rate;
+    if (frames >= sim->queued) {
+        frames = sim->queued;
+        sim->time_carry = 0;
+    }
+    before = (sim->produced - sim->queued) * STREAM_RATE / sim->pcm_rate;
+    sim->queued -= frames;
+    after = (sim->produced - sim->queued) * STREAM_RATE / sim->pcm_rate;
+    sim->played += fmax(0, after - GROUP_DELAY_FRAMES) - fmax(0, before - GROUP_DELAY_FRAMES);
+}
+
+static void query(struct sim *sim)
+{
+    uint32_t queued = (uint32_t)sim->queued;
+    uint64_t presented = playback_position_get(&sim->pos, queued, delay_ns(sim));
+    uint32_t render = playback_position_render(&sim->pos, queued, delay_ns(sim));
+
+    if (presented < sim->last || render < sim->last_render) {
+        printf("position went back: %llu after %llu\n",
+               (unsigned long long)presented, (unsigned long long)sim->last);
+        sim->errors++;
+    }
+    if (fabs(presented - sim->played - sim->offset) > MAX_ERROR_FRAMES) {
+        printf("position %llu, played %.1f, offset %.1f\n", (unsigned long long)presented,
+               sim->played, sim->offset);
+        sim->errors++;
+    }
+    sim->last = presented;
+    sim->last_render = render;
+}
+
+static void run(struct sim *sim, uint32_t pcm_rate)
+{
+    int w, q;
+
+    sim->pcm_rate = pcm_rate;
+    sim->run_output = 0;
+    sim->produced = 0;
+    sim->time_carry = 0;
+    sim->held = 0;
+    sim->last_render = 0;
+    playback_position_start(&sim->pos, pcm_rate);
+
+    for (w = 0; w < WRITES_PER_RUN; w++) {
+        unsigned int held = rand() % MAX_HELD_FRAMES;
+        double out = CHUNK_FRAMES + sim->held - held;
+
+        /* wait_for_write_threshold(), with queries while blocked */
+        if (sim->queued > THRESHOLD_FRAMES) {
+            double wait = (sim->queued - THRESHOLD_FRAMES) / pcm_rate;
+            for (q = 0; q < QUERIES_PER_WRITE; q++) {
+                double dt = wait * rnd() / QUERIES_PER_WRITE;
+                advance(sim, dt);
+                wait -= dt;
+                query(sim);
+            }
+            advance(sim, wait);
+        }
+
+        /* whole pcm frames; the stream frames they carry need not be */
+        sim->held = held;
+        sim->run_output += out;
+        out = floor(sim->run_output * pcm_rate / STREAM_RATE) - sim->produced;
+        sim->produced += out;
+        sim->queued += out;
+        playback_position_add(&sim->pos, CHUNK_FRAMES);
+        query(sim);
+    }
+
+    /* play a little more, then standby drops the rest */
+    advance(sim, rnd() * sim->queued / pcm_rate);
+    query(sim);
+    playback_position_standby(&sim->pos, (uint32_t)sim->queued, delay_ns(sim));
+    sim->queued = 0;
+    query(sim);
+
+    if (fabs(sim->last - sim->played - sim->offset) > MAX_STANDBY_DRIFT_FRAMES) {
+        printf("standby moved the position by %.1f frames\n",
+               sim->last - sim->played - sim->offset);
+        sim->errors++;
+    }
+    sim->offset = sim->last - sim->played;
+}
+
+int main(int argc, char **argv)
+{
+    static const uint32_t pcm_rates[] = { 48000, 44100, 48000 };
+    struct sim sim = { .errors = 0 };
+    unsigned int seed = 1;
+    int opt, r;
+
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch (opt) {
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s seed]\n", argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    srand(seed);
+
+    playback_position_init(&sim.pos, STREAM_RATE);
+    for (r = 0; r < RUNS && sim.errors < 10; r++)
+        run(&sim, pcm_rates[r % (sizeof(pcm_rates) / sizeof(pcm_rates[0]))]);
+
+    printf("%d runs, %llu frames presented, %.1f frames off, %d errors\n", r,
+           (unsigned long long)sim.last, sim.offset, sim.errors);
+    if (sim.errors != 0) {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Checks the channel_remix.h kernels against plain C on random data, for
+ * every length up to a few vector blocks, out of place and (channel
+ * reorders and downmixes) in place, and the stream mixing kernels with random gains and
+ * MIX_MAX_STREAMS full scale inputs.  Then reports the CPU time per second
+ * of 48 kHz audio of each kernel and of the byte by byte channel removal
+ * it replaced.  Exits non zero on any mismatch.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "channel_remix.h"
+
+#define MAX_CHECK_FRAMES 67
+#define MAX_CHANNELS 8
+#define MINUS_3DB 11585             /* Q14 */
+#define PERIOD_FRAMES 1024          /* pcm_config_mm_ul period */
+#define BENCH_SECONDS 600
+#define RATE 48000
+
+static int64_t cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void ref_pick(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        dst[i] = src[i * 2];
+}
+
+static void ref_avg(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        dst[i] = (int16_t)(((int32_t)src[i * 2] + src[i * 2 + 1]) >> 1);
+}
+
+static void ref_dup(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        dst[i * 2] = dst[i * 2 + 1] = src[i];
+}
+
+static void ref_5point1_to_cea(int16_t *dst, const int16_t *src, size_t frames)
+{
+    static const int map[6] = { 0, 1, 3, 2, 4, 5 };
+    size_t i, c;
+
+    for (i = 0; i < frames; i++)
+        for (c = 0; c < 6; c++)
+            dst[i * 6 + c] = src[i * 6 + map[c]];
+}
+
+static void ref_7point1_to_cea(int16_t *dst, const int16_t *src, size_t frames)
+{
+    static const int map[8] = { 0, 1, 3, 2, 6, 7, 4, 5 };
+    size_t i, c;
+
+    for (i = 0; i < frames; i++)
+        for (c = 0; c < 8; c++)
+            dst[i * 8 + c] = src[i * 8 + map[c]];
+}
+
+static int16_t ref_downmix(int64_t front, int64_t center, int64_t surround)
+{
+    int64_t v = (front * 16384 + center * MINUS_3DB + surround * MINUS_3DB) >> 14;
+
+    return v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+}
+
+static void ref_cea_5point1_down(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i;
+
+    for (i = 0; i < frames; i++) {
+        const int16_t *s = src + i * 6;
+
+        dst[i * 2] = ref_downmix(s[0], s[3], s[4]);
+        dst[i * 2 + 1] = ref_downmix(s[1], s[3], s[5]);
+    }
+}
+
+static void ref_cea_7point1_down(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i;
+
+    for (i = 0; i < frames; i++) {
+        const int16_t *s = src + i * 8;
+
+        dst[i * 2] = ref_downmix(s[0], s[3], (int64_t)s[4] + s[6]);
+        dst[i * 2 + 1] = ref_downmix(s[1], s[3], (int64_t)s[5] + s[7]);
+    }
+}
+
+/* the removed remove_channels_from_buf(), stereo to mono */
+static void byte_loop(int16_t *dst, const int16_t *src, size_t frames)
+{
+    const size_t in_frame = 2 * sizeof(int16_t), out_frame = sizeof(int16_t);
+    char *d = (char *)dst;
+    const char *s = (const char *)src;
+    size_t n, c;
+
+    for (n = 0; n < frames; n++) {
+        for (c = 0; c < out_frame; ++c)
+            d[c] = s[c];
+        d += out_frame;
+        s += in_frame;
+    }
+}
+
+struct kernel {
+    const char *name;
+    channel_remix_i16_t func;
+    channel_remix_i16_t ref;
+    size_t in_chans;
+    size_t out_chans;
+};
+
+static const struct kernel kernels[] = {
+    { "stereo->mono pick", remix_stereo_to_mono_pick_i16, ref_pick, 2, 1 },
+    { "stereo->mono avg", remix_stereo_to_mono_avg_i16, ref_avg, 2, 1 },
+    { "mono->stereo dup", remix_mono_to_stereo_i16, ref_dup, 1, 2 },
+    { "byte loop (old)", byte_loop, ref_pick, 2, 1 },
+    { "5.1->cea", remix_5point1_to_cea_i16, ref_5point1_to_cea, 6, 6 },
+    { "7.1->cea", remix_7point1_to_cea_i16, ref_7point1_to_cea, 8, 8 },
+    { "cea 5.1->stereo", remix_cea_5point1_to_stereo_i16, ref_cea_5point1_down, 6, 2 },
+    { "cea 7.1->stereo", remix_cea_7point1_to_stereo_i16, ref_cea_7point1_down, 8, 2 },
+};
+
+static int check(const struct kernel *k)
+{
+    int16_t src[MAX_CHECK_FRAMES * MAX_CHANNELS + 1], dst[MAX_CHECK_FRAMES * MAX_CHANNELS + 1];
+    int16_t ref[MAX_CHECK_FRAMES * MAX_CHANNELS + 1], buf[MAX_CHECK_FRAMES * MAX_CHANNELS + 1];
+    size_t frames, offset, i;
+
+    for (frames = 0; frames <= MAX_CHECK_FRAMES; frames++) {
+        /* odd offsets exercise unaligned loads and stores */
+        for (offset = 0; offset < 2; offset++) {
+            for (i = 0; i < frames * k->in_chans + 1; i++)
+                src[i] = (int16_t)rand();
+            src[offset] = -32768;
+            memset(dst, 0x55, sizeof(dst));
+            memset(ref, 0x55, sizeof(ref));
+
+            k->func(dst + offset, src + offset, frames);
+            k->ref(ref + offset, src + offset, frames);
+            if (memcmp(dst, ref, sizeof(dst)) != 0) {
+                printf("FAIL: %s differs at %zu frames\n", k->name, frames);
+                return 1;
+            }
+
+            if (k->in_chans >= k->out_chans) {
+                memcpy(buf, src, sizeof(buf));
+                k->func(buf + offset, buf + offset, frames);
+                if (memcmp(buf + offset, ref + offset,
+                           frames * k->out_chans * sizeof(int16_t)) != 0) {
+                    printf("FAIL: %s in place differs at %zu frames\n", k->name, frames);
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int check_mix(void)
+{
+    int16_t src[MIX_MAX_STREAMS][MAX_CHECK_FRAMES * 2], dst[MAX_CHECK_FRAMES * 2];
+    int16_t gains[MIX_MAX_STREAMS][2];
+    int32_t acc[MAX_CHECK_FRAMES * 2];
+    size_t frames, s, i;
+    int full;
+
+    for (frames = 0; frames <= MAX_CHECK_FRAMES; frames++) {
+        for (full = 0; full < 2; full++) {
+            memset(acc, 0, sizeof(acc));
+            for (s = 0; s < MIX_MAX_STREAMS; s++) {
+                gains[s][0] = full ? MIX_UNITY_GAIN : rand() % (MIX_UNITY_GAIN + 1);
+                gains[s][1] = full ? MIX_UNITY_GAIN : rand() % (MIX_UNITY_GAIN + 1);
+                for (i = 0; i < frames * 2; i++)
+                    src[s][i] = full ? ((i & 2) ? 32767 : -32768) : (int16_t)rand();
+                mix_accumulate_i16(acc, src[s], frames, gains[s][0], gains[s][1]);
+            }
+            mix_clamp_i16(dst, acc, frames * 2);
+
+            for (i = 0; i < frames * 2; i++) {
+                int64_t sum = 0;
+
+                for (s = 0; s < MIX_MAX_STREAMS; s++)
+                    sum += (int64_t)src[s][i] * gains[s][i & 1];
+                sum >>= MIX_GAIN_SHIFT;
+                sum = sum > 32767 ? 32767 : (sum < -32768 ? -32768 : sum);
+                if (dst[i] != sum) {
+                    printf("FAIL: mix differs at %zu frames, sample %zu\n", frames, i);
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/* two streams at 48 kHz, as the output mixer runs them */
+static double bench_mix(void)
+{
+    int16_t *src = calloc(PERIOD_FRAMES * 2, sizeof(int16_t));
+    int16_t *dst = calloc(PERIOD_FRAMES * 2, sizeof(int16_t));
+    int32_t *acc = calloc(PERIOD_FRAMES * 2, sizeof(int32_t));
+    size_t periods = (size_t)RATE * BENCH_SECONDS / PERIOD_FRAMES, p;
+    int64_t t0;
+
+    if (src == NULL || dst == NULL || acc == NULL) {
+        free(src);
+        free(dst);
+        free(acc);
+        return -1;
+    }
+    for (p = 0; p < PERIOD_FRAMES * 2; p++)
+        src[p] = (int16_t)rand();
+
+    t0 = cpu_ns();
+    for (p = 0; p < periods; p++) {
+        memset(acc, 0, PERIOD_FRAMES * 2 * sizeof(int32_t));
+        mix_accumulate_i16(acc, src, PERIOD_FRAMES, MIX_UNITY_GAIN, MIX_UNITY_GAIN);
+        mix_accumulate_i16(acc, src, PERIOD_FRAMES, MIX_UNITY_GAIN / 2, MIX_UNITY_GAIN / 3);
+        mix_clamp_i16(dst, acc, PERIOD_FRAMES * 2);
+        __asm__ __volatile__("" : : "r"(dst) : "memory");
+    }
+    t0 = cpu_ns() - t0;
+
+    free(src);
+    free(dst);
+    free(acc);
+    return t0 / 1e3 / BENCH_SECONDS;
+}
+
+static double bench(const struct kernel *k)
+{
+    int16_t *src = calloc(PERIOD_FRAMES * MAX_CHANNELS, sizeof(int16_t));
+    int16_t *dst = calloc(PERIOD_FRAMES * MAX_CHANNELS, sizeof(int16_t));
+    size_t periods = (size_t)RATE * BENCH_SECONDS / PERIOD_FRAMES, p;
+    int64_t t0;
+
+    if (src == NULL || dst == NULL) {
+        free(src);
+        free(dst);
+        return -1;
+    }
+    for (p = 0; p < PERIOD_FRAMES * MAX_CHANNELS; p++)
+        src[p] = (int16_t)rand();
+
+    t0 = cpu_ns();
+    for (p = 0; p < periods; p++) {
+        k->func(dst, src, PERIOD_FRAMES);
+        /* keep the compiler from dropping the calls */
+        __asm__ __volatile__("" : : "r"(dst) : "memory");
+    }
+    t0 = cpu_ns() - t0;
+
+    free(src);
+    free(dst);
+    return t0 / 1e3 / BENCH_SECONDS;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int i;
+    int ret = 0;
+
+    srand(1);
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        ret |= check(&kernels[i]);
+        printf("%-18s %.1f us per second of audio\n", kernels[i].name, bench(&kernels[i]));
+    }
+
+    ret |= check_mix();
+    printf("%-18s %.1f us per second of audio\n", "mix 2 streams", bench_mix());
+
+    if (ret == 0)
+        printf("PASS\n");
+    return ret;
+}
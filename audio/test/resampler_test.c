@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Quality and cost of the 44.1 -> 48 kHz playback resamplers.
+ *
+ * THD+N is measured on full scale (-1 dBFS) tones, passband ripple on
+ * tones from 20 Hz to 20 kHz; both use a least squares fit of the known
+ * output frequency.  The benchmark feeds 60 s of audio in out_write()
+ * sized chunks and reports the CPU time per second of audio of
+ * create_resampler_147_160() and of create_resampler(), the generic
+ * libaudioutils path.  Exits non zero if the 147:160 resampler misses
+ * its THD+N or ripple limits.
+ *
+ *   resampler_test [-q quality]
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <audio_utils/resampler.h>
+
+#include "resampler_147_160.h"
+
+#define IN_RATE RESAMPLER_147_160_IN_RATE
+#define OUT_RATE RESAMPLER_147_160_OUT_RATE
+#define CHUNK_FRAMES 1764           /* 40 ms at 44.1 kHz, as out_write() gets it */
+#define OUT_CHUNK_FRAMES 3840
+#define TONE_SECONDS 1
+#define SETTLE_FRAMES 2048          /* skipped at the start of the output */
+#define BENCH_SECONDS 60
+#define MAX_THDN_DB -85.0
+#define MAX_RIPPLE_DB 0.05
+
+typedef int (*create_fn)(struct resampler_itfe **rs, int quality);
+
+static int create_147_160(struct resampler_itfe **rs, int quality)
+{
+    return create_resampler_147_160(rs);
+}
+
+static int create_generic(struct resampler_itfe **rs, int quality)
+{
+    return create_resampler(IN_RATE, OUT_RATE, 2, quality, NULL, rs);
+}
+
+struct candidate {
+    const char *name;
+    create_fn create;
+    void (*release)(struct resampler_itfe *rs);
+};
+
+static const struct candidate candidates[] = {
+    { "147:160", create_147_160, release_resampler_147_160 },
+    { "generic", create_generic, release_resampler },
+};
+
+static int64_t cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Runs in_frames of in through rs in CHUNK_FRAMES pieces, returns the
+ * number of output frames. */
+static size_t run(struct resampler_itfe *rs, const int16_t *in, size_t in_frames,
+                  int16_t *out, size_t out_max)
+{
+    size_t in_pos = 0, out_pos = 0;
+
+    while (in_pos < in_frames && out_pos < out_max) {
+        size_t n = in_frames - in_pos;
+        size_t m = out_max - out_pos;
+
+        if (n > CHUNK_FRAMES)
+            n = CHUNK_FRAMES;
+        if (m > OUT_CHUNK_FRAMES)
+            m = OUT_CHUNK_FRAMES;
+        rs->resample_from_input(rs, (int16_t *)in + in_pos * 2, &n, out + out_pos * 2, &m);
+        if (n == 0 && m == 0)
+            break;
+        in_pos += n;
+        out_pos += m;
+    }
+    return out_pos;
+}
+
+static void make_tone(int16_t *buf, size_t frames, double freq, double level)
+{
+    size_t i;
+
+    for (i = 0; i < frames; i++) {
+        int16_t v = (int16_t)lrint(level * 32767.0 * sin(2 * M_PI * freq * i / IN_RATE));
+        buf[i * 2] = v;
+        buf[i * 2 + 1] = v;
+    }
+}
+
+/* Least squares fit of a sine of freq on the left channel; returns its
+ * amplitude and the power of what is left. */
+static void fit_tone(const int16_t *buf, size_t frames, double freq,
+                     double *amplitude, double *residual)
+{
+    double ss = 0, sc = 0, cc = 0, ys = 0, yc = 0, a, b, det, res = 0;
+    size_t i;
+
+    for (i = 0; i < frames; i++) {
+        double w = 2 * M_PI * freq * i / OUT_RATE;
+        double s = sin(w), c = cos(w), y = buf[i * 2];
+        ss += s * s;
+        sc += s * c;
+        cc += c * c;
+        ys += y * s;
+        yc += y * c;
+    }
+    det = ss * cc - sc * sc;
+    a = (ys * cc - yc * sc) / det;
+    b = (yc * ss - ys * sc) / det;
+
+    for (i = 0; i < frames; i++) {
+        double w = 2 * M_PI * freq * i / OUT_RATE;
+        double e = buf[i * 2] - (a * sin(w) + b * cos(w));
+        res += e * e;
+    }
+
+    *amplitude = sqrt(a * a + b * b);
+    *residual = res / frames;
+}
+
+static int measure_tone(const struct candidate *cand, int quality, double freq,
+                        double level, double *gain_db, double *thdn_db)
+{
+    size_t in_frames = IN_RATE * TONE_SECONDS;
+    size_t out_max = OUT_RATE * TONE_SECONDS;
+    int16_t *in = malloc(in_frames * 2 * sizeof(int16_t));
+    int16_t *out = malloc(out_max * 2 * sizeof(int16_t));
+    struct resampler_itfe *rs;
+    double amplitude, residual;
+    size_t out_frames;
+    int ret = -1;
+
+    if (in == NULL || out == NULL || cand->create(&rs, quality) != 0)
+        goto exit;
+
+    make_tone(in, in_frames, freq, level);
+    out_frames = run(rs, in, in_frames, out, out_max);
+    cand->release(rs);
+    if (out_frames <= SETTLE_FRAMES * 2)
+        goto exit;
+
+    /* drop the filter start up and the tail still in the filter */
+    fit_tone(out + SETTLE_FRAMES * 2, out_frames - SETTLE_FRAMES * 2, freq,
+             &amplitude, &residual);
+    *gain_db = 20 * log10(amplitude / (level * 32767.0));
+    *thdn_db = 10 * log10(residual / (amplitude * amplitude / 2));
+    ret = 0;
+
+exit:
+    free(in);
+    free(out);
+    return ret;
+}
+
+static int bench(const struct candidate *cand, int quality, double *cpu_ms_per_s)
+{
+    size_t in_frames = IN_RATE * BENCH_SECONDS;
+    size_t out_max = OUT_RATE * BENCH_SECONDS + OUT_CHUNK_FRAMES;
+    int16_t *in = malloc(in_frames * 2 * sizeof(int16_t));
+    int16_t *out = malloc(out_max * 2 * sizeof(int16_t));
+    struct resampler_itfe *rs;
+    unsigned int seed = 1;
+    int64_t t0;
+    size_t i;
+    int ret = -1;
+
+    if (in == NULL || out == NULL || cand->create(&rs, quality) != 0)
+        goto exit;
+
+    /* a tone plus noise, so no path can shortcut on silence */
+    make_tone(in, in_frames, 997.0, 0.5);
+    for (i = 0; i < in_frames * 2; i++) {
+        seed = seed * 1103515245 + 12345;
+        in[i] += (int16_t)((seed >> 16) & 0x3fff) - 0x2000;
+    }
+
+    t0 = cpu_ns();
+    run(rs, in, in_frames, out, out_max);
+    *cpu_ms_per_s = (cpu_ns() - t0) / 1e6 / BENCH_SECONDS;
+    cand->release(rs);
+    ret = 0;
+
+exit:
+    free(in);
+    free(out);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    static const double ripple_freqs[] = {
+        20, 50, 100, 200, 500, 1000, 2000, 5000, 8000, 10000,
+        12000, 14000, 16000, 17000, 18000, 19000, 20000,
+    };
+    static const double thdn_freqs[] = { 1000, 10000, 18000 };
+    int quality = RESAMPLER_QUALITY_DEFAULT;
+    int opt, ret = 0;
+    unsigned int c, i;
+
+    while ((opt = getopt(argc, argv, "q:h")) != -1) {
+        switch (opt) {
+        case 'q':
+            quality = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-q quality]\n", argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    for (c = 0; c < sizeof(candidates) / sizeof(candidates[0]); c++) {
+        const struct candidate *cand = &candidates[c];
+        double min_db = 1e9, max_db = -1e9, gain_db, thdn_db, worst_thdn = -1e9;
+        double cpu_ms;
+        bool checked = (c == 0);
+
+        for (i = 0; i < sizeof(ripple_freqs) / sizeof(ripple_freqs[0]); i++) {
+            if (measure_tone(cand, quality, ripple_freqs[i], 0.5, &gain_db, &thdn_db) != 0)
+                break;
+            if (gain_db < min_db)
+                min_db = gain_db;
+            if (gain_db > max_db)
+                max_db = gain_db;
+        }
+        if (i < sizeof(ripple_freqs) / sizeof(ripple_freqs[0])) {
+            printf("%-8s unavailable\n", cand->name);
+            if (checked)
+                ret = 1;
+            continue;
+        }
+
+        printf("%-8s ripple 20 Hz-20 kHz: %.3f dB (%+.3f..%+.3f)\n",
+               cand->name, max_db - min_db, min_db, max_db);
+        for (i = 0; i < sizeof(thdn_freqs) / sizeof(thdn_freqs[0]); i++) {
+            measure_tone(cand, quality, thdn_freqs[i], 0.891, &gain_db, &thdn_db);
+            printf("%-8s THD+N %5.0f Hz -1 dBFS: %.1f dB\n", cand->name, thdn_freqs[i], thdn_db);
+            if (thdn_db > worst_thdn)
+                worst_thdn = thdn_db;
+        }
+        if (bench(cand, quality, &cpu_ms) == 0)
+            printf("%-8s CPU: %.2f ms per second of audio\n", cand->name, cpu_ms);
+
+        if (checked && (max_db - min_db > MAX_RIPPLE_DB || worst_thdn > MAX_THDN_DB)) {
+            printf("FAIL: %s above %.2f dB ripple or %.0f dB THD+N\n",
+                   cand->name, MAX_RIPPLE_DB, MAX_THDN_DB);
+            ret = 1;
+        }
+    }
+
+    if (ret == 0)
+        printf("PASS\n");
+    return ret;
+}
@@ -51,6 +51,10 @@ g_tests = [
 
     { 'filename': 'music-monkey.py',
       'timeout':  60*30, },
+    { 'filename': 'fast-latency.py',
+      'timeout':  60, },
+    { 'filename': 'perf-regression.py',
+      'timeout':  60*5, },
     ]
 
 # These executables are known to be needed for the tests.
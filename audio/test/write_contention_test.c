@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Checks that a playing output stream of the primary audio HAL is not
+ * held up by control calls on the device.
+ *
+ * The HAL is driven directly, so mediaserver must be stopped first.  One
+ * thread writes silence to an output stream opened with the given flags
+ * and times every out_write().  The run has two phases of equal length:
+ * in the first nothing else happens, in the second a control thread
+ * keeps taking the hw device mutex the way the framework does, starting
+ * and stopping a capture stream and setting device parameters.  The
+ * write times of both phases are reported; the test fails if the 99th
+ * percentile of the second exceeds that of the first by more than -m.
+ *
+ *   write_contention_test [-f out_flags] [-s seconds] [-m max_ms]
+ *
+ * out_flags defaults to AUDIO_OUTPUT_FLAG_FAST.
+ */
+
+#define LOG_TAG "write_contention_test"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hardware/hardware.h>
+#include <hardware/audio.h>
+#include <system/audio.h>
+
+#define SAMPLE_RATE 48000
+#define DEFAULT_SECONDS 10
+#define DEFAULT_MAX_MS 2
+#define MAX_WRITES 100000
+#define CAPTURE_FRAMES 320
+
+enum {
+    PHASE_IDLE,
+    PHASE_LOADED,
+    PHASE_COUNT,
+};
+
+static const char *phase_names[PHASE_COUNT] = { "idle", "loaded" };
+
+struct writer {
+    struct audio_stream_out *out;
+    volatile int phase;
+    volatile int stop;
+    int error;
+    int64_t *write_ns[PHASE_COUNT];
+    int writes[PHASE_COUNT];
+};
+
+struct control {
+    audio_hw_device_t *dev;
+    volatile int stop;
+    int cycles;
+    int64_t max_ns;
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void *writer_thread(void *data)
+{
+    struct writer *w = (struct writer *)data;
+    struct audio_stream_out *out = w->out;
+    size_t bytes = out->common.get_buffer_size(&out->common);
+    int16_t *buf = calloc(1, bytes);
+
+    if (buf == NULL) {
+        w->error = -ENOMEM;
+        return NULL;
+    }
+
+    while (!w->stop) {
+        int phase = w->phase;
+        int64_t t0 = now_ns();
+
+        if (out->write(out, buf, bytes) < 0) {
+            w->error = -EIO;
+            break;
+        }
+        if (w->writes[phase] < MAX_WRITES)
+            w->write_ns[phase][w->writes[phase]++] = now_ns() - t0;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/* What the framework does on the device while music plays: a capture
+ * client starting and stopping, and parameter updates. */
+static void *control_thread(void *data)
+{
+    struct control *c = (struct control *)data;
+    audio_hw_device_t *dev = c->dev;
+    int16_t buf[CAPTURE_FRAMES * 2];
+
+    while (!c->stop) {
+        struct audio_stream_in *in = NULL;
+        struct audio_config config;
+        int64_t t0 = now_ns(), t;
+
+        memset(&config, 0, sizeof(config));
+        config.sample_rate = SAMPLE_RATE;
+        config.channel_mask = AUDIO_CHANNEL_IN_MONO;
+        config.format = AUDIO_FORMAT_PCM_16_BIT;
+        if (dev->open_input_stream(dev, 1, AUDIO_DEVICE_IN_BUILTIN_MIC, &config, &in) == 0) {
+            in->read(in, buf, CAPTURE_FRAMES * sizeof(int16_t));
+            in->common.standby(&in->common);
+            dev->close_input_stream(dev, in);
+        }
+        dev->set_parameters(dev, "screen_state=on");
+        dev->set_mic_mute(dev, false);
+
+        t = now_ns() - t0;
+        if (t > c->max_ns)
+            c->max_ns = t;
+        c->cycles++;
+    }
+
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-f out_flags] [-s seconds] [-m max_ms]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const hw_module_t *module;
+    audio_hw_device_t *dev;
+    struct audio_stream_out *out = NULL;
+    struct audio_config config;
+    audio_output_flags_t flags = AUDIO_OUTPUT_FLAG_FAST;
+    struct writer w;
+    struct control c;
+    pthread_t writer, controller;
+    int writer_started = 0, controller_started = 0;
+    int seconds = DEFAULT_SECONDS;
+    int max_ms = DEFAULT_MAX_MS;
+    int64_t p99[PHASE_COUNT];
+    int opt, p, ret = 1;
+
+    while ((opt = getopt(argc, argv, "f:s:m:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            flags = (audio_output_flags_t)strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'm':
+            max_ms = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (seconds < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    memset(&w, 0, sizeof(w));
+    memset(&c, 0, sizeof(c));
+    for (p = 0; p < PHASE_COUNT; p++) {
+        w.write_ns[p] = malloc(MAX_WRITES * sizeof(int64_t));
+        if (w.write_ns[p] == NULL)
+            goto free_buffers;
+    }
+
+    if (hw_get_module_by_class(AUDIO_HARDWARE_MODULE_ID, "primary", &module) != 0 ||
+            audio_hw_device_open(module, &dev) != 0) {
+        fprintf(stderr, "cannot open the primary audio HAL\n");
+        goto free_buffers;
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = SAMPLE_RATE;
+    config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    if (dev->open_output_stream(dev, 0, AUDIO_DEVICE_OUT_AUX_DIGITAL, flags,
+                                &config, &out) != 0) {
+        fprintf(stderr, "cannot open output stream (flags 0x%x)\n", flags);
+        goto exit;
+    }
+
+    w.out = out;
+    w.phase = PHASE_IDLE;
+    if (pthread_create(&writer, NULL, writer_thread, &w) != 0)
+        goto exit;
+    writer_started = 1;
+    sleep(seconds);
+
+    c.dev = dev;
+    if (pthread_create(&controller, NULL, control_thread, &c) != 0)
+        goto exit;
+    controller_started = 1;
+    w.phase = PHASE_LOADED;
+    sleep(seconds);
+
+    c.stop = 1;
+    pthread_join(controller, NULL);
+    controller_started = 0;
+    w.stop = 1;
+    pthread_join(writer, NULL);
+    writer_started = 0;
+
+    if (w.error) {
+        fprintf(stderr, "write failed (%d)\n", w.error);
+        goto exit;
+    }
+
+    printf("output flags 0x%x, buffer %u bytes, %d control cycles, longest %lld ms\n",
+           flags, (unsigned)out->common.get_buffer_size(&out->common), c.cycles,
+           (long long)(c.max_ns / 1000000));
+    for (p = 0; p < PHASE_COUNT; p++) {
+        int n = w.writes[p];
+
+        if (n == 0) {
+            fprintf(stderr, "no writes in the %s phase\n", phase_names[p]);
+            goto exit;
+        }
+        qsort(w.write_ns[p], n, sizeof(int64_t), cmp_int64);
+        p99[p] = w.write_ns[p][n * 99 / 100];
+        printf("%-6s %6d writes: p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+               phase_names[p], n, w.write_ns[p][n / 2] / 1e6, p99[p] / 1e6,
+               w.write_ns[p][n - 1] / 1e6);
+    }
+
+    if (c.cycles == 0) {
+        printf("FAIL: no control cycle completed\n");
+    } else if (p99[PHASE_LOADED] - p99[PHASE_IDLE] > (int64_t)max_ms * 1000000) {
+        printf("FAIL: p99 write time up by more than %d ms under control load\n", max_ms);
+    } else {
+        printf("PASS\n");
+        ret = 0;
+    }
+
+exit:
+    if (controller_started) {
+        c.stop = 1;
+        pthread_join(controller, NULL);
+    }
+    if (writer_started) {
+        w.stop = 1;
+        pthread_join(writer, NULL);
+    }
+    if (out != NULL)
+        dev->close_output_stream(dev, out);
+    audio_hw_device_close(dev);
+free_buffers:
+    for (p = 0; p < PHASE_COUNT; p++)
+        free(w.write_ns[p]);
+    return ret;
+}
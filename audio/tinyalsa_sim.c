@@ -0,0 +1,966 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Simulated tinyalsa for host builds of the HAL, see tinyalsa_sim.h.
+ * The pcm state follows the driver model tinyalsa sees: frames written or
+ * read since the start (appl_ptr) against frames the device has played or
+ * captured (the hardware pointer, computed from the time of the start).
+ */
+
+#define LOG_TAG "tinyalsa_sim"
+//#define LOG_NDEBUG 0
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sound/asound.h>
+
+#include <cutils/log.h>
+
+#include <tinyalsa/asoundlib.h>
+
+#include "tinyalsa_sim.h"
+
+#define SIM_ENV "TINYALSA_SIM"
+#define SIM_MAX_CARDS 4
+#define SIM_MAX_DEVICES 16
+#define SIM_MAX_RATES 12
+#define SIM_MAX_CHANNELS 8
+#define SIM_MAX_CTL_VALUES 24      /* the IEC958 channel status bytes */
+#define SIM_TONE_AMPLITUDE 3277.0       /* -20 dBFS */
+
+struct sim_config {
+    unsigned int cards;                 /* bit per card present */
+    unsigned int rates[SIM_MAX_RATES];
+    unsigned int num_rates;
+    int ppm;
+    unsigned int burst;
+    unsigned int jitter_us;
+    unsigned int xrun_ms;
+    unsigned int tone_hz;
+    unsigned int seed;
+};
+
+struct pcm {
+    unsigned int card;
+    unsigned int device;
+    unsigned int flags;
+    struct pcm_config config;
+    struct sim_config sim;
+    int ready;
+    char error[PCM_ERROR_MAX];
+
+    pthread_mutex_t lock;
+    unsigned int buffer_size;
+    unsigned int frame_size;
+    unsigned int burst;
+    double rate;                        /* device frames per second */
+    int running;
+    int64_t start_ns;
+    uint64_t appl_ptr;                  /* frames since the start */
+    uint64_t tone_base;                 /* device frame of the start */
+    int64_t stall_ns;                   /* when the caller is held up next */
+    unsigned int rand;
+    struct tinyalsa_sim_stats *stats;
+};
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sim_config sim_config;
+static int sim_configured;
+static int64_t sim_origin_ns;
+static unsigned int sim_busy[SIM_MAX_CARDS][SIM_MAX_DEVICES];   /* bit per direction */
+static struct tinyalsa_sim_stats sim_stats[SIM_MAX_CARDS][SIM_MAX_DEVICES][2];
+
+/* returned by pcm_open() when out of memory, as tinyalsa does */
+static struct pcm bad_pcm;
+
+static int64_t sim_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sim_sleep_until(int64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* Parses a comma separated list of unsigned values, returns how many */
+static unsigned int sim_parse_list(const char *str, unsigned int *out, unsigned int max)
+{
+    unsigned int count = 0;
+    char *end;
+
+    while (count < max && *str) {
+        unsigned long value = strtoul(str, &end, 10);
+        if (end == str)
+            break;
+        out[count++] = value;
+        if (*end != ',')
+            break;
+        str = end + 1;
+    }
+
+    return count;
+}
+
+static int sim_parse_config(const char *str, struct sim_config *config)
+{
+    static const unsigned int default_rates[] = { 48000, 44100, 32000, 16000, 8000,
+                                                  192000, 176400, 128000 };
+    char buf[256];
+    char *tok, *save = NULL;
+    unsigned int i;
+
+    memset(config, 0, sizeof(*config));
+    config->cards = (1 << 0) | (1 << 1);
+    config->num_rates = sizeof(default_rates) / sizeof(default_rates[0]);
+    memcpy(config->rates, default_rates, sizeof(default_rates));
+    config->tone_hz = 1000;
+    config->seed = 1;
+
+    if (str == NULL)
+        return 0;
+    strncpy(buf, str, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    for (tok = strtok_r(buf, ";", &save); tok; tok = strtok_r(NULL, ";", &save)) {
+        char *value = strchr(tok, '=');
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+
+        if (!strcmp(tok, "cards")) {
+            unsigned int cards[SIM_MAX_CARDS];
+            unsigned int count = sim_parse_list(value, cards, SIM_MAX_CARDS);
+
+            config->cards = 0;
+            for (i = 0; i < count; i++) {
+                if (cards[i] >= SIM_MAX_CARDS)
+                    return -EINVAL;
+                config->cards |= 1 << cards[i];
+            }
+        } else if (!strcmp(tok, "rates")) {
+            config->num_rates = sim_parse_list(value, config->rates, SIM_MAX_RATES);
+            if (config->num_rates == 0)
+                return -EINVAL;
+        } else if (!strcmp(tok, "ppm")) {
+            config->ppm = atoi(value);
+        } else if (!strcmp(tok, "burst")) {
+            config->burst = atoi(value);
+        } else if (!strcmp(tok, "jitter_us")) {
+            config->jitter_us = atoi(value);
+        } else if (!strcmp(tok, "xrun_ms")) {
+            config->xrun_ms = atoi(value);
+        } else if (!strcmp(tok, "tone_hz")) {
+            config->tone_hz = atoi(value);
+        } else if (!strcmp(tok, "seed")) {
+            config->seed = strtoul(value, NULL, 10);
+        } else {
+            ALOGW("%s: unknown key \"%s\"", __func__, tok);
+        }
+    }
+
+    return 0;
+}
+
+int tinyalsa_sim_configure(const char *config)
+{
+    struct sim_config parsed;
+    int ret = sim_parse_config(config, &parsed);
+
+    if (ret != 0)
+        return ret;
+    pthread_mutex_lock(&sim_lock);
+    sim_config = parsed;
+    sim_configured = 1;
+    pthread_mutex_unlock(&sim_lock);
+    return 0;
+}
+
+int tinyalsa_sim_get_stats(unsigned int card, unsigned int device, unsigned int flags,
+                           struct tinyalsa_sim_stats *stats)
+{
+    if (card >= SIM_MAX_CARDS || device >= SIM_MAX_DEVICES)
+        return -EINVAL;
+    pthread_mutex_lock(&sim_lock);
+    *stats = sim_stats[card][device][(flags & PCM_IN) ? 1 : 0];
+    pthread_mutex_unlock(&sim_lock);
+    return 0;
+}
+
+/* must be called with sim_lock held */
+static void sim_get_config(struct sim_config *config)
+{
+    if (!sim_configured) {
+        const char *env = getenv(SIM_ENV);
+
+        if (sim_parse_config(env, config) != 0) {
+            ALOGE("bad %s \"%s\", using defaults", SIM_ENV, env);
+            sim_parse_config(NULL, config);
+        }
+    } else {
+        *config = sim_config;
+    }
+}
+
+/*
+ * Device clock.  The pointer moves by bursts from start_ns; moved_ns is
+ * the time of the last burst.
+ * must be called with pcm->lock held
+ */
+static uint64_t sim_hw_ptr(struct pcm *pcm, int64_t now, int64_t *moved_ns)
+{
+    int64_t elapsed = now - pcm->start_ns;
+    uint64_t frames;
+
+    if (!pcm->running || elapsed < 0) {
+        if (moved_ns)
+            *moved_ns = pcm->start_ns;
+        return 0;
+    }
+    frames = (uint64_t)(elapsed * pcm->rate / 1e9);
+    frames -= frames % pcm->burst;
+    if (moved_ns)
+        *moved_ns = pcm->start_ns + (int64_t)ceil(frames * 1e9 / pcm->rate);
+    return frames;
+}
+
+/* time at which the pointer reaches target */
+static int64_t sim_hw_ptr_time(struct pcm *pcm, uint64_t target)
+{
+    uint64_t frames = (target + pcm->burst - 1) / pcm->burst * pcm->burst;
+
+    return pcm->start_ns + (int64_t)ceil(frames * 1e9 / pcm->rate) + 1;
+}
+
+/* must be called with pcm->lock held */
+static void sim_start(struct pcm *pcm, int64_t now)
+{
+    pcm->running = 1;
+    pcm->start_ns = now;
+    pcm->tone_base = (uint64_t)((now - sim_origin_ns) * (double)pcm->config.rate / 1e9);
+    if (pcm->sim.xrun_ms && pcm->stall_ns == 0)
+        pcm->stall_ns = now + pcm->sim.xrun_ms * 1000000LL;
+    pcm->stats->starts++;
+}
+
+/* must be called with pcm->lock held */
+static void sim_reset(struct pcm *pcm)
+{
+    pcm->running = 0;
+    pcm->appl_ptr = 0;
+}
+
+/* Frames the caller may transfer now: space to write or frames to read.
+ * must be called with pcm->lock held
+ */
+static int64_t sim_avail(struct pcm *pcm, int64_t now, int64_t *moved_ns)
+{
+    uint64_t hw = sim_hw_ptr(pcm, now, moved_ns);
+
+    if (pcm->flags & PCM_IN)
+        return (int64_t)(hw - pcm->appl_ptr);
+    else if (pcm->running)
+        return (int64_t)pcm->buffer_size - (int64_t)(pcm->appl_ptr - hw);
+    else
+        return (int64_t)pcm->buffer_size - (int64_t)pcm->appl_ptr;
+}
+
+/* sim_avail() after handling an xrun.  An xrun stops the pcm, which the
+ * transfer restarts, as tinyalsa does on EPIPE.  A stop threshold above
+ * the buffer size keeps the pcm running: playback plays silence, capture
+ * overwrites the oldest frames.
+ * must be called with pcm->lock held
+ */
+static int64_t sim_sync(struct pcm *pcm, int64_t now)
+{
+    unsigned int stop = pcm->config.stop_threshold;
+    int64_t avail = sim_avail(pcm, now, NULL);
+
+    if (pcm->running && avail >= (int64_t)stop) {
+        uint64_t hw = sim_hw_ptr(pcm, now, NULL);
+
+        if (stop > pcm->buffer_size) {
+            if (pcm->flags & PCM_IN)
+                pcm->appl_ptr = hw - pcm->buffer_size;
+            else
+                pcm->appl_ptr = hw;
+            avail = pcm->buffer_size;
+        } else {
+            ALOGV("%s: card %u device %u xrun", __func__, pcm->card, pcm->device);
+            pcm->stats->xruns++;
+            sim_reset(pcm);
+            avail = (pcm->flags & PCM_IN) ? 0 : pcm->buffer_size;
+        }
+    }
+    return avail;
+}
+
+static void sim_capture(struct pcm *pcm, void *data, unsigned int frames)
+{
+    uint64_t pos = pcm->tone_base + pcm->appl_ptr;
+    unsigned int i, c;
+
+    for (i = 0; i < frames; i++, pos++) {
+        double v = 0;
+        int32_t s;
+
+        if (pcm->sim.tone_hz)
+            v = SIM_TONE_AMPLITUDE *
+                    sin(2 * M_PI * pcm->sim.tone_hz * (double)(pos % pcm->config.rate) /
+                        pcm->config.rate);
+        s = (int32_t)lrint(v);
+        for (c = 0; c < pcm->config.channels; c++) {
+            if (pcm->config.format == PCM_FORMAT_S32_LE)
+                ((int32_t *)data)[i * pcm->config.channels + c] = s << 16;
+            else
+                ((int16_t *)data)[i * pcm->config.channels + c] = (int16_t)s;
+        }
+    }
+}
+
+/* Blocking transfer of pcm_write(), pcm_read() and their mmap variants. */
+static int sim_transfer(struct pcm *pcm, void *data, unsigned int count)
+{
+    unsigned int remaining;
+    int is_in = (pcm->flags & PCM_IN) != 0;
+
+    if (!pcm->ready) {
+        snprintf(pcm->error, PCM_ERROR_MAX, "pcm not open");
+        return -EBADFD;
+    }
+    if (count % pcm->frame_size) {
+        snprintf(pcm->error, PCM_ERROR_MAX, "partial frame");
+        return -EINVAL;
+    }
+    remaining = count / pcm->frame_size;
+
+    pthread_mutex_lock(&pcm->lock);
+    if (pcm->running && pcm->stall_ns != 0 && sim_now_ns() >= pcm->stall_ns) {
+        /* the caller misses the device for a buffer and a period */
+        int64_t stall = (int64_t)((pcm->buffer_size + pcm->config.period_size) * 1e9 /
+                                  pcm->rate);
+
+        pcm->stall_ns += pcm->sim.xrun_ms * 1000000LL;
+        pthread_mutex_unlock(&pcm->lock);
+        sim_sleep_until(sim_now_ns() + stall);
+        pthread_mutex_lock(&pcm->lock);
+    }
+    while (remaining != 0) {
+        int64_t now = sim_now_ns();
+        int64_t avail = sim_sync(pcm, now);
+        unsigned int need, chunk;
+
+        if (is_in && !pcm->running) {
+            sim_start(pcm, now);
+            avail = 0;
+        }
+        need = remaining < (unsigned int)pcm->config.avail_min ?
+                    remaining : (unsigned int)pcm->config.avail_min;
+        if (need == 0)
+            need = 1;
+
+        if (!is_in && !pcm->running) {
+            if (avail == 0) {
+                /* full before the start threshold */
+                sim_start(pcm, now);
+                continue;
+            }
+        } else if (avail < need) {
+            uint64_t target = is_in ? pcm->appl_ptr + need :
+                                      pcm->appl_ptr + need - pcm->buffer_size;
+            int64_t wake = sim_hw_ptr_time(pcm, target);
+
+            if (pcm->sim.jitter_us)
+                wake += (int64_t)(rand_r(&pcm->rand) % (pcm->sim.jitter_us + 1)) * 1000;
+            pthread_mutex_unlock(&pcm->lock);
+            sim_sleep_until(wake);
+            pthread_mutex_lock(&pcm->lock);
+            continue;
+        }
+
+        chunk = avail < remaining ? (unsigned int)avail : remaining;
+        if (is_in)
+            sim_capture(pcm, data, chunk);
+        data = (char *)data + chunk * pcm->frame_size;
+        pcm->appl_ptr += chunk;
+        remaining -= chunk;
+        pcm->stats->frames += chunk;
+
+        if (!is_in && !pcm->running && pcm->appl_ptr >= pcm->config.start_threshold)
+            sim_start(pcm, sim_now_ns());
+    }
+    pthread_mutex_unlock(&pcm->lock);
+
+    return 0;
+}
+
+struct pcm *pcm_open(unsigned int card, unsigned int device,
+                     unsigned int flags, struct pcm_config *config)
+{
+    struct pcm *pcm;
+    unsigned int dir = (flags & PCM_IN) ? 1 : 0;
+    unsigned int i;
+
+    pcm = calloc(1, sizeof(struct pcm));
+    if (pcm == NULL || config == NULL) {
+        free(pcm);
+        return &bad_pcm;
+    }
+    pcm->card = card;
+    pcm->device = device;
+    pcm->flags = flags;
+    pcm->config = *config;
+
+    pthread_mutex_lock(&sim_lock);
+    sim_get_config(&pcm->sim);
+    if (sim_origin_ns == 0)
+        sim_origin_ns = sim_now_ns();
+
+    if (card >= SIM_MAX_CARDS || device >= SIM_MAX_DEVICES ||
+            !(pcm->sim.cards & (1 << card))) {
+        snprintf(pcm->error, PCM_ERROR_MAX, "cannot open device '/dev/snd/pcmC%uD%u%c': %s",
+                 card, device, dir ? 'c' : 'p', strerror(ENOENT));
+        goto exit;
+    }
+    if (sim_busy[card][device] & (1 << dir)) {
+        snprintf(pcm->error, PCM_ERROR_MAX, "cannot open device '/dev/snd/pcmC%uD%u%c': %s",
+                 card, device, dir ? 'c' : 'p', strerror(EBUSY));
+        goto exit;
+    }
+
+    for (i = 0; i < pcm->sim.num_rates; i++) {
+        if (pcm->sim.rates[i] == config->rate)
+            break;
+    }
+    if (i == pcm->sim.num_rates || config->channels == 0 ||
+            config->channels > SIM_MAX_CHANNELS || config->period_size == 0 ||
+            config->period_count < 2 || config->format >= PCM_FORMAT_MAX) {
+        snprintf(pcm->error, PCM_ERROR_MAX, "cannot set hw params: %s", strerror(EINVAL));
+        goto exit;
+    }
+
+    /* the defaults tinyalsa sets for zero software parameters */
+    pcm->buffer_size = config->period_size * config->period_count;
+    if (pcm->config.start_threshold == 0)
+        pcm->config.start_threshold = config->period_count * config->period_size / 2;
+    if (pcm->config.stop_threshold == 0)
+        pcm->config.stop_threshold = pcm->buffer_size;
+    if (pcm->config.avail_min == 0)
+        pcm->config.avail_min = config->period_size;
+    *config = pcm->config;
+
+    pcm->frame_size = config->channels * pcm_format_to_bits(config->format) / 8;
+    pcm->burst = pcm->sim.burst ? pcm->sim.burst : config->period_size;
+    pcm->rate = config->rate * (1.0 + pcm->sim.ppm / 1e6);
+    pcm->rand = pcm->sim.seed;
+    pcm->stats = &sim_stats[card][device][dir];
+    pcm->stats->opens++;
+    pthread_mutex_init(&pcm->lock, NULL);
+    sim_busy[card][device] |= 1 << dir;
+    pcm->ready = 1;
+
+exit:
+    pthread_mutex_unlock(&sim_lock);
+    return pcm;
+}
+
+int pcm_close(struct pcm *pcm)
+{
+    if (pcm == &bad_pcm || pcm == NULL)
+        return 0;
+
+    if (pcm->ready) {
+        pthread_mutex_lock(&sim_lock);
+        sim_busy[pcm->card][pcm->device] &= ~(1 << ((pcm->flags & PCM_IN) ? 1 : 0));
+        pthread_mutex_unlock(&sim_lock);
+        pthread_mutex_destroy(&pcm->lock);
+    }
+    free(pcm);
+    return 0;
+}
+
+int pcm_is_ready(struct pcm *pcm)
+{
+    return pcm != NULL && pcm->ready;
+}
+
+int pcm_get_file_descriptor(struct pcm *pcm)
+{
+    return -1;
+}
+
+const char *pcm_get_error(struct pcm *pcm)
+{
+    return pcm->error;
+}
+
+unsigned int pcm_get_buffer_size(struct pcm *pcm)
+{
+    return pcm->buffer_size;
+}
+
+unsigned int pcm_format_to_bits(enum pcm_format format)
+{
+    switch (format) {
+    case PCM_FORMAT_S32_LE:
+        return 32;
+    default:
+    case PCM_FORMAT_S16_LE:
+        return 16;
+    };
+}
+
+unsigned int pcm_frames_to_bytes(struct pcm *pcm, unsigned int frames)
+{
+    return frames * pcm->frame_size;
+}
+
+unsigned int pcm_bytes_to_frames(struct pcm *pcm, unsigned int bytes)
+{
+    return bytes / pcm->frame_size;
+}
+
+int pcm_get_htimestamp(struct pcm *pcm, unsigned int *avail, struct timespec *tstamp)
+{
+    int64_t moved_ns, frames;
+    int ret = -1;
+
+    if (!pcm_is_ready(pcm))
+        return -1;
+
+    /* an xrun shows as a full (capture) or empty (playback) buffer until
+     * the next transfer restarts the pcm, the pointer stopping there */
+    pthread_mutex_lock(&pcm->lock);
+    frames = sim_avail(pcm, sim_now_ns(), &moved_ns);
+    if (pcm->running) {
+        *avail = frames < (int64_t)pcm->buffer_size ? (unsigned int)frames : pcm->buffer_size;
+        tstamp->tv_sec = moved_ns / 1000000000LL;
+        tstamp->tv_nsec = moved_ns % 1000000000LL;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&pcm->lock);
+
+    return ret;
+}
+
+int pcm_write(struct pcm *pcm, const void *data, unsigned int count)
+{
+    if (pcm->flags & PCM_IN)
+        return -EINVAL;
+    return sim_transfer(pcm, (void *)data, count);
+}
+
+int pcm_read(struct pcm *pcm, void *data, unsigned int count)
+{
+    if (!(pcm->flags & PCM_IN))
+        return -EINVAL;
+    return sim_transfer(pcm, data, count);
+}
+
+int pcm_mmap_write(struct pcm *pcm, const void *data, unsigned int count)
+{
+    return pcm_write(pcm, data, count);
+}
+
+int pcm_mmap_read(struct pcm *pcm, void *data, unsigned int count)
+{
+    return pcm_read(pcm, data, count);
+}
+
+/* the ring is not exposed: the HAL only uses the copying calls */
+int pcm_mmap_begin(struct pcm *pcm, void **areas, unsigned int *offset, unsigned int *frames)
+{
+    return -ENOSYS;
+}
+
+int pcm_mmap_commit(struct pcm *pcm, unsigned int offset, unsigned int frames)
+{
+    return -ENOSYS;
+}
+
+int pcm_mmap_avail(struct pcm *pcm)
+{
+    int64_t avail;
+
+    if (!pcm_is_ready(pcm))
+        return -EBADFD;
+    pthread_mutex_lock(&pcm->lock);
+    avail = sim_sync(pcm, sim_now_ns());
+    pthread_mutex_unlock(&pcm->lock);
+    return (int)avail;
+}
+
+int pcm_prepare(struct pcm *pcm)
+{
+    if (!pcm_is_ready(pcm))
+        return -EBADFD;
+    pthread_mutex_lock(&pcm->lock);
+    sim_reset(pcm);
+    pcm->stall_ns = 0;
+    pthread_mutex_unlock(&pcm->lock);
+    return 0;
+}
+
+int pcm_start(struct pcm *pcm)
+{
+    if (!pcm_is_ready(pcm))
+        return -EBADFD;
+    pthread_mutex_lock(&pcm->lock);
+    if (!pcm->running)
+        sim_start(pcm, sim_now_ns());
+    pthread_mutex_unlock(&pcm->lock);
+    return 0;
+}
+
+int pcm_stop(struct pcm *pcm)
+{
+    return pcm_prepare(pcm);
+}
+
+int pcm_wait(struct pcm *pcm, int timeout)
+{
+    int64_t now = sim_now_ns(), wake;
+
+    if (!pcm_is_ready(pcm))
+        return -EBADFD;
+    pthread_mutex_lock(&pcm->lock);
+    if (!pcm->running || sim_sync(pcm, now) >= pcm->config.avail_min) {
+        pthread_mutex_unlock(&pcm->lock);
+        return 1;
+    }
+    wake = sim_hw_ptr_time(pcm, (pcm->flags & PCM_IN) ?
+                    pcm->appl_ptr + pcm->config.avail_min :
+                    pcm->appl_ptr + pcm->config.avail_min - pcm->buffer_size);
+    pthread_mutex_unlock(&pcm->lock);
+
+    if (timeout >= 0 && wake > now + timeout * 1000000LL) {
+        sim_sleep_until(now + timeout * 1000000LL);
+        return 0;
+    }
+    sim_sleep_until(wake);
+    return 1;
+}
+
+int pcm_set_avail_min(struct pcm *pcm, int avail_min)
+{
+    if (!pcm_is_ready(pcm))
+        return -EBADFD;
+    pthread_mutex_lock(&pcm->lock);
+    pcm->config.avail_min = avail_min;
+    pthread_mutex_unlock(&pcm->lock);
+    return 0;
+}
+
+/*
+ * Mixer: the controls of the OMAP4 ABE and TWL6040 the HAL refers to,
+ * the same on every card.
+ */
+
+struct sim_ctl {
+    const char *name;
+    enum mixer_ctl_type type;
+    unsigned int num_values;
+    int max;
+    const char * const *enums;
+};
+
+static const char * const sim_eq_enums[] = {
+    "Flat Response", "High-pass 0dB", "450Hz High-pass", "4Khz LPF   0dB", NULL,
+};
+static const char * const sim_mux_enums[] = {
+    "None", "DMic0L", "DMic0R", "DMic1L", "DMic1R", "DMic2L", "DMic2R",
+    "BT Left", "BT Right", "AMic0", "AMic1", "VX Left", "VX Right", NULL,
+};
+static const char * const sim_left_capture_enums[] = {
+    "Off", "Main Mic", "Headset Mic", "Aux/FM Left", NULL,
+};
+static const char * const sim_right_capture_enums[] = {
+    "Off", "Sub Mic", "Aux/FM Right", NULL,
+};
+static const char * const sim_hs_enums[] = {
+    "Off", "HS DAC", "Aux/FM Left", NULL,
+};
+static const char * const sim_hf_enums[] = {
+    "Off", "HF DAC", "Aux/FM Left", NULL,
+};
+
+#define SIM_BOOL(n)         { n, MIXER_CTL_TYPE_BOOL, 1, 1, NULL }
+#define SIM_INT(n, c, m)    { n, MIXER_CTL_TYPE_INT, c, m, NULL }
+#define SIM_ENUM(n, e)      { n, MIXER_CTL_TYPE_ENUM, 1, 0, e }
+#define SIM_IEC958(n)       { n, MIXER_CTL_TYPE_IEC958, 1, 0, NULL }
+
+static const struct sim_ctl sim_ctls[] = {
+    SIM_ENUM("DL1 Equalizer", sim_eq_enums),
+    SIM_ENUM("DL2 Left Equalizer", sim_eq_enums),
+    SIM_ENUM("DL2 Right Equalizer", sim_eq_enums),
+    SIM_INT("DL1 Media Playback Volume", 1, 149),
+    SIM_INT("DL1 Voice Playback Volume", 1, 149),
+    SIM_INT("DL2 Media Playback Volume", 1, 149),
+    SIM_INT("DL2 Voice Playback Volume", 1, 149),
+    SIM_INT("DL1 Capture Playback Volume", 1, 149),
+    SIM_INT("DL2 Capture Playback Volume", 1, 149),
+    SIM_INT("SDT DL Volume", 1, 149),
+    SIM_INT("SDT UL Volume", 1, 149),
+    SIM_INT("BT UL Volume", 1, 149),
+    SIM_INT("AMIC UL Volume", 2, 149),
+    SIM_INT("DMIC1 UL Volume", 2, 149),
+    SIM_INT("AUDUL Voice UL Volume", 1, 149),
+    SIM_INT("Headset Playback Volume", 2, 15),
+    SIM_INT("Handsfree Playback Volume", 2, 29),
+    SIM_INT("Earphone Playback Volume", 1, 15),
+    SIM_INT("Capture Preamplifier Volume", 2, 2),
+    SIM_INT("Capture Volume", 2, 4),
+    SIM_BOOL("DL1 Mixer Multimedia"),
+    SIM_BOOL("DL1 Mixer Voice"),
+    SIM_BOOL("DL1 Mono Mixer"),
+    SIM_BOOL("DL2 Mixer Multimedia"),
+    SIM_BOOL("DL2 Mixer Voice"),
+    SIM_BOOL("DL2 Mono Mixer"),
+    SIM_BOOL("Sidetone Mixer Playback"),
+    SIM_BOOL("Sidetone Mixer Capture"),
+    SIM_BOOL("DL1 PDM Switch"),
+    SIM_BOOL("DL1 BT_VX Switch"),
+    SIM_BOOL("DL1 MM_EXT Switch"),
+    SIM_BOOL("Voice Capture Mixer Capture"),
+    SIM_BOOL("Earphone Enable Switch"),
+    SIM_ENUM("HS Left Playback", sim_hs_enums),
+    SIM_ENUM("HS Right Playback", sim_hs_enums),
+    SIM_ENUM("HF Left Playback", sim_hf_enums),
+    SIM_ENUM("HF Right Playback", sim_hf_enums),
+    SIM_ENUM("Analog Left Capture Route", sim_left_capture_enums),
+    SIM_ENUM("Analog Right Capture Route", sim_right_capture_enums),
+    SIM_ENUM("MUX_VX0", sim_mux_enums),
+    SIM_ENUM("MUX_VX1", sim_mux_enums),
+    SIM_ENUM("MUX_UL10", sim_mux_enums),
+    SIM_ENUM("MUX_UL11", sim_mux_enums),
+    SIM_IEC958("IEC958 Playback Default"),
+};
+
+#define SIM_NUM_CTLS (sizeof(sim_ctls) / sizeof(sim_ctls[0]))
+
+struct mixer_ctl {
+    struct mixer *mixer;
+    const struct sim_ctl *desc;
+    int *values;
+};
+
+struct mixer {
+    unsigned int card;
+    struct mixer_ctl ctls[SIM_NUM_CTLS];
+};
+
+/* control values of each card, kept across mixer_open() and mixer_close() */
+static int sim_ctl_values[SIM_MAX_CARDS][SIM_NUM_CTLS][SIM_MAX_CTL_VALUES];
+static unsigned int sim_mixer_writes[SIM_MAX_CARDS];
+
+struct mixer *mixer_open(unsigned int card)
+{
+    struct sim_config config;
+    struct mixer *mixer;
+    unsigned int i;
+
+    pthread_mutex_lock(&sim_lock);
+    sim_get_config(&config);
+    pthread_mutex_unlock(&sim_lock);
+    if (card >= SIM_MAX_CARDS || !(config.cards & (1 << card)))
+        return NULL;
+
+    mixer = calloc(1, sizeof(struct mixer));
+    if (mixer == NULL)
+        return NULL;
+    mixer->card = card;
+    for (i = 0; i < SIM_NUM_CTLS; i++) {
+        mixer->ctls[i].mixer = mixer;
+        mixer->ctls[i].desc = &sim_ctls[i];
+        mixer->ctls[i].values = sim_ctl_values[card][i];
+    }
+    return mixer;
+}
+
+void mixer_close(struct mixer *mixer)
+{
+    free(mixer);
+}
+
+const char *mixer_get_name(struct mixer *mixer)
+{
+    return "OMAP4 simulated";
+}
+
+unsigned int mixer_get_num_ctls(struct mixer *mixer)
+{
+    return SIM_NUM_CTLS;
+}
+
+struct mixer_ctl *mixer_get_ctl(struct mixer *mixer, unsigned int id)
+{
+    if (mixer == NULL || id >= SIM_NUM_CTLS)
+        return NULL;
+    return &mixer->ctls[id];
+}
+
+struct mixer_ctl *mixer_get_ctl_by_name(struct mixer *mixer, const char *name)
+{
+    unsigned int i;
+
+    if (mixer == NULL)
+        return NULL;
+    for (i = 0; i < SIM_NUM_CTLS; i++) {
+        if (!strcmp(name, sim_ctls[i].name))
+            return &mixer->ctls[i];
+    }
+    return NULL;
+}
+
+const char *mixer_ctl_get_name(struct mixer_ctl *ctl)
+{
+    return ctl ? ctl->desc->name : NULL;
+}
+
+enum mixer_ctl_type mixer_ctl_get_type(struct mixer_ctl *ctl)
+{
+    return ctl ? ctl->desc->type : MIXER_CTL_TYPE_UNKNOWN;
+}
+
+unsigned int mixer_ctl_get_num_values(struct mixer_ctl *ctl)
+{
+    return ctl ? ctl->desc->num_values : 0;
+}
+
+unsigned int mixer_ctl_get_num_enums(struct mixer_ctl *ctl)
+{
+    unsigned int count = 0;
+
+    if (ctl == NULL || ctl->desc->enums == NULL)
+        return 0;
+    while (ctl->desc->enums[count])
+        count++;
+    return count;
+}
+
+const char *mixer_ctl_get_enum_string(struct mixer_ctl *ctl, unsigned int enum_id)
+{
+    if (enum_id >= mixer_ctl_get_num_enums(ctl))
+        return NULL;
+    return ctl->desc->enums[enum_id];
+}
+
+int mixer_ctl_get_value(struct mixer_ctl *ctl, unsigned int id)
+{
+    int value;
+
+    if (ctl == NULL)
+        return -EINVAL;
+    /* an IEC958 control reads back as its channel status bytes */
+    if (ctl->desc->type == MIXER_CTL_TYPE_IEC958 ? id >= SIM_MAX_CTL_VALUES :
+            id >= ctl->desc->num_values)
+        return -EINVAL;
+    pthread_mutex_lock(&sim_lock);
+    value = ctl->values[id];
+    pthread_mutex_unlock(&sim_lock);
+    return value;
+}
+
+static int sim_ctl_max(struct mixer_ctl *ctl)
+{
+    if (ctl->desc->type == MIXER_CTL_TYPE_ENUM)
+        return (int)mixer_ctl_get_num_enums(ctl) - 1;
+    return ctl->desc->max;
+}
+
+int mixer_ctl_set_value(struct mixer_ctl *ctl, unsigned int id, int value)
+{
+    if (ctl == NULL || id >= ctl->desc->num_values || value < 0 || value > sim_ctl_max(ctl))
+        return -EINVAL;
+    pthread_mutex_lock(&sim_lock);
+    ctl->values[id] = value;
+    sim_mixer_writes[ctl->mixer->card]++;
+    pthread_mutex_unlock(&sim_lock);
+    return 0;
+}
+
+/* integer and boolean controls, values as long as in the ALSA ioctl, and
+ * IEC958 controls, a struct snd_aes_iec958 */
+int mixer_ctl_set_array(struct mixer_ctl *ctl, const void *array, size_t count)
+{
+    const long *values = (const long *)array;
+    unsigned int i;
+
+    if (ctl != NULL && array != NULL && ctl->desc->type == MIXER_CTL_TYPE_IEC958) {
+        const struct snd_aes_iec958 *iec958 = (const struct snd_aes_iec958 *)array;
+
+        if (count != 1)
+            return -EINVAL;
+        pthread_mutex_lock(&sim_lock);
+        for (i = 0; i < SIM_MAX_CTL_VALUES; i++)
+            ctl->values[i] = iec958->status[i];
+        sim_mixer_writes[ctl->mixer->card]++;
+        pthread_mutex_unlock(&sim_lock);
+        return 0;
+    }
+    if (ctl == NULL || array == NULL || count > ctl->desc->num_values ||
+            ctl->desc->type == MIXER_CTL_TYPE_ENUM)
+        return -EINVAL;
+    for (i = 0; i < count; i++) {
+        if (values[i] < 0 || values[i] > sim_ctl_max(ctl))
+            return -EINVAL;
+    }
+    pthread_mutex_lock(&sim_lock);
+    for (i = 0; i < count; i++)
+        ctl->values[i] = (int)values[i];
+    sim_mixer_writes[ctl->mixer->card] += count;
+    pthread_mutex_unlock(&sim_lock);
+    return 0;
+}
+
+int mixer_ctl_set_enum_by_string(struct mixer_ctl *ctl, const char *string)
+{
+    unsigned int i, num_enums = mixer_ctl_get_num_enums(ctl);
+
+    for (i = 0; i < num_enums; i++) {
+        if (!strcmp(string, ctl->desc->enums[i]))
+            return mixer_ctl_set_value(ctl, 0, i);
+    }
+    return -EINVAL;
+}
+
+unsigned int tinyalsa_sim_get_mixer_writes(unsigned int card)
+{
+    unsigned int writes;
+
+    if (card >= SIM_MAX_CARDS)
+        return 0;
+    pthread_mutex_lock(&sim_lock);
+    writes = sim_mixer_writes[card];
+    pthread_mutex_unlock(&sim_lock);
+    return writes;
+}
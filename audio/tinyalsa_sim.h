@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2012 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TINYALSA_SIM_H
+#define TINYALSA_SIM_H
+
+#include <stdint.h>
+
+/*
+ * Host stand-in for libtinyalsa (tinyalsa_sim.c), implementing the pcm and
+ * mixer calls of tinyalsa/asoundlib.h against simulated cards so the HAL
+ * can run on a build host.
+ *
+ * Every pcm is a clocked device: once started, its hardware pointer moves
+ * at the configured rate, in bursts of one period, from the time of the
+ * start.  Playback frames are discarded as the pointer passes them, a
+ * capture reads a tone.  Blocking calls sleep until the pointer has moved
+ * far enough, so out_write() and in_read() are paced as on the device.
+ * A playback pointer passing the written frames, or a capture pointer a
+ * full buffer ahead of the reader, is an xrun; the stream restarts the
+ * way pcm_write() and pcm_read() recover on a driver.  Mixer controls are
+ * the OMAP4 ABE set the HAL knows and "IEC958 Playback Default", whose
+ * channel status bytes read back as its values, all kept in memory for
+ * the life of the process.
+ *
+ * The devices are configured by the TINYALSA_SIM environment variable,
+ * read at each pcm_open(), or by tinyalsa_sim_configure().  It holds
+ * "key=value" pairs separated by ';':
+ *
+ *   cards=0,1       cards present (default 0,1: HDMI and S/PDIF)
+ *   rates=48000,... rates a pcm may be opened at (default 48000,44100,
+ *                   32000,16000,8000 and the E-AC-3 passthrough rates
+ *                   192000,176400,128000)
+ *   ppm=N           clock error of every device, signed
+ *   burst=N         frames the pointer moves at once, 0 for a period
+ *   jitter_us=N     random extra delay of each wakeup, up to N us
+ *   xrun_ms=N       every N ms the caller of a running pcm is held up for
+ *                   a buffer and a period, as if descheduled, so the
+ *                   stream xruns
+ *   tone_hz=N       frequency of the captured tone, 0 for silence
+ *                   (default 1000, at -20 dBFS)
+ *   seed=N          random seed
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct tinyalsa_sim_stats {
+    uint32_t opens;
+    uint32_t starts;
+    uint32_t xruns;
+    uint64_t frames;            /* written or read */
+};
+
+/* replaces the configuration of TINYALSA_SIM for pcms opened later,
+ * returns -EINVAL if config does not parse */
+int tinyalsa_sim_configure(const char *config);
+
+/* totals of the pcms opened so far on card, device and direction (PCM_IN
+ * or PCM_OUT in flags); returns -EINVAL if out of range */
+int tinyalsa_sim_get_stats(unsigned int card, unsigned int device, unsigned int flags,
+                           struct tinyalsa_sim_stats *stats);
+
+/* number of mixer values written on card */
+unsigned int tinyalsa_sim_get_mixer_writes(unsigned int card);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TINYALSA_SIM_H */
@@ -10,7 +10,8 @@ LOCAL_C_INCLUDES += $(LOCAL_PATH)/../include
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libs3cjpeg
 
 LOCAL_SRC_FILES:= \
-	UVCCamera.cpp UVCCameraHWInterface.cpp
+	UVCCamera.cpp UVCCameraHWInterface.cpp UVCFrameUtils.cpp \
+	UVCDevice.cpp
 
 LOCAL_SHARED_LIBRARIES:= libutils libcutils libbinder liblog libcamera_client libhardware
 LOCAL_SHARED_LIBRARIES+= libs3cjpeg
@@ -21,3 +22,49 @@ LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_SHARED_LIBRARY)
 
+
+# Offline replay benchmark for the frame conversion paths, see
+# bench/uvc_replay_bench.cpp.
+include $(CLEAR_VARS)
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../include
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libs3cjpeg
+
+LOCAL_SRC_FILES:= \
+	bench/uvc_replay_bench.cpp UVCFrameUtils.cpp ../libs3cjpeg/JpegEncoder.cpp
+
+# bionic gets PAGE_SIZE from its headers, glibc does not
+LOCAL_CFLAGS += -DPAGE_SIZE=4096
+
+LOCAL_STATIC_LIBRARIES:= liblog
+
+LOCAL_MODULE := uvc_replay_bench
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+
+# Open/preview/snapshot latency benchmark against the simulated UVC
+# device, see bench/uvc_latency_bench.cpp.
+include $(CLEAR_VARS)
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../include
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../libs3cjpeg
+
+LOCAL_SRC_FILES:= \
+	bench/uvc_latency_bench.cpp UVCCamera.cpp UVCDevice.cpp UVCDeviceSim.cpp \
+	UVCFrameUtils.cpp ../libs3cjpeg/JpegEncoder.cpp
+
+LOCAL_CFLAGS += -DPAGE_SIZE=4096
+# let UVCDevice::create() pick the simulator, never set for camera.steelhead
+LOCAL_CFLAGS += -DUVC_DEVICE_SIM
+
+LOCAL_STATIC_LIBRARIES:= libutils libcutils liblog
+LOCAL_LDLIBS += -lpthread -lrt
+
+LOCAL_MODULE := uvc_latency_bench
+
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
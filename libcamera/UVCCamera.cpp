@@ -19,12 +19,15 @@
 #define LOG_TAG "UVCCamera"
 
 #include <utils/Log.h>
+#include <utils/Timers.h>
 
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/poll.h>
+#include <limits.h>
 #include "UVCCamera.h"
+#include "cutils/atomic.h"
 #include "cutils/properties.h"
 
 using namespace android;
@@ -115,38 +118,172 @@ static int get_pixel_depth(unsigned int fmt)
 #define ALIGN_H(x)      (((x) + 0x1F) & (~0x1F))    // Set as multiple of 32
 #define ALIGN_BUF(x)    (((x) + 0x1FFF)& (~0x1FFF)) // Set as multiple of 8K
 
-static int fimc_poll(struct pollfd *events)
+static int fimc_epoll_add(int epoll_fd, int fd)
 {
-    int ret;
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLERR;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        ALOGE("ERR(%s):epoll_ctl(fd = %d) failed: %s\n", __func__, fd, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Waits for a frame on the V4L2 fd or a control command on the eventfd.
+ * Returns a mask of UVCCamera::CAPTURE_EVENT_* bits, 0 on timeout,
+ * or < 0 on error (including a V4L2 fd that reports an error condition,
+ * e.g. a disconnected device).
+ */
+static int fimc_poll(int epoll_fd, int cam_fd, int event_fd, int timeout_ms)
+{
+    struct epoll_event events[2];
+    int ret, i, mask = 0;
+
+    do {
+        ret = epoll_wait(epoll_fd, events, 2, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
 
-    /* 10 second delay is because sensor can take a long time
-     * to do auto focus and capture in dark settings
-     */
-    ret = poll(events, 1, 10000);
     if (ret < 0) {
-        ALOGE("ERR(%s):poll error\n", __func__);
+        ALOGE("ERR(%s):epoll error\n", __func__);
         return ret;
     }
 
-    if (ret == 0) {
-        ALOGE("ERR(%s):No data in 10 secs..\n", __func__);
+    for (i = 0; i < ret; i++) {
+        if (events[i].data.fd == cam_fd) {
+            if (events[i].events & EPOLLIN) {
+                mask |= UVCCamera::CAPTURE_EVENT_FRAME;
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                ALOGE("ERR(%s):error condition on camera fd\n", __func__);
+                return -EIO;
+            }
+        } else if (events[i].data.fd == event_fd) {
+            eventfd_t value;
+            eventfd_read(event_fd, &value);
+            mask |= UVCCamera::CAPTURE_EVENT_COMMAND;
+        }
+    }
+
+    return mask;
+}
+
+int UVCCamera::m_waitCapture(int timeout_ms)
+{
+    if (m_epoll_fd < 0) {
+        ALOGE("ERR(%s):Camera was closed\n", __func__);
+        return -1;
+    }
+
+    return fimc_poll(m_epoll_fd, m_cam_fd, m_event_fd, timeout_ms);
+}
+
+/* Waits for the next preview frame for at most one and a half frame
+ * intervals, so that the preview thread gets to look at its state (and any
+ * posted command) at least once per frame.  A device that delivers nothing
+ * for CAPTURE_STALL_TIMEOUT_MS is reported as stalled with -ETIMEDOUT.
+ */
+int UVCCamera::previewPoll(bool preview)
+{
+    int timeout_ms = getFrameIntervalUs() * 3 / 2 / 1000;
+    int ret;
+
+    if (timeout_ms < MIN_WATCHDOG_TIMEOUT_MS)
+        timeout_ms = MIN_WATCHDOG_TIMEOUT_MS;
+
+    ret = m_waitCapture(timeout_ms);
+    if (ret < 0)
         return ret;
+
+    if (ret & CAPTURE_EVENT_FRAME) {
+        m_stall_ms = 0;
+    } else if (ret == 0) {
+        m_stall_ms += timeout_ms;
+        if (m_stall_ms >= CAPTURE_STALL_TIMEOUT_MS) {
+            ALOGE("ERR(%s):No data in %d ms, device stalled\n", __func__, m_stall_ms);
+            m_stall_ms = 0;
+            return -ETIMEDOUT;
+        }
     }
 
     return ret;
 }
 
-int UVCCamera::previewPoll(bool preview)
+/* Waits up to CAPTURE_SNAPSHOT_TIMEOUT_MS for the snapshot frame.  Only
+ * CAPTURE_CMD_STOP (cancelPicture()) ends the wait early: any other command
+ * was meant for the preview thread and is dropped.  Returns the event mask
+ * as m_waitCapture() does, 0 on timeout.
+ */
+int UVCCamera::m_waitSnapshot(void)
+{
+    nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC) +
+                       ms2ns(CAPTURE_SNAPSHOT_TIMEOUT_MS);
+    int ret;
+
+    for (;;) {
+        int timeout_ms = ns2ms(deadline - systemTime(SYSTEM_TIME_MONOTONIC));
+
+        if (timeout_ms < 0)
+            timeout_ms = 0;
+
+        ret = m_waitCapture(timeout_ms);
+        if (ret <= 0 || (ret & CAPTURE_EVENT_FRAME))
+            return ret;
+        if (getCaptureCommands() & CAPTURE_CMD_STOP)
+            return ret;
+    }
+}
+
+int UVCCamera::sendCaptureCommand(int cmd)
+{
+    android_atomic_or(cmd, &m_capture_cmds);
+
+    if (m_event_fd < 0)
+        return -1;
+
+    if (eventfd_write(m_event_fd, 1) < 0) {
+        ALOGE("ERR(%s):eventfd_write failed: %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns and clears the pending CAPTURE_CMD_* bits, draining the eventfd
+ * with them so that a command nobody waited for (the SNAPSHOT kick of a
+ * preview thread that had already stopped) cannot wake a later wait.  The
+ * eventfd goes first: a command posted in between keeps at worst a stale
+ * wakeup, never a bit without one.
+ */
+int UVCCamera::getCaptureCommands(void)
 {
-    return fimc_poll(&m_events_c);
+    eventfd_t value;
+
+    if (m_event_fd > -1)
+        eventfd_read(m_event_fd, &value);
+
+    return android_atomic_and(0, &m_capture_cmds);
 }
 
-static int fimc_v4l2_querycap(int fp)
+int UVCCamera::getFrameIntervalUs(void)
+{
+    struct v4l2_fract *tpf = &m_streamparm.parm.capture.timeperframe;
+
+    if (tpf->numerator == 0 || tpf->denominator == 0)
+        return DEFAULT_FRAME_INTERVAL_US;
+
+    return (int)(((int64_t)tpf->numerator * 1000000) / tpf->denominator);
+}
+
+static int fimc_v4l2_querycap(UVCDevice *dev)
 {
     struct v4l2_capability cap;
     int ret = 0;
 
-    ret = ioctl(fp, VIDIOC_QUERYCAP, &cap);
+    ret = dev->ioctl(VIDIOC_QUERYCAP, &cap);
 
     if (ret < 0) {
         ALOGE("ERR(%s):VIDIOC_QUERYCAP failed\n", __func__);
@@ -161,12 +298,12 @@ static int fimc_v4l2_querycap(int fp)
     return ret;
 }
 
-static const __u8* fimc_v4l2_enuminput(int fp, int index)
+static const __u8* fimc_v4l2_enuminput(UVCDevice *dev, int index)
 {
     static struct v4l2_input input;
 
     input.index = index;
-    if (ioctl(fp, VIDIOC_ENUMINPUT, &input) != 0) {
+    if (dev->ioctl(VIDIOC_ENUMINPUT, &input) != 0) {
         ALOGE("ERR(%s):No matching index found\n", __func__);
         return NULL;
     }
@@ -176,14 +313,14 @@ static const __u8* fimc_v4l2_enuminput(int fp, int index)
 }
 
 
-static int fimc_v4l2_s_input(int fp, int index)
+static int fimc_v4l2_s_input(UVCDevice *dev, int index)
 {
     struct v4l2_input input;
     int ret;
 
     input.index = index;
 
-    ret = ioctl(fp, VIDIOC_S_INPUT, &input);
+    ret = dev->ioctl(VIDIOC_S_INPUT, &input);
     if (ret < 0) {
         ALOGE("ERR(%s):VIDIOC_S_INPUT failed\n", __func__);
         return ret;
@@ -192,7 +329,7 @@ static int fimc_v4l2_s_input(int fp, int index)
     return ret;
 }
 
-static int fimc_v4l2_s_fmt(int fp, int width, int height, unsigned int fmt, int flag_capture)
+static int fimc_v4l2_s_fmt(UVCDevice *dev, int width, int height, unsigned int fmt, int flag_capture)
 {
     struct v4l2_format v4l2_fmt;
     struct v4l2_pix_format pixfmt;
@@ -213,7 +350,7 @@ static int fimc_v4l2_s_fmt(int fp, int width, int height, unsigned int fmt, int
     v4l2_fmt.fmt.pix = pixfmt;
 
     /* Set up for capture */
-    ret = ioctl(fp, VIDIOC_S_FMT, &v4l2_fmt);
+    ret = dev->ioctl(VIDIOC_S_FMT, &v4l2_fmt);
     if (ret < 0) {
         ALOGE("ERR(%s):VIDIOC_S_FMT failed\n", __func__);
         return -1;
@@ -222,7 +359,7 @@ static int fimc_v4l2_s_fmt(int fp, int width, int height, unsigned int fmt, int
     return 0;
 }
 
-static int fimc_v4l2_s_fmt_cap(int fp, int width, int height, unsigned int fmt)
+static int fimc_v4l2_s_fmt_cap(UVCDevice *dev, int width, int height, unsigned int fmt)
 {
     struct v4l2_format v4l2_fmt;
     struct v4l2_pix_format pixfmt;
@@ -246,7 +383,7 @@ static int fimc_v4l2_s_fmt_cap(int fp, int width, int height, unsigned int fmt)
     //ALOGE("ori_w %d, ori_h %d, w %d, h %d\n", width, height, v4l2_fmt.fmt.pix.width, v4l2_fmt.fmt.pix.height);
 
     /* Set up for capture */
-    ret = ioctl(fp, VIDIOC_S_FMT, &v4l2_fmt);
+    ret = dev->ioctl(VIDIOC_S_FMT, &v4l2_fmt);
     if (ret < 0) {
         ALOGE("ERR(%s):VIDIOC_S_FMT failed\n", __func__);
         return ret;
@@ -255,7 +392,7 @@ static int fimc_v4l2_s_fmt_cap(int fp, int width, int height, unsigned int fmt)
     return ret;
 }
 
-static int fimc_v4l2_enum_fmt(int fp, unsigned int fmt)
+static int fimc_v4l2_enum_fmt(UVCDevice *dev, unsigned int fmt)
 {
     struct v4l2_fmtdesc fmtdesc;
     int found = 0;
@@ -263,7 +400,7 @@ static int fimc_v4l2_enum_fmt(int fp, unsigned int fmt)
     fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     fmtdesc.index = 0;
 
-    while (ioctl(fp, VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
+    while (dev->ioctl(VIDIOC_ENUM_FMT, &fmtdesc) == 0) {
         ALOGD("supported pixel format: (%x) %s\n", fmtdesc.pixelformat, fmtdesc.description);
         if (fmtdesc.pixelformat == fmt) {
             found = 1;
@@ -281,7 +418,7 @@ static int fimc_v4l2_enum_fmt(int fp, unsigned int fmt)
     return 0;
 }
 
-static int fimc_v4l2_enum_framesize(int fp, unsigned int pixel_format, unsigned int index,
+static int fimc_v4l2_enum_framesize(UVCDevice *dev, unsigned int pixel_format, unsigned int index,
                                     unsigned *width, unsigned *height)
 {
     struct v4l2_frmsizeenum fsize;
@@ -289,7 +426,7 @@ static int fimc_v4l2_enum_framesize(int fp, unsigned int pixel_format, unsigned
     fsize.pixel_format = pixel_format;
     fsize.index = index;
 
-    if(ioctl(fp, VIDIOC_ENUM_FRAMESIZES, &fsize) == 0) {
+    if(dev->ioctl(VIDIOC_ENUM_FRAMESIZES, &fsize) == 0) {
         // UVC devices always use discrete frame sizes
         *width = fsize.discrete.width;
         *height = fsize.discrete.height;
@@ -301,7 +438,85 @@ static int fimc_v4l2_enum_framesize(int fp, unsigned int pixel_format, unsigned
     }
 }
 
-static int fimc_v4l2_reqbufs(int fp, enum v4l2_buf_type type, unsigned nr_bufs)
+static int fimc_v4l2_enum_frameintervals(UVCDevice *dev, unsigned int pixel_format,
+                                         unsigned width, unsigned height,
+                                         struct v4l2_fract *intervals, int max)
+{
+    struct v4l2_frmivalenum fival;
+    int count = 0;
+
+    memset(&fival, 0, sizeof(fival));
+    fival.pixel_format = pixel_format;
+    fival.width = width;
+    fival.height = height;
+
+    while (count < max && dev->ioctl(VIDIOC_ENUM_FRAMEINTERVALS, &fival) == 0) {
+        if (fival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+            intervals[count++] = fival.discrete;
+            fival.index++;
+            continue;
+        }
+
+        // Stepwise and continuous ranges only answer index 0,
+        // keep both ends of the range.
+        intervals[count++] = fival.stepwise.min;
+        if (count < max)
+            intervals[count++] = fival.stepwise.max;
+        break;
+    }
+
+    return count;
+}
+
+static bool fimc_is_compressed(unsigned int fmt)
+{
+    return fmt == V4L2_PIX_FMT_MJPEG || fmt == V4L2_PIX_FMT_JPEG;
+}
+
+/* Frame rate of a stream mode in fps * 1000, the unit used by
+ * CameraParameters::KEY_PREVIEW_FPS_RANGE.
+ */
+static int fimc_mode_fps(const struct uvc_stream_mode *mode)
+{
+    if (mode->interval.numerator == 0)
+        return 0;
+
+    return (int)(((int64_t)mode->interval.denominator * 1000) / mode->interval.numerator);
+}
+
+static unsigned int fimc_mode_bandwidth(const struct uvc_stream_mode *mode)
+{
+    int depth = get_pixel_depth(mode->fmt);
+    uint64_t frame_size;
+
+    if (mode->interval.numerator == 0)
+        return UINT_MAX;
+
+    if (fimc_is_compressed(mode->fmt))
+        frame_size = (uint64_t)mode->width * mode->height * 2 / MJPEG_COMPRESSION_RATIO;
+    else
+        frame_size = (uint64_t)mode->width * mode->height * (depth ? depth : 16) / 8;
+
+    uint64_t bandwidth = frame_size * mode->interval.denominator / mode->interval.numerator;
+    return bandwidth > UINT_MAX ? UINT_MAX : (unsigned int)bandwidth;
+}
+
+/* Ranking used by negotiateStreamMode(): the higher frame rate wins, then a
+ * raw format (no decode on our side), then the lighter load on the bus.
+ */
+static bool fimc_mode_better(const struct uvc_stream_mode *a, const struct uvc_stream_mode *b)
+{
+    int fps_a = fimc_mode_fps(a);
+    int fps_b = fimc_mode_fps(b);
+
+    if (fps_a != fps_b)
+        return fps_a > fps_b;
+    if (fimc_is_compressed(a->fmt) != fimc_is_compressed(b->fmt))
+        return !fimc_is_compressed(a->fmt);
+    return a->bandwidth < b->bandwidth;
+}
+
+static int fimc_v4l2_reqbufs(UVCDevice *dev, enum v4l2_buf_type type, unsigned nr_bufs)
 {
     struct v4l2_requestbuffers req;
     int ret;
@@ -311,7 +526,7 @@ static int fimc_v4l2_reqbufs(int fp, enum v4l2_buf_type type, unsigned nr_bufs)
     req.type = type;
     req.memory = V4L2_MEMORY_MMAP;
 
-    ret = ioctl(fp, VIDIOC_REQBUFS, &req);
+    ret = dev->ioctl(VIDIOC_REQBUFS, &req);
     if (ret < 0) {
         ALOGE("ERR(%s):VIDIOC_REQBUFS failed\n", __func__);
         return -1;
@@ -325,7 +540,7 @@ static int fimc_v4l2_reqbufs(int fp, enum v4l2_buf_type type, unsigned nr_bufs)
     return req.count;
 }
 
-static int fimc_v4l2_querybuf(int fp, int index, struct fimc_buffer *buffer, enum v4l2_buf_type type)
+static int fimc_v4l2_querybuf(UVCDevice *dev, int index, struct fimc_buffer *buffer, enum v4l2_buf_type type)
 {
     struct v4l2_buffer v4l2_buf;
     int ret;
@@ -337,16 +552,16 @@ static int fimc_v4l2_querybuf(int fp, int index, struct fimc_buffer *buffer, enu
     v4l2_buf.memory = V4L2_MEMORY_MMAP;
     v4l2_buf.index = index;
 
-    ret = ioctl(fp , VIDIOC_QUERYBUF, &v4l2_buf);
+    ret = dev->ioctl(VIDIOC_QUERYBUF, &v4l2_buf);
     if (ret < 0) {
         ALOGE("ERR(%s):VIDIOC_QUERYBUF failed\n", __func__);
         return -1;
     }
 
     buffer->length = v4l2_buf.length;
-    if ((buffer->start = (char *)mmap(0, v4l2_buf.length,
-                                         PROT_READ | PROT_WRITE, MAP_SHARED,
-                                         fp, v4l2_buf.m.offset)) < 0) {
+    buffer->start = (char *)dev->mmap(v4l2_buf.length, v4l2_buf.m.offset);
+    if (buffer->start == MAP_FAILED) {
+         buffer->start = NULL;
          ALOGE("%s %d] mmap() failed\n",__func__, __LINE__);
          return -1;
     }
@@ -357,18 +572,18 @@ static int fimc_v4l2_querybuf(int fp, int index, struct fimc_buffer *buffer, enu
     return 0;
 }
 
-static void fimc_v4l2_querybufs(int fp, struct fimc_buffer *buffer, int bufcount, enum v4l2_buf_type type)
+static void fimc_v4l2_querybufs(UVCDevice *dev, struct fimc_buffer *buffer, int bufcount, enum v4l2_buf_type type)
 {
     for(int i = 0; i < bufcount; i++)
-        fimc_v4l2_querybuf(fp, i, buffer + i, type);
+        fimc_v4l2_querybuf(dev, i, buffer + i, type);
 }
 
-static int fimc_v4l2_streamon(int fp)
+static int fimc_v4l2_streamon(UVCDevice *dev)
 {
     enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     int ret;
 
-    ret = ioctl(fp, VIDIOC_STREAMON, &type);
+    ret = dev->ioctl(VIDIOC_STREAMON, &type);
     if (ret < 0) {
         ALOGE("ERR(%s):VIDIOC_STREAMON failed\n", __func__);
         return ret;
@@ -377,13 +592,13 @@ static int fimc_v4l2_streamon(int fp)
     return ret;
 }
 
-static int fimc_v4l2_streamoff(int fp)
+static int fimc_v4l2_streamoff(UVCDevice *dev)
 {
     enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     int ret;
 
     ALOGV("%s :", __func__);
-    ret = ioctl(fp, VIDIOC_STREAMOFF, &type);
+    ret = dev->ioctl(VIDIOC_STREAMOFF, &type);
     if (ret < 0) {
         ALOGE("ERR(%s):VIDIOC_STREAMOFF failed\n", __func__);
         return ret;
@@ -392,7 +607,7 @@ static int fimc_v4l2_streamoff(int fp)
     return ret;
 }
 
-static int fimc_v4l2_qbuf(int fp, int index)
+static int fimc_v4l2_qbuf(UVCDevice *dev, int index)
 {
     struct v4l2_buffer v4l2_buf;
     int ret;
@@ -402,7 +617,7 @@ static int fimc_v4l2_qbuf(int fp, int index)
     v4l2_buf.memory = V4L2_MEMORY_MMAP;
     v4l2_buf.index = index;
 
-    ret = ioctl(fp, VIDIOC_QBUF, &v4l2_buf);
+    ret = dev->ioctl(VIDIOC_QBUF, &v4l2_buf);
     if (ret < 0) {
         ALOGE("ERR(%s):VIDIOC_QBUF failed\n", __func__);
         return ret;
@@ -411,7 +626,7 @@ static int fimc_v4l2_qbuf(int fp, int index)
     return 0;
 }
 
-static int fimc_v4l2_dqbuf(int fp)
+static int fimc_v4l2_dqbuf(UVCDevice *dev)
 {
     struct v4l2_buffer v4l2_buf;
     int ret;
@@ -420,7 +635,7 @@ static int fimc_v4l2_dqbuf(int fp)
     v4l2_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     v4l2_buf.memory = V4L2_MEMORY_MMAP;
 
-    ret = ioctl(fp, VIDIOC_DQBUF, &v4l2_buf);
+    ret = dev->ioctl(VIDIOC_DQBUF, &v4l2_buf);
     if (ret < 0) {
         ALOGE("ERR(%s):VIDIOC_DQBUF failed, dropped frame (%d)\n", __func__, ret);
         return ret;
@@ -429,14 +644,14 @@ static int fimc_v4l2_dqbuf(int fp)
     return v4l2_buf.index;
 }
 
-static int fimc_v4l2_g_ctrl(int fp, unsigned int id)
+static int fimc_v4l2_g_ctrl(UVCDevice *dev, unsigned int id)
 {
     struct v4l2_control ctrl;
     int ret;
 
     ctrl.id = id;
 
-    ret = ioctl(fp, VIDIOC_G_CTRL, &ctrl);
+    ret = dev->ioctl(VIDIOC_G_CTRL, &ctrl);
     if (ret < 0) {
         ALOGE("ERR(%s): VIDIOC_G_CTRL(id = 0x%x (%d)) failed, ret = %d\n",
              __func__, id, id-V4L2_CID_PRIVATE_BASE, ret);
@@ -446,7 +661,7 @@ static int fimc_v4l2_g_ctrl(int fp, unsigned int id)
     return ctrl.value;
 }
 
-static int fimc_v4l2_s_ctrl(int fp, unsigned int id, unsigned int value)
+static int fimc_v4l2_s_ctrl(UVCDevice *dev, unsigned int id, unsigned int value)
 {
     struct v4l2_control ctrl;
     int ret;
@@ -460,7 +675,7 @@ static int fimc_v4l2_s_ctrl(int fp, unsigned int id, unsigned int value)
         return 0;
     }
 
-    ret = ioctl(fp, VIDIOC_S_CTRL, &ctrl);
+    ret = dev->ioctl(VIDIOC_S_CTRL, &ctrl);
     if (ret < 0) {
         ALOGE("ERR(%s):VIDIOC_S_CTRL(id = %#x (%d), value = %d) failed ret = %d\n",
              __func__, id, id-V4L2_CID_PRIVATE_BASE, value, ret);
@@ -471,7 +686,7 @@ static int fimc_v4l2_s_ctrl(int fp, unsigned int id, unsigned int value)
     return ctrl.value;
 }
 
-static int fimc_v4l2_s_ext_ctrl(int fp, unsigned int id, void *value)
+static int fimc_v4l2_s_ext_ctrl(UVCDevice *dev, unsigned int id, void *value)
 {
     struct v4l2_ext_controls ctrls;
     struct v4l2_ext_control ctrl;
@@ -485,20 +700,20 @@ static int fimc_v4l2_s_ext_ctrl(int fp, unsigned int id, void *value)
     ctrls.count = 1;
     ctrls.controls = &ctrl;
 
-    ret = ioctl(fp, VIDIOC_S_EXT_CTRLS, &ctrls);
+    ret = dev->ioctl(VIDIOC_S_EXT_CTRLS, &ctrls);
     if (ret < 0)
         ALOGE("ERR(%s):VIDIOC_S_EXT_CTRLS failed\n", __func__);
 
     return ret;
 }
 
-static int fimc_v4l2_g_parm(int fp, struct v4l2_streamparm *streamparm)
+static int fimc_v4l2_g_parm(UVCDevice *dev, struct v4l2_streamparm *streamparm)
 {
     int ret;
 
     streamparm->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-    ret = ioctl(fp, VIDIOC_G_PARM, streamparm);
+    ret = dev->ioctl(VIDIOC_G_PARM, streamparm);
     if (ret < 0) {
         ALOGE("ERR(%s):VIDIOC_G_PARM failed\n", __func__);
         return -1;
@@ -511,13 +726,13 @@ static int fimc_v4l2_g_parm(int fp, struct v4l2_streamparm *streamparm)
     return 0;
 }
 
-static int fimc_v4l2_s_parm(int fp, struct v4l2_streamparm *streamparm)
+static int fimc_v4l2_s_parm(UVCDevice *dev, struct v4l2_streamparm *streamparm)
 {
     int ret;
 
     streamparm->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-    ret = ioctl(fp, VIDIOC_S_PARM, streamparm);
+    ret = dev->ioctl(VIDIOC_S_PARM, streamparm);
     if (ret < 0) {
         ALOGE("ERR(%s):VIDIOC_S_PARM failed\n", __func__);
         return ret;
@@ -533,6 +748,7 @@ UVCCamera::UVCCamera() :
             m_flag_init(0),
             m_camera_id(CAMERA_ID_FRONT),
             m_cam_fd(-1),
+            m_dev(NULL),
             //m_cam_fd2(-1),
             m_preview_v4lformat(V4L2_PIX_FMT_YUV422P),
             m_preview_width      (0),
@@ -549,6 +765,7 @@ UVCCamera::UVCCamera() :
             m_wdr(-1),
             m_anti_shake(-1),
             m_zoom_level(-1),
+            m_flip(FLIP_NONE),
             m_object_tracking(-1),
             m_smart_auto(-1),
             m_beauty_shot(-1),
@@ -571,11 +788,24 @@ UVCCamera::UVCCamera() :
             m_flag_camera_start(0),
             m_jpeg_thumbnail_width (0),
             m_jpeg_thumbnail_height(0),
-            m_jpeg_quality(100)
+            m_jpeg_quality(100),
+            m_epoll_fd(-1),
+            m_event_fd(-1),
+            m_capture_cmds(0),
+            m_stall_ms(0),
+            m_num_stream_modes(0),
+            m_cur_stream_mode(-1),
+            m_flag_mode_pending(0),
+            m_pending_stream_mode(-1),
+            m_pending_width(0),
+            m_pending_height(0),
+            m_pending_v4lformat(0)
 {
     struct v4l2_captureparm capture;
 
     memset(&m_capture_buf, 0, sizeof(m_capture_buf));
+    memset(&m_streamparm, 0, sizeof(m_streamparm));
+    memset(&m_pending_interval, 0, sizeof(m_pending_interval));
 
     ALOGV("%s :", __func__);
 }
@@ -592,7 +822,6 @@ const char *UVCCamera::getPreviewSizes() {
 int UVCCamera::initCamera(int index)
 {
     ALOGV("%s :", __func__);
-    int ret = 0;
 
     if (!m_flag_init) {
         /* Arun C
@@ -601,21 +830,39 @@ int UVCCamera::initCamera(int index)
          */
         m_camera_af_flag = -1;
 
-        m_cam_fd = open(CAMERA_DEV_NAME, O_RDWR);
+        m_dev = UVCDevice::create();
+        m_cam_fd = m_dev->open(CAMERA_DEV_NAME);
         if (m_cam_fd < 0) {
             ALOGE("ERR(%s):Cannot open %s (error : %s)\n", __func__, CAMERA_DEV_NAME, strerror(errno));
+            delete m_dev;
+            m_dev = NULL;
             return -1;
         }
         ALOGV("%s: open(%s) --> m_cam_fd %d", __FUNCTION__, CAMERA_DEV_NAME, m_cam_fd);
 
+        m_event_fd = eventfd(0, EFD_NONBLOCK);
+        if (m_event_fd < 0) {
+            ALOGE("ERR(%s):Cannot create eventfd (error : %s)\n", __func__, strerror(errno));
+            goto err;
+        }
+        m_epoll_fd = epoll_create(2);
+        if (m_epoll_fd < 0) {
+            ALOGE("ERR(%s):Cannot create epoll fd (error : %s)\n", __func__, strerror(errno));
+            goto err;
+        }
+        if (fimc_epoll_add(m_epoll_fd, m_cam_fd) < 0 ||
+                fimc_epoll_add(m_epoll_fd, m_event_fd) < 0) {
+            ALOGE("ERR(%s):Cannot add to epoll fd (error : %s)\n", __func__, strerror(errno));
+            goto err;
+        }
+
         ALOGE("initCamera: m_cam_fd(%d), m_jpeg_fd(%d)", m_cam_fd, m_jpeg_fd);
 
-        ret = fimc_v4l2_querycap(m_cam_fd);
-        CHECK(ret);
-        if (!fimc_v4l2_enuminput(m_cam_fd, index))
-            return -1;
-        ret = fimc_v4l2_s_input(m_cam_fd, index);
-        CHECK(ret);
+        if (fimc_v4l2_querycap(m_dev) < 0 || !fimc_v4l2_enuminput(m_dev, index) ||
+                fimc_v4l2_s_input(m_dev, index) < 0) {
+            ALOGE("ERR(%s):Cannot select input %d\n", __func__, index);
+            goto err;
+        }
 
         m_camera_id = index;
 
@@ -625,7 +872,7 @@ int UVCCamera::initCamera(int index)
         char *sizeStr = m_frame_size_string;
         unsigned w, h;
         for(int sindex = 0;
-                fimc_v4l2_enum_framesize(m_cam_fd, V4L2_PIX_FMT_YUYV, sindex, &w, &h) == 0;
+                fimc_v4l2_enum_framesize(m_dev, V4L2_PIX_FMT_YUYV, sindex, &w, &h) == 0;
                 sindex++) {
             ALOGD("Adding %d,%d\n", w, h);
             // FIXME - KR found string overrun.
@@ -641,6 +888,8 @@ int UVCCamera::initCamera(int index)
                 m_preview_max_height = h;
         }
 
+        m_enumStreamModes();
+
         m_snapshot_max_width  = MAX_FRONT_CAMERA_SNAPSHOT_WIDTH;
         m_snapshot_max_height = MAX_FRONT_CAMERA_SNAPSHOT_HEIGHT;
 
@@ -650,6 +899,205 @@ int UVCCamera::initCamera(int index)
         ALOGI("%s : initialized", __FUNCTION__);
     }
     return 0;
+
+err:
+    m_closeDevice();
+    return -1;
+}
+
+/* Closes the device and the fds waited on with it, whichever are open */
+void UVCCamera::m_closeDevice(void)
+{
+    if (m_dev) {
+        m_dev->close();
+        delete m_dev;
+        m_dev = NULL;
+        m_cam_fd = -1;
+    }
+
+    if (m_epoll_fd > -1) {
+        close(m_epoll_fd);
+        m_epoll_fd = -1;
+    }
+    if (m_event_fd > -1) {
+        close(m_event_fd);
+        m_event_fd = -1;
+    }
+}
+
+void UVCCamera::m_enumStreamModes(void)
+{
+    struct v4l2_fmtdesc fmtdesc;
+    struct v4l2_fract intervals[16];
+    unsigned w, h;
+
+    m_num_stream_modes = 0;
+    m_cur_stream_mode = -1;
+    m_flag_mode_pending = 0;
+
+    memset(&fmtdesc, 0, sizeof(fmtdesc));
+    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    for (; m_dev->ioctl(VIDIOC_ENUM_FMT, &fmtdesc) == 0; fmtdesc.index++) {
+        for (int sindex = 0;
+                fimc_v4l2_enum_framesize(m_dev, fmtdesc.pixelformat, sindex, &w, &h) == 0;
+                sindex++) {
+            int count = fimc_v4l2_enum_frameintervals(m_dev, fmtdesc.pixelformat, w, h,
+                                                      intervals, 16);
+
+            for (int i = 0; i < count; i++) {
+                if (m_num_stream_modes >= MAX_STREAM_MODES) {
+                    ALOGW("%s: more than %d stream modes, ignoring the rest",
+                            __func__, MAX_STREAM_MODES);
+                    return;
+                }
+
+                struct uvc_stream_mode *mode = &m_stream_modes[m_num_stream_modes++];
+                mode->fmt = fmtdesc.pixelformat;
+                mode->width = w;
+                mode->height = h;
+                mode->interval = intervals[i];
+                mode->bandwidth = fimc_mode_bandwidth(mode);
+
+                ALOGD("stream mode %.4s %ux%u @ %d.%03d fps, ~%u KB/s",
+                        (const char *)&mode->fmt, w, h,
+                        fimc_mode_fps(mode) / 1000, fimc_mode_fps(mode) % 1000,
+                        mode->bandwidth / 1024);
+            }
+        }
+    }
+}
+
+/* Pick the (format, size, interval) tuple for a preview of width x height
+ * whose frame rate lies in [min_fps, max_fps] (fps * 1000) and whose
+ * estimated bandwidth fits in the isochronous budget.  Compressed formats
+ * are only considered when the caller can consume them.  When nothing fits
+ * the range, the fastest mode that fits the bus is used instead so the
+ * frame rate drops deliberately rather than collapsing on the wire.
+ */
+int UVCCamera::negotiateStreamMode(int width, int height, int min_fps, int max_fps,
+                                   bool allow_compressed)
+{
+    unsigned int budget = USB_ISOC_MAX_BANDWIDTH / 100 * USB_ISOC_BUDGET_PERCENT;
+    int best = -1;
+    int fallback = -1;
+    int cheapest = -1;
+
+    ALOGV("%s(%dx%d, fps %d..%d, compressed %d)", __func__,
+            width, height, min_fps, max_fps, allow_compressed);
+
+    if (m_num_stream_modes == 0) {
+        // Driver can't enumerate intervals, keep the old blind behaviour.
+        struct v4l2_fract interval = m_streamparm.parm.capture.timeperframe;
+
+        if (max_fps > 0) {
+            interval.numerator = 1000;
+            interval.denominator = max_fps;
+        }
+        m_stageStreamMode(-1, width, height, V4L2_PIX_FMT_YUYV, &interval);
+        return 0;
+    }
+
+    for (int i = 0; i < m_num_stream_modes; i++) {
+        struct uvc_stream_mode *mode = &m_stream_modes[i];
+        int fps = fimc_mode_fps(mode);
+
+        if ((int)mode->width != width || (int)mode->height != height)
+            continue;
+        // YUYV is the only raw format the preview path converts.
+        if (fimc_is_compressed(mode->fmt) ? !allow_compressed : mode->fmt != V4L2_PIX_FMT_YUYV)
+            continue;
+
+        if (cheapest < 0 || mode->bandwidth < m_stream_modes[cheapest].bandwidth)
+            cheapest = i;
+
+        if (mode->bandwidth > budget || fps > max_fps)
+            continue;
+
+        if (fallback < 0 || fimc_mode_better(mode, &m_stream_modes[fallback]))
+            fallback = i;
+
+        if (fps < min_fps)
+            continue;
+
+        if (best < 0 || fimc_mode_better(mode, &m_stream_modes[best]))
+            best = i;
+    }
+
+    if (best < 0) {
+        best = fallback >= 0 ? fallback : cheapest;
+        if (best < 0) {
+            ALOGE("ERR(%s):No stream mode for %dx%d\n", __func__, width, height);
+            return -1;
+        }
+        ALOGW("%s: no mode for %dx%d within %d..%d fps fits %u B/s, using %d fps",
+                __func__, width, height, min_fps, max_fps, budget,
+                fimc_mode_fps(&m_stream_modes[best]));
+    }
+
+    struct uvc_stream_mode *mode = &m_stream_modes[best];
+
+    m_stageStreamMode(best, mode->width, mode->height, mode->fmt, &mode->interval);
+
+    ALOGI("%s: %.4s %ux%u @ %d fps, ~%u KB/s", __func__,
+            (const char *)&mode->fmt, mode->width, mode->height,
+            fimc_mode_fps(mode) / 1000, mode->bandwidth / 1024);
+
+    return 0;
+}
+
+/* Records the mode negotiateStreamMode() settled on.  While the preview
+ * streams the mode is only staged: m_preview_* and the frame interval keep
+ * describing the buffers in flight until applyStreamMode() runs with the
+ * stream down.
+ */
+void UVCCamera::m_stageStreamMode(int index, int width, int height, int fmt,
+                                  const struct v4l2_fract *interval)
+{
+    m_pending_stream_mode = index;
+    m_pending_width = width;
+    m_pending_height = height;
+    m_pending_v4lformat = fmt;
+    m_pending_interval = *interval;
+    m_flag_mode_pending = 1;
+
+    if (m_flag_camera_start == 0)
+        applyStreamMode();
+}
+
+/* Switches to the staged stream mode.  Must be called with the preview
+ * stopped.  Returns 1 if the mode changed, 0 if nothing was staged.
+ */
+int UVCCamera::applyStreamMode(void)
+{
+    if (!m_flag_mode_pending)
+        return 0;
+
+    if (m_flag_camera_start > 0) {
+        ALOGE("ERR(%s):Preview is still running\n", __func__);
+        return -1;
+    }
+
+    m_cur_stream_mode = m_pending_stream_mode;
+    setPreviewSize(m_pending_width, m_pending_height, m_pending_v4lformat);
+    m_streamparm.parm.capture.timeperframe = m_pending_interval;
+    m_flag_mode_pending = 0;
+
+    return 1;
+}
+
+/* Reports the staged mode when there is one, so the parameters describe
+ * what the next stream start will use.
+ */
+int UVCCamera::getStreamMode(struct uvc_stream_mode *mode)
+{
+    int index = m_flag_mode_pending ? m_pending_stream_mode : m_cur_stream_mode;
+
+    if (index < 0)
+        return -1;
+
+    *mode = m_stream_modes[index];
+    return 0;
 }
 
 void UVCCamera::resetCamera()
@@ -671,10 +1119,7 @@ void UVCCamera::DeinitCamera()
          * uses m_cam_fd to change frame rate
          */
         ALOGI("DeinitCamera: m_cam_fd(%d)", m_cam_fd);
-        if (m_cam_fd > -1) {
-            close(m_cam_fd);
-            m_cam_fd = -1;
-        }
+        m_closeDevice();
 
 #if 0
         ALOGI("DeinitCamera: m_cam_fd2(%d)", m_cam_fd2);
@@ -695,6 +1140,33 @@ int UVCCamera::getCameraFd(void)
     return m_cam_fd;
 }
 
+/* Where preview buffer index lives, for mapping it into a MemoryHeapBase */
+int UVCCamera::getPreviewBuffer(int index, int *fd, unsigned int *length, unsigned int *offset)
+{
+    struct v4l2_buffer v4l2_buf;
+
+    if (m_dev == NULL) {
+        ALOGE("ERR(%s):Camera was closed\n", __func__);
+        return -1;
+    }
+
+    memset(&v4l2_buf, 0, sizeof(v4l2_buf));
+    v4l2_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    v4l2_buf.memory = V4L2_MEMORY_MMAP;
+    v4l2_buf.index = index;
+
+    if (m_dev->ioctl(VIDIOC_QUERYBUF, &v4l2_buf) < 0) {
+        ALOGE("ERR(%s):VIDIOC_QUERYBUF(%d) failed\n", __func__, index);
+        return -1;
+    }
+
+    *fd = m_dev->getMmapFd();
+    *length = v4l2_buf.length;
+    *offset = v4l2_buf.m.offset;
+
+    return 0;
+}
+
 // ======================================================================
 // Preview
 
@@ -713,17 +1185,17 @@ int UVCCamera::startPreview(void)
         return -1;
     }
 
-    memset(&m_events_c, 0, sizeof(m_events_c));
-    m_events_c.fd = m_cam_fd;
-    m_events_c.events = POLLIN | POLLERR;
+    /* drop commands aimed at a previous session */
+    getCaptureCommands();
+    m_stall_ms = 0;
 
     /* enum_fmt, s_fmt sample */
-    int ret = fimc_v4l2_enum_fmt(m_cam_fd,m_preview_v4lformat);
+    int ret = fimc_v4l2_enum_fmt(m_dev,m_preview_v4lformat);
     CHECK(ret);
-    ret = fimc_v4l2_s_fmt(m_cam_fd, m_preview_width,m_preview_height,m_preview_v4lformat, 0);
+    ret = fimc_v4l2_s_fmt(m_dev, m_preview_width,m_preview_height,m_preview_v4lformat, 0);
     CHECK(ret);
 
-    ret = fimc_v4l2_reqbufs(m_cam_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, MAX_BUFFERS);
+    ret = fimc_v4l2_reqbufs(m_dev, V4L2_BUF_TYPE_VIDEO_CAPTURE, MAX_BUFFERS);
     CHECK(ret);
 
     ALOGV("%s : m_preview_width: %d m_preview_height: %d m_angle: %d\n",
@@ -731,20 +1203,20 @@ int UVCCamera::startPreview(void)
 
     /* start with all buffers in queue */
     for (int i = 0; i < MAX_BUFFERS; i++) {
-        ret = fimc_v4l2_qbuf(m_cam_fd, i);
+        ret = fimc_v4l2_qbuf(m_dev, i);
         CHECK(ret);
     }
 
-    ret = fimc_v4l2_s_parm(m_cam_fd, &m_streamparm);
+    ret = fimc_v4l2_s_parm(m_dev, &m_streamparm);
     CHECK(ret);
 
-    ret = fimc_v4l2_streamon(m_cam_fd);
+    ret = fimc_v4l2_streamon(m_dev);
     CHECK(ret);
 
     m_flag_camera_start = 1;
 
     // It is a delay for a new frame, not to show the previous bigger ugly picture frame.
-    ret = fimc_poll(&m_events_c);
+    ret = m_waitCapture(CAPTURE_FIRST_FRAME_TIMEOUT_MS);
     CHECK(ret);
 
     ALOGV("%s: got the first frame of the preview\n", __func__);
@@ -768,7 +1240,7 @@ int UVCCamera::stopPreview(void)
         return -1;
     }
 
-    ret = fimc_v4l2_streamoff(m_cam_fd);
+    ret = fimc_v4l2_streamoff(m_dev);
     CHECK(ret);
 
     m_flag_camera_start = 0;
@@ -865,14 +1337,14 @@ int UVCCamera::stopRecord(void)
 
 void UVCCamera::pausePreview()
 {
-    fimc_v4l2_s_ctrl(m_cam_fd, V4L2_CID_STREAM_PAUSE, 0);
+    fimc_v4l2_s_ctrl(m_dev, V4L2_CID_STREAM_PAUSE, 0);
 }
 
 int UVCCamera::getPreview()
 {
     int index;
 
-    index = fimc_v4l2_dqbuf(m_cam_fd);
+    index = fimc_v4l2_dqbuf(m_dev);
     if (!(0 <= index && index < MAX_BUFFERS)) {
         ALOGE("ERR(%s):wrong index = %d\n", __func__, index);
         return -1;
@@ -898,7 +1370,7 @@ int UVCCamera::getRecordFrame()
 
 int UVCCamera::releaseFrame(int index)
 {
-    return fimc_v4l2_qbuf(m_cam_fd, index);
+    return fimc_v4l2_qbuf(m_dev, index);
 }
 
 int UVCCamera::setPreviewSize(int width, int height, int pixel_format)
@@ -982,26 +1454,24 @@ int UVCCamera::setSnapshotCmd(void)
         LOG_TIME_END(0)
     }
 
-    memset(&m_events_c, 0, sizeof(m_events_c));
-    m_events_c.fd = m_cam_fd;
-    m_events_c.events = POLLIN | POLLERR;
+    getCaptureCommands();
 
     LOG_TIME_START(1) // prepare
     int nframe = 1;
 
-    ret = fimc_v4l2_enum_fmt(m_cam_fd,m_snapshot_v4lformat);
+    ret = fimc_v4l2_enum_fmt(m_dev,m_snapshot_v4lformat);
     CHECK(ret);
-    ret = fimc_v4l2_s_fmt_cap(m_cam_fd, m_snapshot_width, m_snapshot_height, V4L2_PIX_FMT_JPEG);
+    ret = fimc_v4l2_s_fmt_cap(m_dev, m_snapshot_width, m_snapshot_height, V4L2_PIX_FMT_JPEG);
     CHECK(ret);
-    ret = fimc_v4l2_reqbufs(m_cam_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, nframe);
+    ret = fimc_v4l2_reqbufs(m_dev, V4L2_BUF_TYPE_VIDEO_CAPTURE, nframe);
     CHECK(ret);
-    fimc_v4l2_querybufs(m_cam_fd, m_capture_buf, nframe, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+    fimc_v4l2_querybufs(m_dev, m_capture_buf, nframe, V4L2_BUF_TYPE_VIDEO_CAPTURE);
 
     // FIXME kevinh - should queue up more frames
-    ret = fimc_v4l2_qbuf(m_cam_fd, 0);
+    ret = fimc_v4l2_qbuf(m_dev, 0);
     CHECK(ret);
 
-    ret = fimc_v4l2_streamon(m_cam_fd);
+    ret = fimc_v4l2_streamon(m_dev);
     CHECK(ret);
     LOG_TIME_END(1)
 
@@ -1037,23 +1507,29 @@ unsigned char* UVCCamera::getJpeg(int *jpeg_size, unsigned int *phyaddr)
     LOG_TIME_DEFINE(2)
 
     // capture
-    ret = fimc_poll(&m_events_c);
+    ret = m_waitSnapshot();
     CHECK_PTR(ret);
-    index = fimc_v4l2_dqbuf(m_cam_fd);
+    if (!(ret & CAPTURE_EVENT_FRAME)) {
+        ALOGE("ERR(%s):No snapshot frame (%s)\n", __func__,
+             ret ? "cancelled" : "timed out");
+        fimc_v4l2_streamoff(m_dev);
+        return NULL;
+    }
+    index = fimc_v4l2_dqbuf(m_dev);
     if (index != 0) {
         ALOGE("ERR(%s):wrong index = %d\n", __func__, index);
         return NULL;
     }
 
-    *jpeg_size = fimc_v4l2_g_ctrl(m_cam_fd, V4L2_CID_CAM_JPEG_MAIN_SIZE);
+    *jpeg_size = fimc_v4l2_g_ctrl(m_dev, V4L2_CID_CAM_JPEG_MAIN_SIZE);
     CHECK_PTR(*jpeg_size);
 
-    int main_offset = fimc_v4l2_g_ctrl(m_cam_fd, V4L2_CID_CAM_JPEG_MAIN_OFFSET);
+    int main_offset = fimc_v4l2_g_ctrl(m_dev, V4L2_CID_CAM_JPEG_MAIN_OFFSET);
     CHECK_PTR(main_offset);
-    m_postview_offset = fimc_v4l2_g_ctrl(m_cam_fd, V4L2_CID_CAM_JPEG_POSTVIEW_OFFSET);
+    m_postview_offset = fimc_v4l2_g_ctrl(m_dev, V4L2_CID_CAM_JPEG_POSTVIEW_OFFSET);
     CHECK_PTR(m_postview_offset);
 
-    ret = fimc_v4l2_s_ctrl(m_cam_fd, V4L2_CID_STREAM_PAUSE, 0);
+    ret = fimc_v4l2_s_ctrl(m_dev, V4L2_CID_STREAM_PAUSE, 0);
     CHECK_PTR(ret);
     ALOGV("\nsnapshot dqueued buffer = %d snapshot_width = %d snapshot_height = %d, size = %d\n\n",
             index, m_snapshot_width, m_snapshot_height, *jpeg_size);
@@ -1062,7 +1538,7 @@ unsigned char* UVCCamera::getJpeg(int *jpeg_size, unsigned int *phyaddr)
     *phyaddr = 0; // FIXME kevinh - not correct
 
     LOG_TIME_START(2) // post
-    ret = fimc_v4l2_streamoff(m_cam_fd);
+    ret = fimc_v4l2_streamoff(m_dev);
     CHECK_PTR(ret);
     LOG_TIME_END(2)
 
@@ -1177,7 +1653,7 @@ int UVCCamera::getSnapshotAndJpeg(unsigned char *yuv_buf, unsigned char *jpeg_bu
     LOG_TIME_DEFINE(4)
     LOG_TIME_DEFINE(5)
 
-    //fimc_v4l2_streamoff(m_cam_fd); [zzangdol] remove - it is separate in HWInterface with camera_id
+    //fimc_v4l2_streamoff(m_dev); [zzangdol] remove - it is separate in HWInterface with camera_id
 
     if (m_cam_fd <= 0) {
         ALOGE("ERR(%s):Camera was closed\n", __func__);
@@ -1191,9 +1667,7 @@ int UVCCamera::getSnapshotAndJpeg(unsigned char *yuv_buf, unsigned char *jpeg_bu
         LOG_TIME_END(0)
     }
 
-    memset(&m_events_c, 0, sizeof(m_events_c));
-    m_events_c.fd = m_cam_fd;
-    m_events_c.events = POLLIN | POLLERR;
+    getCaptureCommands();
 
 #if defined(LOG_NDEBUG) && LOG_NDEBUG == 0
     if (m_snapshot_v4lformat == V4L2_PIX_FMT_YUV420)
@@ -1219,27 +1693,33 @@ int UVCCamera::getSnapshotAndJpeg(unsigned char *yuv_buf, unsigned char *jpeg_bu
     LOG_TIME_START(1) // prepare
     int nframe = 1;
 
-    ret = fimc_v4l2_enum_fmt(m_cam_fd,m_snapshot_v4lformat);
+    ret = fimc_v4l2_enum_fmt(m_dev,m_snapshot_v4lformat);
     CHECK(ret);
-    ret = fimc_v4l2_s_fmt_cap(m_cam_fd, m_snapshot_width, m_snapshot_height, m_snapshot_v4lformat);
+    ret = fimc_v4l2_s_fmt_cap(m_dev, m_snapshot_width, m_snapshot_height, m_snapshot_v4lformat);
     CHECK(ret);
-    ret = fimc_v4l2_reqbufs(m_cam_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, nframe);
+    ret = fimc_v4l2_reqbufs(m_dev, V4L2_BUF_TYPE_VIDEO_CAPTURE, nframe);
     CHECK(ret);
     // Just use buffer #0
-    ret = fimc_v4l2_querybuf(m_cam_fd, 0, m_capture_buf, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+    ret = fimc_v4l2_querybuf(m_dev, 0, m_capture_buf, V4L2_BUF_TYPE_VIDEO_CAPTURE);
     CHECK(ret);
 
-    ret = fimc_v4l2_qbuf(m_cam_fd, 0);
+    ret = fimc_v4l2_qbuf(m_dev, 0);
     CHECK(ret);
 
-    ret = fimc_v4l2_streamon(m_cam_fd);
+    ret = fimc_v4l2_streamon(m_dev);
     CHECK(ret);
     LOG_TIME_END(1)
 
     LOG_TIME_START(2) // capture
-    fimc_poll(&m_events_c);
-    index = fimc_v4l2_dqbuf(m_cam_fd);
-    fimc_v4l2_s_ctrl(m_cam_fd, V4L2_CID_STREAM_PAUSE, 0);
+    ret = m_waitSnapshot();
+    if (ret <= 0 || !(ret & CAPTURE_EVENT_FRAME)) {
+        ALOGE("ERR(%s):No snapshot frame (%s)\n", __func__,
+             ret > 0 ? "cancelled" : "timed out");
+        fimc_v4l2_streamoff(m_dev);
+        return -1;
+    }
+    index = fimc_v4l2_dqbuf(m_dev);
+    fimc_v4l2_s_ctrl(m_dev, V4L2_CID_STREAM_PAUSE, 0);
     ALOGV("\nsnapshot dequeued buffer = %d snapshot_width = %d snapshot_height = %d\n\n",
             index, m_snapshot_width, m_snapshot_height);
 
@@ -1248,7 +1728,7 @@ int UVCCamera::getSnapshotAndJpeg(unsigned char *yuv_buf, unsigned char *jpeg_bu
     ALOGI("%s : calling memcpy from m_capture_buf", __func__);
     memcpy(yuv_buf, (unsigned char*)m_capture_buf[0].start, m_snapshot_width * m_snapshot_height * 2);
     LOG_TIME_START(5) // post
-    fimc_v4l2_streamoff(m_cam_fd);
+    fimc_v4l2_streamoff(m_dev);
     LOG_TIME_END(5)
 
     LOG_CAMERA("getSnapshotAndJpeg intervals : stopPreview(%lu), prepare(%lu),"
@@ -1446,14 +1926,8 @@ int UVCCamera::setRotate(int angle)
             return -1;
         }
 
-        if (m_flag_camera_start) {
-#if 0
-            if (fimc_v4l2_s_ctrl(m_cam_fd, V4L2_CID_ROTATION, angle) < 0) {
-                ALOGE("ERR(%s):Fail on V4L2_CID_ROTATION", __func__);
-                return -1;
-            }
-#endif
-        }
+        // UVC has no rotation control, the preview conversion applies
+        // m_angle in software (see getPreviewTransform()).
     }
 
     return 0;
@@ -1469,42 +1943,88 @@ int UVCCamera::setFrameRate(int frame_rate)
 {
     ALOGV("%s(FrameRate(%d))", __func__, frame_rate);
 
-    // not yet implemented
+    if (frame_rate <= 0) {
+        ALOGE("ERR(%s):Invalid frame rate(%d)", __func__, frame_rate);
+        return -1;
+    }
 
-    return 0;
+    return negotiateStreamMode(m_preview_width, m_preview_height,
+                               frame_rate * 1000, frame_rate * 1000,
+                               fimc_is_compressed(m_preview_v4lformat));
 }
 
 // -----------------------------------
 
+/* Few UVC devices implement V4L2_CID_HFLIP/VFLIP, so mirroring is done
+ * by the preview conversion like rotation.
+ */
 int UVCCamera::setVerticalMirror(void)
 {
     ALOGV("%s :", __func__);
+    return setMirror(m_flip | FLIP_VERTICAL);
+}
 
-    if (m_cam_fd <= 0) {
-        ALOGE("ERR(%s):Camera was closed\n", __func__);
-        return -1;
-    }
+int UVCCamera::setHorizontalMirror(void)
+{
+    ALOGV("%s :", __func__);
+    return setMirror(m_flip | FLIP_HORIZONTAL);
+}
 
-    if (fimc_v4l2_s_ctrl(m_cam_fd, V4L2_CID_VFLIP, 0) < 0) {
-        ALOGE("ERR(%s):Fail on V4L2_CID_VFLIP", __func__);
+int UVCCamera::setMirror(int flip)
+{
+    ALOGV("%s(flip(%d))", __func__, flip);
+
+    if (flip & ~(FLIP_HORIZONTAL | FLIP_VERTICAL)) {
+        ALOGE("ERR(%s):Invalid flip(%d)", __func__, flip);
         return -1;
     }
 
+    m_flip = flip;
     return 0;
 }
 
-int UVCCamera::setHorizontalMirror(void)
+int UVCCamera::getMirror(void)
 {
-    ALOGV("%s :", __func__);
+    return m_flip;
+}
 
-    if (m_cam_fd <= 0) {
-        ALOGE("ERR(%s):Camera was closed\n", __func__);
+int UVCCamera::setZoom(int zoom_level)
+{
+    ALOGV("%s(zoom_level(%d))", __func__, zoom_level);
+
+    if (zoom_level < 0 || zoom_level > MAX_ZOOM_LEVEL) {
+        ALOGE("ERR(%s):Invalid zoom_level(%d)", __func__, zoom_level);
         return -1;
     }
 
-    if (fimc_v4l2_s_ctrl(m_cam_fd, V4L2_CID_HFLIP, 0) < 0) {
-        ALOGE("ERR(%s):Fail on V4L2_CID_HFLIP", __func__);
-        return -1;
+    m_zoom_level = zoom_level;
+    return 0;
+}
+
+int UVCCamera::getZoom(void)
+{
+    return m_zoom_level < 0 ? 0 : m_zoom_level;
+}
+
+int UVCCamera::getPreviewTransform(struct preview_transform *t)
+{
+    int ratio = 100 + getZoom() * ZOOM_STEP_PERCENT;
+
+    t->angle = m_angle < 0 ? 0 : m_angle;
+    t->flip = m_flip;
+
+    // Keep the crop on whole YUYV macropixels.
+    t->crop_width = (m_preview_width * 100 / ratio) & ~1;
+    t->crop_height = (m_preview_height * 100 / ratio) & ~1;
+    t->crop_x = ((m_preview_width - t->crop_width) / 2) & ~1;
+    t->crop_y = (m_preview_height - t->crop_height) / 2;
+
+    if (t->angle == 90 || t->angle == 270) {
+        t->out_width = m_preview_height;
+        t->out_height = m_preview_width;
+    } else {
+        t->out_width = m_preview_width;
+        t->out_height = m_preview_height;
     }
 
     return 0;
@@ -1611,7 +2131,7 @@ const __u8* UVCCamera::getCameraSensorName(void)
 {
     ALOGV("%s", __func__);
 
-    return fimc_v4l2_enuminput(m_cam_fd, getCameraId());
+    return fimc_v4l2_enuminput(m_dev, getCameraId());
 }
 
 // ======================================================================
@@ -31,6 +31,8 @@
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 
 #include <utils/RefBase.h>
@@ -39,6 +41,8 @@
 #include <utils/String8.h>
 
 #include "JpegEncoder.h"
+#include "UVCFrameUtils.h"
+#include "UVCDevice.h"
 
 namespace android {
 
@@ -112,6 +116,30 @@ namespace android {
 #define AF_SUCCESS 0x02
 #define AF_DELAY 50000
 
+/* Capture loop timing.  The watchdog is derived from the negotiated frame
+ * interval so a stop request never waits longer than about one frame;
+ * DEFAULT_FRAME_INTERVAL_US is used until the driver has reported one.
+ */
+#define DEFAULT_FRAME_INTERVAL_US       66666   // 15 fps
+#define MIN_WATCHDOG_TIMEOUT_MS         10
+#define CAPTURE_STALL_TIMEOUT_MS        2000
+#define CAPTURE_FIRST_FRAME_TIMEOUT_MS  3000
+#define CAPTURE_SNAPSHOT_TIMEOUT_MS     10000
+
+/* Stream negotiation.  A high-speed isochronous endpoint moves at most
+ * 3 x 1024 bytes per microframe; keep some headroom for the audio
+ * interface and bus overhead.  MJPEG payloads are estimated from the
+ * equivalent YUYV size.
+ */
+#define MAX_STREAM_MODES                256
+#define USB_ISOC_MAX_BANDWIDTH          (3 * 1024 * 8000)   // bytes per second
+#define USB_ISOC_BUDGET_PERCENT         80
+#define MJPEG_COMPRESSION_RATIO         6
+
+/* Digital zoom is a centred crop, ZOOM_STEP_PERCENT per zoom level */
+#define MAX_ZOOM_LEVEL                  12
+#define ZOOM_STEP_PERCENT               25
+
 /*
  * V 4 L 2   F I M C   E X T E N S I O N S
  *
@@ -159,6 +187,15 @@ struct yuv_fmt_list {
     int     planes;
 };
 
+/* One (format, size, frame interval) tuple offered by the device */
+struct uvc_stream_mode {
+    unsigned int    fmt;
+    unsigned int    width;
+    unsigned int    height;
+    struct v4l2_fract interval;
+    unsigned int    bandwidth;  /* estimated bytes per second */
+};
+
 //s1 [Apply factory standard]
 struct camsensor_date_info {
     unsigned int year;
@@ -214,6 +251,26 @@ public:
         CHK_DATALINE_MAX,
     };
 
+    /* Preview mirroring, done in software */
+    enum FLIP {
+        FLIP_NONE       = PREVIEW_FLIP_NONE,
+        FLIP_HORIZONTAL = PREVIEW_FLIP_HORIZONTAL,
+        FLIP_VERTICAL   = PREVIEW_FLIP_VERTICAL,
+    };
+
+    /* Control commands posted to the capture loop through the eventfd */
+    enum CAPTURE_CMD {
+        CAPTURE_CMD_STOP        = 1 << 0,
+        CAPTURE_CMD_RECONFIGURE = 1 << 1,
+        CAPTURE_CMD_SNAPSHOT    = 1 << 2,
+    };
+
+    /* Bits returned by previewPoll() */
+    enum CAPTURE_EVENT {
+        CAPTURE_EVENT_FRAME     = 1 << 0,
+        CAPTURE_EVENT_COMMAND   = 1 << 1,
+    };
+
     int m_touch_af_start_stop;
 
     struct gps_info_latiude {
@@ -282,6 +339,11 @@ public:
     int             getRotate(void);
     int             setVerticalMirror(void);
     int             setHorizontalMirror(void);
+    int             setMirror(int flip);
+    int             getMirror(void);
+    int             setZoom(int zoom_level);
+    int             getZoom(void);
+    int             getPreviewTransform(struct preview_transform *t);
 
     int             setGPSLatitude(const char *gps_latitude);
     int             setGPSLongitude(const char *gps_longitude);
@@ -316,6 +378,13 @@ public:
     int             getDefultIMEI(void);
     const __u8*     getCameraSensorName(void);
     int             previewPoll(bool preview);
+    int             sendCaptureCommand(int cmd);
+    int             getCaptureCommands(void);
+    int             getFrameIntervalUs(void);
+    int             negotiateStreamMode(int width, int height, int min_fps, int max_fps,
+                                        bool allow_compressed);
+    int             getStreamMode(struct uvc_stream_mode *mode);
+    int             applyStreamMode(void);
 
     int setFrameRate(int frame_rate);
     unsigned char*  getJpeg(int*, unsigned int*);
@@ -328,6 +397,8 @@ public:
 
     int             getPostViewOffset(void);
     int             getCameraFd(void);
+    int             getPreviewBuffer(int index, int *fd, unsigned int *length,
+                                     unsigned int *offset);
     int             getJpegFd(void);
     void            SetJpgAddr(unsigned char *addr);
     void            pausePreview();
@@ -374,6 +445,7 @@ private:
     int             m_camera_id;
 
     int             m_cam_fd;
+    UVCDevice      *m_dev;
 
     // int             m_cam_fd2;
     struct pollfd   m_events_c2;
@@ -396,6 +468,7 @@ private:
     int             m_wdr;
     int             m_anti_shake;
     int             m_zoom_level;
+    int             m_flip;
     int             m_object_tracking;
     int             m_smart_auto;
     int             m_beauty_shot;
@@ -435,9 +508,30 @@ private:
     exif_attribute_t mExifInfo;
 
     struct fimc_buffer m_capture_buf[MAX_BUFFERS];
-    struct pollfd   m_events_c;
+
+    int             m_epoll_fd;
+    int             m_event_fd;
+    volatile int32_t m_capture_cmds;
+    int             m_stall_ms;
+
+    struct uvc_stream_mode m_stream_modes[MAX_STREAM_MODES];
+    int             m_num_stream_modes;
+    int             m_cur_stream_mode;
+
+    int             m_flag_mode_pending;
+    int             m_pending_stream_mode;
+    int             m_pending_width;
+    int             m_pending_height;
+    int             m_pending_v4lformat;
+    struct v4l2_fract m_pending_interval;
 
     inline int      m_frameSize(int format, int width, int height);
+    int             m_waitCapture(int timeout_ms);
+    int             m_waitSnapshot(void);
+    void            m_stageStreamMode(int index, int width, int height, int fmt,
+                                      const struct v4l2_fract *interval);
+    void            m_enumStreamModes(void);
+    void            m_closeDevice(void);
 
     void            setExifChangedAttribute();
     void            setExifFixedAttribute();
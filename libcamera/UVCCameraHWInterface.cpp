@@ -21,21 +21,30 @@
 #include <utils/Log.h>
 
 #include "UVCCameraHWInterface.h"
+#include "UVCFrameUtils.h"
 #include <utils/threads.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <camera/Camera.h>
+#include <cutils/properties.h>
 #include <media/hardware/MetadataBufferType.h>
 
-#define VIDEO_COMMENT_MARKER_H          0xFFBE
-#define VIDEO_COMMENT_MARKER_L          0xFFBF
-#define VIDEO_COMMENT_MARKER_LENGTH     4
-#define JPEG_EOI_MARKER                 0xFFD9
-#define HIBYTE(x) (((x) >> 8) & 0xFF)
-#define LOBYTE(x) ((x) & 0xFF)
-
 #define FRONT_CAMERA_FOCUS_DISTANCES_STR           "0.20,0.25,Infinity"
 
+// Read-only keys describing the negotiated UVC stream
+#define KEY_UVC_STREAM_FORMAT           "uvc-stream-format"
+#define KEY_UVC_STREAM_FRAME_RATE       "uvc-stream-frame-rate"
+#define KEY_UVC_STREAM_BANDWIDTH        "uvc-stream-bandwidth"
+
+// Preview orientation for wall or ceiling mounted cameras, defaults
+// come from ro.camera.uvc.rotation and ro.camera.uvc.mirror.
+#define KEY_UVC_PREVIEW_ROTATION        "uvc-preview-rotation"
+#define KEY_UVC_PREVIEW_MIRROR          "uvc-preview-mirror"
+#define UVC_MIRROR_NONE                 "none"
+#define UVC_MIRROR_HORIZONTAL           "horizontal"
+#define UVC_MIRROR_VERTICAL             "vertical"
+#define UVC_MIRROR_BOTH                 "both"
+
 // FIXME:
 // -- The actual preview color is set to YV12. The preview frames
 //    returned via preview callback must be generated by color
@@ -203,6 +212,21 @@ void CameraHardwareUVC::initDefaultParameters(int cameraId)
 
         p.set(CameraParameters::KEY_FOCAL_LENGTH, "0.9");
 
+    // digital zoom and preview orientation are done in software
+    parameterString = "100";
+    for (int i = 1; i <= MAX_ZOOM_LEVEL; i++)
+        parameterString.appendFormat(",%d", 100 + i * ZOOM_STEP_PERCENT);
+    p.set(CameraParameters::KEY_ZOOM_SUPPORTED, CameraParameters::TRUE);
+    p.set(CameraParameters::KEY_MAX_ZOOM, MAX_ZOOM_LEVEL);
+    p.set(CameraParameters::KEY_ZOOM_RATIOS, parameterString.string());
+    p.set(CameraParameters::KEY_ZOOM, 0);
+
+    char prop[PROPERTY_VALUE_MAX];
+    property_get("ro.camera.uvc.rotation", prop, "0");
+    p.set(KEY_UVC_PREVIEW_ROTATION, prop);
+    property_get("ro.camera.uvc.mirror", prop, UVC_MIRROR_NONE);
+    p.set(KEY_UVC_PREVIEW_MIRROR, prop);
+
     parameterString = CameraParameters::WHITE_BALANCE_AUTO;
     parameterString.append(",");
     parameterString.append(CameraParameters::WHITE_BALANCE_INCANDESCENT);
@@ -258,8 +282,6 @@ void CameraHardwareUVC::initDefaultParameters(int cameraId)
      * want to change something.
      */
     setParameters(p);
-
-    mUVCCamera->setFrameRate(15);
 }
 
 CameraHardwareUVC::~CameraHardwareUVC()
@@ -300,7 +322,7 @@ status_t CameraHardwareUVC::setPreviewWindow(preview_stream_ops *w)
 
     int preview_width;
     int preview_height;
-    mParameters.getPreviewSize(&preview_width, &preview_height);
+    getPreviewBufferSize(&preview_width, &preview_height);
     int hal_pixel_format = HAL_PIXEL_FORMAT_YV12;
 
     const char *str_preview_format = mParameters.getPreviewFormat();
@@ -386,83 +408,55 @@ int CameraHardwareUVC::previewThreadWrapper()
 
 }
 
-static void YUYVtoYV12(int width, int height, int stride,
-                       const uint8_t *frame, uint8_t *vaddr)
-{
-    // Convert from YUYV to YV12 using 32 bit reads and 16 bit writes.
-    // Also does all math in 32-bit quantities.
-    // This is about twice as fast as KevinH's original implementation.
-
-    // YUYV=4 bytes per 2 pixels
-    int numPixels = width * height;
-    const uint32_t *src0 = (const uint32_t*)frame; // Even rows of YUYV
-    const uint32_t *src1 = (const uint32_t*)(frame + width * 2); // Odd rows of YUYV
-
-    uint32_t *yOut0 = (uint32_t*)vaddr;  // Even rows of Y plane.
-    uint32_t *yOut1 = (uint32_t*)(vaddr + stride);  // Odd rows of Y plane.
-    uint16_t *vOut = (uint16_t*)((uint8_t*)yOut0 + numPixels); // V plane
-    uint16_t *uOut = (uint16_t*)((uint8_t*)vOut + numPixels / 4); // U plane
-
-    uint32_t r0_0, r0_1, r1_0, r1_1;
-
-    // Read 2x2 uint32_t YUYV at a time, output 2x4Y, 1x2U, 1x2V.
-    // This code is little endian only.
-    for(int r = 0 ; r < height / 2 ; r++) {
-        for (int c = 0 ; c < width / 4 ; c++) {
-            // Read 2x4 bytes from two consecutive rows.
-            r0_0 = *src0++; r0_1 = *src0++;
-            r1_0 = *src1++; r1_1 = *src1++;
-
-            // Output 2x2x8-bit luma.
-            *yOut0++ =
-                (r0_0 & 0xff) |
-                ((r0_0 >> 8) & 0xff00) |
-                ((r0_1 << 16) & 0xff0000) |
-                ((r0_1 << 8) & 0xff000000);
-            *yOut1++ =
-                (r1_0 & 0xff) |
-                ((r1_0 >> 8) & 0xff00) |
-                ((r1_1 << 16) & 0xff0000) |
-                ((r1_1 << 8) & 0xff000000);
-
-            // Now we trash the YUYV pixels to generate sub-sampled
-            // chroma U and V.
-            // We will make a 32-bit word with VVUU.
-
-            // Convert VVYYUUYY to 00VV00UU
-            r0_0 = (r0_0 & 0xff00ff00) >> 8;
-            r1_0 = (r1_0 & 0xff00ff00) >> 8;
-            r0_1 = (r0_1 & 0xff00ff00) >> 8;
-            r1_1 = (r1_1 & 0xff00ff00) >> 8;
-
-            // Add 00VV00UU values and divide by 2 (average U and V).
-            r0_0 = ((r0_0 + r1_0) >> 1) & 0x00ff00ff; // 00VV00UU
-            // Also shift second value left by 8.
-            r0_1 = ((r0_1 + r1_1) << 7) & 0xff00ff00; // VV00UU00
-
-            // OR to get VVVVUUUU
-            r0_0 = r0_0 | r0_1;
-
-            // Output V and U.
-            *vOut++ = r0_0 >> 16;
-            *uOut++ = r0_0 & 0xffff;
-        }
-
-        // Move to next pair of rows.
-        src0 += width / 2;
-        src1 += width / 2;
-        yOut0 += width / 4;
-        yOut1 += width / 4;
-    }
-
-}
-
 int CameraHardwareUVC::previewThread()
 {
     int index = -1;
     nsecs_t timestamp;
     struct addrs *addrs;
 
+    int events = mUVCCamera->previewPoll(true);
+    if (events < 0) {
+        ALOGE("ERR(%s):Fail on UVCCamera->previewPoll() (%d)", __func__, events);
+        if (msgTypeEnabled(CAMERA_MSG_ERROR))
+            mNotifyCb(CAMERA_MSG_ERROR, CAMERA_ERROR_UNKNOWN, 0, mCallbackCookie);
+
+        if (events != -ETIMEDOUT) {
+            // The device is gone, park until preview gets stopped.
+            mPreviewLock.lock();
+            while (mPreviewRunning)
+                mPreviewCondition.wait(mPreviewLock);
+            mPreviewLock.unlock();
+        }
+        return UNKNOWN_ERROR;
+    }
+
+    if (events & UVCCamera::CAPTURE_EVENT_COMMAND) {
+        int cmds = mUVCCamera->getCaptureCommands();
+
+        // Stop and snapshot: mPreviewRunning is already cleared, so just
+        // return to previewThreadWrapper() and let it shut the stream down.
+        if (cmds & (UVCCamera::CAPTURE_CMD_STOP | UVCCamera::CAPTURE_CMD_SNAPSHOT))
+            return NO_ERROR;
+
+        if (cmds & UVCCamera::CAPTURE_CMD_RECONFIGURE) {
+            Mutex::Autolock lock(mPreviewLock);
+            if (mPreviewRunning) {
+                ALOGV("%s: restarting preview with the new configuration", __func__);
+                mUVCCamera->stopPreview();
+                freePreviewHeap();
+                if (mUVCCamera->applyStreamMode() > 0 && mPreviewWindow)
+                    setPreviewWindowGeometry();
+                if (previewInit() < 0)
+                    ALOGE("ERR(%s):Fail on preview restart", __func__);
+            }
+            return NO_ERROR;
+        }
+    }
+
+    // Watchdog expired, go around and look at mPreviewRunning again.
+    if (!(events & UVCCamera::CAPTURE_EVENT_FRAME))
+        return NO_ERROR;
+
     index = mUVCCamera->getPreview();
     if (index < 0) {
         ALOGE("ERR(%s):Fail on UVCCamera->getPreview()", __func__);
@@ -477,6 +471,9 @@ int CameraHardwareUVC::previewThread()
     mUVCCamera->getPreviewSize(&width, &height, &frame_size);
     // ALOGI("preview frame w=%d, h=%d, sz=%d", width, height, frame_size);
 
+    struct preview_transform xform;
+    mUVCCamera->getPreviewTransform(&xform);
+
     if (mPreviewWindow && mGrallocHal) {
         buffer_handle_t *buf_handle;
         int stride;
@@ -497,14 +494,16 @@ int CameraHardwareUVC::previewThread()
         if (!mGrallocHal->lock(mGrallocHal,
                                *buf_handle,
                                GRALLOC_USAGE_SW_WRITE_OFTEN,
-                               0, 0, width, height, &vaddr)) {
+                               0, 0, xform.out_width, xform.out_height, &vaddr)) {
 
             uint8_t *frame = (uint8_t *) mPreviewHeap[index]->base();
 
-            if(mUVCCamera->getPreviewPixelFormat() == V4L2_PIX_FMT_YUYV)
+            if (mUVCCamera->getPreviewPixelFormat() != V4L2_PIX_FMT_YUYV)
+                memcpy(vaddr, frame, frame_size);
+            else if (isIdentityTransform(&xform, width, height))
                 YUYVtoYV12(width, height, stride, frame, (uint8_t*) vaddr);
             else
-                memcpy(vaddr, frame, frame_size);
+                YUYVtoYV12Transform(width, height, &xform, stride, frame, (uint8_t*) vaddr);
 
             // Unlock buf_handle before passing to enqueue_buffer.
             // We are done with it, the upstream can lock it if it
@@ -600,6 +599,11 @@ status_t CameraHardwareUVC::startPreview()
         return INVALID_OPERATION;
     }
 
+    // A mode staged while the last preview streamed, if it stopped before
+    // the capture loop got to switch it.
+    if (mUVCCamera->applyStreamMode() > 0 && mPreviewWindow)
+        setPreviewWindowGeometry();
+
     // Check the hardware path before starting the thread.
     int err = previewInit();
     if (err < 0) {
@@ -645,21 +649,16 @@ status_t CameraHardwareUVC::previewInit()
     freePreviewHeap();
 
     for(int i = 0; i < kBufferCount; i++) {
-      struct v4l2_buffer req;
-      req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-      req.memory = V4L2_MEMORY_MMAP;
-      req.index = i;
-      req.length = -1;
-      ret = ioctl(mUVCCamera->getCameraFd(), VIDIOC_QUERYBUF, &req);
+      int fd = -1;
+      unsigned int length = 0, offset = 0;
+      ret = mUVCCamera->getPreviewBuffer(i, &fd, &length, &offset);
       if(ret < 0)
         ALOGE("query failed\n");
 
-      //ALOGD("KEVINH expected length %d\n", req.length);
-
-      mPreviewHeap[i] = new MemoryHeapBase((int)mUVCCamera->getCameraFd(),
-                                req.length,
+      mPreviewHeap[i] = new MemoryHeapBase(fd,
+                                length,
                                            0, // flags
-                                req.m.offset);
+                                offset);
       if (!mPreviewHeap[i]) {
         ALOGE("ERR(%s): Preview heap creation fail", __func__);
         return UNKNOWN_ERROR;
@@ -674,6 +673,11 @@ status_t CameraHardwareUVC::previewInit()
 }
 
 void CameraHardwareUVC::stopPreview()
+{
+    stopPreviewThread(UVCCamera::CAPTURE_CMD_STOP);
+}
+
+void CameraHardwareUVC::stopPreviewThread(int cmd)
 {
     // Protect this whole function so startPreview
     // can't be called while we wait for the thread to exit.
@@ -682,12 +686,13 @@ void CameraHardwareUVC::stopPreview()
     ALOGV("%s :", __func__);
 
     mPreviewLock.lock();
-    // Set running to false and signal thread, then wait for
-    // thread to exit.
+    // Set running to false, signal thread and kick the capture loop
+    // out of its wait, then wait for thread to exit.
     if (mPreviewRunning) {
         mPreviewRunning = false;
         mPreviewCondition.signal();
         mPreviewLock.unlock();
+        mUVCCamera->sendCaptureCommand(cmd);
         mPreviewThread->join();
         return;
     }
@@ -841,69 +846,6 @@ void CameraHardwareUVC::save_postview(const char *fname, uint8_t *buf, uint32_t
     ::close(fd);
 }
 
-bool CameraHardwareUVC::scaleDownYuv422(char *srcBuf, uint32_t srcWidth, uint32_t srcHeight,
-                                        char *dstBuf, uint32_t dstWidth, uint32_t dstHeight)
-{
-    int32_t step_x, step_y;
-    int32_t iXsrc, iXdst;
-    int32_t x, y, src_y_start_pos, dst_pos, src_pos;
-
-    if (dstWidth % 2 != 0 || dstHeight % 2 != 0){
-        ALOGE("scale_down_yuv422: invalid width, height for scaling");
-        return false;
-    }
-
-    step_x = srcWidth / dstWidth;
-    step_y = srcHeight / dstHeight;
-
-    dst_pos = 0;
-    for (uint32_t y = 0; y < dstHeight; y++) {
-        src_y_start_pos = (y * step_y * (srcWidth * 2));
-
-        for (uint32_t x = 0; x < dstWidth; x += 2) {
-            src_pos = src_y_start_pos + (x * (step_x * 2));
-
-            dstBuf[dst_pos++] = srcBuf[src_pos    ];
-            dstBuf[dst_pos++] = srcBuf[src_pos + 1];
-            dstBuf[dst_pos++] = srcBuf[src_pos + 2];
-            dstBuf[dst_pos++] = srcBuf[src_pos + 3];
-        }
-    }
-
-    return true;
-}
-
-bool CameraHardwareUVC::YUY2toNV21(void *srcBuf, void *dstBuf, uint32_t srcWidth, uint32_t srcHeight)
-{
-    int32_t        x, y, src_y_start_pos, dst_cbcr_pos, dst_pos, src_pos;
-    unsigned char *srcBufPointer = (unsigned char *)srcBuf;
-    unsigned char *dstBufPointer = (unsigned char *)dstBuf;
-
-    dst_pos = 0;
-    dst_cbcr_pos = srcWidth*srcHeight;
-    for (uint32_t y = 0; y < srcHeight; y++) {
-        src_y_start_pos = (y * (srcWidth * 2));
-
-        for (uint32_t x = 0; x < (srcWidth * 2); x += 2) {
-            src_pos = src_y_start_pos + x;
-
-            dstBufPointer[dst_pos++] = srcBufPointer[src_pos];
-        }
-    }
-    for (uint32_t y = 0; y < srcHeight; y += 2) {
-        src_y_start_pos = (y * (srcWidth * 2));
-
-        for (uint32_t x = 0; x < (srcWidth * 2); x += 4) {
-            src_pos = src_y_start_pos + x;
-
-            dstBufPointer[dst_cbcr_pos++] = srcBufPointer[src_pos + 3];
-            dstBufPointer[dst_cbcr_pos++] = srcBufPointer[src_pos + 1];
-        }
-    }
-
-    return true;
-}
-
 int CameraHardwareUVC::pictureThread()
 {
     ALOGV("%s :", __func__);
@@ -1038,7 +980,7 @@ status_t CameraHardwareUVC::takePicture()
 {
     ALOGV("%s :", __func__);
 
-    stopPreview();
+    stopPreviewThread(UVCCamera::CAPTURE_CMD_SNAPSHOT);
 
     if (!mRawHeap) {
         int rawHeapSize = mPostViewSize;
@@ -1069,6 +1011,8 @@ status_t CameraHardwareUVC::cancelPicture()
     ALOGV("%s", __func__);
 
     if (mPictureThread.get()) {
+        // Abort a pending snapshot wait instead of sitting out its timeout.
+        mUVCCamera->sendCaptureCommand(UVCCamera::CAPTURE_CMD_STOP);
         ALOGV("%s: waiting for picture thread to exit", __func__);
         mPictureThread->requestExitAndWait();
         ALOGV("%s: picture thread has exited", __func__);
@@ -1077,236 +1021,6 @@ status_t CameraHardwareUVC::cancelPicture()
     return NO_ERROR;
 }
 
-bool CameraHardwareUVC::CheckVideoStartMarker(unsigned char *pBuf)
-{
-    if (!pBuf) {
-        ALOGE("CheckVideoStartMarker() => pBuf is NULL\n");
-        return false;
-    }
-
-    if (HIBYTE(VIDEO_COMMENT_MARKER_H) == * pBuf      && LOBYTE(VIDEO_COMMENT_MARKER_H) == *(pBuf + 1) &&
-        HIBYTE(VIDEO_COMMENT_MARKER_L) == *(pBuf + 2) && LOBYTE(VIDEO_COMMENT_MARKER_L) == *(pBuf + 3))
-        return true;
-
-    return false;
-}
-
-bool CameraHardwareUVC::CheckEOIMarker(unsigned char *pBuf)
-{
-    if (!pBuf) {
-        ALOGE("CheckEOIMarker() => pBuf is NULL\n");
-        return false;
-    }
-
-    // EOI marker [FF D9]
-    if (HIBYTE(JPEG_EOI_MARKER) == *pBuf && LOBYTE(JPEG_EOI_MARKER) == *(pBuf + 1))
-        return true;
-
-    return false;
-}
-
-bool CameraHardwareUVC::FindEOIMarkerInJPEG(unsigned char *pBuf, int dwBufSize, int *pnJPEGsize)
-{
-    if (NULL == pBuf || 0 >= dwBufSize) {
-        ALOGE("FindEOIMarkerInJPEG() => There is no contents.");
-        return false;
-    }
-
-    unsigned char *pBufEnd = pBuf + dwBufSize;
-
-    while (pBuf < pBufEnd) {
-        if (CheckEOIMarker(pBuf++))
-            return true;
-
-        (*pnJPEGsize)++;
-    }
-
-    return false;
-}
-
-bool CameraHardwareUVC::SplitFrame(unsigned char *pFrame, int dwSize,
-                    int dwJPEGLineLength, int dwVideoLineLength, int dwVideoHeight,
-                    void *pJPEG, int *pdwJPEGSize,
-                    void *pVideo, int *pdwVideoSize)
-{
-    ALOGV("===========SplitFrame Start==============");
-
-    if (NULL == pFrame || 0 >= dwSize) {
-        ALOGE("There is no contents (pFrame=%p, dwSize=%d", pFrame, dwSize);
-        return false;
-    }
-
-    if (0 == dwJPEGLineLength || 0 == dwVideoLineLength) {
-        ALOGE("There in no input information for decoding interleaved jpeg");
-        return false;
-    }
-
-    unsigned char *pSrc = pFrame;
-    unsigned char *pSrcEnd = pFrame + dwSize;
-
-    unsigned char *pJ = (unsigned char *)pJPEG;
-    int dwJSize = 0;
-    unsigned char *pV = (unsigned char *)pVideo;
-    int dwVSize = 0;
-
-    bool bRet = false;
-    bool isFinishJpeg = false;
-
-    while (pSrc < pSrcEnd) {
-        // Check video start marker
-        if (CheckVideoStartMarker(pSrc)) {
-            int copyLength;
-
-            if (pSrc + dwVideoLineLength <= pSrcEnd)
-                copyLength = dwVideoLineLength;
-            else
-                copyLength = pSrcEnd - pSrc - VIDEO_COMMENT_MARKER_LENGTH;
-
-            // Copy video data
-            if (pV) {
-                memcpy(pV, pSrc + VIDEO_COMMENT_MARKER_LENGTH, copyLength);
-                pV += copyLength;
-                dwVSize += copyLength;
-            }
-
-            pSrc += copyLength + VIDEO_COMMENT_MARKER_LENGTH;
-        } else {
-            // Copy pure JPEG data
-            int size = 0;
-            int dwCopyBufLen = dwJPEGLineLength <= pSrcEnd-pSrc ? dwJPEGLineLength : pSrcEnd - pSrc;
-
-            if (FindEOIMarkerInJPEG((unsigned char *)pSrc, dwCopyBufLen, &size)) {
-                isFinishJpeg = true;
-                size += 2;  // to count EOF marker size
-            } else {
-                if ((dwCopyBufLen == 1) && (pJPEG < pJ)) {
-                    unsigned char checkBuf[2] = { *(pJ - 1), *pSrc };
-
-                    if (CheckEOIMarker(checkBuf))
-                        isFinishJpeg = true;
-                }
-                size = dwCopyBufLen;
-            }
-
-            memcpy(pJ, pSrc, size);
-
-            dwJSize += size;
-
-            pJ += dwCopyBufLen;
-            pSrc += dwCopyBufLen;
-        }
-        if (isFinishJpeg)
-            break;
-    }
-
-    if (isFinishJpeg) {
-        bRet = true;
-        if(pdwJPEGSize)
-            *pdwJPEGSize = dwJSize;
-        if(pdwVideoSize)
-            *pdwVideoSize = dwVSize;
-    } else {
-        ALOGE("DecodeInterleaveJPEG_WithOutDT() => Can not find EOI");
-        bRet = false;
-        if(pdwJPEGSize)
-            *pdwJPEGSize = 0;
-        if(pdwVideoSize)
-            *pdwVideoSize = 0;
-    }
-    ALOGV("===========SplitFrame end==============");
-
-    return bRet;
-}
-
-int CameraHardwareUVC::decodeInterleaveData(unsigned char *pInterleaveData,
-                                                 int interleaveDataSize,
-                                                 int yuvWidth,
-                                                 int yuvHeight,
-                                                 int *pJpegSize,
-                                                 void *pJpegData,
-                                                 void *pYuvData)
-{
-    if (pInterleaveData == NULL)
-        return false;
-
-    bool ret = true;
-    unsigned int *interleave_ptr = (unsigned int *)pInterleaveData;
-    unsigned char *jpeg_ptr = (unsigned char *)pJpegData;
-    unsigned char *yuv_ptr = (unsigned char *)pYuvData;
-    unsigned char *p;
-    int jpeg_size = 0;
-    int yuv_size = 0;
-
-    int i = 0;
-
-    ALOGV("decodeInterleaveData Start~~~");
-    while (i < interleaveDataSize) {
-        if ((*interleave_ptr == 0xFFFFFFFF) || (*interleave_ptr == 0x02FFFFFF) ||
-                (*interleave_ptr == 0xFF02FFFF)) {
-            // Padding Data
-//            ALOGE("%d(%x) padding data\n", i, *interleave_ptr);
-            interleave_ptr++;
-            i += 4;
-        }
-        else if ((*interleave_ptr & 0xFFFF) == 0x05FF) {
-            // Start-code of YUV Data
-//            ALOGE("%d(%x) yuv data\n", i, *interleave_ptr);
-            p = (unsigned char *)interleave_ptr;
-            p += 2;
-            i += 2;
-
-            // Extract YUV Data
-            if (pYuvData != NULL) {
-                memcpy(yuv_ptr, p, yuvWidth * 2);
-                yuv_ptr += yuvWidth * 2;
-                yuv_size += yuvWidth * 2;
-            }
-            p += yuvWidth * 2;
-            i += yuvWidth * 2;
-
-            // Check End-code of YUV Data
-            if ((*p == 0xFF) && (*(p + 1) == 0x06)) {
-                interleave_ptr = (unsigned int *)(p + 2);
-                i += 2;
-            } else {
-                ret = false;
-                break;
-            }
-        } else {
-            // Extract JPEG Data
-//            ALOGE("%d(%x) jpg data, jpeg_size = %d bytes\n", i, *interleave_ptr, jpeg_size);
-            if (pJpegData != NULL) {
-                memcpy(jpeg_ptr, interleave_ptr, 4);
-                jpeg_ptr += 4;
-                jpeg_size += 4;
-            }
-            interleave_ptr++;
-            i += 4;
-        }
-    }
-    if (ret) {
-        if (pJpegData != NULL) {
-            // Remove Padding after EOI
-            for (i = 0; i < 3; i++) {
-                if (*(--jpeg_ptr) != 0xFF) {
-                    break;
-                }
-                jpeg_size--;
-            }
-            *pJpegSize = jpeg_size;
-
-        }
-        // Check YUV Data Size
-        if (pYuvData != NULL) {
-            if (yuv_size != (yuvWidth * yuvHeight * 2)) {
-                ret = false;
-            }
-        }
-    }
-    ALOGV("decodeInterleaveData End~~~");
-    return ret;
-}
-
 status_t CameraHardwareUVC::dump(int fd) const
 {
     const size_t SIZE = 256;
@@ -1395,6 +1109,66 @@ status_t CameraHardwareUVC::setParameters(const CameraParameters& params)
         return BAD_VALUE;
     }
 
+    // preview fps range, in fps * 1000
+    int new_min_fps = 0;
+    int new_max_fps = 0;
+    params.getPreviewFpsRange(&new_min_fps, &new_max_fps);
+    if (new_min_fps <= 0 || new_max_fps < new_min_fps) {
+        ALOGE("%s: Invalid preview fps range(%d,%d)", __func__, new_min_fps, new_max_fps);
+        return BAD_VALUE;
+    }
+
+    bool update_geometry = false;
+    bool reconfigure = false;
+
+    // preview orientation
+    int new_preview_rotation = params.getInt(KEY_UVC_PREVIEW_ROTATION);
+    if (new_preview_rotation < 0)
+        new_preview_rotation = 0;
+    if (new_preview_rotation != mUVCCamera->getRotate()) {
+        int old_rotation = mUVCCamera->getRotate();
+        if (mUVCCamera->setRotate(new_preview_rotation) < 0) {
+            ALOGE("ERR(%s):Fail on mUVCCamera->setRotate(%d)", __func__, new_preview_rotation);
+            ret = BAD_VALUE;
+        } else {
+            mParameters.set(KEY_UVC_PREVIEW_ROTATION, mUVCCamera->getRotate());
+            if ((old_rotation % 180) != (mUVCCamera->getRotate() % 180))
+                update_geometry = true;
+        }
+    }
+
+    const char *new_preview_mirror_str = params.get(KEY_UVC_PREVIEW_MIRROR);
+    if (new_preview_mirror_str != NULL) {
+        int new_preview_mirror = -1;
+
+        if (!strcmp(new_preview_mirror_str, UVC_MIRROR_NONE))
+            new_preview_mirror = UVCCamera::FLIP_NONE;
+        else if (!strcmp(new_preview_mirror_str, UVC_MIRROR_HORIZONTAL))
+            new_preview_mirror = UVCCamera::FLIP_HORIZONTAL;
+        else if (!strcmp(new_preview_mirror_str, UVC_MIRROR_VERTICAL))
+            new_preview_mirror = UVCCamera::FLIP_VERTICAL;
+        else if (!strcmp(new_preview_mirror_str, UVC_MIRROR_BOTH))
+            new_preview_mirror = UVCCamera::FLIP_HORIZONTAL | UVCCamera::FLIP_VERTICAL;
+
+        if (new_preview_mirror < 0 || mUVCCamera->setMirror(new_preview_mirror) < 0) {
+            ALOGE("ERR(%s):Invalid preview mirror(%s)", __func__, new_preview_mirror_str);
+            ret = BAD_VALUE;
+        } else {
+            mParameters.set(KEY_UVC_PREVIEW_MIRROR, new_preview_mirror_str);
+        }
+    }
+
+    // digital zoom
+    int new_zoom = params.getInt(CameraParameters::KEY_ZOOM);
+    if (0 <= new_zoom) {
+        if (mUVCCamera->setZoom(new_zoom) < 0) {
+            ALOGE("ERR(%s):Fail on mUVCCamera->setZoom(%d)", __func__, new_zoom);
+            ret = BAD_VALUE;
+        } else {
+            mParameters.set(CameraParameters::KEY_ZOOM, new_zoom);
+        }
+    }
+
     if (0 < new_preview_width && 0 < new_preview_height &&
             new_str_preview_format != NULL &&
             isSupportedPreviewSize(new_preview_width, new_preview_height)) {
@@ -1409,34 +1183,35 @@ status_t CameraHardwareUVC::setParameters(const CameraParameters& params)
                                    &current_preview_height,
                                    &current_frame_size);
         int current_pixel_format = mUVCCamera->getPreviewPixelFormat();
+        int current_min_fps, current_max_fps;
+        mParameters.getPreviewFpsRange(&current_min_fps, &current_max_fps);
 
         if (current_preview_width != new_preview_width ||
                     current_preview_height != new_preview_height ||
-                    current_pixel_format != new_preview_format) {
-            if (mUVCCamera->setPreviewSize(new_preview_width, new_preview_height,
-                                           new_preview_format) < 0) {
-                ALOGE("ERR(%s):Fail on mUVCCamera->setPreviewSize(width(%d), height(%d), format(%d))",
-                     __func__, new_preview_width, new_preview_height, new_preview_format);
+                    current_pixel_format != new_preview_format ||
+                    current_min_fps != new_min_fps ||
+                    current_max_fps != new_max_fps) {
+            // The preview path only converts YUYV, so keep compressed
+            // formats out of the negotiation.
+            if (mUVCCamera->negotiateStreamMode(new_preview_width, new_preview_height,
+                                                new_min_fps, new_max_fps, false) < 0) {
+                ALOGE("ERR(%s):Fail on mUVCCamera->negotiateStreamMode(width(%d), height(%d), fps(%d,%d))",
+                     __func__, new_preview_width, new_preview_height, new_min_fps, new_max_fps);
                 ret = UNKNOWN_ERROR;
             } else {
-                if (mPreviewWindow) {
-                    if (mPreviewRunning) {
-                        ALOGE("ERR(%s): preview is running, cannot change size and format!",
-                             __func__);
-                        ret = INVALID_OPERATION;
-                    }
-
-                    ALOGV("%s: mPreviewWindow (%p) set_buffers_geometry", __func__, mPreviewWindow);
-                    ALOGV("%s: mPreviewWindow->set_buffers_geometry (%p)", __func__,
-                         mPreviewWindow->set_buffers_geometry);
-                    mPreviewWindow->set_buffers_geometry(mPreviewWindow,
-                                                         new_preview_width, new_preview_height,
-                                                         new_preview_format);
-                    ALOGV("%s: DONE mPreviewWindow (%p) set_buffers_geometry", __func__, mPreviewWindow);
-                }
-
                 mParameters.setPreviewSize(new_preview_width, new_preview_height);
                 mParameters.setPreviewFormat(new_str_preview_format);
+                mParameters.set(CameraParameters::KEY_PREVIEW_FPS_RANGE,
+                                params.get(CameraParameters::KEY_PREVIEW_FPS_RANGE));
+                updateStreamModeParameters();
+
+                // The mode is only staged while the preview streams: let
+                // the capture loop switch it, and the window, once the
+                // stream is down.
+                if (mPreviewRunning)
+                    reconfigure = true;
+                else
+                    update_geometry = true;
             }
         }
         else ALOGV("%s: preview size and format has not changed", __func__);
@@ -1447,6 +1222,11 @@ status_t CameraHardwareUVC::setParameters(const CameraParameters& params)
         ret = INVALID_OPERATION;
     }
 
+    if (reconfigure)
+        mUVCCamera->sendCaptureCommand(UVCCamera::CAPTURE_CMD_RECONFIGURE);
+    else if (update_geometry && mPreviewWindow)
+        setPreviewWindowGeometry();
+
     int new_picture_width  = 0;
     int new_picture_height = 0;
 
@@ -1697,6 +1477,58 @@ status_t CameraHardwareUVC::setParameters(const CameraParameters& params)
     return ret;
 }
 
+/* Preview buffers are rotated along with the image */
+void CameraHardwareUVC::getPreviewBufferSize(int *width, int *height)
+{
+    int angle = mUVCCamera->getRotate();
+
+    mParameters.getPreviewSize(width, height);
+    if (angle == 90 || angle == 270) {
+        int tmp = *width;
+        *width = *height;
+        *height = tmp;
+    }
+}
+
+void CameraHardwareUVC::setPreviewWindowGeometry()
+{
+    int buffer_width, buffer_height;
+    getPreviewBufferSize(&buffer_width, &buffer_height);
+    ALOGV("%s: mPreviewWindow (%p) set_buffers_geometry %dx%d", __func__,
+         mPreviewWindow, buffer_width, buffer_height);
+    mPreviewWindow->set_buffers_geometry(mPreviewWindow,
+                                         buffer_width, buffer_height,
+                                         HAL_PIXEL_FORMAT_YV12);
+}
+
+/* Report what negotiateStreamMode() settled on so applications (and
+ * dumpsys) can tell a bandwidth-limited frame rate from a driver stall.
+ */
+void CameraHardwareUVC::updateStreamModeParameters()
+{
+    struct uvc_stream_mode mode;
+    char fourcc[5];
+
+    if (mUVCCamera->getStreamMode(&mode) < 0) {
+        mParameters.remove(KEY_UVC_STREAM_FORMAT);
+        mParameters.remove(KEY_UVC_STREAM_FRAME_RATE);
+        mParameters.remove(KEY_UVC_STREAM_BANDWIDTH);
+        return;
+    }
+
+    fourcc[0] = mode.fmt & 0xff;
+    fourcc[1] = (mode.fmt >> 8) & 0xff;
+    fourcc[2] = (mode.fmt >> 16) & 0xff;
+    fourcc[3] = (mode.fmt >> 24) & 0xff;
+    fourcc[4] = '\0';
+
+    mParameters.set(KEY_UVC_STREAM_FORMAT, fourcc);
+    mParameters.set(KEY_UVC_STREAM_FRAME_RATE,
+                    (int)(((int64_t)mode.interval.denominator * 1000) /
+                          mode.interval.numerator));
+    mParameters.set(KEY_UVC_STREAM_BANDWIDTH, (int)mode.bandwidth);
+}
+
 CameraParameters CameraHardwareUVC::getParameters() const
 {
     ALOGV("%s :", __func__);
@@ -1726,6 +1558,7 @@ void CameraHardwareUVC::release()
         mPreviewThread->requestExit();
         mPreviewRunning = true; /* let it run so it can exit */
         mPreviewCondition.signal();
+        mUVCCamera->sendCaptureCommand(UVCCamera::CAPTURE_CMD_STOP);
         mPreviewThread->requestExitAndWait();
         mPreviewThread.clear();
     }
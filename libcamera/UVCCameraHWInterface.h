@@ -69,6 +69,10 @@ public:
 private:
     status_t    previewInit();
     void stopPreviewLocked();
+    void stopPreviewThread(int cmd);
+    void updateStreamModeParameters();
+    void getPreviewBufferSize(int *width, int *height);
+    void setPreviewWindowGeometry();
     void freePreviewHeap();
 
     static  const int   kBufferCount = MAX_BUFFERS;
@@ -115,27 +119,6 @@ private:
             int         save_jpeg(unsigned char *real_jpeg, int jpeg_size);
             void        save_postview(const char *fname, uint8_t *buf,
                                         uint32_t size);
-            int         decodeInterleaveData(unsigned char *pInterleaveData,
-                                                int interleaveDataSize,
-                                                int yuvWidth,
-                                                int yuvHeight,
-                                                int *pJpegSize,
-                                                void *pJpegData,
-                                                void *pYuvData);
-            bool        YUY2toNV21(void *srcBuf, void *dstBuf, uint32_t srcWidth, uint32_t srcHeight);
-            bool        scaleDownYuv422(char *srcBuf, uint32_t srcWidth,
-                                        uint32_t srcHight, char *dstBuf,
-                                        uint32_t dstWidth, uint32_t dstHight);
-
-            bool        CheckVideoStartMarker(unsigned char *pBuf);
-            bool        CheckEOIMarker(unsigned char *pBuf);
-            bool        FindEOIMarkerInJPEG(unsigned char *pBuf,
-                                            int dwBufSize, int *pnJPEGsize);
-            bool        SplitFrame(unsigned char *pFrame, int dwSize,
-                                   int dwJPEGLineLength, int dwVideoLineLength,
-                                   int dwVideoHeight, void *pJPEG,
-                                   int *pdwJPEGSize, void *pVideo,
-                                   int *pdwVideoSize);
             bool        isSupportedPreviewSize(const int width,
                                                const int height) const;
             bool        isSupportedParameter(const char * const parm,
@@ -0,0 +1,97 @@
+/*
+**
+** Copyright 2008, The Android Open Source Project
+** Copyright 2010, Samsung Electronics Co. LTD
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "UVCDevice"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "cutils/properties.h"
+#include "UVCDevice.h"
+
+namespace android {
+
+UVCDevice *UVCDevice::create(void)
+{
+#ifdef UVC_DEVICE_SIM
+    char value[PROPERTY_VALUE_MAX];
+    const char *config = NULL;
+
+    if (property_get(UVC_SIM_PROPERTY, value, NULL) > 0)
+        config = value;
+    else
+        config = getenv(UVC_SIM_ENV);
+
+    if (config != NULL && config[0] != '\0') {
+        ALOGI("%s: using simulated device \"%s\"", __func__, config);
+        return new UVCDeviceSim(config);
+    }
+#endif
+
+    return new UVCDeviceV4L2();
+}
+
+// ======================================================================
+// V4L2 node
+
+UVCDeviceV4L2::UVCDeviceV4L2() :
+            m_fd(-1)
+{
+}
+
+UVCDeviceV4L2::~UVCDeviceV4L2()
+{
+    close();
+}
+
+int UVCDeviceV4L2::open(const char *path)
+{
+    m_fd = ::open(path, O_RDWR);
+    return m_fd;
+}
+
+void UVCDeviceV4L2::close(void)
+{
+    if (m_fd > -1) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+int UVCDeviceV4L2::ioctl(unsigned long request, void *arg)
+{
+    return ::ioctl(m_fd, request, arg);
+}
+
+void *UVCDeviceV4L2::mmap(size_t length, off_t offset)
+{
+    return ::mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, offset);
+}
+
+int UVCDeviceV4L2::getMmapFd(void)
+{
+    return m_fd;
+}
+
+}; // namespace android
@@ -0,0 +1,165 @@
+/*
+**
+** Copyright 2008, The Android Open Source Project
+** Copyright 2010, Samsung Electronics Co. LTD
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Everything UVCCamera asks of the V4L2 node goes through a UVCDevice.
+ * UVCDeviceV4L2 is the real /dev/videoN; UVCDeviceSim is an in-process
+ * UVC camera with configurable modes and timing, used to measure the HAL
+ * latencies deterministically (see bench/uvc_latency_bench.cpp).
+ */
+
+#ifndef ANDROID_HARDWARE_UVC_DEVICE_H
+#define ANDROID_HARDWARE_UVC_DEVICE_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+namespace android {
+
+/* Selects the simulated device when set, e.g.
+ * "sizes=640x480,320x240;fps=30,15;jitter_us=2000;drop_pct=5;ctrl_delay_us=20000"
+ * The environment variable of the same meaning is used on the host.  Only
+ * builds with UVC_DEVICE_SIM defined (the benchmarks) look at either; the
+ * camera HAL always opens the real device.
+ */
+#define UVC_SIM_PROPERTY    "camera.uvc.sim"
+#define UVC_SIM_ENV         "UVC_SIM"
+
+class UVCDevice {
+public:
+    virtual ~UVCDevice() {}
+
+    /* Returns a pollable fd (EPOLLIN when a frame can be dequeued)
+     * or -1 with errno set. */
+    virtual int     open(const char *path) = 0;
+    virtual void    close(void) = 0;
+
+    /* Same contract as ioctl(2) on a V4L2 node: -1 and errno on failure. */
+    virtual int     ioctl(unsigned long request, void *arg) = 0;
+
+    /* Maps a buffer at the offset reported by VIDIOC_QUERYBUF,
+     * MAP_FAILED on failure. */
+    virtual void   *mmap(size_t length, off_t offset) = 0;
+
+    /* fd that VIDIOC_QUERYBUF offsets refer to, for MemoryHeapBase */
+    virtual int     getMmapFd(void) = 0;
+
+    static UVCDevice *create(void);
+};
+
+class UVCDeviceV4L2 : public UVCDevice {
+public:
+    UVCDeviceV4L2();
+    virtual ~UVCDeviceV4L2();
+
+    virtual int     open(const char *path);
+    virtual void    close(void);
+    virtual int     ioctl(unsigned long request, void *arg);
+    virtual void   *mmap(size_t length, off_t offset);
+    virtual int     getMmapFd(void);
+
+private:
+    int             m_fd;
+};
+
+/* Parsed UVC_SIM_PROPERTY */
+#define SIM_MAX_SIZES       8
+#define SIM_MAX_RATES       8
+#define SIM_MAX_BUFFERS     16
+
+struct uvc_sim_config {
+    int      num_sizes;
+    unsigned widths[SIM_MAX_SIZES];
+    unsigned heights[SIM_MAX_SIZES];
+    int      num_rates;
+    unsigned rates[SIM_MAX_RATES];      // fps, fastest first
+    bool     mjpeg;                     // also offer MJPEG modes
+    int      jitter_us;                 // +- uniform jitter on each frame
+    int      drop_pct;                  // chance a frame is lost on the bus
+    int      ctrl_delay_us;             // cost of one control transfer
+    unsigned seed;
+};
+
+class UVCDeviceSim : public UVCDevice {
+public:
+    UVCDeviceSim(const char *config);
+    virtual ~UVCDeviceSim();
+
+    virtual int     open(const char *path);
+    virtual void    close(void);
+    virtual int     ioctl(unsigned long request, void *arg);
+    virtual void   *mmap(size_t length, off_t offset);
+    virtual int     getMmapFd(void);
+
+    static int      parseConfig(const char *str, struct uvc_sim_config *config);
+
+    /* Frames produced, lost on the "bus", and lost for lack of a queued
+     * buffer since the last STREAMON. */
+    void            getStats(int *produced, int *dropped, int *overrun);
+
+private:
+    enum buf_state {
+        BUF_DEQUEUED,
+        BUF_QUEUED,
+        BUF_DONE,
+    };
+
+    static void    *producerThread(void *data);
+    void            m_produce(void);
+    int             m_streamOn(void);
+    int             m_streamOff(void);
+    int             m_reqBufs(unsigned int count);
+    int             m_fillFrame(int index);
+    void            m_controlTransfer(void);
+    bool            m_hasMode(unsigned fmt, unsigned width, unsigned height);
+
+    struct uvc_sim_config m_config;
+
+    pthread_mutex_t m_lock;
+    pthread_cond_t  m_cond;
+    pthread_t       m_thread;
+    bool            m_streaming;
+
+    int             m_event_fd;
+    int             m_mem_fd;
+
+    unsigned        m_fmt;
+    unsigned        m_width;
+    unsigned        m_height;
+    unsigned        m_sizeimage;
+    unsigned        m_interval_us;
+
+    int             m_num_bufs;
+    unsigned        m_buf_stride;       // page aligned sizeimage
+    char           *m_mem;
+    enum buf_state  m_buf_state[SIM_MAX_BUFFERS];
+    unsigned        m_buf_sequence[SIM_MAX_BUFFERS];
+    int             m_done[SIM_MAX_BUFFERS];
+    int             m_done_head;
+    int             m_num_done;
+    unsigned        m_sequence;
+    unsigned        m_rand;
+
+    int             m_produced;
+    int             m_dropped;
+    int             m_overrun;
+};
+
+}; // namespace android
+
+#endif // ANDROID_HARDWARE_UVC_DEVICE_H
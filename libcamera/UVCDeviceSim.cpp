@@ -0,0 +1,692 @@
+/*
+**
+** Copyright 2008, The Android Open Source Project
+** Copyright 2010, Samsung Electronics Co. LTD
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Simulated UVC camera.  Implements the subset of the V4L2 capture API
+ * that UVCCamera uses: a producer thread completes queued buffers at the
+ * negotiated frame interval (plus jitter and bus losses), the pollable fd
+ * is an eventfd that is readable while a buffer is done, and the buffers
+ * live in an ashmem region so they can be mmap()ed like driver memory.
+ * Control requests sleep for ctrl_delay_us to model EP0 transfers.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "UVCDeviceSim"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <linux/videodev2.h>
+
+#include "cutils/ashmem.h"
+#include "UVCDevice.h"
+
+#define SIM_PAGE_ALIGN(x)   (((x) + 4095) & ~4095)
+#define SIM_BAR_LINES       8
+
+namespace android {
+
+static long long sim_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void sim_sleep_us(int us)
+{
+    struct timespec ts;
+
+    if (us <= 0)
+        return;
+
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/* Parses a comma separated list of unsigned values, returns how many */
+static int sim_parse_list(const char *str, unsigned *out, int max)
+{
+    int count = 0;
+    char *end;
+
+    while (count < max && *str) {
+        unsigned long value = strtoul(str, &end, 10);
+        if (end == str)
+            break;
+        out[count++] = value;
+        if (*end != ',')
+            break;
+        str = end + 1;
+    }
+
+    return count;
+}
+
+int UVCDeviceSim::parseConfig(const char *str, struct uvc_sim_config *config)
+{
+    char buf[256];
+    char *save = NULL;
+
+    memset(config, 0, sizeof(*config));
+    config->num_sizes = 2;
+    config->widths[0] = 640;
+    config->heights[0] = 480;
+    config->widths[1] = 320;
+    config->heights[1] = 240;
+    config->num_rates = 2;
+    config->rates[0] = 30;
+    config->rates[1] = 15;
+    config->seed = 1;
+
+    strncpy(buf, str, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    for (char *tok = strtok_r(buf, ";", &save); tok; tok = strtok_r(NULL, ";", &save)) {
+        char *value = strchr(tok, '=');
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+
+        if (!strcmp(tok, "sizes")) {
+            int count = 0;
+            for (char *p = value; p && *p && count < SIM_MAX_SIZES; ) {
+                unsigned w, h;
+                if (sscanf(p, "%ux%u", &w, &h) != 2) {
+                    ALOGE("ERR(%s):bad size \"%s\"\n", __func__, p);
+                    return -1;
+                }
+                config->widths[count] = w;
+                config->heights[count] = h;
+                count++;
+                p = strchr(p, ',');
+                if (p)
+                    p++;
+            }
+            if (count == 0)
+                return -1;
+            config->num_sizes = count;
+        } else if (!strcmp(tok, "fps")) {
+            int count = sim_parse_list(value, config->rates, SIM_MAX_RATES);
+            if (count == 0)
+                return -1;
+            config->num_rates = count;
+        } else if (!strcmp(tok, "mjpeg")) {
+            config->mjpeg = atoi(value) != 0;
+        } else if (!strcmp(tok, "jitter_us")) {
+            config->jitter_us = atoi(value);
+        } else if (!strcmp(tok, "drop_pct")) {
+            config->drop_pct = atoi(value);
+        } else if (!strcmp(tok, "ctrl_delay_us")) {
+            config->ctrl_delay_us = atoi(value);
+        } else if (!strcmp(tok, "seed")) {
+            config->seed = strtoul(value, NULL, 10);
+        } else {
+            ALOGW("%s: unknown key \"%s\"", __func__, tok);
+        }
+    }
+
+    // ENUM_FRAMEINTERVALS reports the fastest rate first
+    for (int i = 1; i < config->num_rates; i++) {
+        for (int j = i; j > 0 && config->rates[j] > config->rates[j - 1]; j--) {
+            unsigned tmp = config->rates[j];
+            config->rates[j] = config->rates[j - 1];
+            config->rates[j - 1] = tmp;
+        }
+    }
+    for (int i = 0; i < config->num_rates; i++) {
+        if (config->rates[i] == 0) {
+            config->num_rates = i;
+            break;
+        }
+    }
+    if (config->num_rates == 0)
+        return -1;
+
+    return 0;
+}
+
+UVCDeviceSim::UVCDeviceSim(const char *config) :
+            m_streaming(false),
+            m_event_fd(-1),
+            m_mem_fd(-1),
+            m_fmt(V4L2_PIX_FMT_YUYV),
+            m_width(0),
+            m_height(0),
+            m_sizeimage(0),
+            m_interval_us(0),
+            m_num_bufs(0),
+            m_buf_stride(0),
+            m_mem(NULL),
+            m_done_head(0),
+            m_num_done(0),
+            m_sequence(0),
+            m_rand(1),
+            m_produced(0),
+            m_dropped(0),
+            m_overrun(0)
+{
+    if (parseConfig(config, &m_config) < 0) {
+        ALOGE("ERR(%s):bad config \"%s\", using defaults\n", __func__, config);
+        parseConfig("", &m_config);
+    }
+
+    m_width = m_config.widths[0];
+    m_height = m_config.heights[0];
+    m_sizeimage = m_width * m_height * 2;
+    m_interval_us = 1000000 / m_config.rates[0];
+    m_rand = m_config.seed;
+
+    pthread_mutex_init(&m_lock, NULL);
+    pthread_cond_init(&m_cond, NULL);
+}
+
+UVCDeviceSim::~UVCDeviceSim()
+{
+    close();
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_lock);
+}
+
+int UVCDeviceSim::open(const char *path)
+{
+    ALOGV("%s(%s)", __func__, path);
+
+    m_event_fd = eventfd(0, EFD_NONBLOCK);
+    if (m_event_fd < 0)
+        return -1;
+
+    // probe of the streaming interface
+    m_controlTransfer();
+
+    return m_event_fd;
+}
+
+void UVCDeviceSim::close(void)
+{
+    m_streamOff();
+    m_reqBufs(0);
+
+    if (m_event_fd > -1) {
+        ::close(m_event_fd);
+        m_event_fd = -1;
+    }
+}
+
+void *UVCDeviceSim::mmap(size_t length, off_t offset)
+{
+    if (m_mem_fd < 0 || offset + length > m_buf_stride * m_num_bufs) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    return ::mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, m_mem_fd, offset);
+}
+
+int UVCDeviceSim::getMmapFd(void)
+{
+    return m_mem_fd;
+}
+
+void UVCDeviceSim::getStats(int *produced, int *dropped, int *overrun)
+{
+    pthread_mutex_lock(&m_lock);
+    *produced = m_produced;
+    *dropped = m_dropped;
+    *overrun = m_overrun;
+    pthread_mutex_unlock(&m_lock);
+}
+
+void UVCDeviceSim::m_controlTransfer(void)
+{
+    sim_sleep_us(m_config.ctrl_delay_us);
+}
+
+bool UVCDeviceSim::m_hasMode(unsigned fmt, unsigned width, unsigned height)
+{
+    if (fmt != V4L2_PIX_FMT_YUYV &&
+        !(m_config.mjpeg && (fmt == V4L2_PIX_FMT_MJPEG || fmt == V4L2_PIX_FMT_JPEG)))
+        return false;
+
+    for (int i = 0; i < m_config.num_sizes; i++) {
+        if (m_config.widths[i] == width && m_config.heights[i] == height)
+            return true;
+    }
+
+    return false;
+}
+
+int UVCDeviceSim::m_reqBufs(unsigned int count)
+{
+    if (m_streaming) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (m_mem) {
+        munmap(m_mem, m_buf_stride * m_num_bufs);
+        m_mem = NULL;
+    }
+    if (m_mem_fd > -1) {
+        ::close(m_mem_fd);
+        m_mem_fd = -1;
+    }
+    m_num_bufs = 0;
+    m_num_done = 0;
+    m_done_head = 0;
+
+    if (count == 0)
+        return 0;
+    if (count > SIM_MAX_BUFFERS)
+        count = SIM_MAX_BUFFERS;
+
+    m_buf_stride = SIM_PAGE_ALIGN(m_sizeimage);
+    m_mem_fd = ashmem_create_region("uvcsim", m_buf_stride * count);
+    if (m_mem_fd < 0) {
+        ALOGE("ERR(%s):ashmem_create_region failed\n", __func__);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    m_mem = (char *)::mmap(0, m_buf_stride * count, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, m_mem_fd, 0);
+    if (m_mem == MAP_FAILED) {
+        m_mem = NULL;
+        ::close(m_mem_fd);
+        m_mem_fd = -1;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // mid grey, the producer only redraws a moving bar
+    for (unsigned i = 0; i < m_buf_stride * count; i += 2) {
+        m_mem[i] = 0x80;
+        m_mem[i + 1] = 0x80;
+    }
+
+    m_num_bufs = count;
+    for (int i = 0; i < m_num_bufs; i++)
+        m_buf_state[i] = BUF_DEQUEUED;
+
+    return count;
+}
+
+/* Called with m_lock held */
+int UVCDeviceSim::m_fillFrame(int index)
+{
+    unsigned char *frame = (unsigned char *)m_mem + m_buf_stride * index;
+
+    if (m_fmt != V4L2_PIX_FMT_YUYV) {
+        // Smallest thing the HAL's marker scanners accept as a JPEG
+        static const unsigned char jpeg[] = { 0xFF, 0xD8, 0xFF, 0xD9 };
+        memcpy(frame, jpeg, sizeof(jpeg));
+        return sizeof(jpeg);
+    }
+
+    unsigned stride = m_width * 2;
+    unsigned bar = (m_sequence * 4) % m_height;
+    unsigned prev = ((m_sequence - m_num_bufs) * 4) % m_height;
+
+    for (unsigned y = 0; y < SIM_BAR_LINES; y++) {
+        if (prev + y < m_height)
+            memset(frame + (prev + y) * stride, 0x80, stride);
+    }
+    for (unsigned y = 0; y < SIM_BAR_LINES; y++) {
+        if (bar + y < m_height)
+            memset(frame + (bar + y) * stride, 0xEB, stride);
+    }
+
+    return m_sizeimage;
+}
+
+void UVCDeviceSim::m_produce(void)
+{
+    long long next = sim_now_us() + m_interval_us;
+
+    pthread_mutex_lock(&m_lock);
+
+    while (m_streaming) {
+        long long now = sim_now_us();
+
+        if (now < next) {
+            struct timeval tv;
+            struct timespec abstime;
+            long long wait = next - now;
+
+            gettimeofday(&tv, NULL);
+            wait += tv.tv_usec;
+            abstime.tv_sec = tv.tv_sec + wait / 1000000;
+            abstime.tv_nsec = (wait % 1000000) * 1000;
+            pthread_cond_timedwait(&m_cond, &m_lock, &abstime);
+            continue;
+        }
+
+        m_rand = m_rand * 1103515245 + 12345;
+        unsigned r = (m_rand >> 16) & 0x7fff;
+
+        int jitter = 0;
+        if (m_config.jitter_us > 0)
+            jitter = (int)(r % (2 * m_config.jitter_us + 1)) - m_config.jitter_us;
+        next += m_interval_us + jitter;
+
+        m_sequence++;
+
+        if (m_config.drop_pct > 0 && (int)(r % 100) < m_config.drop_pct) {
+            m_dropped++;
+            continue;
+        }
+
+        int index = -1;
+        for (int i = 0; i < m_num_bufs; i++) {
+            int candidate = (m_sequence + i) % m_num_bufs;
+            if (m_buf_state[candidate] == BUF_QUEUED) {
+                index = candidate;
+                break;
+            }
+        }
+        if (index < 0) {
+            m_overrun++;
+            continue;
+        }
+
+        m_fillFrame(index);
+        m_buf_state[index] = BUF_DONE;
+        m_buf_sequence[index] = m_sequence;
+        m_done[(m_done_head + m_num_done) % SIM_MAX_BUFFERS] = index;
+        m_num_done++;
+        m_produced++;
+
+        eventfd_write(m_event_fd, 1);
+        pthread_cond_broadcast(&m_cond);
+    }
+
+    pthread_mutex_unlock(&m_lock);
+}
+
+void *UVCDeviceSim::producerThread(void *data)
+{
+    ((UVCDeviceSim *)data)->m_produce();
+    return NULL;
+}
+
+int UVCDeviceSim::m_streamOn(void)
+{
+    if (m_streaming)
+        return 0;
+
+    if (m_num_bufs == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // probe/commit of the negotiated format
+    m_controlTransfer();
+
+    pthread_mutex_lock(&m_lock);
+    m_streaming = true;
+    m_produced = m_dropped = m_overrun = 0;
+    pthread_mutex_unlock(&m_lock);
+
+    if (pthread_create(&m_thread, NULL, producerThread, this) != 0) {
+        m_streaming = false;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+int UVCDeviceSim::m_streamOff(void)
+{
+    if (!m_streaming)
+        return 0;
+
+    pthread_mutex_lock(&m_lock);
+    m_streaming = false;
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_lock);
+
+    pthread_join(m_thread, NULL);
+
+    // like the driver, STREAMOFF returns every buffer to userspace
+    for (int i = 0; i < m_num_bufs; i++)
+        m_buf_state[i] = BUF_DEQUEUED;
+    m_num_done = 0;
+    m_done_head = 0;
+
+    eventfd_t value;
+    eventfd_read(m_event_fd, &value);
+
+    return 0;
+}
+
+int UVCDeviceSim::ioctl(unsigned long request, void *arg)
+{
+    switch (request) {
+    case VIDIOC_QUERYCAP: {
+        struct v4l2_capability *cap = (struct v4l2_capability *)arg;
+        memset(cap, 0, sizeof(*cap));
+        strcpy((char *)cap->driver, "uvcsim");
+        strcpy((char *)cap->card, "Simulated UVC Camera");
+        cap->capabilities = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+        return 0;
+    }
+
+    case VIDIOC_ENUMINPUT: {
+        struct v4l2_input *input = (struct v4l2_input *)arg;
+        if (input->index != 0)
+            break;
+        strcpy((char *)input->name, "Camera 1");
+        input->type = V4L2_INPUT_TYPE_CAMERA;
+        return 0;
+    }
+
+    case VIDIOC_S_INPUT:
+        if (*(int *)arg != 0)
+            break;
+        return 0;
+
+    case VIDIOC_ENUM_FMT: {
+        struct v4l2_fmtdesc *fmtdesc = (struct v4l2_fmtdesc *)arg;
+        if (fmtdesc->index == 0) {
+            fmtdesc->pixelformat = V4L2_PIX_FMT_YUYV;
+            strcpy((char *)fmtdesc->description, "YUV 4:2:2 (YUYV)");
+            fmtdesc->flags = 0;
+        } else if (fmtdesc->index == 1 && m_config.mjpeg) {
+            fmtdesc->pixelformat = V4L2_PIX_FMT_MJPEG;
+            strcpy((char *)fmtdesc->description, "MJPEG");
+            fmtdesc->flags = V4L2_FMT_FLAG_COMPRESSED;
+        } else {
+            break;
+        }
+        return 0;
+    }
+
+    case VIDIOC_ENUM_FRAMESIZES: {
+        struct v4l2_frmsizeenum *fsize = (struct v4l2_frmsizeenum *)arg;
+        if (!m_hasMode(fsize->pixel_format, m_config.widths[0], m_config.heights[0]) ||
+            fsize->index >= (unsigned)m_config.num_sizes)
+            break;
+        fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+        fsize->discrete.width = m_config.widths[fsize->index];
+        fsize->discrete.height = m_config.heights[fsize->index];
+        return 0;
+    }
+
+    case VIDIOC_ENUM_FRAMEINTERVALS: {
+        struct v4l2_frmivalenum *fival = (struct v4l2_frmivalenum *)arg;
+        if (!m_hasMode(fival->pixel_format, fival->width, fival->height) ||
+            fival->index >= (unsigned)m_config.num_rates)
+            break;
+        fival->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+        fival->discrete.numerator = 1;
+        fival->discrete.denominator = m_config.rates[fival->index];
+        return 0;
+    }
+
+    case VIDIOC_S_FMT: {
+        struct v4l2_pix_format *pix = &((struct v4l2_format *)arg)->fmt.pix;
+        int best = 0;
+
+        if (m_streaming) {
+            errno = EBUSY;
+            return -1;
+        }
+        if (!m_hasMode(pix->pixelformat, m_config.widths[0], m_config.heights[0]))
+            pix->pixelformat = V4L2_PIX_FMT_YUYV;
+
+        // uvcvideo snaps to the closest advertised frame size
+        for (int i = 1; i < m_config.num_sizes; i++) {
+            if (abs((int)m_config.widths[i] - (int)pix->width) +
+                abs((int)m_config.heights[i] - (int)pix->height) <
+                abs((int)m_config.widths[best] - (int)pix->width) +
+                abs((int)m_config.heights[best] - (int)pix->height))
+                best = i;
+        }
+
+        m_controlTransfer();
+
+        m_fmt = pix->pixelformat;
+        m_width = pix->width = m_config.widths[best];
+        m_height = pix->height = m_config.heights[best];
+        pix->bytesperline = m_fmt == V4L2_PIX_FMT_YUYV ? m_width * 2 : 0;
+        m_sizeimage = pix->sizeimage = m_width * m_height * 2;
+        pix->field = V4L2_FIELD_NONE;
+        return 0;
+    }
+
+    case VIDIOC_G_PARM:
+    case VIDIOC_S_PARM: {
+        struct v4l2_captureparm *capture = &((struct v4l2_streamparm *)arg)->parm.capture;
+
+        m_controlTransfer();
+
+        if (request == VIDIOC_S_PARM && capture->timeperframe.numerator != 0) {
+            unsigned want = capture->timeperframe.denominator * 1000 /
+                            capture->timeperframe.numerator;
+            int best = 0;
+            for (int i = 1; i < m_config.num_rates; i++) {
+                if (abs((int)m_config.rates[i] * 1000 - (int)want) <
+                    abs((int)m_config.rates[best] * 1000 - (int)want))
+                    best = i;
+            }
+            pthread_mutex_lock(&m_lock);
+            m_interval_us = 1000000 / m_config.rates[best];
+            pthread_mutex_unlock(&m_lock);
+        }
+
+        capture->capability = V4L2_CAP_TIMEPERFRAME;
+        capture->timeperframe.numerator = m_interval_us;
+        capture->timeperframe.denominator = 1000000;
+        return 0;
+    }
+
+    case VIDIOC_REQBUFS: {
+        struct v4l2_requestbuffers *req = (struct v4l2_requestbuffers *)arg;
+        int ret = m_reqBufs(req->count);
+        if (ret < 0)
+            return -1;
+        req->count = ret;
+        return 0;
+    }
+
+    case VIDIOC_QUERYBUF:
+    case VIDIOC_QBUF:
+    case VIDIOC_DQBUF: {
+        struct v4l2_buffer *buf = (struct v4l2_buffer *)arg;
+        int ret = 0;
+
+        pthread_mutex_lock(&m_lock);
+
+        if (request == VIDIOC_DQBUF) {
+            while (m_num_done == 0 && m_streaming)
+                pthread_cond_wait(&m_cond, &m_lock);
+            if (m_num_done == 0) {
+                pthread_mutex_unlock(&m_lock);
+                errno = EINVAL;
+                return -1;
+            }
+            buf->index = m_done[m_done_head];
+            m_done_head = (m_done_head + 1) % SIM_MAX_BUFFERS;
+            if (--m_num_done == 0) {
+                eventfd_t value;
+                eventfd_read(m_event_fd, &value);
+            }
+            m_buf_state[buf->index] = BUF_DEQUEUED;
+            buf->bytesused = m_fmt == V4L2_PIX_FMT_YUYV ? m_sizeimage : 4;
+            buf->sequence = m_buf_sequence[buf->index];
+            gettimeofday(&buf->timestamp, NULL);
+        } else if (buf->index >= (unsigned)m_num_bufs) {
+            ret = -1;
+        } else if (request == VIDIOC_QBUF) {
+            if (m_buf_state[buf->index] != BUF_DEQUEUED)
+                ret = -1;
+            else
+                m_buf_state[buf->index] = BUF_QUEUED;
+        }
+
+        if (ret == 0) {
+            buf->length = m_sizeimage;
+            buf->m.offset = m_buf_stride * buf->index;
+            buf->field = V4L2_FIELD_NONE;
+        }
+
+        pthread_mutex_unlock(&m_lock);
+
+        if (ret < 0)
+            errno = EINVAL;
+        return ret;
+    }
+
+    case VIDIOC_STREAMON:
+        return m_streamOn();
+
+    case VIDIOC_STREAMOFF:
+        return m_streamOff();
+
+    case VIDIOC_G_CTRL:
+        m_controlTransfer();
+        ((struct v4l2_control *)arg)->value = 0;
+        return 0;
+
+    case VIDIOC_S_CTRL:
+    case VIDIOC_S_EXT_CTRLS:
+        m_controlTransfer();
+        return 0;
+
+    default:
+        ALOGV("%s: unhandled request %#lx", __func__, request);
+        errno = ENOTTY;
+        return -1;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+}; // namespace android
@@ -0,0 +1,505 @@
+/*
+**
+** Copyright 2008, The Android Open Source Project
+** Copyright 2010, Samsung Electronics Co. LTD
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "UVCFrameUtils"
+#include <utils/Log.h>
+
+#include <string.h>
+
+#include "UVCFrameUtils.h"
+
+#define VIDEO_COMMENT_MARKER_H          0xFFBE
+#define VIDEO_COMMENT_MARKER_L          0xFFBF
+#define VIDEO_COMMENT_MARKER_LENGTH     4
+#define JPEG_EOI_MARKER                 0xFFD9
+#define HIBYTE(x) (((x) >> 8) & 0xFF)
+#define LOBYTE(x) ((x) & 0xFF)
+
+#define YV12_CHROMA_STRIDE(stride)      ((((stride) / 2) + 15) & ~15)
+
+namespace android {
+
+void YUYVtoYV12(int width, int height, int stride,
+                       const uint8_t *frame, uint8_t *vaddr)
+{
+    // Convert from YUYV to YV12 using 32 bit reads and 16 bit writes.
+    // Also does all math in 32-bit quantities.
+    // This is about twice as fast as KevinH's original implementation.
+
+    // YUYV=4 bytes per 2 pixels
+    int numPixels = width * height;
+    const uint32_t *src0 = (const uint32_t*)frame; // Even rows of YUYV
+    const uint32_t *src1 = (const uint32_t*)(frame + width * 2); // Odd rows of YUYV
+
+    uint32_t *yOut0 = (uint32_t*)vaddr;  // Even rows of Y plane.
+    uint32_t *yOut1 = (uint32_t*)(vaddr + stride);  // Odd rows of Y plane.
+    uint16_t *vOut = (uint16_t*)((uint8_t*)yOut0 + numPixels); // V plane
+    uint16_t *uOut = (uint16_t*)((uint8_t*)vOut + numPixels / 4); // U plane
+
+    uint32_t r0_0, r0_1, r1_0, r1_1;
+
+    // Read 2x2 uint32_t YUYV at a time, output 2x4Y, 1x2U, 1x2V.
+    // This code is little endian only.
+    for(int r = 0 ; r < height / 2 ; r++) {
+        for (int c = 0 ; c < width / 4 ; c++) {
+            // Read 2x4 bytes from two consecutive rows.
+            r0_0 = *src0++; r0_1 = *src0++;
+            r1_0 = *src1++; r1_1 = *src1++;
+
+            // Output 2x2x8-bit luma.
+            *yOut0++ =
+                (r0_0 & 0xff) |
+                ((r0_0 >> 8) & 0xff00) |
+                ((r0_1 << 16) & 0xff0000) |
+                ((r0_1 << 8) & 0xff000000);
+            *yOut1++ =
+                (r1_0 & 0xff) |
+                ((r1_0 >> 8) & 0xff00) |
+                ((r1_1 << 16) & 0xff0000) |
+                ((r1_1 << 8) & 0xff000000);
+
+            // Now we trash the YUYV pixels to generate sub-sampled
+            // chroma U and V.
+            // We will make a 32-bit word with VVUU.
+
+            // Convert VVYYUUYY to 00VV00UU
+            r0_0 = (r0_0 & 0xff00ff00) >> 8;
+            r1_0 = (r1_0 & 0xff00ff00) >> 8;
+            r0_1 = (r0_1 & 0xff00ff00) >> 8;
+            r1_1 = (r1_1 & 0xff00ff00) >> 8;
+
+            // Add 00VV00UU values and divide by 2 (average U and V).
+            r0_0 = ((r0_0 + r1_0) >> 1) & 0x00ff00ff; // 00VV00UU
+            // Also shift second value left by 8.
+            r0_1 = ((r0_1 + r1_1) << 7) & 0xff00ff00; // VV00UU00
+
+            // OR to get VVVVUUUU
+            r0_0 = r0_0 | r0_1;
+
+            // Output V and U.
+            *vOut++ = r0_0 >> 16;
+            *uOut++ = r0_0 & 0xffff;
+        }
+
+        // Move to next pair of rows.
+        src0 += width / 2;
+        src1 += width / 2;
+        yOut0 += width / 4;
+        yOut1 += width / 4;
+    }
+
+}
+
+bool isIdentityTransform(const struct preview_transform *t, int width, int height)
+{
+    return t->angle == 0 && t->flip == PREVIEW_FLIP_NONE &&
+           t->crop_width == width && t->crop_height == height;
+}
+
+// Crop, scale, rotate and mirror in the same pass as the YUYV to YV12
+// conversion. The walk runs over the output and steps through the source
+// with a 16.16 fixed point affine increment, so only the cropped window
+// of the frame is ever read. Luma is nearest neighbour, chroma is taken
+// from the macropixel under the top-left pixel of each 2x2 output block.
+void YUYVtoYV12Transform(int width, int height,
+                                const struct preview_transform *t,
+                                int stride, const uint8_t *frame, uint8_t *vaddr)
+{
+    const int out_w = t->out_width;
+    const int out_h = t->out_height;
+    const bool swap = t->angle == 90 || t->angle == 270;
+    const int32_t cw = t->crop_width << 16;
+    const int32_t ch = t->crop_height << 16;
+
+    // Step per output pixel in the rotated crop, sampled at pixel centres
+    // so that mirrored and rotated walks stay inside the crop.
+    const int32_t step_x = (int32_t)(((int64_t)(swap ? t->crop_height : t->crop_width) << 16) / out_w);
+    const int32_t step_y = (int32_t)(((int64_t)(swap ? t->crop_width : t->crop_height) << 16) / out_h);
+    int32_t rx0 = step_x / 2, drx = step_x;
+    int32_t ry0 = step_y / 2, dry = step_y;
+
+    if (t->flip & PREVIEW_FLIP_HORIZONTAL) {
+        rx0 += (out_w - 1) * step_x;
+        drx = -step_x;
+    }
+    if (t->flip & PREVIEW_FLIP_VERTICAL) {
+        ry0 += (out_h - 1) * step_y;
+        dry = -step_y;
+    }
+
+    // Undo the clockwise rotation: source origin, then the source
+    // increments for one output column (dc) and one output row (dr).
+    int32_t sx0, sy0, sx_dc, sy_dc, sx_dr, sy_dr;
+    switch (t->angle) {
+    case 90:
+        sx0 = ry0;      sy0 = ch - rx0;
+        sx_dc = 0;      sy_dc = -drx;
+        sx_dr = dry;    sy_dr = 0;
+        break;
+    case 180:
+        sx0 = cw - rx0; sy0 = ch - ry0;
+        sx_dc = -drx;   sy_dc = 0;
+        sx_dr = 0;      sy_dr = -dry;
+        break;
+    case 270:
+        sx0 = cw - ry0; sy0 = rx0;
+        sx_dc = 0;      sy_dc = drx;
+        sx_dr = -dry;   sy_dr = 0;
+        break;
+    default:
+        sx0 = rx0;      sy0 = ry0;
+        sx_dc = drx;    sy_dc = 0;
+        sx_dr = 0;      sy_dr = dry;
+        break;
+    }
+    sx0 += t->crop_x << 16;
+    sy0 += t->crop_y << 16;
+
+    const int pitch = width * 2;
+    const int cstride = YV12_CHROMA_STRIDE(stride);
+    uint8_t *vPlane = vaddr + stride * out_h;
+    uint8_t *uPlane = vPlane + cstride * out_h / 2;
+
+    for (int r = 0; r < out_h; r++) {
+        int32_t sx = sx0 + r * sx_dr;
+        int32_t sy = sy0 + r * sy_dr;
+        uint8_t *yOut = vaddr + r * stride;
+
+        if (r & 1) {
+            for (int c = 0; c < out_w; c++) {
+                yOut[c] = frame[(sy >> 16) * pitch + (sx >> 16) * 2];
+                sx += sx_dc;
+                sy += sy_dc;
+            }
+            continue;
+        }
+
+        uint8_t *vOut = vPlane + (r / 2) * cstride;
+        uint8_t *uOut = uPlane + (r / 2) * cstride;
+        for (int c = 0; c < out_w; c += 2) {
+            const uint8_t *row = frame + (sy >> 16) * pitch;
+            const uint8_t *mp = row + ((sx >> 16) & ~1) * 2;
+
+            yOut[c] = row[(sx >> 16) * 2];
+            uOut[c / 2] = mp[1];
+            vOut[c / 2] = mp[3];
+            sx += sx_dc;
+            sy += sy_dc;
+
+            yOut[c + 1] = frame[(sy >> 16) * pitch + (sx >> 16) * 2];
+            sx += sx_dc;
+            sy += sy_dc;
+        }
+    }
+}
+
+bool scaleDownYuv422(char *srcBuf, uint32_t srcWidth, uint32_t srcHeight,
+                                        char *dstBuf, uint32_t dstWidth, uint32_t dstHeight)
+{
+    int32_t step_x, step_y;
+    int32_t iXsrc, iXdst;
+    int32_t x, y, src_y_start_pos, dst_pos, src_pos;
+
+    if (dstWidth % 2 != 0 || dstHeight % 2 != 0){
+        ALOGE("scale_down_yuv422: invalid width, height for scaling");
+        return false;
+    }
+
+    step_x = srcWidth / dstWidth;
+    step_y = srcHeight / dstHeight;
+
+    dst_pos = 0;
+    for (uint32_t y = 0; y < dstHeight; y++) {
+        src_y_start_pos = (y * step_y * (srcWidth * 2));
+
+        for (uint32_t x = 0; x < dstWidth; x += 2) {
+            src_pos = src_y_start_pos + (x * (step_x * 2));
+
+            dstBuf[dst_pos++] = srcBuf[src_pos    ];
+            dstBuf[dst_pos++] = srcBuf[src_pos + 1];
+            dstBuf[dst_pos++] = srcBuf[src_pos + 2];
+            dstBuf[dst_pos++] = srcBuf[src_pos + 3];
+        }
+    }
+
+    return true;
+}
+
+bool YUY2toNV21(void *srcBuf, void *dstBuf, uint32_t srcWidth, uint32_t srcHeight)
+{
+    int32_t        x, y, src_y_start_pos, dst_cbcr_pos, dst_pos, src_pos;
+    unsigned char *srcBufPointer = (unsigned char *)srcBuf;
+    unsigned char *dstBufPointer = (unsigned char *)dstBuf;
+
+    dst_pos = 0;
+    dst_cbcr_pos = srcWidth*srcHeight;
+    for (uint32_t y = 0; y < srcHeight; y++) {
+        src_y_start_pos = (y * (srcWidth * 2));
+
+        for (uint32_t x = 0; x < (srcWidth * 2); x += 2) {
+            src_pos = src_y_start_pos + x;
+
+            dstBufPointer[dst_pos++] = srcBufPointer[src_pos];
+        }
+    }
+    for (uint32_t y = 0; y < srcHeight; y += 2) {
+        src_y_start_pos = (y * (srcWidth * 2));
+
+        for (uint32_t x = 0; x < (srcWidth * 2); x += 4) {
+            src_pos = src_y_start_pos + x;
+
+            dstBufPointer[dst_cbcr_pos++] = srcBufPointer[src_pos + 3];
+            dstBufPointer[dst_cbcr_pos++] = srcBufPointer[src_pos + 1];
+        }
+    }
+
+    return true;
+}
+
+bool CheckVideoStartMarker(unsigned char *pBuf)
+{
+    if (!pBuf) {
+        ALOGE("CheckVideoStartMarker() => pBuf is NULL\n");
+        return false;
+    }
+
+    if (HIBYTE(VIDEO_COMMENT_MARKER_H) == * pBuf      && LOBYTE(VIDEO_COMMENT_MARKER_H) == *(pBuf + 1) &&
+        HIBYTE(VIDEO_COMMENT_MARKER_L) == *(pBuf + 2) && LOBYTE(VIDEO_COMMENT_MARKER_L) == *(pBuf + 3))
+        return true;
+
+    return false;
+}
+
+bool CheckEOIMarker(unsigned char *pBuf)
+{
+    if (!pBuf) {
+        ALOGE("CheckEOIMarker() => pBuf is NULL\n");
+        return false;
+    }
+
+    // EOI marker [FF D9]
+    if (HIBYTE(JPEG_EOI_MARKER) == *pBuf && LOBYTE(JPEG_EOI_MARKER) == *(pBuf + 1))
+        return true;
+
+    return false;
+}
+
+bool FindEOIMarkerInJPEG(unsigned char *pBuf, int dwBufSize, int *pnJPEGsize)
+{
+    if (NULL == pBuf || 0 >= dwBufSize) {
+        ALOGE("FindEOIMarkerInJPEG() => There is no contents.");
+        return false;
+    }
+
+    unsigned char *pBufEnd = pBuf + dwBufSize;
+
+    while (pBuf < pBufEnd) {
+        if (CheckEOIMarker(pBuf++))
+            return true;
+
+        (*pnJPEGsize)++;
+    }
+
+    return false;
+}
+
+bool SplitFrame(unsigned char *pFrame, int dwSize,
+                    int dwJPEGLineLength, int dwVideoLineLength, int dwVideoHeight,
+                    void *pJPEG, int *pdwJPEGSize,
+                    void *pVideo, int *pdwVideoSize)
+{
+    ALOGV("===========SplitFrame Start==============");
+
+    if (NULL == pFrame || 0 >= dwSize) {
+        ALOGE("There is no contents (pFrame=%p, dwSize=%d", pFrame, dwSize);
+        return false;
+    }
+
+    if (0 == dwJPEGLineLength || 0 == dwVideoLineLength) {
+        ALOGE("There in no input information for decoding interleaved jpeg");
+        return false;
+    }
+
+    unsigned char *pSrc = pFrame;
+    unsigned char *pSrcEnd = pFrame + dwSize;
+
+    unsigned char *pJ = (unsigned char *)pJPEG;
+    int dwJSize = 0;
+    unsigned char *pV = (unsigned char *)pVideo;
+    int dwVSize = 0;
+
+    bool bRet = false;
+    bool isFinishJpeg = false;
+
+    while (pSrc < pSrcEnd) {
+        // Check video start marker
+        if (CheckVideoStartMarker(pSrc)) {
+            int copyLength;
+
+            if (pSrc + dwVideoLineLength <= pSrcEnd)
+                copyLength = dwVideoLineLength;
+            else
+                copyLength = pSrcEnd - pSrc - VIDEO_COMMENT_MARKER_LENGTH;
+
+            // Copy video data
+            if (pV) {
+                memcpy(pV, pSrc + VIDEO_COMMENT_MARKER_LENGTH, copyLength);
+                pV += copyLength;
+                dwVSize += copyLength;
+            }
+
+            pSrc += copyLength + VIDEO_COMMENT_MARKER_LENGTH;
+        } else {
+            // Copy pure JPEG data
+            int size = 0;
+            int dwCopyBufLen = dwJPEGLineLength <= pSrcEnd-pSrc ? dwJPEGLineLength : pSrcEnd - pSrc;
+
+            if (FindEOIMarkerInJPEG((unsigned char *)pSrc, dwCopyBufLen, &size)) {
+                isFinishJpeg = true;
+                size += 2;  // to count EOF marker size
+            } else {
+                if ((dwCopyBufLen == 1) && (pJPEG < pJ)) {
+                    unsigned char checkBuf[2] = { *(pJ - 1), *pSrc };
+
+                    if (CheckEOIMarker(checkBuf))
+                        isFinishJpeg = true;
+                }
+                size = dwCopyBufLen;
+            }
+
+            memcpy(pJ, pSrc, size);
+
+            dwJSize += size;
+
+            pJ += dwCopyBufLen;
+            pSrc += dwCopyBufLen;
+        }
+        if (isFinishJpeg)
+            break;
+    }
+
+    if (isFinishJpeg) {
+        bRet = true;
+        if(pdwJPEGSize)
+            *pdwJPEGSize = dwJSize;
+        if(pdwVideoSize)
+            *pdwVideoSize = dwVSize;
+    } else {
+        ALOGE("DecodeInterleaveJPEG_WithOutDT() => Can not find EOI");
+        bRet = false;
+        if(pdwJPEGSize)
+            *pdwJPEGSize = 0;
+        if(pdwVideoSize)
+            *pdwVideoSize = 0;
+    }
+    ALOGV("===========SplitFrame end==============");
+
+    return bRet;
+}
+
+int decodeInterleaveData(unsigned char *pInterleaveData,
+                                                 int interleaveDataSize,
+                                                 int yuvWidth,
+                                                 int yuvHeight,
+                                                 int *pJpegSize,
+                                                 void *pJpegData,
+                                                 void *pYuvData)
+{
+    if (pInterleaveData == NULL)
+        return false;
+
+    bool ret = true;
+    unsigned int *interleave_ptr = (unsigned int *)pInterleaveData;
+    unsigned char *jpeg_ptr = (unsigned char *)pJpegData;
+    unsigned char *yuv_ptr = (unsigned char *)pYuvData;
+    unsigned char *p;
+    int jpeg_size = 0;
+    int yuv_size = 0;
+
+    int i = 0;
+
+    ALOGV("decodeInterleaveData Start~~~");
+    while (i < interleaveDataSize) {
+        if ((*interleave_ptr == 0xFFFFFFFF) || (*interleave_ptr == 0x02FFFFFF) ||
+                (*interleave_ptr == 0xFF02FFFF)) {
+            // Padding Data
+//            ALOGE("%d(%x) padding data\n", i, *interleave_ptr);
+            interleave_ptr++;
+            i += 4;
+        }
+        else if ((*interleave_ptr & 0xFFFF) == 0x05FF) {
+            // Start-code of YUV Data
+//            ALOGE("%d(%x) yuv data\n", i, *interleave_ptr);
+            p = (unsigned char *)interleave_ptr;
+            p += 2;
+            i += 2;
+
+            // Extract YUV Data
+            if (pYuvData != NULL) {
+                memcpy(yuv_ptr, p, yuvWidth * 2);
+                yuv_ptr += yuvWidth * 2;
+                yuv_size += yuvWidth * 2;
+            }
+            p += yuvWidth * 2;
+            i += yuvWidth * 2;
+
+            // Check End-code of YUV Data
+            if ((*p == 0xFF) && (*(p + 1) == 0x06)) {
+                interleave_ptr = (unsigned int *)(p + 2);
+                i += 2;
+            } else {
+                ret = false;
+                break;
+            }
+        } else {
+            // Extract JPEG Data
+//            ALOGE("%d(%x) jpg data, jpeg_size = %d bytes\n", i, *interleave_ptr, jpeg_size);
+            if (pJpegData != NULL) {
+                memcpy(jpeg_ptr, interleave_ptr, 4);
+                jpeg_ptr += 4;
+                jpeg_size += 4;
+            }
+            interleave_ptr++;
+            i += 4;
+        }
+    }
+    if (ret) {
+        if (pJpegData != NULL) {
+            // Remove Padding after EOI
+            for (i = 0; i < 3; i++) {
+                if (*(--jpeg_ptr) != 0xFF) {
+                    break;
+                }
+                jpeg_size--;
+            }
+            *pJpegSize = jpeg_size;
+
+        }
+        // Check YUV Data Size
+        if (pYuvData != NULL) {
+            if (yuv_size != (yuvWidth * yuvHeight * 2)) {
+                ret = false;
+            }
+        }
+    }
+    ALOGV("decodeInterleaveData End~~~");
+    return ret;
+}
+
+}; // namespace android
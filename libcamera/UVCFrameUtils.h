@@ -0,0 +1,83 @@
+/*
+**
+** Copyright 2008, The Android Open Source Project
+** Copyright 2010, Samsung Electronics Co. LTD
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Frame conversion and demuxing helpers used by the UVC camera HAL.
+ * These only touch memory, so they are also built into the host replay
+ * benchmark (bench/uvc_replay_bench.cpp).
+ */
+
+#ifndef ANDROID_HARDWARE_UVC_FRAME_UTILS_H
+#define ANDROID_HARDWARE_UVC_FRAME_UTILS_H
+
+#include <stdint.h>
+
+namespace android {
+
+/* Preview mirroring bits, see UVCCamera::FLIP */
+enum {
+    PREVIEW_FLIP_NONE       = 0,
+    PREVIEW_FLIP_HORIZONTAL = 1 << 0,
+    PREVIEW_FLIP_VERTICAL   = 1 << 1,
+};
+
+/* Software transform applied while converting a preview frame: crop a
+ * window of the source, scale it to out_width x out_height, then rotate
+ * clockwise by angle and mirror according to flip.
+ */
+struct preview_transform {
+    int             angle;
+    int             flip;
+    int             crop_x;
+    int             crop_y;
+    int             crop_width;
+    int             crop_height;
+    int             out_width;
+    int             out_height;
+};
+
+void    YUYVtoYV12(int width, int height, int stride,
+                   const uint8_t *frame, uint8_t *vaddr);
+bool    isIdentityTransform(const struct preview_transform *t, int width, int height);
+void    YUYVtoYV12Transform(int width, int height,
+                            const struct preview_transform *t,
+                            int stride, const uint8_t *frame, uint8_t *vaddr);
+
+bool    YUY2toNV21(void *srcBuf, void *dstBuf, uint32_t srcWidth, uint32_t srcHeight);
+bool    scaleDownYuv422(char *srcBuf, uint32_t srcWidth, uint32_t srcHight,
+                        char *dstBuf, uint32_t dstWidth, uint32_t dstHight);
+
+bool    CheckVideoStartMarker(unsigned char *pBuf);
+bool    CheckEOIMarker(unsigned char *pBuf);
+bool    FindEOIMarkerInJPEG(unsigned char *pBuf, int dwBufSize, int *pnJPEGsize);
+bool    SplitFrame(unsigned char *pFrame, int dwSize,
+                   int dwJPEGLineLength, int dwVideoLineLength,
+                   int dwVideoHeight, void *pJPEG,
+                   int *pdwJPEGSize, void *pVideo,
+                   int *pdwVideoSize);
+int     decodeInterleaveData(unsigned char *pInterleaveData,
+                             int interleaveDataSize,
+                             int yuvWidth,
+                             int yuvHeight,
+                             int *pJpegSize,
+                             void *pJpegData,
+                             void *pYuvData);
+
+}; // namespace android
+
+#endif // ANDROID_HARDWARE_UVC_FRAME_UTILS_H
@@ -0,0 +1,300 @@
+/*
+**
+** Copyright 2008, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * End to end latency benchmark for UVCCamera against the simulated device
+ * (UVCDeviceSim).  Drives the same calls CameraHardwareUVC makes for
+ * open, start/stop preview, a preview size/fps change and a snapshot, and
+ * reports the median of each over several runs together with the preview
+ * frame interval spread.  With jitter_us=0 and drop_pct=0 the numbers only
+ * depend on the HAL and the configured frame/control timing.
+ *
+ *   uvc_latency_bench [-c sim_config] [-n frames] [-r runs]
+ *
+ * sim_config uses the camera.uvc.sim syntax, see UVCDevice.h.
+ */
+
+#define LOG_TAG "uvc_latency_bench"
+#include <utils/Log.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "UVCCamera.h"
+
+using namespace android;
+
+#define DEFAULT_CONFIG          "sizes=640x480,320x240;fps=30,15;mjpeg=1;ctrl_delay_us=2000"
+#define DEFAULT_FRAMES          60
+#define DEFAULT_RUNS            5
+#define MAX_FRAMES              1024
+#define MAX_RUNS                32
+
+enum {
+    LAT_OPEN,
+    LAT_START_PREVIEW,
+    LAT_STOP_PREVIEW,
+    LAT_RECONFIGURE,
+    LAT_SNAPSHOT,
+    LAT_CLOSE,
+    LAT_INTERVAL_P50,
+    LAT_INTERVAL_P95,
+    LAT_INTERVAL_MAX,
+    LAT_COUNT,
+};
+
+static const char *lat_names[LAT_COUNT] = {
+    "open",
+    "start_preview",
+    "stop_preview",
+    "reconfigure",
+    "snapshot",
+    "close",
+    "frame_interval_p50",
+    "frame_interval_p95",
+    "frame_interval_max",
+};
+
+struct preview_loop {
+    UVCCamera  *camera;
+    int         max_frames;
+    int         frames;
+    int64_t     arrival_us[MAX_FRAMES];
+    int         result;
+};
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Same loop shape as CameraHardwareUVC::previewThread: wait for a frame
+ * or a command, dequeue, hand the buffer back.  Stops on any command. */
+static void *preview_thread(void *data)
+{
+    struct preview_loop *loop = (struct preview_loop *)data;
+    UVCCamera *camera = loop->camera;
+
+    for (;;) {
+        int ret = camera->previewPoll(true);
+        if (ret < 0) {
+            loop->result = ret;
+            break;
+        }
+        if (ret & UVCCamera::CAPTURE_EVENT_COMMAND) {
+            if (camera->getCaptureCommands())
+                break;
+        }
+        if (!(ret & UVCCamera::CAPTURE_EVENT_FRAME))
+            continue;
+
+        int index = camera->getPreview();
+        if (index < 0) {
+            loop->result = index;
+            break;
+        }
+        if (loop->frames < loop->max_frames)
+            loop->arrival_us[loop->frames++] = now_us();
+        camera->releaseFrame(index);
+    }
+
+    return NULL;
+}
+
+static int run_preview(UVCCamera *camera, struct preview_loop *loop, int frames,
+                       int64_t *stop_us)
+{
+    pthread_t thread;
+
+    memset(loop, 0, sizeof(*loop));
+    loop->camera = camera;
+    loop->max_frames = frames;
+
+    if (pthread_create(&thread, NULL, preview_thread, loop) != 0)
+        return -1;
+
+    while (loop->frames < frames && loop->result == 0)
+        usleep(1000);
+
+    // stopPreviewThread() + stopPreview()
+    int64_t t0 = now_us();
+    camera->sendCaptureCommand(UVCCamera::CAPTURE_CMD_STOP);
+    pthread_join(thread, NULL);
+    camera->stopPreview();
+    *stop_us = now_us() - t0;
+
+    return loop->result;
+}
+
+static int run_once(const char *config, int frames, int64_t *lat)
+{
+    UVCCamera *camera = new UVCCamera();
+    struct preview_loop loop;
+    int64_t t0;
+    int ret;
+
+    for (int i = 0; i < LAT_COUNT; i++)
+        lat[i] = -1;
+
+    setenv(UVC_SIM_ENV, config, 1);
+
+    t0 = now_us();
+    ret = camera->initCamera(0);
+    lat[LAT_OPEN] = now_us() - t0;
+    if (ret < 0) {
+        fprintf(stderr, "initCamera failed\n");
+        delete camera;
+        return -1;
+    }
+
+    t0 = now_us();
+    ret = camera->negotiateStreamMode(640, 480, 15000, 30000, false);
+    if (ret == 0)
+        ret = camera->startPreview();
+    lat[LAT_START_PREVIEW] = now_us() - t0;
+    if (ret < 0) {
+        fprintf(stderr, "startPreview failed\n");
+        goto out;
+    }
+
+    ret = run_preview(camera, &loop, frames, &lat[LAT_STOP_PREVIEW]);
+    if (ret < 0) {
+        fprintf(stderr, "preview loop failed (%d)\n", ret);
+        goto out;
+    }
+
+    if (loop.frames > 1) {
+        int64_t intervals[MAX_FRAMES];
+        int n = loop.frames - 1;
+
+        for (int i = 0; i < n; i++)
+            intervals[i] = loop.arrival_us[i + 1] - loop.arrival_us[i];
+        qsort(intervals, n, sizeof(intervals[0]), cmp_int64);
+        lat[LAT_INTERVAL_P50] = intervals[n / 2];
+        lat[LAT_INTERVAL_P95] = intervals[n * 95 / 100];
+        lat[LAT_INTERVAL_MAX] = intervals[n - 1];
+    }
+
+    // size + fps change while previewing, as setParameters() does it
+    ret = camera->startPreview();
+    if (ret < 0)
+        goto out;
+    t0 = now_us();
+    camera->stopPreview();
+    ret = camera->negotiateStreamMode(320, 240, 15000, 15000, false);
+    if (ret == 0)
+        ret = camera->startPreview();
+    lat[LAT_RECONFIGURE] = now_us() - t0;
+    camera->stopPreview();
+    if (ret < 0) {
+        fprintf(stderr, "reconfigure failed\n");
+        goto out;
+    }
+
+    camera->setSnapshotPixelFormat(V4L2_PIX_FMT_YUYV);
+    camera->setSnapshotSize(640, 480);
+    t0 = now_us();
+    ret = camera->setSnapshotCmd();
+    if (ret == 0) {
+        int jpeg_size;
+        unsigned int phyaddr;
+        if (camera->getJpeg(&jpeg_size, &phyaddr) == NULL)
+            ret = -1;
+        camera->endSnapshot();
+    }
+    lat[LAT_SNAPSHOT] = now_us() - t0;
+    if (ret < 0)
+        fprintf(stderr, "snapshot failed\n");
+
+out:
+    t0 = now_us();
+    camera->DeinitCamera();
+    lat[LAT_CLOSE] = now_us() - t0;
+
+    delete camera;
+    return ret < 0 ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-c sim_config] [-n frames] [-r runs]\n"
+            "  default config \"%s\"\n", prog, DEFAULT_CONFIG);
+}
+
+int main(int argc, char **argv)
+{
+    const char *config = DEFAULT_CONFIG;
+    int frames = DEFAULT_FRAMES;
+    int runs = DEFAULT_RUNS;
+    int64_t lat[MAX_RUNS][LAT_COUNT];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:r:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            config = optarg;
+            break;
+        case 'n':
+            frames = atoi(optarg);
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (frames < 2 || frames > MAX_FRAMES || runs < 1 || runs > MAX_RUNS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (int r = 0; r < runs; r++) {
+        if (run_once(config, frames, lat[r]) < 0)
+            return 1;
+    }
+
+    printf("# uvc_latency_bench \"%s\", %d frames, median of %d runs, us\n",
+           config, frames, runs);
+    for (int i = 0; i < LAT_COUNT; i++) {
+        int64_t values[MAX_RUNS];
+
+        for (int r = 0; r < runs; r++)
+            values[r] = lat[r][i];
+        qsort(values, runs, sizeof(values[0]), cmp_int64);
+        printf("%-20s %8lld\n", lat_names[i], (long long)values[runs / 2]);
+    }
+
+    return 0;
+}
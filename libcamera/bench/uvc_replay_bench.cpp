@@ -0,0 +1,670 @@
+/*
+**
+** Copyright 2008, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Offline replay benchmark for the UVC camera frame paths.
+ *
+ * Feeds recorded frame dumps (or synthetic frames when none are given)
+ * through the same conversion and demuxing code the HAL uses and reports
+ * frames/s, ns/pixel and cache misses per frame.  Results can be checked
+ * against a baseline file; any kernel slower than its baseline by more
+ * than the tolerance fails the run.
+ *
+ *   uvc_replay_bench [-S WxH] [-n iterations] [-t tolerance%]
+ *                    [-y yuyv.dump] [-m mjpeg.dump] [-i interleave.dump]
+ *                    [-s split.dump -J jpeg_line -V video_line]
+ *                    [-b baseline.txt] [-w baseline.txt]
+ *
+ * YUYV dumps are raw back to back frames of the -S size, MJPEG dumps are
+ * concatenated JPEGs, interleaved dumps hold a single snapshot frame.
+ */
+
+#define LOG_TAG "uvc_replay_bench"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#endif
+
+#include "UVCFrameUtils.h"
+#include "JpegEncoder.h"
+
+using namespace android;
+
+#define DEFAULT_WIDTH           640
+#define DEFAULT_HEIGHT          480
+#define DEFAULT_ITERATIONS      200
+#define DEFAULT_TOLERANCE       25      // percent
+#define THUMBNAIL_WIDTH         160
+#define THUMBNAIL_HEIGHT        120
+#define MAX_RESULTS             32
+#define MAX_MJPEG_FRAMES        64
+#define BENCH_ROUNDS            5       // report the fastest round
+
+struct frame_set {
+    uint8_t    *data;
+    size_t      size;
+    size_t      frame_size;     // 0 if frames are variable sized
+    int         count;
+    size_t      offsets[MAX_MJPEG_FRAMES];
+    size_t      sizes[MAX_MJPEG_FRAMES];
+};
+
+struct bench_result {
+    char        name[48];
+    double      fps;
+    double      ns_per_pixel;
+    long long   cache_misses;   // per frame, -1 if unavailable
+};
+
+struct bench_ctx {
+    int         width;
+    int         height;
+    int         iterations;
+    int         perf_fd;
+    int         num_results;
+    struct bench_result results[MAX_RESULTS];
+};
+
+// ----------------------------------------------------------------------
+// measurement
+
+static int perf_open_cache_misses(void)
+{
+#if defined(__linux__) && defined(__NR_perf_event_open)
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static void perf_start(int fd)
+{
+#if defined(__linux__)
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static long long perf_stop(int fd)
+{
+    long long count = -1;
+
+#if defined(__linux__)
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+            count = -1;
+    }
+#endif
+    return count;
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+typedef void (*bench_fn)(void *arg, int iteration);
+
+static void run_bench(struct bench_ctx *ctx, const char *name, bench_fn fn, void *arg,
+                      long pixels_per_frame)
+{
+    struct bench_result *r;
+    int64_t elapsed = INT64_MAX;
+    long long misses = -1;
+
+    if (ctx->num_results >= MAX_RESULTS)
+        return;
+
+    // warm up caches and branch predictors
+    for (int i = 0; i < 3; i++)
+        fn(arg, i);
+
+    // Scheduling noise only ever adds time, keep the fastest round.
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        perf_start(ctx->perf_fd);
+        int64_t start = now_ns();
+        for (int i = 0; i < ctx->iterations; i++)
+            fn(arg, i);
+        int64_t t = now_ns() - start;
+        long long m = perf_stop(ctx->perf_fd);
+
+        if (t < elapsed) {
+            elapsed = t;
+            misses = m;
+        }
+    }
+
+    r = &ctx->results[ctx->num_results++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->fps = (double)ctx->iterations * 1e9 / (double)(elapsed ? elapsed : 1);
+    r->ns_per_pixel = (double)elapsed / ((double)ctx->iterations * pixels_per_frame);
+    r->cache_misses = misses < 0 ? -1 : misses / ctx->iterations;
+}
+
+// ----------------------------------------------------------------------
+// frame sources
+
+static uint32_t lcg(uint32_t *state)
+{
+    *state = *state * 1664525 + 1013904223;
+    return *state;
+}
+
+// JPEG entropy data never contains a bare 0xFF, keep the fill free of it.
+static void fill_entropy(uint8_t *buf, size_t len, uint32_t *seed)
+{
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (uint8_t)(lcg(seed) % 0xFF);
+}
+
+static void make_yuyv(uint8_t *buf, int width, int height, uint32_t seed)
+{
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x += 2) {
+            uint8_t *p = buf + (y * width + x) * 2;
+            p[0] = (uint8_t)(x + y);
+            p[1] = (uint8_t)(128 + (lcg(&seed) & 0x1f));
+            p[2] = (uint8_t)(x + y + 1);
+            p[3] = (uint8_t)(128 - (lcg(&seed) & 0x1f));
+        }
+    }
+}
+
+static int load_file(const char *path, struct frame_set *fs)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size <= 0) {
+        fprintf(stderr, "cannot read %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    fs->size = st.st_size;
+    fs->data = (uint8_t *)malloc(fs->size);
+    if (fs->data == NULL || read(fd, fs->data, fs->size) != (ssize_t)fs->size) {
+        fprintf(stderr, "short read on %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+static int load_yuyv(const char *path, int width, int height, struct frame_set *fs)
+{
+    memset(fs, 0, sizeof(*fs));
+    fs->frame_size = width * height * 2;
+
+    if (path == NULL) {
+        fs->count = 4;
+        fs->size = fs->frame_size * fs->count;
+        fs->data = (uint8_t *)malloc(fs->size);
+        for (int i = 0; i < fs->count; i++)
+            make_yuyv(fs->data + i * fs->frame_size, width, height, i + 1);
+        return 0;
+    }
+
+    if (load_file(path, fs) < 0)
+        return -1;
+
+    fs->count = fs->size / fs->frame_size;
+    if (fs->count == 0) {
+        fprintf(stderr, "%s is smaller than one %dx%d frame\n", path, width, height);
+        return -1;
+    }
+    return 0;
+}
+
+static int load_mjpeg(const char *path, int width, int height, struct frame_set *fs)
+{
+    memset(fs, 0, sizeof(*fs));
+
+    if (path == NULL) {
+        size_t len = width * height * 2 / 6;
+        uint32_t seed = 0x4a504547;
+
+        fs->count = 4;
+        fs->size = (len + 4) * fs->count;
+        fs->data = (uint8_t *)malloc(fs->size);
+        for (int i = 0; i < fs->count; i++) {
+            uint8_t *p = fs->data + i * (len + 4);
+            p[0] = 0xFF; p[1] = 0xD8;
+            fill_entropy(p + 2, len, &seed);
+            p[len + 2] = 0xFF; p[len + 3] = 0xD9;
+            fs->offsets[i] = i * (len + 4);
+            fs->sizes[i] = len + 4;
+        }
+        return 0;
+    }
+
+    if (load_file(path, fs) < 0)
+        return -1;
+
+    // split on SOI markers
+    for (size_t i = 0; i + 1 < fs->size && fs->count < MAX_MJPEG_FRAMES; i++) {
+        if (fs->data[i] == 0xFF && fs->data[i + 1] == 0xD8) {
+            if (fs->count)
+                fs->sizes[fs->count - 1] = i - fs->offsets[fs->count - 1];
+            fs->offsets[fs->count++] = i;
+        }
+    }
+    if (fs->count == 0) {
+        fprintf(stderr, "no JPEG frames in %s\n", path);
+        return -1;
+    }
+    fs->sizes[fs->count - 1] = fs->size - fs->offsets[fs->count - 1];
+    return 0;
+}
+
+// Samsung interleaved snapshot: JPEG words with YUV lines framed by
+// 0xFF05 ... 0xFF06, see decodeInterleaveData().
+static int make_interleave(int width, int height, struct frame_set *fs)
+{
+    size_t jpeg_chunk = 64;
+    size_t line = width * 2 + 4;
+    uint32_t seed = 0x1234;
+    uint8_t *p;
+
+    memset(fs, 0, sizeof(*fs));
+    fs->size = height * (jpeg_chunk + line) + jpeg_chunk + 8;
+    fs->data = (uint8_t *)malloc(fs->size);
+    p = fs->data;
+
+    for (int y = 0; y < height; y++) {
+        fill_entropy(p, jpeg_chunk, &seed);
+        p += jpeg_chunk;
+        p[0] = 0xFF; p[1] = 0x05;
+        make_yuyv(p + 2, width, 1, y);
+        p[line - 2] = 0xFF; p[line - 1] = 0x06;
+        p += line;
+    }
+    fill_entropy(p, jpeg_chunk, &seed);
+    p += jpeg_chunk;
+    p[0] = 0xFF; p[1] = 0xD9; p[2] = 0xFF; p[3] = 0xFF;
+    p += 4;
+    memset(p, 0xFF, 4);
+
+    fs->count = 1;
+    fs->frame_size = fs->size;
+    return 0;
+}
+
+// Comment-marker interleave: video lines prefixed with 0xFFBEFFBF between
+// fixed-length JPEG lines, see SplitFrame().
+static int make_split(int width, int height, int jpeg_line, int video_line,
+                      struct frame_set *fs)
+{
+    uint32_t seed = 0x5678;
+    uint8_t *p;
+
+    memset(fs, 0, sizeof(*fs));
+    fs->size = height * (jpeg_line + video_line + 4);
+    fs->data = (uint8_t *)malloc(fs->size);
+    p = fs->data;
+
+    for (int y = 0; y < height; y++) {
+        p[0] = 0xFF; p[1] = 0xBE; p[2] = 0xFF; p[3] = 0xBF;
+        fill_entropy(p + 4, video_line, &seed);
+        p += video_line + 4;
+        fill_entropy(p, jpeg_line, &seed);
+        p += jpeg_line;
+    }
+    // terminate the JPEG stream in the last JPEG line
+    p[-2] = 0xFF;
+    p[-1] = 0xD9;
+
+    fs->count = 1;
+    fs->frame_size = fs->size;
+    return 0;
+}
+
+// ----------------------------------------------------------------------
+// kernels
+
+struct conv_arg {
+    struct frame_set *src;
+    int         width;
+    int         height;
+    struct preview_transform xform;
+    uint8_t    *dst;
+    uint8_t    *aux;
+    int         jpeg_line;
+    int         video_line;
+};
+
+static const uint8_t *frame_at(struct frame_set *fs, int i)
+{
+    return fs->data + (i % fs->count) * fs->frame_size;
+}
+
+static void bench_yv12(void *p, int i)
+{
+    struct conv_arg *a = (struct conv_arg *)p;
+    YUYVtoYV12(a->width, a->height, a->width, frame_at(a->src, i), a->dst);
+}
+
+static void bench_yv12_transform(void *p, int i)
+{
+    struct conv_arg *a = (struct conv_arg *)p;
+    YUYVtoYV12Transform(a->width, a->height, &a->xform, a->xform.out_width,
+                        frame_at(a->src, i), a->dst);
+}
+
+static void bench_nv21(void *p, int i)
+{
+    struct conv_arg *a = (struct conv_arg *)p;
+    YUY2toNV21((void *)frame_at(a->src, i), a->dst, a->width, a->height);
+}
+
+static void bench_scale(void *p, int i)
+{
+    struct conv_arg *a = (struct conv_arg *)p;
+    scaleDownYuv422((char *)frame_at(a->src, i), a->width, a->height,
+                    (char *)a->dst, THUMBNAIL_WIDTH, THUMBNAIL_HEIGHT);
+}
+
+static void bench_eoi(void *p, int i)
+{
+    struct conv_arg *a = (struct conv_arg *)p;
+    struct frame_set *fs = a->src;
+    int n = i % fs->count;
+    int size = 0;
+
+    FindEOIMarkerInJPEG(fs->data + fs->offsets[n], fs->sizes[n], &size);
+}
+
+static void bench_split(void *p, int i)
+{
+    struct conv_arg *a = (struct conv_arg *)p;
+    int jpeg_size, video_size;
+
+    SplitFrame(a->src->data, a->src->size, a->jpeg_line, a->video_line, a->height,
+               a->dst, &jpeg_size, a->aux, &video_size);
+}
+
+static void bench_interleave(void *p, int i)
+{
+    struct conv_arg *a = (struct conv_arg *)p;
+    int jpeg_size;
+
+    decodeInterleaveData(a->src->data, a->src->size, a->width, a->height,
+                         &jpeg_size, a->dst, a->aux);
+}
+
+struct jpeg_arg {
+    JpegEncoder *enc;
+    struct frame_set *src;
+    unsigned char *in;
+    unsigned int size;
+};
+
+static void bench_jpeg(void *p, int i)
+{
+    struct jpeg_arg *a = (struct jpeg_arg *)p;
+    unsigned int out_size;
+
+    memcpy(a->in, frame_at(a->src, i), a->size);
+    a->enc->encode(&out_size, NULL);
+}
+
+// ----------------------------------------------------------------------
+// baselines
+
+static int check_baseline(struct bench_ctx *ctx, const char *path, int tolerance)
+{
+    FILE *f = fopen(path, "r");
+    char line[128], name[48];
+    double base;
+    int regressions = 0;
+
+    if (f == NULL) {
+        fprintf(stderr, "cannot open baseline %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || sscanf(line, "%47s %lf", name, &base) != 2)
+            continue;
+
+        for (int i = 0; i < ctx->num_results; i++) {
+            struct bench_result *r = &ctx->results[i];
+            if (strcmp(r->name, name))
+                continue;
+
+            double delta = (r->ns_per_pixel - base) * 100.0 / base;
+            bool bad = delta > tolerance;
+            printf("%-28s %8.3f ns/px  baseline %8.3f  %+6.1f%%%s\n",
+                   name, r->ns_per_pixel, base, delta, bad ? "  REGRESSION" : "");
+            regressions += bad;
+        }
+    }
+
+    fclose(f);
+    return regressions;
+}
+
+static int write_baseline(struct bench_ctx *ctx, const char *path)
+{
+    FILE *f = fopen(path, "w");
+
+    if (f == NULL) {
+        fprintf(stderr, "cannot write baseline %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "# uvc_replay_bench baseline, %dx%d, ns per pixel\n", ctx->width, ctx->height);
+    for (int i = 0; i < ctx->num_results; i++)
+        fprintf(f, "%s %.3f\n", ctx->results[i].name, ctx->results[i].ns_per_pixel);
+
+    fclose(f);
+    return 0;
+}
+
+// ----------------------------------------------------------------------
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-S WxH] [-n iterations] [-t tolerance%%]\n"
+            "          [-y yuyv.dump] [-m mjpeg.dump] [-i interleave.dump]\n"
+            "          [-s split.dump -J jpeg_line -V video_line]\n"
+            "          [-b baseline.txt] [-w baseline.txt]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_ctx ctx;
+    const char *yuyv_path = NULL, *mjpeg_path = NULL;
+    const char *interleave_path = NULL, *split_path = NULL;
+    const char *baseline = NULL, *write_path = NULL;
+    int tolerance = DEFAULT_TOLERANCE;
+    int jpeg_line = 4096, video_line = 0;
+    int opt;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.width = DEFAULT_WIDTH;
+    ctx.height = DEFAULT_HEIGHT;
+    ctx.iterations = DEFAULT_ITERATIONS;
+
+    while ((opt = getopt(argc, argv, "S:n:t:y:m:i:s:J:V:b:w:h")) != -1) {
+        switch (opt) {
+        case 'S':
+            if (sscanf(optarg, "%dx%d", &ctx.width, &ctx.height) != 2 ||
+                    ctx.width <= 0 || ctx.height <= 0 || (ctx.width & 3) || (ctx.height & 1)) {
+                fprintf(stderr, "bad size %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'n': ctx.iterations = atoi(optarg); break;
+        case 't': tolerance = atoi(optarg); break;
+        case 'y': yuyv_path = optarg; break;
+        case 'm': mjpeg_path = optarg; break;
+        case 'i': interleave_path = optarg; break;
+        case 's': split_path = optarg; break;
+        case 'J': jpeg_line = atoi(optarg); break;
+        case 'V': video_line = atoi(optarg); break;
+        case 'b': baseline = optarg; break;
+        case 'w': write_path = optarg; break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (ctx.iterations <= 0)
+        ctx.iterations = DEFAULT_ITERATIONS;
+    if (video_line <= 0)
+        video_line = ctx.width * 2;
+
+    struct frame_set yuyv, mjpeg, interleave, split;
+    if (load_yuyv(yuyv_path, ctx.width, ctx.height, &yuyv) < 0 ||
+            load_mjpeg(mjpeg_path, ctx.width, ctx.height, &mjpeg) < 0)
+        return 1;
+    if (interleave_path) {
+        memset(&interleave, 0, sizeof(interleave));
+        if (load_file(interleave_path, &interleave) < 0)
+            return 1;
+        interleave.count = 1;
+    } else {
+        make_interleave(ctx.width, ctx.height, &interleave);
+    }
+    if (split_path) {
+        memset(&split, 0, sizeof(split));
+        if (load_file(split_path, &split) < 0)
+            return 1;
+        split.count = 1;
+    } else {
+        make_split(ctx.width, ctx.height, jpeg_line, video_line, &split);
+    }
+
+    ctx.perf_fd = perf_open_cache_misses();
+    if (ctx.perf_fd < 0)
+        fprintf(stderr, "perf_event unavailable (%s), no cache-miss counts\n", strerror(errno));
+
+    long pixels = (long)ctx.width * ctx.height;
+    size_t scratch = pixels * 4 + split.size + interleave.size;
+    struct conv_arg a;
+
+    memset(&a, 0, sizeof(a));
+    a.width = ctx.width;
+    a.height = ctx.height;
+    a.dst = (uint8_t *)malloc(scratch);
+    a.aux = (uint8_t *)malloc(scratch);
+    a.jpeg_line = jpeg_line;
+    a.video_line = video_line;
+
+    a.src = &yuyv;
+    run_bench(&ctx, "yuyv_to_yv12", bench_yv12, &a, pixels);
+
+    // wall mount case: 90 degrees, mirrored, 2x zoom
+    a.xform.angle = 90;
+    a.xform.flip = PREVIEW_FLIP_HORIZONTAL;
+    a.xform.crop_width = (ctx.width / 2) & ~1;
+    a.xform.crop_height = (ctx.height / 2) & ~1;
+    a.xform.crop_x = ((ctx.width - a.xform.crop_width) / 2) & ~1;
+    a.xform.crop_y = (ctx.height - a.xform.crop_height) / 2;
+    a.xform.out_width = ctx.height;
+    a.xform.out_height = ctx.width;
+    run_bench(&ctx, "yuyv_to_yv12_rot90_zoom2x", bench_yv12_transform, &a, pixels);
+
+    run_bench(&ctx, "yuy2_to_nv21", bench_nv21, &a, pixels);
+    run_bench(&ctx, "scale_down_yuv422", bench_scale, &a,
+              THUMBNAIL_WIDTH * THUMBNAIL_HEIGHT);
+
+    a.src = &mjpeg;
+    run_bench(&ctx, "mjpeg_eoi_scan", bench_eoi, &a, pixels);
+
+    a.src = &split;
+    run_bench(&ctx, "split_frame", bench_split, &a, pixels);
+
+    a.src = &interleave;
+    run_bench(&ctx, "decode_interleave", bench_interleave, &a, pixels);
+
+    // The encoder is the S3C hardware block, only present on target.
+    JpegEncoder enc;
+    struct jpeg_arg j;
+    j.enc = &enc;
+    j.src = &yuyv;
+    j.size = yuyv.frame_size;
+    j.in = (unsigned char *)enc.getInBuf(j.size);
+    if (j.in != NULL &&
+            enc.setConfig(JPEG_SET_ENCODE_WIDTH, ctx.width) == JPG_SUCCESS &&
+            enc.setConfig(JPEG_SET_ENCODE_HEIGHT, ctx.height) == JPG_SUCCESS &&
+            enc.setConfig(JPEG_SET_ENCODE_IN_FORMAT, JPG_MODESEL_YCBCR) == JPG_SUCCESS &&
+            enc.setConfig(JPEG_SET_SAMPING_MODE, JPG_422) == JPG_SUCCESS)
+        run_bench(&ctx, "jpeg_encode", bench_jpeg, &j, pixels);
+    else
+        fprintf(stderr, "jpeg_encode skipped: %s not available\n", JPG_DRIVER_NAME);
+
+    printf("%dx%d, %d iterations\n", ctx.width, ctx.height, ctx.iterations);
+    printf("%-28s %10s %10s %14s\n", "kernel", "frames/s", "ns/pixel", "misses/frame");
+    for (int i = 0; i < ctx.num_results; i++) {
+        struct bench_result *r = &ctx.results[i];
+        if (r->cache_misses < 0)
+            printf("%-28s %10.1f %10.3f %14s\n", r->name, r->fps, r->ns_per_pixel, "n/a");
+        else
+            printf("%-28s %10.1f %10.3f %14lld\n", r->name, r->fps, r->ns_per_pixel,
+                   r->cache_misses);
+    }
+
+    int ret = 0;
+    if (write_path && write_baseline(&ctx, write_path) < 0)
+        ret = 1;
+    if (baseline) {
+        int regressions = check_baseline(&ctx, baseline, tolerance);
+        if (regressions != 0) {
+            if (regressions > 0)
+                fprintf(stderr, "%d kernel(s) regressed by more than %d%%\n",
+                        regressions, tolerance);
+            ret = 1;
+        }
+    }
+
+    if (ctx.perf_fd >= 0)
+        close(ctx.perf_fd);
+    return ret;
+}
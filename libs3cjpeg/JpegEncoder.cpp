@@ -26,6 +26,8 @@
 #include <utils/Log.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "JpegEncoder.h"
 
@@ -245,7 +247,7 @@ jpg_return_status JpegEncoder::encode(unsigned int *size, exif_attribute_t *exif
     if (exifInfo) {
         unsigned int thumbLen, exifLen;
 
-        uint_t bufSize = 0;
+        unsigned int bufSize = 0;
         if (exifInfo->enableThumb) {
             ret = encodeThumbImg(&thumbLen);
             if (ret != JPG_SUCCESS) {